@@ -52,7 +52,7 @@ void peisk_closeBluetooth() {}
 int peisk_haveBluetoothCapabilities() { return 0; }
 int peisk_bluetoothIsConnectable(unsigned char btAddr[6],int port) { return 0; }
 int peisk_bluetoothConnect(unsigned char btAddr[6],int port,int flags) { return 0; }
-int peisk_bluetoothSendAtomic(struct PeisConnection *connection,struct PeisPackage *package,int len) { return -1; }
+int peisk_bluetoothSendAtomic(struct PeisConnection *connection,struct PeisPackageHeader *header,void *data,int datalen) { return -1; }
 int peisk_bluetoothReceiveIncomming(struct PeisConnection *connection,struct PeisPackage *package) { return 0; }
 void peisk_bluetoothCloseConnection(struct PeisConnection *connection) {}
 
@@ -266,6 +266,11 @@ void peisk_clUseBluetooth(char *device) {
   /* Mark adaptor as not having any pending hello's right now */
   adaptor->pendingHelloFd = -1;
 
+  /* Wake up the kernel on incomming connections and hellos. They are
+     otherwise only accepted on the periodic wakeups. */
+  if(adaptor->listenSocket != -1) peisk_reactorWatch(adaptor->listenSocket,1);
+  if(adaptor->helloSocket != -1) peisk_reactorWatch(adaptor->helloSocket,1);
+
   printf("Listesting on %s: %02X:%02X:%02X:%02X:%02X:%02X;%d\n",device,
 	 adaptor->addr.b[5],adaptor->addr.b[4],adaptor->addr.b[3],adaptor->addr.b[2],
 	 adaptor->addr.b[1],adaptor->addr.b[0],adaptor->port);
@@ -983,10 +988,10 @@ void peisk_bluetoothConnectOutgoing() {
   }
 }
 
-int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackage *package,int len) {
-  int status;
-  void *data = (void*) package;
-  PeisPackageHeader *header;
+int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) {
+  int status, len;
+  struct iovec iov[2];
+  struct msghdr msg;
 
   PEISK_ASSERT(connection->connection.bluetooth.adaptor >= &peisk_bluetoothAdaptors[0] &&
 	       connection->connection.bluetooth.adaptor <= &peisk_bluetoothAdaptors[peisk_nBluetoothAdaptors],
@@ -1005,13 +1010,21 @@ int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackage *package,in
       return -1;
   }
 
-  header=&package->header;
   header->linkCnt = htonl(connection->outgoingIdCnt++);
 
+  iov[0].iov_base = (void*) header;
+  iov[0].iov_len = sizeof(PeisPackageHeader);
+  iov[1].iov_base = data;
+  iov[1].iov_len = datalen;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = datalen > 0 ? 2 : 1;
+  len = sizeof(PeisPackageHeader) + datalen;
+
   /** \todo Let the linklayer send operations send partial messages
       and queue the leftovers. */
   errno=0;
-  status=send(connection->connection.bluetooth.socket,(void*) data,len,MSG_DONTWAIT|MSG_NOSIGNAL);
+  status=sendmsg(connection->connection.bluetooth.socket,&msg,MSG_DONTWAIT|MSG_NOSIGNAL);
   if(status != -1 && status < len) {
     fprintf(stderr,"ERROR - only %d of %d bytes sent over L2CAP bluetooth connection\n",status,len);
     peisk_closeConnection(connection->id);
@@ -1020,8 +1033,8 @@ int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackage *package,in
   if(status > 0) {
     peisk_logTimeStamp(stdout);
     printf("BT send: %d bytes TO: %d ",status,connection->neighbour.id);
-    /*peisk_hexDump(package,status);*/
-    peisk_printNetPackageInfo(package);
+    /*peisk_hexDump(header,status);*/
+    peisk_printNetPackageInfo((PeisPackage*) header);
     /* Increment bytes/second counter */
     connection->connection.bluetooth.adaptor->bsCount += status;
   }
@@ -107,7 +107,7 @@ PeisConnection *peisk_bluetoothConnect(unsigned char btAddr[6],int port,int flag
 /** Performs the sending of data on a bluetooth L2CAP connection. Package
     points to a PeisPackage structure including data for a total 
     length of len bytes. Returns zero on success. */
-int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackage *package,int len);
+int peisk_bluetoothSendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen);
 
 /** Attempts to read a package from a bluetooth L2CAP connection. 
     Returns non-zero if there was a package.  */
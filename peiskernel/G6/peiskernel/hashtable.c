@@ -42,196 +42,218 @@
 #include "peiskernel.h"
 #include "hashtable.h"
 
+/** FNV-1a over the lower case characters of a string key. Unlike
+    peisk_hashString all bits of the result are well mixed, which is
+    needed since only the lowest bits select the slot. */
+static unsigned int peisk_hashTable_hashString(const char *string) {
+  unsigned int val=2166136261u;
+  int i;
+  for(i=0;string[i];i++) { val ^= (unsigned char) tolower(string[i]); val *= 16777619u; }
+  return val;
+}
+
 int peisk_hashTable_hash(PeisHashTable *table,void *key) {
+  unsigned int val;
   switch(table->keyType) {
-  case PeisHashTableKey_String: return peisk_hashString((char*)key);
-  case PeisHashTableKey_Integer: return (((int)(long) key) ^ 0xdeadf00d) & 0x7fffffff;
+  case PeisHashTableKey_String: return peisk_hashTable_hashString((char*)key) & 0x7fffffff;
+  case PeisHashTableKey_Integer: 
+    /* Mix all bits since only the lowest bits select the slot */
+    val = (unsigned int)(long) key;
+    val ^= val >> 16; val *= 0x85ebca6b;
+    val ^= val >> 13; val *= 0xc2b2ae35;
+    val ^= val >> 16;
+    return val & 0x7fffffff;
   default: fprintf(stderr,"peisk:: error - Broken hashtable type\n"); exit(0); 
   }
 }
 
-/** \todo Let the hashtable operations save free'ed links so that they
-    can be used later on. Would reduce memory fragmentation. */
+/** Tests if the given slot contains the given key with the given hash value */
+static int peisk_hashTable_slotMatches(PeisHashTable *table,PeisHashTableSlot *slot,int hash,void *key) {
+  if(slot->hash != hash) return 0;
+  if(table->keyType == PeisHashTableKey_String) 
+    return strcasecmp(table->keyArena+slot->key,(char*)key) == 0;
+  else
+    return (int) slot->key == (int)(long) key;
+}
+
+/** Finds the slot containing the given key, or NULL if the key does
+    not exist. */
+static PeisHashTableSlot *peisk_hashTable_find(PeisHashTable *table,void *key) {
+  int hash, i, mask;
+  PeisHashTableSlot *slot;
+
+  if(table->count == 0) return NULL;
+  hash=peisk_hashTable_hash(table,key);
+  mask=table->nSlots-1;
+  for(i=hash&mask;;i=(i+1)&mask) {
+    slot=&table->slots[i];
+    if(slot->hash == PEISK_HASH_SLOT_EMPTY) return NULL;
+    if(peisk_hashTable_slotMatches(table,slot,hash,key)) return slot;
+  }
+}
+
+/** Copies a string key into the key arena and returns its offset, or
+    -1 if out of memory. The key may point into the arena itself. When
+    the arena is full it is reallocated with only the keys still in use. */
+static long peisk_hashTable_storeKey(PeisHashTable *table,const char *key) {
+  int len=strlen(key)+1;
+  int i, newSize, newUsed;
+  char *newArena;
+  long offset;
+
+  if(table->arenaUsed + len > table->arenaSize) {
+    newSize = 256;
+    while(newSize < 2*(table->arenaLive + len)) newSize *= 2;
+    newArena = (char*) malloc(newSize);
+    if(!newArena) return -1;
+    /* Compact all keys still in use into the new arena */
+    for(i=0,newUsed=0;i<table->nSlots;i++) 
+      if(table->slots[i].hash >= 0) {
+	strcpy(newArena+newUsed,table->keyArena+table->slots[i].key);
+	table->slots[i].key = newUsed;
+	newUsed += strlen(newArena+newUsed)+1;
+      }
+    /* The old arena must remain valid until the new key have been copied */
+    memcpy(newArena+newUsed,key,len);
+    if(table->keyArena) free(table->keyArena);
+    table->keyArena=newArena;
+    table->arenaSize=newSize;
+    table->arenaUsed=newUsed;
+  } else
+    memmove(table->keyArena+table->arenaUsed,key,len);
+  offset=table->arenaUsed;
+  table->arenaUsed += len;
+  table->arenaLive += len;
+  return offset;
+}
+
 PeisHashTable *peisk_hashTable_create(PeisHashTableKeyType keyType) {
   PeisHashTable *table=(PeisHashTable*)malloc(sizeof(PeisHashTable));
-  table->nBuckets=0;
-  table->buckets=NULL;
+  table->nSlots=0;
+  table->count=0;
+  table->used=0;
+  table->slots=NULL;
+  table->keyArena=NULL;
+  table->arenaSize=0;
+  table->arenaUsed=0;
+  table->arenaLive=0;
   table->keyType = keyType;
   return table;
 }
 void peisk_hashTable_delete(PeisHashTable *table) {
-  int i;
-  PeisHashTableLink *link;
-  PeisHashTableLink *next;
-
-  /* Free all links and their keys */
-  for(i=0;i<table->nBuckets;i++)  {
-    for(link=table->buckets[i];link;) {
-      next=link->next;
-      if(table->keyType == PeisHashTableKey_String)
-	free(link->key.str);
-      free(link);
-      link=next;
-    }
-    table->buckets[i]=NULL;
-  }
+  /* Free all slots and their keys */
+  if(table->slots) free(table->slots);
+  if(table->keyArena) free(table->keyArena);
 
   /* Free the table */
   free(table);
 }
 void peisk_hashTable_clear(PeisHashTable *table) {
   int i;
-  PeisHashTableLink *link;
-  PeisHashTableLink *next;
-
-  /* Free all links and their keys */
-  for(i=0;i<table->nBuckets;i++)  {
-    for(link=table->buckets[i];link;) {
-      next=link->next;
-      if(table->keyType == PeisHashTableKey_String)
-	free(link->key.str);
-      free(link);
-      link=next;
-    }
-    table->buckets[i]=NULL;
-  }
+
+  /* Mark all slots as empty and forget all keys, but keep the memory */
+  for(i=0;i<table->nSlots;i++)
+    table->slots[i].hash=PEISK_HASH_SLOT_EMPTY;
+  table->count=0;
+  table->used=0;
+  table->arenaUsed=0;
+  table->arenaLive=0;
 }
 int peisk_hashTable_count(PeisHashTable *table) {
-  int i,count;
-  PeisHashTableLink *link;
-
-  /* Free all links and their keys */
-  for(i=0,count=0;i<table->nBuckets;i++)
-    for(link=table->buckets[i];link;link=link->next) { count++; }
-  return count;
+  return table->count;
 }
 
 
 int peisk_hashTable_getValue(PeisHashTable *table,void *key,void **value) {
-  int hash;
-  PeisHashTableLink *link;
-
-  if(table->nBuckets==0) return PEISK_HASH_KEY_NOT_FOUND;
-  hash=peisk_hashTable_hash(table,key);
-  link=table->buckets[hash%table->nBuckets];
-
-  if(table->keyType == PeisHashTableKey_String) {
-    while(link) {
-      if(hash == link->hash && strcasecmp(link->key.str,(char*)key) == 0) {
-	*value = link->value; return 0;
-      }
-      link=link->next;
-    }
-  } else if(table->keyType == PeisHashTableKey_Integer) {
-    while(link) {
-      if(hash == link->hash && link->key.val == (int)(long) key) {
-	*value = link->value; return 0;
-      }
-      link=link->next;
-    }
-  }
-  return PEISK_HASH_KEY_NOT_FOUND;
-
-  /*
-  while(link) {
-    if(hash == link->hash && 
-       ((table->keyType == PeisHashTableKey_String && strcasecmp(link->key.str,(char*)key)==0)
-	|| (table->keyType == PeisHashTableKey_Integer && link->key.val == (int)(long) key)
-	)) {
-      *value = link->value; return 0; 
-    }
-    link=link->next;
-    }*/
-
+  PeisHashTableSlot *slot;
 
+  slot=peisk_hashTable_find(table,key);
+  if(!slot) return PEISK_HASH_KEY_NOT_FOUND;
+  *value = slot->value;
+  return 0;
 }
 int peisk_hashTable_remove(PeisHashTable *table,void *key) {
-  int hash;
-  PeisHashTableLink *link;
-  PeisHashTableLink **prev;
+  PeisHashTableSlot *slot;
 
-  if(table->nBuckets==0) return PEISK_HASH_KEY_NOT_FOUND;
-  hash=peisk_hashTable_hash(table,key);
-  link=table->buckets[hash%table->nBuckets];
-  prev=&table->buckets[hash%table->nBuckets];
-  while(link) {
-    if(hash == link->hash && 
-       ((table->keyType == PeisHashTableKey_String && strcasecmp(link->key.str,(char*)key)==0)
-	|| (table->keyType == PeisHashTableKey_Integer && link->key.val == (int)(long) key)
-	)) {
-      *prev=link->next;
-      if(table->keyType == PeisHashTableKey_String)
-	free(link->key.str);
-      free(link);
-      return 0;
-    }
-    prev=&link->next;
-    link=link->next;
-  }
-  return PEISK_HASH_KEY_NOT_FOUND;
+  slot=peisk_hashTable_find(table,key);
+  if(!slot) return PEISK_HASH_KEY_NOT_FOUND;
+
+  /* Leave a marker so that probing for other keys continues past this
+     slot. Nothing is moved, which keeps any iterators valid. */
+  if(table->keyType == PeisHashTableKey_String)
+    table->arenaLive -= strlen(table->keyArena+slot->key)+1;
+  slot->hash=PEISK_HASH_SLOT_REMOVED;
+  slot->value=NULL;
+  table->count--;
+  return 0;
 }
 
 int peisk_hashTable_insert(PeisHashTable *table,void *key,void *value) {
-  int hash, cost;
-  PeisHashTableLink *link, *newLink;
+  int hash, i, mask;
+  PeisHashTableSlot *slot, *removed;
+  long storedKey;
 
-  if(table->nBuckets==0) peisk_hashTable_resize(table,5);
-  hash=peisk_hashTable_hash(table,key);
   /* First see if key already exits, if so just modify it. */
-  link=table->buckets[hash%table->nBuckets];
-  cost=0;
-  while(link) {
-    /* This also counts the "cost" of the hashtable to determine if we should resize it. The cost is the number of links that
-       have different hash values but lie in the same bucket. 
-    */
-    if(hash != link->hash) cost++;
-    if(hash == link->hash && 
-       ((table->keyType == PeisHashTableKey_String && strcasecmp(link->key.str,(char*)key)==0)
-	|| (table->keyType == PeisHashTableKey_Integer && link->key.val == (int)(long) key)
-	)) {
-      link->value = value; return 0; 
-    }
-    link=link->next;
-  }  
-  /* No previous value found, insert into hash table instead */
-  newLink = (PeisHashTableLink*) malloc(sizeof(PeisHashTableLink));
-  if(!newLink) return PEISK_HASH_OUT_OF_MEMORY;
-  newLink->hash=hash;
-  if(table->keyType == PeisHashTableKey_String)
-    newLink->key.str = strdup((char*)key);
-  else
-    newLink->key.val = (int)(long) key;
-  newLink->value = value;
-  newLink->next = table->buckets[hash%table->nBuckets];
-  table->buckets[hash%table->nBuckets] = newLink;
-  /* Resize if new cost (links same bucket but with differnt hash) above threshold */
-  if(cost + 1 > 3+table->nBuckets/10) peisk_hashTable_resize(table,table->nBuckets+table->nBuckets/2);
+  slot=peisk_hashTable_find(table,key);
+  if(slot) { slot->value = value; return 0; }
+
+  /* Keep the load (including removed slots) below 3/4, rebuilding
+     gets rid of the removed slots and grows the table if needed. */
+  if(4*(table->used+1) > 3*table->nSlots)
+    if(peisk_hashTable_resize(table,2*(table->count+1))) return PEISK_HASH_OUT_OF_MEMORY;
+
+  if(table->keyType == PeisHashTableKey_String) {
+    storedKey = peisk_hashTable_storeKey(table,(char*)key);
+    if(storedKey < 0) return PEISK_HASH_OUT_OF_MEMORY;
+  } else
+    storedKey = (int)(long) key;
+
+  /* No previous value found, insert into the first free slot,
+     reusing removed slots if possible. */
+  hash=peisk_hashTable_hash(table,key);
+  mask=table->nSlots-1;
+  removed=NULL;
+  for(i=hash&mask;;i=(i+1)&mask) {
+    slot=&table->slots[i];
+    if(slot->hash == PEISK_HASH_SLOT_REMOVED && !removed) removed=slot;
+    if(slot->hash == PEISK_HASH_SLOT_EMPTY) break;
+  }
+  if(removed) slot=removed;
+  else table->used++;
+  slot->hash=hash;
+  slot->key=storedKey;
+  slot->value=value;
+  table->count++;
   return 0;
 }
 
-int peisk_hashTable_resize(PeisHashTable *table,int nNewBuckets) {
-  int i,hash,nOldBuckets;
-  PeisHashTableLink **oldBuckets;
-  PeisHashTableLink *link, *next;
-
-  if(nNewBuckets < 1) return PEISK_HASH_INVALID_ARG;
-  nOldBuckets=table->nBuckets;
-  oldBuckets=table->buckets;
-  table->buckets = (PeisHashTableLink**) calloc(nNewBuckets,sizeof(PeisHashTableLink));  
-  if(!table->buckets) { table->buckets=oldBuckets; return PEISK_HASH_OUT_OF_MEMORY; }
-  table->nBuckets=nNewBuckets;
-
-  /* Now iterate over all old links and put them in the new hashtable */
-  for(i=0;i<nOldBuckets;i++)
-    for(link=oldBuckets[i];link;) {
-      next=link->next;
-      hash = link->hash;
-      link->next=table->buckets[hash%nNewBuckets];
-      table->buckets[hash%nNewBuckets]=link;
-      link=next;
-    }
+int peisk_hashTable_resize(PeisHashTable *table,int nNewSlots) {
+  int i, j, mask, nOldSlots;
+  PeisHashTableSlot *oldSlots;
+
+  if(nNewSlots < 1) return PEISK_HASH_INVALID_ARG;
+  /* Round up to a power of two with room for all current entries */
+  for(i=8;i<nNewSlots || 4*table->count >= 3*i;i*=2) {}
+  nNewSlots=i;
+
+  nOldSlots=table->nSlots;
+  oldSlots=table->slots;
+  table->slots = (PeisHashTableSlot*) malloc(nNewSlots*sizeof(PeisHashTableSlot));
+  if(!table->slots) { table->slots=oldSlots; return PEISK_HASH_OUT_OF_MEMORY; }
+  for(i=0;i<nNewSlots;i++) table->slots[i].hash=PEISK_HASH_SLOT_EMPTY;
+  table->nSlots=nNewSlots;
+  table->used=table->count;
+
+  /* Now iterate over all old slots and put them in the new hashtable,
+     their keys stay where they are in the key arena. */
+  mask=nNewSlots-1;
+  for(i=0;i<nOldSlots;i++) {
+    if(oldSlots[i].hash < 0) continue;
+    for(j=oldSlots[i].hash&mask;table->slots[j].hash != PEISK_HASH_SLOT_EMPTY;j=(j+1)&mask) {}
+    table->slots[j]=oldSlots[i];
+  }
   /* Cleanup */
-  if(oldBuckets) free(oldBuckets);
+  if(oldSlots) free(oldSlots);
   return 0;
 }
 
@@ -244,23 +266,88 @@ const char *peisk_hashTable_strerror(int error) {
   return "Unknown error code - not a valid hashtable error?";
 }
 void peisk_hashTableIterator_first(PeisHashTable *hashTable, PeisHashTableIterator *iterator) {
-  iterator->bucket=0;
-  iterator->link=NULL;
+  iterator->slot=-1;
   iterator->hashTable=hashTable;
 }
 int peisk_hashTableIterator_next(PeisHashTableIterator *iterator) {
-  if(iterator->link) iterator->link=iterator->link->next;
-  while(iterator->link == NULL) {
-    if(iterator->bucket >= iterator->hashTable->nBuckets) return 0;    
-    iterator->link=iterator->hashTable->buckets[iterator->bucket];
-    iterator->bucket++;
-  }
-  return 1;
+  PeisHashTable *table=iterator->hashTable;
+  while(++iterator->slot < table->nSlots)
+    if(table->slots[iterator->slot].hash >= 0) return 1;
+  return 0;
 }
 int peisk_hashTableIterator_value(PeisHashTableIterator *iterator,void **key,void **value) {
-  /*PEISK_ASSERT(iterator->link,("HashTable iterator pointing outside hashTable, not initialized or not called _next??"));*/
-  if(!iterator->link) return 0;
-  *key=(void*)(long)iterator->link->key.val;
-  *value=iterator->link->value;
+  PeisHashTable *table=iterator->hashTable;
+  PeisHashTableSlot *slot;
+  /* The current element might have been removed since the call to _next */
+  if(iterator->slot < 0 || iterator->slot >= table->nSlots) return 0;
+  slot=&table->slots[iterator->slot];
+  if(slot->hash < 0) return 0;
+  *key=peisk_hashTable_slotKey(table,slot);
+  *value=slot->value;
   return 1;
 }
+
+void peisk_sortedArray_init(PeisSortedArray *array,int elementSize) {
+  array->data=NULL;
+  array->count=0;
+  array->allocated=0;
+  array->elementSize=elementSize;
+}
+void peisk_sortedArray_free(PeisSortedArray *array) {
+  free(array->data);
+  array->data=NULL;
+  array->count=0;
+  array->allocated=0;
+}
+/** Returns the index of the first element with a key not less than
+    the given key */
+static int peisk_sortedArray_lowerBound(PeisSortedArray *array,int key) {
+  int lo=0, hi=array->count, mid;
+  while(lo < hi) {
+    mid=(lo+hi)/2;
+    if(*(int*)peisk_sortedArray_get(array,mid) < key) lo=mid+1;
+    else hi=mid;
+  }
+  return lo;
+}
+void *peisk_sortedArray_find(PeisSortedArray *array,int key) {
+  int index=peisk_sortedArray_lowerBound(array,key);
+  if(index < array->count && *(int*)peisk_sortedArray_get(array,index) == key)
+    return peisk_sortedArray_get(array,index);
+  return NULL;
+}
+void *peisk_sortedArray_insert(PeisSortedArray *array,int key) {
+  int index;
+  char *data, *element;
+
+  /* Elements usually arrive in increasing order, check the end first */
+  if(array->count == 0 || *(int*)peisk_sortedArray_get(array,array->count-1) < key)
+    index=array->count;
+  else {
+    index=peisk_sortedArray_lowerBound(array,key);
+    if(*(int*)peisk_sortedArray_get(array,index) == key) return peisk_sortedArray_get(array,index);
+  }
+  if(array->count == array->allocated) {
+    data=(char*) realloc(array->data,(array->allocated ? 2*array->allocated : 16)*array->elementSize);
+    if(!data) return NULL;
+    array->data=data;
+    array->allocated=array->allocated ? 2*array->allocated : 16;
+  }
+  element=peisk_sortedArray_get(array,index);
+  memmove(element+array->elementSize,element,(array->count-index)*array->elementSize);
+  memset(element,0,array->elementSize);
+  *(int*)element=key;
+  array->count++;
+  return element;
+}
+int peisk_sortedArray_remove(PeisSortedArray *array,int key) {
+  int index=peisk_sortedArray_lowerBound(array,key);
+  if(index == array->count || *(int*)peisk_sortedArray_get(array,index) != key) return PEISK_HASH_KEY_NOT_FOUND;
+  peisk_sortedArray_removeAt(array,index);
+  return 0;
+}
+void peisk_sortedArray_removeAt(PeisSortedArray *array,int index) {
+  char *element=peisk_sortedArray_get(array,index);
+  memmove(element,element+array->elementSize,(array->count-index-1)*array->elementSize);
+  array->count--;
+}
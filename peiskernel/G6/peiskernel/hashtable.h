@@ -43,28 +43,34 @@
 
 typedef enum { PeisHashTableKey_String=0, PeisHashTableKey_Integer=1 } PeisHashTableKeyType;
 
-/** Container for (key,value) pairs in the hashtables. */
-typedef struct PeisHashTableLink {
-  int hash;
-  union {
-    char *str; /**< A copy (strdup) of string keys */
-    long val;   /**< Integer valued keys */
-  } key;       /**< The key for this link */
-  void *value;        /** The value for this link, this is not copied by the hashtable routines. User must ensure that values are persistent */
-
-  struct PeisHashTableLink *next;
-} PeisHashTableLink;
-
-/** Datatype for generic hashtable indexed by C-strings. */
+/** Marks a slot in a hashtable that have never been used */
+#define PEISK_HASH_SLOT_EMPTY   -1
+/** Marks a slot in a hashtable whose entry have been removed */
+#define PEISK_HASH_SLOT_REMOVED -2
+
+/** Container for (key,value) pairs in the hashtables. All slots are
+    stored in one array and collisions are resolved by linear probing. */
+typedef struct PeisHashTableSlot {
+  int hash;    /**< Hash value of the key, or PEISK_HASH_SLOT_EMPTY/REMOVED */
+  long key;    /**< Integer valued keys, or offset of string keys in the key arena */
+  void *value; /**< The value for this slot, this is not copied by the hashtable routines. User must ensure that values are persistent */
+} PeisHashTableSlot;
+
+/** Datatype for generic hashtable indexed by C-strings or integers. */
 typedef struct PeisHashTable {
-  int nBuckets;
-  struct PeisHashTableLink **buckets; /** Array of pointer to links (lists) */
+  int nSlots;    /**< Size of the slots array, always a power of two (or zero) */
+  int count;     /**< Number of entries in the hashtable */
+  int used;      /**< Number of slots that are not empty, including removed ones */
+  struct PeisHashTableSlot *slots; /**< Array of all slots */
+  char *keyArena;  /**< Copies of all string keys, referenced by offsets from the slots */
+  int arenaSize;   /**< Allocated size of keyArena */
+  int arenaUsed;   /**< Number of bytes used in keyArena, including removed keys */
+  int arenaLive;   /**< Number of bytes in keyArena used by current keys */
   PeisHashTableKeyType keyType;
 } PeisHashTable;
 
 typedef struct PeisHashTableIterator { 
-  int bucket;
-  struct PeisHashTableLink *link;
+  int slot;
   struct PeisHashTable *hashTable;
 } PeisHashTableIterator;
 
@@ -74,7 +80,7 @@ PeisHashTable *peisk_hashTable_create(PeisHashTableKeyType keyType);
 void peisk_hashTable_delete(PeisHashTable *);
 /** Removes all content from a hashTable */
 void peisk_hashTable_clear(PeisHashTable *);
-/** Counts how many entries have in a hashTable */
+/** Returns how many entries there are in a hashTable */
 int peisk_hashTable_count(PeisHashTable *);
 /** Gets the value associated to given key in hashtable (need to
     typecast correct key into void*). 
@@ -88,11 +94,10 @@ int peisk_hashTable_insert(PeisHashTable *,void *key,void *value);
 
 /** Initialize a hashTable iterator to point to just before the first entry in hashtable. 
     You must call the *_next function before asking for the first value. 
-    Never change a hashtable when iterating over it. 
+    Never insert into a hashtable when iterating over it. 
     Note: It is allowed to remove elements from a hashtable while
-    iterating over it *as long as the the element currently pointed to
-    by the iterator is not removed*. Ie. if you want to delete the
-    current element then do a _next call before deleting it. */
+    iterating over it, including the element currently pointed to by
+    the iterator. Removing elements never moves the remaining ones. */
 void peisk_hashTableIterator_first(PeisHashTable *hashtable, PeisHashTableIterator *iterator);
 /** Steps a hashTable iterator to point to the next value. Returns non zero if successfull. */
 int peisk_hashTableIterator_next(PeisHashTableIterator *iterator);
@@ -111,8 +116,10 @@ int peisk_hashTableIterator_value(PeisHashTableIterator *iterator,void **key,voi
     Type of value should be a pointer to "long long" integer or any kind of pointer. */
 #define peisk_hashTableIterator_value_generic(iterator,keyp,valuep) ({void *_keyp, *_valuep; int _success=peisk_hashTableIterator_value(iterator,&_keyp,&_valuep); *keyp = (typeof(*keyp)) _keyp; *valuep = (typeof(*valuep)) _valuep; _success; })
 
-/** Changes number of buckets in hashtable and rebuilds it. Returns non zero if succcesfull. */
-int peisk_hashTable_resize(PeisHashTable *,int nBuckets);
+/** Changes number of slots in hashtable and rebuilds it. The size is
+    rounded up to a power of two large enough for all current entries.
+    Returns zero on success, error code on failure. */
+int peisk_hashTable_resize(PeisHashTable *,int nSlots);
 
 
 /* These are the error codes that can be returned from the hashtable functions */
@@ -130,8 +137,46 @@ int peisk_hashTable_resize(PeisHashTable *,int nBuckets);
 /** Converts a hashtable error code to a printable string */
 const char *peisk_hashTable_strerror(int error);
 
+/** Returns the key stored in the given slot, as it should be given to the user */
+#define peisk_hashTable_slotKey(table,slot) \
+  ((table)->keyType == PeisHashTableKey_String ? (void*)((table)->keyArena+(slot)->key) : (void*)(slot)->key)
+
 /** Ugly inline definition to be used only inside the peiskernel. It's fast but sacrificing safety and elegance. This requires the C compiler to have the typeof compile-time operator, all GCC derivatives have it. */
-#define peisk_hashTableIterator_value_fast(_it,_k,_v) {*(_k)=(typeof(*_k))(_it)->link->key.val; *(_v)=(typeof(*_v))(_it)->link->value;}
+#define peisk_hashTableIterator_value_fast(_it,_k,_v) {*(_k)=(typeof(*_k))(long)peisk_hashTable_slotKey((_it)->hashTable,&(_it)->hashTable->slots[(_it)->slot]); *(_v)=(typeof(*_v))(_it)->hashTable->slots[(_it)->slot].value;}
+
+/** \brief Array of fixed size elements kept sorted by an integer key.
+
+    Each element must start with its integer key. Elements are stored
+    inline in one array, so looking up a key is a binary search and
+    no memory is allocated for each element. Inserting and removing
+    elements move the elements after them, which invalidates pointers
+    to those elements. */
+typedef struct PeisSortedArray {
+  char *data;       /**< All elements, sorted by their keys */
+  int count;        /**< Number of elements in the array */
+  int allocated;    /**< Number of elements there is room for in data */
+  int elementSize;  /**< Size of each element in bytes */
+} PeisSortedArray;
+
+/** Initializes an empty sorted array of elements of the given size */
+void peisk_sortedArray_init(PeisSortedArray *array,int elementSize);
+/** Deallocates the memory used by the array, leaving it empty */
+void peisk_sortedArray_free(PeisSortedArray *array);
+/** Returns the element with the given key, or NULL if there is none */
+void *peisk_sortedArray_find(PeisSortedArray *array,int key);
+/** Returns the element with the given key, inserting a new element
+    that is zeroed except for its key if there was none. Returns NULL
+    if out of memory. */
+void *peisk_sortedArray_insert(PeisSortedArray *array,int key);
+/** Removes the element with the given key. Returns zero on success,
+    PEISK_HASH_KEY_NOT_FOUND if there was no such element. */
+int peisk_sortedArray_remove(PeisSortedArray *array,int key);
+/** Removes the element at the given index */
+void peisk_sortedArray_removeAt(PeisSortedArray *array,int index);
+/** Returns the element at the given index */
+#define peisk_sortedArray_get(array,index) ((void*) ((array)->data + (index)*(array)->elementSize))
+/** Removes all elements but keeps the memory */
+#define peisk_sortedArray_clear(array) ((array)->count=0)
 
 /*\}@ Hashtables */
 /*\}@ Ingroup  peisk */
@@ -39,6 +39,13 @@
 #include <string.h>
 #include <math.h>
 
+#ifdef WITH_EPOLL
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
+
 /* This is needed for SIOCOUTQ tests below. Can be disabled for platforms which does not have it... */
 /* CYGWIN does not have these...  --AS 060816 */
 #ifndef __CYGWIN__
@@ -53,6 +60,8 @@
 #include "peiskernel.h"
 #include "p2p.h"
 #include "peiskernel_tcpip.h"
+#include "udp.h"
+#include "shm.h"
 #include "bluetooth.h"
 
 void peisk_autoConnect(char *url) {
@@ -77,7 +86,6 @@ PeisConnection *peisk_connect(char *url,int flags) {
     printf("peisk: connecting to %s\n",url);
 
   if(strncmp("udp://",url,6) == 0) {
-#ifdef UNUSED
     url += 6;
 
     /* Extract hostname and port */
@@ -88,11 +96,17 @@ PeisConnection *peisk_connect(char *url,int flags) {
     if(url[i] && url[i+1]) {
       if(sscanf(&url[i+1],"%d",&port) != 1) {
 	fprintf(stderr,"peisk::connect; malformed url: 'udp://%s'\n",url);
-	return -1;
+	return NULL;
       }
     }
     return peisk_udpConnect(name,port,flags);
-#endif    
+  } else if(strncmp("shm://",url,6) == 0) {
+    url += 6;
+    if(sscanf(url,"%d",&port) != 1) {
+      fprintf(stderr,"peisk::connect; malformed url: 'shm://%s'\n",url);
+      return NULL;
+    }
+    return peisk_shmConnect(port,flags);
   } else if(strncmp("tcp://",url,6) == 0) {
     url += 6;
 
@@ -147,7 +161,7 @@ int peisk_estimateHostMetric(PeisHostInfo *hostInfo) {
   else return peisk_netMetricCost;
 }
 
-int peisk_connection_sendAtomic(PeisConnection *connection,PeisPackage *package,int len) {
+int peisk_connection_sendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) {
   if(connection->isPending) return -1;
 
   if(peiskernel.simulatePackageLoss > 0.0 && (rand()%1000) < (peiskernel.simulatePackageLoss*1000.0)) {
@@ -161,106 +175,101 @@ int peisk_connection_sendAtomic(PeisConnection *connection,PeisPackage *package,
   case eSerialConnection:
     return -1;
   case eTCPConnection:
-    return peisk_tcpSendAtomic(connection,package,len);
-  case eUDPConnection:
-    /*return peisk_udpSendAtomic(connection,package,len);*/
+    /* TCP connections are only written to by peisk_connection_sendQueued */
     return -1;
+  case eUDPConnection:
+    return peisk_udpSendAtomic(connection,header,data,datalen);
+  case eShmConnection:
+    return peisk_shmSendAtomic(connection,header,data,datalen);
   case eBluetoothConnection:
-    return peisk_bluetoothSendAtomic(connection,package,len);
+    return peisk_bluetoothSendAtomic(connection,header,data,datalen);
   }
   return -1;
 }
-/** Call when a connection seem to be out of sync, flushes packages until we are back on track again. */
+
+int peisk_connection_sendQueued(PeisConnection *connection,PeisQueuedPackage **packages,int n,int *offset) {
+  int i;
+
+  if(connection->isPending) return 0;
+  if(connection->type == eTCPConnection)
+    return peisk_tcpSendQueued(connection,packages,n,offset);
+  if(connection->type == eUDPConnection)
+    return peisk_udpSendQueued(connection,packages,n);
+  if(connection->type == eShmConnection)
+    return peisk_shmSendQueued(connection,packages,n);
+
+  /* Other links preserve package boundaries, send one package at a time */
+  for(i=0;i<n;i++)
+    if(peisk_connection_sendAtomic(connection,&packages[i]->package.header,peisk_queuedPackage_data(packages[i]),
+				   ntohs(packages[i]->package.header.datalen)) != 0)
+      return connection->id == -1 ? -1 : i;
+  return n;
+}
+
+void peisk_iovecAdvance(struct msghdr *msg,int n) {
+  while(msg->msg_iovlen > 0 && n >= msg->msg_iov->iov_len) {
+    n -= msg->msg_iov->iov_len;
+    msg->msg_iov++;
+    msg->msg_iovlen--;
+  }
+  if(msg->msg_iovlen > 0) {
+    msg->msg_iov->iov_base = (char*) msg->msg_iov->iov_base + n;
+    msg->msg_iov->iov_len -= n;
+  }
+}
 void peisk_syncflush(PeisConnection *connection) {
-  int status;
-  long int mysync;
+  int32 sync=PEISK_SYNC;
+  int i;
 
   if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
     fprintf(stdout,"peisk: connection %d lost sync\n",connection->id);
   switch(connection->type) {
   case eTCPConnection:
-	  while(1) {
-	    /* For TCP connections we just attempt to read and throw away chars until we have found a sync long int
-	       until we have found a new sync character. */
-	    errno=0;
-	    status=recv(connection->connection.tcp.socket,(void*)&mysync,sizeof(mysync),MSG_PEEK|MSG_NOSIGNAL);
-	    if(errno == EAGAIN) return;
-	    if(errno == EPIPE || status == -1) {          /* Error - close socket */
-	      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-		printf("peisk: warning - error (3) in receive, closing socket\n");
-	      peisk_closeConnection(connection->id);
-	      return;
-	    }
-	    if(status == sizeof(mysync) && mysync == PEISK_SYNC)
-	      /* We have found the sync, continue as before */
-	      { peisk_connection_processIncomming(connection); return; }
-	    /* read again but without peek so that the data is realy consumed */
-	    errno=0;
-	    //status=recv(connection->connection.tcp.socket,(void*)&mysync,sizeof(mysync),MSG_NOSIGNAL);
-	    status=recv(connection->connection.tcp.socket,(void*)&mysync,1,MSG_NOSIGNAL);
-	  }
-	  break;
+    /* For TCP connections we throw away buffered data until the next
+       sync. A partial sync at the end of the buffer is kept, the
+       remaining data is received and checked as usual. */
+    for(i=connection->inStart+1;i+sizeof(sync)<=connection->inEnd;i++)
+      if(memcmp(connection->inBuffer+i,&sync,sizeof(sync)) == 0) break;
+    connection->inStart = MIN(i,connection->inEnd);
+    return;
   case eUDPConnection:
     /* UDP connections cannot become out of sync since udp preserves record boundaries */
     return;
   case eBluetoothConnection:
     /* Bluetooth connections cannot become out of sync since L2CAP preserves record boundaries */
     return;
+  case eShmConnection:
+    /* Corrupt shared memory connections are closed when reading from them */
+    return;
   default: peisk_closeConnection(connection->id);
   }
 }
 
 
-/** \todo remove the pending connection stuff from
-    peisk_connection_receiveIncomming and put into periodic functions
-    instead. */
-int peisk_connection_receiveIncomming(PeisConnection *connection,PeisPackage *package) {
-  if(connection->isPending) return 0;
-
-#ifdef OLD
-  /* Handle pending UDP connection specially, just check for the ACK message so it can be promoted
-     to a eUDPConnected status */
-  if(connection->type == eUDPConnection && connection->connection.udp.status == eUDPPending) {
-    /* Check for a response... */
-    /* Update our sin_port according to response */
-    errno=0;
-    len=sizeof(addr);
-    size=recvfrom(connection->connection.udp.socket,buf,sizeof(buf),MSG_DONTWAIT,&addr,&len);
-    if(size <= 0) return 0;
-
-    /* TODO: Test that we realy got the package "ack" back */
-
-    in_addr=(struct sockaddr_in*) &connection->connection.udp.addr; 
-    memcpy(&connection->connection.udp.addr,&addr,len);
-    connection->connection.udp.len = len;
-    printf("UDP connection acknowledged. Socket: %d Len: %d Port: %d\n",connection->connection.udp.socket,len,ntohs(in_addr->sin_port));
-    printf("New sin_addr: %d %d %d %d\n",((unsigned char*)&in_addr->sin_addr)[0],((unsigned char*)&in_addr->sin_addr)[1],((unsigned char*)&in_addr->sin_addr)[2],((unsigned char*)&in_addr->sin_addr)[3]);
+int peisk_connection_receiveIncomming(PeisConnection *connection,PeisPackage **packageRef) {
+  PeisPackage *package;
 
-    /* Force an update of routing tables by directly calling the periodic routing function */
-    /* peisk_do_routing(1); */
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: new outbound udp/ip connection #%d established\n",connection->id);
-
-    connection->connection.udp.status=eUDPConnected;
-    return 0;
-  }
-#endif
+  if(connection->isPending) return 0;
 
   int success=0;
   switch(connection->type) {
   case eTCPConnection:
-    success = peisk_tcpReceiveIncomming(connection,package);
+    success = peisk_tcpReceiveIncomming(connection,packageRef);
     break;
   case eUDPConnection:
-    /*success = peisk_udpReceiveIncomming(connection,package);*/
+    success = peisk_udpReceiveIncomming(connection,packageRef);
+    break;
+  case eShmConnection:
+    success = peisk_shmReceiveIncomming(connection,packageRef);
     break;
   case eBluetoothConnection:
-    success = peisk_bluetoothReceiveIncomming(connection,package);
+    success = peisk_bluetoothReceiveIncomming(connection,*packageRef);
     break;
   default: return 0; /* TODO - handle other connection types here */
   }
 
   if(!success) return 0;
+  package = *packageRef;
 
   /* Update congestion control information */
   if(ntohl(package->header.linkCnt)+1 > connection->incomingIdHi)
@@ -380,6 +389,10 @@ void peisk_setSelectReadSignals(int *n,fd_set *readSet,fd_set *writeSet,fd_set *
     *n=MAX(*n,peiskernel.udp_serverSocket);
     FD_SET(peiskernel.udp_serverSocket,readSet);
   }
+  if(peiskernel.shm_serverSocket != -1) {
+    *n=MAX(*n,peiskernel.shm_serverSocket);
+    FD_SET(peiskernel.shm_serverSocket,readSet);
+  }
   *n=MAX(*n,peiskernel.tcp_broadcast_receiver);
   if(peiskernel.tcp_broadcast_receiver >= 0)
     FD_SET(peiskernel.tcp_broadcast_receiver,readSet);
@@ -387,16 +400,234 @@ void peisk_setSelectReadSignals(int *n,fd_set *readSet,fd_set *writeSet,fd_set *
   for(i=0;i<=peiskernel.highestConnection;i++)
     if(peiskernel.connections[i].id != -1) {
       PeisConnection *connection=&peiskernel.connections[i];
-      if(connection->type == eTCPConnection) {
+      if(connection->type == eUDPConnection) {
+	*n=MAX(*n,connection->connection.udp.socket);
+	FD_SET(connection->connection.udp.socket,readSet);
+      }
+      if(connection->type == eShmConnection && !connection->isPending) {
+	*n=MAX(*n,connection->connection.shm.eventFd);
+	FD_SET(connection->connection.shm.eventFd,readSet);
+      }
+      if(connection->type == eShmConnection && connection->connection.shm.socket != -1) {
+	*n=MAX(*n,connection->connection.shm.socket);
+	FD_SET(connection->connection.shm.socket,readSet);
+      }
+      if(connection->type == eTCPConnection && connection->connection.tcp.socket != -1) {
 	*n=MAX(*n,connection->connection.tcp.socket);
 	FD_SET(connection->connection.tcp.socket,readSet);
 	/*FD_SET(peiskernel.connections[i].connection.tcp.socket,excpSet);*/ /*Is this neccessary????? */
-	for(j=0;j<PEISK_NQUEUES;j++) if(connection->nQueuedPackages[j] > 0) break;
-	if(j != PEISK_NQUEUES) FD_SET(connection->connection.tcp.socket,writeSet);
+	/* Packages in the pending queue are only resent when their
+	   timeout expires, waiting for write on them only gives spurious wakeups */
+	for(j=0;j<PEISK_NQUEUES;j++) if(j != PEISK_QUEUE_PENDING && connection->nQueuedPackages[j] > 0) break;
+	if(j != PEISK_NQUEUES || connection->sendPartial ||
+	   (connection->isPending && connection->connection.tcp.status == eTCPConnecting))
+	  FD_SET(connection->connection.tcp.socket,writeSet);
       }
     }
 }
 
+/** Gives the file descriptor used by a connection */
+static int peisk_connectionFd(PeisConnection *connection) {
+  switch(connection->type) {
+  case eTCPConnection: return connection->connection.tcp.socket;
+  case eUDPConnection: return connection->connection.udp.socket;
+  case eSerialConnection: return connection->connection.serial.device;
+  case eBluetoothConnection: return connection->connection.bluetooth.socket;
+  case eShmConnection: return connection->connection.shm.eventFd;
+  }
+  return -1;
+}
+
+void peisk_reactorInitialize() {
+  peiskernel.epollFd = -1;
+  peiskernel.timerFd = -1;
+  peiskernel.wakeupFd = -1;
+  peiskernel.timerDeadline = -1.0;
+  peiskernel.reactorSleeping = 0;
+  peiskernel.moreIncomming = 0;
+  peiskernel.hangups = 0;
+#ifdef WITH_EPOLL
+  peiskernel.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if(peiskernel.epollFd == -1) {
+    perror("peisk::reactorInitialize::epoll_create");
+    return;
+  }
+  peiskernel.timerFd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+  peiskernel.wakeupFd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  if(peiskernel.timerFd == -1 || peiskernel.wakeupFd == -1) {
+    perror("peisk::reactorInitialize::timerfd/eventfd");
+    peisk_reactorShutdown();
+    return;
+  }
+  peisk_reactorWatch(peiskernel.timerFd,1);
+  peisk_reactorWatch(peiskernel.wakeupFd,1);
+#endif
+}
+
+void peisk_reactorShutdown() {
+  if(peiskernel.timerFd != -1) close(peiskernel.timerFd);
+  if(peiskernel.wakeupFd != -1) close(peiskernel.wakeupFd);
+  if(peiskernel.epollFd != -1) close(peiskernel.epollFd);
+  peiskernel.epollFd = -1;
+  peiskernel.timerFd = -1;
+  peiskernel.wakeupFd = -1;
+}
+
+void peisk_reactorWatch(int fd,int edgeTriggered) {
+#ifdef WITH_EPOLL
+  struct epoll_event event;
+
+  if(peiskernel.epollFd == -1 || fd < 0) return;
+  memset(&event,0,sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP | (edgeTriggered ? EPOLLET : 0);
+  event.data.fd = fd;
+  /* Pending connections are watched already before they are finished */
+  if(epoll_ctl(peiskernel.epollFd,EPOLL_CTL_ADD,fd,&event) == -1 &&
+     (errno != EEXIST || epoll_ctl(peiskernel.epollFd,EPOLL_CTL_MOD,fd,&event) == -1))
+    perror("peisk::reactorWatch::epoll_ctl");
+#endif
+}
+
+void peisk_reactorWatchConnect(int fd) {
+#ifdef WITH_EPOLL
+  struct epoll_event event;
+
+  if(peiskernel.epollFd == -1 || fd < 0) return;
+  memset(&event,0,sizeof(event));
+  /* The socket becomes writable when the connect has finished or failed */
+  event.events = EPOLLOUT | EPOLLET;
+  event.data.fd = fd;
+  if(epoll_ctl(peiskernel.epollFd,EPOLL_CTL_ADD,fd,&event) == -1)
+    perror("peisk::reactorWatchConnect::epoll_ctl");
+#endif
+}
+
+void peisk_reactorWatchConnection(PeisConnection *connection) {
+  connection->watchesOutput = 0;
+  peisk_reactorWatch(peisk_connectionFd(connection),1);
+}
+
+int peisk_reactorPrepare() {
+#ifdef WITH_EPOLL
+  PeisConnection *connection;
+  struct epoll_event event;
+  struct itimerspec timer;
+  double deadline, delay, pacing;
+  int i, j, wantsOutput, hasOutput;
+
+  /* Edge triggered events are not repeated for packages the last
+     step left unread, so go on reading them directly */
+  if(peiskernel.moreIncomming) return 1;
+
+  /* Watch for output only on connections that have packages to send */
+  hasOutput=0;
+  pacing=-1.0;
+  for(i=0;i<=peiskernel.highestConnection;i++) {
+    connection=&peiskernel.connections[i];
+    if(connection->id == -1) continue;
+    if(connection->isPending) {
+      /* Pending UDP connections repeat their connect message, pending
+	 TCP connections poll their hostname lookup or are given up, as
+	 are shared memory connections */
+      delay = -1.0;
+      if(connection->type == eUDPConnection)
+	delay = connection->connection.udp.nextAttempt;
+      else if(connection->type == eShmConnection)
+	delay = connection->connection.shm.timeout;
+      else if(connection->type == eTCPConnection)
+	delay = connection->connection.tcp.status == eTCPResolving ?
+	  peisk_gettimef() + PEISK_TCP_RESOLVE_POLL : connection->connection.tcp.timeout;
+      if(delay >= 0.0 && (pacing < 0.0 || delay < pacing)) pacing = delay;
+      continue;
+    }
+    for(j=0;j<PEISK_NQUEUES;j++) 
+      if(j != PEISK_QUEUE_PENDING && connection->nQueuedPackages[j] > 0) break;
+    /* Throttled connections wait for their pacer instead */
+    wantsOutput = (j != PEISK_NQUEUES || connection->sendPartial) && !connection->isThrottled;
+    if(wantsOutput) hasOutput=1;
+    else if(connection->isThrottled) {
+      delay = peisk_connection_pacingDeadline(connection);
+      if(pacing < 0.0 || delay < pacing) pacing = delay;
+    }
+    if(wantsOutput == connection->watchesOutput) continue;
+    memset(&event,0,sizeof(event));
+    event.events = EPOLLIN | EPOLLET | (wantsOutput ? EPOLLOUT : 0);
+    event.data.fd = peisk_connectionFd(connection);
+    if(epoll_ctl(peiskernel.epollFd,EPOLL_CTL_MOD,event.data.fd,&event) == 0)
+      connection->watchesOutput = wantsOutput;
+  }
+
+  /* Arm the timer for the next periodic function. Periodic functions
+     with zero periodicity are run on every step and do not need
+     it. No periodics are run while shutting down. */
+  deadline = -1.0;
+  if(!peiskernel.doShutdown)
+    for(i=0;i<=peiskernel.highestPeriodic;i++)
+      if(peiskernel.periodics[i].periodicity > 0.0 &&
+	 (deadline < 0.0 || peiskernel.periodics[i].last + peiskernel.periodics[i].periodicity < deadline))
+	deadline = peiskernel.periodics[i].last + peiskernel.periodics[i].periodicity;
+  /* Sockets with a full send buffer are writable again once
+     acknowledged, but our own limit on buffered data is not */
+  if(hasOutput) {
+    delay = peisk_gettimef() + PEISK_REACTOR_OUTPUT_POLL;
+    if(deadline < 0.0 || delay < deadline) deadline = delay;
+  }
+  if(pacing >= 0.0 && (deadline < 0.0 || pacing < deadline)) deadline = pacing;
+  if(deadline != peiskernel.timerDeadline) {
+    memset(&timer,0,sizeof(timer));
+    if(deadline >= 0.0) {
+      delay = deadline - peisk_gettimef();
+      if(delay < 1e-6) delay = 1e-6;
+      timer.it_value.tv_sec = (time_t) delay;
+      timer.it_value.tv_nsec = (long) (fmod(delay,1.0) * 1e9);
+    }
+    if(timerfd_settime(peiskernel.timerFd,0,&timer,NULL) == -1)
+      perror("peisk::reactorPrepare::timerfd_settime");
+    peiskernel.timerDeadline = deadline;
+  }
+  peiskernel.reactorSleeping = 1;
+#endif
+  return 0;
+}
+
+void peisk_reactorSleep(double maxTime) {
+#ifdef WITH_EPOLL
+  struct epoll_event events[PEISK_REACTOR_EVENTS];
+  uint64_t value;
+  int i, n, timeout;
+
+  if(peiskernel.epollFd == -1) return;
+  timeout = maxTime < 0.0 ? -1 : (int) ceil(maxTime * 1000.0);
+  n = epoll_wait(peiskernel.epollFd,events,PEISK_REACTOR_EVENTS,timeout);
+  if(n == -1 && errno != EINTR) perror("peisk::reactorSleep::epoll_wait");
+  for(i=0;i<n;i++)
+    if(events[i].data.fd == peiskernel.timerFd) {
+      if(read(peiskernel.timerFd,&value,sizeof(value)) != sizeof(value)) continue;
+      /* The timer is one-shot, make sure it is armed again even if
+	 it expired just before the periodic was due */
+      peiskernel.timerDeadline = -2.0;
+    } else if(events[i].data.fd == peiskernel.wakeupFd) {
+      if(read(peiskernel.wakeupFd,&value,sizeof(value)) != sizeof(value)) continue;
+    } else if(events[i].events & (EPOLLHUP|EPOLLRDHUP)) peiskernel.hangups = 1;
+#endif
+}
+
+void peisk_reactorWait(double maxTime) {
+  if(peisk_reactorPrepare()) return;
+  peisk_reactorSleep(maxTime);
+  peiskernel.reactorSleeping = 0;
+}
+
+void peisk_reactorWakeup() {
+#ifdef WITH_EPOLL
+  uint64_t value = 1;
+
+  peiskernel.reactorSleeping = 0;
+  if(write(peiskernel.wakeupFd,&value,sizeof(value)) != sizeof(value))
+    perror("peisk::reactorWakeup::write");
+#endif
+}
+
 int peisk_linkIsConnectable(PeisLowlevelAddress *address) {
   switch(address->type) {
   case ePeisTcpIPv4:    
@@ -404,14 +635,15 @@ int peisk_linkIsConnectable(PeisLowlevelAddress *address) {
     /*return 0;*/
     return peisk_ipIsConnectable(address->addr.tcpIPv4.ip,address->addr.tcpIPv4.port);
   case ePeisUdpIPv4:
-    /* We have currently disabled UDP */
-    return 0;
-    /*return peis_ipIsConnectable(address->addr.tcpIPv4.ip,address->addr.tcpIPv4.port);*/
+    if(peiskernel.udp_serverPort == 0) return 0;
+    return peisk_ipIsConnectable(address->addr.udpIPv4.ip,address->addr.udpIPv4.port);
   case ePeisTcpIPv6:
     /* Not fully implemented */
     return 0;
   case ePeisBluetooth:
     return peisk_bluetoothIsConnectable(address->addr.bluetooth.baddr,address->addr.bluetooth.port);
+  case ePeisShm:
+    return peisk_shmIsConnectable(address->addr.shm.hostKey,address->addr.shm.port);
   }
   return 0;
 }
@@ -419,7 +651,8 @@ int peisk_linkIsConnectable(PeisLowlevelAddress *address) {
 void peisk_initConnectMessage(PeisConnectMessage *message,int flags) {
   message->version = htonl(peisk_protocollVersion);  
   strncpy(message->networkString,peisk_networkString,sizeof(message->networkString));
-  message->flags = htonl(flags);
+  message->flags = htonl(flags | PEISK_CONNECT_FLAG_SEQUENCED | PEISK_CONNECT_FLAG_ROUTING_DELTA |
+			 PEISK_CONNECT_FLAG_MULTICAST);
   message->id = htonl(peiskernel.id);
 }
 
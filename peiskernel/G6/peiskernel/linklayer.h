@@ -48,8 +48,11 @@ struct PeisConnection;
     - TCP/IPv4: Currently the dominant link mechanism. Provides
     bidirectional links to any other PEIS on the same ethernet
     network. Sometimes also to other networks. 
-    - UDP/IPv4: Currenly not used. Promises a few advantages with
-    regards to speed, overhead and latencies. 
+    - UDP/IPv4: Preferred for links to PEIS on the same local
+    network. Lower latencies than TCP since a lost package does not
+    delay the packages after it, see \ref UdpIP.
+    - Shared memory: Used between PEIS on the same computer, avoids
+    the TCP/IP stack altogether. See \ref SharedMemory.
     - Bluetooth: Creates connections between any bluetooth connected
     peis as soon as they enter the same physical space. Allows for a
     much simpler (even non existant) infrastructure, ie. no network
@@ -70,8 +73,13 @@ struct PeisConnection;
 /** Timeout for reading data packages */
 #define PEISK_READ_PACKAGE_TIMEOUT  5.0
 
+/** Size of the receive buffer of stream based connections. Must hold
+    at least one full package, larger buffers lets more packages be
+    read with each system call. */
+#define PEISK_STREAM_BUFFER_SIZE  16384
+
 /** The different lowlevel addresses available. */
-typedef enum { ePeisTcpIPv4=0, ePeisUdpIPv4, ePeisTcpIPv6, ePeisBluetooth } PeisLowlevelAddressType;
+typedef enum { ePeisTcpIPv4=0, ePeisUdpIPv4, ePeisTcpIPv6, ePeisBluetooth, ePeisShm } PeisLowlevelAddressType;
 /** Representation of different lowlevel addresses. This structure is
     always stored in HOST byte order. */
 typedef struct PeisLowlevelAddress {
@@ -83,11 +91,13 @@ typedef struct PeisLowlevelAddress {
     struct { unsigned char ip[4]; int port; } tcpIPv4;
     struct { unsigned char ip[4]; int port; } udpIPv4;
     struct { unsigned char baddr[6]; short port; } bluetooth;
+    struct { unsigned int hostKey; int port; } shm;
   } addr;
 } PeisLowlevelAddress;
 
-typedef enum { eTCPConnection, eUDPConnection, eSerialConnection, eBluetoothConnection } PeisConnectionType;
+typedef enum { eTCPConnection, eUDPConnection, eSerialConnection, eBluetoothConnection, eShmConnection } PeisConnectionType;
 typedef enum { eUDPConnected, eUDPPending } PeisUDPStatus;
+typedef enum { eTCPConnected, eTCPResolving, eTCPConnecting, eTCPAccepting } PeisTCPStatus;
 
 
 /** \brief Assumed overhead for each UDP package sent out */
@@ -97,6 +107,7 @@ typedef enum { eUDPConnected, eUDPPending } PeisUDPStatus;
    parameters. Actual declarations are done later in the
    peiskernel_private.h file.  */
 struct PeisPackage;
+struct PeisPackageHeader;
 struct PeisConnection;
 
 
@@ -109,15 +120,37 @@ int peisk_linkIsConnectable(PeisLowlevelAddress *address);
     This is one of the major interface between the P2P layer and
     the link layer. 
 
-    Package points to a PeisPackage structure including data 
-    for a total length of len bytes. Returns zero on
-    success. */
-int peisk_connection_sendAtomic(struct PeisConnection *connection,struct PeisPackage *package,int len);
+    The package header and the datalen bytes of data are sent
+    together as one package, without first copying them into one
+    buffer. Returns zero on success. */
+int peisk_connection_sendAtomic(struct PeisConnection *connection,struct PeisPackageHeader *header,void *data,int datalen);
+
+struct PeisQueuedPackage;
+/** Sends the n given packages in order, using as few system calls as
+    the link allows. *offset is the number of bytes of the first
+    package that have already been sent, and is updated to the number
+    of bytes sent of the first package that was not completely
+    sent. Returns the number of packages completely sent, or -1 if the
+    connection was closed. */
+int peisk_connection_sendQueued(struct PeisConnection *connection,struct PeisQueuedPackage **packages,int n,int *offset);
+
+struct msghdr;
+/** Skips the first n bytes of the iovec's of the given message, used
+    after partial sends. */
+void peisk_iovecAdvance(struct msghdr *msg,int n);
 
 /** Attempts to read a package from the connection. This is one of the
     major interface between the P2P layer and the link layer.    
+    *package must point to space for a full package when called, it
+    is changed to point directly to the package in the receive buffer
+    of the connection when possible. Such packages are only valid
+    until the connection is read again.
     Returns non-zero if there was a package.  */
-int peisk_connection_receiveIncomming(struct PeisConnection *connection,struct PeisPackage *package);
+int peisk_connection_receiveIncomming(struct PeisConnection *connection,struct PeisPackage **package);
+
+/** Call when a connection seem to be out of sync, discards received
+    data up to the next sync. */
+void peisk_syncflush(struct PeisConnection *connection);
 
 /** Manages the speed of all connections requiring congestion control */
 void peisk_periodic_connectionControl1(void *data);       
@@ -137,6 +170,48 @@ int peisk_recvBlocking(int fd,void *buf,size_t len,int flags,double timeout);
      Blocks if there is atleast one byte but less than the number of requested bytes */
 int peisk_recvAtomic(int fd,void *buf,size_t len,int flags);
 
+/** \brief Maximum number of events handled by each call to epoll_wait */
+#define PEISK_REACTOR_EVENTS      32
+/** \brief Seconds between attempts to send on connections that have
+    queued packages but that are not reported writable by the reactor,
+    eg. since too much data already waits in the socket buffer */
+#define PEISK_REACTOR_OUTPUT_POLL 0.01
+
+/** Creates the epoll instance, timerfd and wakeup eventfd used when
+    waiting for events. Without WITH_EPOLL, or if epoll is not
+    available, the wait functions fall back to select(2). */
+void peisk_reactorInitialize();
+/** Closes all file descriptors of the reactor */
+void peisk_reactorShutdown();
+/** Registers a file descriptor to wake up the kernel when it
+    becomes readable. Descriptors are registered once, closing them
+    removes them from the reactor. Edge triggered descriptors only
+    wake up the kernel when new data arrives and must be read until
+    empty, others wake it up for as long as they are readable. */
+void peisk_reactorWatch(int fd,int edgeTriggered);
+/** Registers a socket with a non-blocking connect in progress, to
+    wake up the kernel once the connect has finished. Registering the
+    finished connection later changes it to watch for input instead. */
+void peisk_reactorWatchConnect(int fd);
+/** Registers the socket of a newly established connection */
+void peisk_reactorWatchConnection(struct PeisConnection *connection);
+/** Prepares for waiting by watching output on connections with
+    queued packages only, and arming the timer for the next periodic
+    function or output poll. Returns non-zero if the kernel should step again without
+    waiting. */
+int peisk_reactorPrepare();
+/** Blocks until any watched file descriptor is ready, the next
+    periodic function is due, peisk_reactorWakeup is called or maxTime
+    seconds have passed. A negative maxTime waits without limit. Does
+    not access the kernel data and can thus be called without holding
+    any locks. */
+void peisk_reactorSleep(double maxTime);
+/** Waits for at most maxTime seconds or until the kernel needs to
+    step again */
+void peisk_reactorWait(double maxTime);
+/** Wakes up a kernel sleeping in another thread */
+void peisk_reactorWakeup();
+
 /** Intializes and returns the next usable connection structure. Returns NULL on error. */
 struct PeisConnection *peisk_newConnection();
 
@@ -40,6 +40,7 @@
 #include "peiskernel.h"
 #include "peiskernel_tcpip.h"
 #include "udp.h"
+#include "shm.h"
 #include "bluetooth.h"
 
 /** Describes which port numbers provide only meta information and
@@ -50,7 +51,8 @@ const char peisk_metaPorts[PEISK_HIGHEST_PORT_NUMBER] = {
   1, 1, 1, 1, 1, 
   0, 0, 0, 1, 1, 
   0, 1, 1 /*??*/, 1 /*??*/, 0, 
-  0, 0, 0, 0, 0,  
+  0, 0, 1, 0, 0,  
+  0,
 };
 
 PeisConnection *peisk_incommingBroadcastConnection;
@@ -69,13 +71,43 @@ void peisk_initConnectionMgrInfo(PeisConnectionMgrInfo *connMgrInfo) {
   connMgrInfo->lastUsefullTraffic=0;
   connMgrInfo->directlyConnected=0;
   connMgrInfo->nConnections=255; /* Aka -1 */
+  connMgrInfo->nRttSamples=0;
+  connMgrInfo->srtt=0.0;
+  connMgrInfo->rttvar=0.0;
+  connMgrInfo->rto=PEISK_PENDING_RETRY_TIME;
+  connMgrInfo->avoidUdpUntil=0.0;
+  connMgrInfo->avoidShm=0;
+}
+
+void peisk_updateRtt(int destination,double rtt) {
+  PeisConnectionMgrInfo *connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
+  if(!connMgrInfo || rtt < 0.0) return;
+
+  if(connMgrInfo->nRttSamples == 0) {
+    connMgrInfo->srtt = rtt;
+    connMgrInfo->rttvar = rtt / 2.0;
+  } else {
+    connMgrInfo->rttvar = (1.0-PEISK_RTT_BETA)*connMgrInfo->rttvar + PEISK_RTT_BETA*fabs(connMgrInfo->srtt - rtt);
+    connMgrInfo->srtt = (1.0-PEISK_RTT_ALPHA)*connMgrInfo->srtt + PEISK_RTT_ALPHA*rtt;
+  }
+  connMgrInfo->nRttSamples++;
+
+  connMgrInfo->rto = connMgrInfo->srtt + 4.0*connMgrInfo->rttvar;
+  if(connMgrInfo->rto < PEISK_RTO_MIN) connMgrInfo->rto = PEISK_RTO_MIN;
+  if(connMgrInfo->rto > PEISK_RTO_MAX) connMgrInfo->rto = PEISK_RTO_MAX;
+}
+
+double peisk_retransmissionTimeout(int destination,int retries) {
+  PeisConnectionMgrInfo *connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
+  double rto = connMgrInfo ? connMgrInfo->rto : PEISK_PENDING_RETRY_TIME;
+
+  /* Exponential backoff for each retry */
+  for(;retries>0 && rto < PEISK_RTO_MAX;retries--) rto *= 2.0;
+  return rto < PEISK_RTO_MAX ? rto : PEISK_RTO_MAX;
 }
 
 void peisk_initConnection(PeisConnection *connection) {
   int i;
-  PeisHashTableIterator iterator;
-  PeisRoutingInfo *routingInfo;
-  intA destination;
 
   connection->id=peiskernel.nextConnectionId++;
   /* Default hostinfo for new host is -1 = unknown host */
@@ -83,21 +115,41 @@ void peisk_initConnection(PeisConnection *connection) {
   connection->timestamp=peisk_timeNow;
   connection->createdTime=peisk_timeNow;
   connection->outgoing=0.0;
+  connection->pacingUpdated=peisk_timeNow;
   connection->isThrottled=0;
+  connection->rateLimited=0;
   connection->totalOutgoing=0;
   connection->totalIncomming=0;
   connection->totalOutgoing=0;
-  /* Default limit of num packages per time interval (0.05s) */
-  connection->maxOutgoing=PEISK_MIN_CONTROL_SPEED; 
+  /* Start in slow start from a modest rate */
+  connection->maxOutgoing=PEISK_CC_INITIAL_RATE;
+  connection->ssthresh=PEISK_CC_MAX_RATE;
+  connection->lastDecrease=peisk_timeNow;
   connection->outgoingIdCnt=0;
-  connection->incomingIdLo=-1;
+  connection->incomingIdLo=0;
   connection->incomingIdSuccess=0;
   connection->forceBroadcasts=0;
+  connection->sequencedIds=0;
+  connection->multicasts=0;
+  connection->routingDeltas=0;
+  connection->routingAcked=0;
+  connection->routingReceived=0;
+  connection->routingAssembling=0;
+  connection->routingSerial=-1;
+  connection->routingNParts=0;
+  connection->routingPartsMissing=0;
+  connection->routingRedecode=0;
+  connection->routingMetricCost=0;
   connection->incommingTraffic=0;
   connection->estimatedPacketLoss=0.0;
   connection->usefullTraffic=0;
   connection->lastUsefullTraffic=0;
   connection->isPending=1;
+  connection->watchesOutput=0;
+  connection->inStart=0;
+  connection->inEnd=0;
+  connection->sendPartial=NULL;
+  connection->sendOffset=0;
 
   /* Recompute metric cost of connection */
   peisk_recomputeConnectionMetric(connection);
@@ -108,14 +160,8 @@ void peisk_initConnection(PeisConnection *connection) {
     connection->nQueuedPackages[i]=0;
   }
 
-  if(!connection->routingTable) connection->routingTable = peisk_hashTable_create(PeisHashTableKey_Integer);
-
-  peisk_hashTableIterator_first(connection->routingTable,&iterator);
-  while(peisk_hashTableIterator_next(&iterator)) {
-    peisk_hashTableIterator_value_generic(&iterator,&destination,&routingInfo);
-    routingInfo->hops = 255;
-    routingInfo->sequenceNumber = 0;
-  }
+  peisk_sortedArray_clear(&connection->routingTable);
+  peisk_sortedArray_clear(&connection->routingEntries);
 }
 /** Intializes and returns the next usable connection structure. Returns NULL on error. */
 PeisConnection *peisk_newConnection() {
@@ -168,6 +214,11 @@ void peisk_freeConnection(PeisConnection *connection) {
 void peisk_abortConnect(PeisConnection *connection) {
   int i;
 
+  /* Autohosts are attempted again later */
+  for(i=0;i<peiskernel.nAutohosts;i++)
+    if(peiskernel.autohosts[i].isConnected == connection->id)
+      peiskernel.autohosts[i].isConnected=-1;
+
   connection->id=-1;
   
   /* Check all other connections and change connectionManagerInfo 
@@ -189,10 +240,95 @@ void peisk_abortConnect(PeisConnection *connection) {
   connection->neighbour.id = -1;
 }
 
+/** Updates statistics for a package that have been sent on the
+    connection and places it in the pending queue if it is waiting
+    for an acknowledgement, otherwise frees it. The package must
+    already be removed from its queue. */
+/** Notes that a part of one of our long messages has left our
+    queues. The message is remembered for answering retransmission
+    requests from when its last part was sent. */
+static void peisk_longMessagePartSent(PeisPackageHeader *header) {
+  PeisSentLongMessage *sent;
+  int seqid, seqnum;
+
+  seqid = ntohs(header->seqid);
+  seqnum = ntohs(header->seqnum);
+  sent = &peiskernel.sentLongMessages[seqid % PEISK_MAX_SENT_LONG_MESSAGES];
+  if(sent->seqid != seqid || !sent->payload || seqnum < 0 || seqnum >= sent->seqlen) return;
+  if(!sent->partSent[seqnum]) {
+    sent->partSent[seqnum] = 1;
+    sent->nPartsSent++;
+  }
+  if(sent->nPartsSent == sent->seqlen) sent->timeout = peisk_timeNow + PEISK_TIMEOUT_SENT_LONG_MESSAGE;
+}
+
+static void peisk_connection_packageSent(PeisConnection *connection,PeisQueuedPackage *qpackage,int queue,double t0) {
+  int len;
+
+  /* Update statistics */
+  /*printf("send: %d ON %d\n",ntohl(qpackage->package.header.id),queue);*/
+  len=sizeof(PeisPackageHeader)+ntohs(qpackage->package.header.datalen);
+  connection->totalOutgoing += len;
+  peiskernel.outgoingTraffic += len;
+  connection->outgoingTraffic += len;
+  connection->outgoing += len;
+
+  /* Append package to usefullTraffic if the port is not meta port.
+     Applies to both connection and the source and destination ConnMgrInfo's
+  */
+  int destination = ntohl(qpackage->package.header.destination);
+  int port = ntohs(qpackage->package.header.port);
+  /*int source = ntohl(qpackage->package.header.source);*/
+
+  if(port >= 0 && port < PEISK_HIGHEST_PORT_NUMBER && peisk_metaPorts[port] == 0) {
+    PeisConnectionMgrInfo *connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
+    if(connMgrInfo)
+      connMgrInfo->lastUsefullTraffic += len;
+    if(connection->neighbour.id != destination) {
+      connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
+      if(connMgrInfo)
+	connMgrInfo->lastUsefullTraffic += len;
+    }
+    connection->lastUsefullTraffic  += len;
+  }
+
+  /*printf("package sent, %d %d\n",ntohs(qpackage->package.header.flags),ntohl(qpackage->package.header.source));*/
+
+  if(qpackage->package.header.seqlen && ntohl(qpackage->package.header.source) == peisk_id)
+    peisk_longMessagePartSent(&qpackage->package.header);
+
+  /* Package was sent, add it (back) to the free packages OR to the
+     pending queue - depending on mode */
+  if(queue == PEISK_QUEUE_PENDING) {
+    /* update "pending" meta information */
+    qpackage->retries++;
+    qpackage->t0 = t0 + peisk_retransmissionTimeout(ntohl(qpackage->package.header.destination),qpackage->retries);
+  } else if((ntohs(qpackage->package.header.flags) & PEISK_PACKAGE_REQUEST_ACK) &&
+	    ntohl(qpackage->package.header.source) == peisk_id) {
+    qpackage->sent = t0;
+    qpackage->t0 = t0 + peisk_retransmissionTimeout(ntohl(qpackage->package.header.destination),0);
+    qpackage->retries = 0;
+    /* Remove BULK flag from messages in pending queue. Should help when important bulk packages 
+       are routed. (Then they are only bulk on the first try. Those that fail 
+       are send in normal mode to increase chance of delivery). */
+    qpackage->package.header.flags &= ~PEISK_PACKAGE_BULK;
+  } else {
+    /* Add to free packages */
+    peisk_queuedPackage_free(qpackage);
+    return;
+  }
+
+  /* Add to pending packages */
+  peisk_connection_enqueue(connection,PEISK_QUEUE_PENDING,qpackage);
+}
+
 void peisk_connection_processOutgoing(PeisConnection *connection) {
-  int i,len,pkgid;
-  PeisQueuedPackage *qpackage, **prev;
+  static PeisQueuedPackage *packages[PEISK_MAX_SEND_BATCH];
+  static int queues[PEISK_MAX_SEND_BATCH];
+  int i,n,first,nSent,offset;
+  PeisQueuedPackage *qpackage, *next;
   double t0 = peisk_timeNow;
+  double budget;
 
   int queue;
   int loopCheck;
@@ -200,143 +336,90 @@ void peisk_connection_processOutgoing(PeisConnection *connection) {
   /* Check if queue is working correctly, otherwise send no further packages on it */
   if(connection->type == eUDPConnection && connection->connection.udp.status != eUDPConnected) return;
 
-  /* Process all outgoing queues, take special care of the PENDING queue since it is special. */
-  for(queue=0;queue<PEISK_NQUEUES;queue++) {
-    qpackage=connection->outgoingQueueFirst[queue];
-    prev=&connection->outgoingQueueFirst[queue];
+  /* Packages are deferred, never dropped, while the pacer has no
+     bytes to spare */
+  budget=peisk_connection_pace(connection);
+  if(budget <= 0.0) return;
+
+  /* A package that was only partially sent must be finished first */
+  n=0;
+  if(connection->sendPartial) {
+    packages[0]=connection->sendPartial;
+    queues[0]=connection->sendPartialQueue;
+    budget -= sizeof(PeisPackageHeader)+ntohs(connection->sendPartial->package.header.datalen);
+    n=1;
+  }
+  first=n;
 
+  /* Collect packages from all outgoing queues, take special care of
+     the PENDING queue since it is special. */
+  for(queue=0;queue<PEISK_NQUEUES && n<PEISK_MAX_SEND_BATCH && !connection->isThrottled;queue++) {
     loopCheck=0; /* For debugging */
     /* Step through all packages */
-    for(;qpackage&&loopCheck<2000;loopCheck++) {
+    for(qpackage=connection->outgoingQueueFirst[queue];qpackage&&loopCheck<2000&&n<PEISK_MAX_SEND_BATCH;qpackage=next,loopCheck++) {
+      next=qpackage->next;
 
       PEISK_ASSERT(qpackage->package.header.sync==PEISK_SYNC,("malformed outgoing package"));
       /* Treat the PENDING queue in a special way, we only send packages if their 
 	 deadline for ACK have passed and delete them if they are too old */
       if(queue == PEISK_QUEUE_PENDING) {
 	/*printf("pending package->t0 = %.3f, my t0 = %.3f, retries: %d\n",qpackage->t0,t0,qpackage->retries);*/
-	if(qpackage->t0 > t0) goto pendingContinue; /* Pending package has not yet expired */
+	if(qpackage->t0 > t0) continue; /* Pending package has not yet expired */
 	if(qpackage->retries > PEISK_PENDING_MAX_RETRIES) {
 	  /* Give up this package and remove it from pending queue and add to list of free qpackages */
 	  if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
 	    printf("Giving up on ackID %x, retries: %d\n",ntohl(qpackage->package.header.ackID),qpackage->retries);
 	  /* If there was an acknowledgement hook registered for this package,
 	     invoke it */
-	  if(qpackage->hook) {
-	    peiskernel.ackHookFailureType=eAckHookFailureTooManyRetries;
-	    PEISK_ASSERT(qpackage->nHooks<PEISK_MAX_ACKHOOKS,("Found a queue package with %d hooks\n",qpackage->nHooks));
-	    for(i=0;i<qpackage->nHooks;i++)
-	    (qpackage->hook[i])(0,qpackage->package.header.datalen,&qpackage->package,qpackage->hookData[i]);
-	  }
-
-	  connection->nQueuedPackages[queue]--;
-	  *prev=qpackage->next;
-	    /* Be carefull when removing the lastmost element of the queues */
-	  if(&qpackage->next == connection->outgoingQueueLast[queue]) {
-	    connection->outgoingQueueLast[queue]=prev;
-	  }
-
-	  qpackage->next = peiskernel.freeQueuedPackages;
-	  peiskernel.freeQueuedPackages = qpackage;
-
-	  qpackage=*prev;
-
-	  /* OLD
-	  if(connection->outgoingQueueFirst[queue] == NULL)
-	    PEISK_ASSERT(connection->outgoingQueueLast[queue] == &connection->outgoingQueueFirst[queue],
-	    ("I've just created a bad queue\n"));*/
+	  peiskernel.ackHookFailureType=eAckHookFailureTooManyRetries;
+	  peisk_queuedPackage_callHooks(qpackage,0);
+	  /* The hooks might have queued more packages */
+	  next=qpackage->next;
+	  peisk_connection_dequeue(connection,queue,qpackage);
+	  peisk_queuedPackage_free(qpackage);
 	  continue;
 	}
-	/* Else, continue on by resending the package again */
-	if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
-	  printf("Sending package with ackID %d again\n",ntohl(qpackage->package.header.ackID));
-	/* Send with a fresh identifier to avoid problems with loop detection */
-	do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
-	qpackage->package.header.id = htonl(pkgid);
       }
 
-      errno=0;
-
-      len=sizeof(PeisPackageHeader)+ntohs(qpackage->package.header.datalen);
-      if(peisk_connection_sendAtomic(connection,&qpackage->package,len) != 0) 
-	return;     /* Failed to send, no need to continue processing queue */
-
-      /* Package successfully sent */
-      /* Update statistics */
-      /*printf("send: %d ON %d\n",ntohl(qpackage->package.header.id),queue);*/
-      connection->totalOutgoing += len;
-      peiskernel.outgoingTraffic += len;
-      connection->outgoingTraffic += len;
-
-      /* Append package to usefullTraffic if the port is not meta port.
-	 Applies to both connection and the source and destination ConnMgrInfo's
-      */
-      int destination = ntohl(qpackage->package.header.destination);
-      int port = ntohs(qpackage->package.header.port);
-      /*int source = ntohl(qpackage->package.header.source);*/
-
-      if(port >= 0 && port < PEISK_HIGHEST_PORT_NUMBER && peisk_metaPorts[port] == 0) {
-	PeisConnectionMgrInfo *connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
-	if(connMgrInfo)
-	  connMgrInfo->lastUsefullTraffic += len;
-	if(connection->neighbour.id != destination) {
-	  connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
-	  if(connMgrInfo)
-	    connMgrInfo->lastUsefullTraffic += len;
-	}
-	connection->lastUsefullTraffic  += len;
+      /* Leave the rest of the packages for when the pacer allows more */
+      if(n > 0 && budget <= 0.0) {
+	connection->isThrottled=1;
+	connection->rateLimited=1;
+	break;
       }
-
-
+      budget -= sizeof(PeisPackageHeader)+ntohs(qpackage->package.header.datalen);
 
       if(queue == PEISK_QUEUE_PENDING) {
-	/* update "pending" meta information */
-	qpackage->retries++;
-	qpackage->t0 = t0 + PEISK_PENDING_RETRY_TIME * qpackage->retries;
-      pendingContinue:
-	prev=&qpackage->next;
-	qpackage=qpackage->next;
-      } else {
-	/* Remove it from current queue */
-	connection->nQueuedPackages[queue]--;
-	*prev=qpackage->next;
-	/* Be carefull when removing the lastmost element of the queues */
-	if(&qpackage->next == connection->outgoingQueueLast[queue])
-	  connection->outgoingQueueLast[queue]=prev;
-
-	/*printf("package sent, %d %d\n",ntohs(qpackage->package.header.flags),ntohl(qpackage->package.header.source));*/
-
-	/* Package was sent, remove it from queue and add it (back) to the free packages OR
-	   to the pending queue - depending on mode */
-	if((ntohs(qpackage->package.header.flags) & PEISK_PACKAGE_REQUEST_ACK) &&
-	   ntohl(qpackage->package.header.source) == peisk_id) {
-	  /* Add to pending packages */
-	  connection->nQueuedPackages[PEISK_QUEUE_PENDING]++;
-	  /*printf("add pending: %d\n",connection->nQueuedPackages[PEISK_QUEUE_PENDING]);*/
-	  qpackage->t0 = t0 + PEISK_PENDING_RETRY_TIME;
-	  qpackage->retries = 0;
-	  qpackage->next = NULL;
-
-	  *connection->outgoingQueueLast[PEISK_QUEUE_PENDING]=qpackage;
-	  connection->outgoingQueueLast[PEISK_QUEUE_PENDING]=&qpackage->next;
-
-	  PEISK_ASSERT(connection->outgoingQueueFirst[PEISK_QUEUE_PENDING] != NULL,("Pending queue is broken\n"));
-
-	  /* Remove BULK flag from messages in pending queue. Should help when important bulk packages 
-	     are routed. (Then they are only bulk on the first try. Those that fail 
-	     are send in normal mode to increase chance of delivery). */
-	  qpackage->package.header.flags &= ~PEISK_PACKAGE_BULK;
-	} else {
-	  /* Add to free packages */
-	  qpackage->next = peiskernel.freeQueuedPackages;
-	  peiskernel.freeQueuedPackages = qpackage;
-	}
-
-	/* Continue working on the next package... */
-	qpackage=*prev;
+	/* Else, continue on by resending the package again */
+	if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+	  printf("Sending package with ackID %d again\n",ntohl(qpackage->package.header.ackID));
+	/* Send with a fresh identifier to avoid problems with loop detection */
+	peisk_assignPackageId(&qpackage->package.header);
+	peisk_connection_legacyId(connection,&qpackage->package.header);
       }
+
+      packages[n]=qpackage;
+      queues[n]=queue;
+      n++;
     }
     PEISK_ASSERT(loopCheck<20000,("Loop in outgoing packages for queue %d?\n",queue));
   }
+  if(n == 0) return;
+
+  /* Let the link layer send as many as possible of them at once */
+  errno=0;
+  offset=connection->sendOffset;
+  nSent=peisk_connection_sendQueued(connection,packages,n,&offset);
+  if(nSent < 0) return;  /* Connection was closed, together with all queued packages */
+
+  /* Remove the sent packages, and any partially sent package, from their queues */
+  for(i=first;i<nSent+(offset>0?1:0);i++)
+    peisk_connection_dequeue(connection,queues[i],packages[i]);
+  for(i=0;i<nSent;i++)
+    peisk_connection_packageSent(connection,packages[i],queues[i],t0);
+  connection->sendPartial = offset > 0 ? packages[nSent] : NULL;
+  connection->sendPartialQueue = offset > 0 ? queues[nSent] : 0;
+  connection->sendOffset = offset;
 
   if(connection->outgoingQueueFirst[PEISK_QUEUE_PENDING] == NULL)
     PEISK_ASSERT(connection->outgoingQueueLast[PEISK_QUEUE_PENDING] == 
@@ -345,6 +428,9 @@ void peisk_connection_processOutgoing(PeisConnection *connection) {
 
 }
 
+static int peisk_relayMulticastPackage(PeisPackage *package);
+static PeisConnection *peisk_selectNextHop(PeisRoutingInfo *routingInfo,int source,int port);
+
 int peisk_connection_processIncomming(PeisConnection *connection) {
   int datalen;
   int port,destination,source;
@@ -352,32 +438,61 @@ int peisk_connection_processIncomming(PeisConnection *connection) {
   PeisConnectionMgrInfo *connMgrInfo;
   PeisHookList *hooklist;
   PeisConnection *outConnection;
-  static PeisPackage package;
+  static PeisPackage buffer;
+  PeisPackage *package=&buffer;
+  int legacyId;
 
   /* Read incomming package from link layer. If no package was found, return */
   if(!peisk_connection_receiveIncomming(connection,&package)) return 0;
 
   /* First, check if message already seen */
-  if(peisk_isRepeated(ntohl(package.header.id)))
-	return 1;
+  source = ntohl(package->header.source);
+  if(ntohs(package->header.flags) & PEISK_PACKAGE_SEQ_ID) {
+    /* Packages numbered by ourselves can only have looped back */
+    if(source == peiskernel.id || peisk_sequenceSeen(source,ntohl(package->header.id),1))
+      return 1;
+    /* Older relays give the same package its legacy id instead, a
+       copy of it arriving that way is the same package */
+    legacyId = peisk_legacyId(source,ntohl(package->header.id));
+    if(peisk_isRepeated(legacyId)) return 1;
+    peisk_markAsRepeated(legacyId);
+    /* Only newer kernels send sequence numbered ids, so our neighbour
+       understands them too */
+    connection->sequencedIds=1;
+  } else {
+    if(peisk_isRepeated(ntohl(package->header.id)))
+      return 1;
+    /* Add message to loop detection tables */
+    peisk_markAsRepeated(ntohl(package->header.id));
+  }
 
-  /* Add message to loop detection tables */
-  peisk_markAsRepeated(ntohl(package.header.id));
+  /* Multicast packages are forwarded to all other targets, and only
+     processed further if we are one of the targets. Only newer
+     kernels send them, so our neighbour understands them too */
+  if(package->header.type == ePeisMulticastPackage) {
+    connection->multicasts=1;
+    if(!peisk_relayMulticastPackage(package)) return 1;
+  }
 
   /* See if ACK is requested and if the package is aimed at us */
-  if(ntohs(package.header.flags) & PEISK_PACKAGE_REQUEST_ACK && ntohl(package.header.destination) == peiskernel.id) {
-    if(ntohs(package.header.port) == PEISK_PORT_ACKNOWLEDGEMENTS) {
-      /*peisk_sendBulkAcknowledgement(ntohl(package.header.source),package.header.ackID);*/
+  if(ntohs(package->header.flags) & PEISK_PACKAGE_REQUEST_ACK && ntohl(package->header.destination) == peiskernel.id) {
+    if(ntohs(package->header.port) == PEISK_PORT_ACKNOWLEDGEMENTS) {
+      /*peisk_sendBulkAcknowledgement(ntohl(package->header.source),package->header.ackID);*/
     } else {
-      peisk_sendBulkAcknowledgement(ntohl(package.header.source),package.header.ackID);
+      peisk_sendBulkAcknowledgement(ntohl(package->header.source),package->header.ackID);
     }
   }
 
   /* If message is aimed at us then discard package data if ackID already seen, otherwise mark ackID as seen */
-  if(ntohl(package.header.destination) == peiskernel.id &&
-     package.header.ackID != package.header.id) {
-    if(peisk_isRepeated(ntohl(package.header.ackID))) return 1;
-    peisk_markAsRepeated(ntohl(package.header.ackID));
+  if(ntohl(package->header.destination) == peiskernel.id) {
+    if(ntohs(package->header.flags) & PEISK_PACKAGE_SEQ_ACK) {
+      /* An ackID too old for the window is more likely a late
+	 retransmission than a duplicate, better accept it */
+      if(peisk_sequenceSeen(source,ntohl(package->header.ackID),0)) return 1;
+    } else if(package->header.ackID != package->header.id) {
+      if(peisk_isRepeated(ntohl(package->header.ackID))) return 1;
+      peisk_markAsRepeated(ntohl(package->header.ackID));
+    }
   }
 
   /* Set global variable for last connection, in case message is
@@ -385,22 +500,22 @@ int peisk_connection_processIncomming(PeisConnection *connection) {
      from which connection the package came (eg. routing routines). */
   peisk_lastConnection = connection->id;
 
-  destination = ntohl(package.header.destination);
-  port = ntohs(package.header.port);
-  source = ntohl(package.header.source);
-  datalen = ntohs(package.header.datalen);
+  destination = ntohl(package->header.destination);
+  port = ntohs(package->header.port);
+  source = ntohl(package->header.source);
+  datalen = ntohs(package->header.datalen);
 
-  if(ntohs(package.header.seqlen) > 0) {
+  if(ntohs(package->header.seqlen) > 0) {
     /* Handle long messages */
     if(destination == peiskernel.id)
-      peisk_assembleLongMessage(&package.header,datalen,(void*) package.data);
+      peisk_assembleLongMessage(&package->header,datalen,(void*) package->data);
   } else {
     /* It's not a long message, so allow it to be intercepted by local routines */
-    peisk_lastPackage = &package.header;
+    peisk_lastPackage = &package->header;
     hooklist=peisk_lookupHook(port);
     while(hooklist) {
       /*printf("%s triggered. source=%d dest=%d\n",hooklist->name,source,destination);*/
-      if((hooklist->hook)(port,destination,source,datalen,package.data))
+      if((hooklist->hook)(port,destination,source,datalen,package->data))
 	return 1; /* If nonzero return code then stop processing this
 		     package */
       hooklist=hooklist->next;
@@ -411,58 +526,56 @@ int peisk_connection_processIncomming(PeisConnection *connection) {
      Applies to both connection and the source and destination ConnMgrInfo's
   */
   if(port >= 0 && port < PEISK_HIGHEST_PORT_NUMBER && peisk_metaPorts[port] == 0) {
-    connection->lastUsefullTraffic  += sizeof(package.header) + datalen;
+    connection->lastUsefullTraffic  += sizeof(package->header) + datalen;
     connMgrInfo = peisk_lookupConnectionMgrInfo(source);
     if(connMgrInfo)
-      connMgrInfo->lastUsefullTraffic += sizeof(package.header) + datalen;
+      connMgrInfo->lastUsefullTraffic += sizeof(package->header) + datalen;
     if(connection->neighbour.id != -1 && source != connection->neighbour.id) {
       connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
       if(connMgrInfo)
-	connMgrInfo->lastUsefullTraffic += sizeof(package.header) + datalen;
+	connMgrInfo->lastUsefullTraffic += sizeof(package->header) + datalen;
     }
   }
 
   /* Don't route package if it has reached maximum number of hops */
-  if(package.header.hops >= PEISK_MAX_HOPS-1) return 1;
+  if(package->header.hops >= PEISK_MAX_HOPS-1) return 1;
 
   /* Propagate message */
-  switch(package.header.type) {
+  switch(package->header.type) {
   case ePeisLinkPackage:
 	/* Linklevel packages are not propagated */
 	break;
   case ePeisBroadcastPackage:
 	/* Propagation of broadcasted packages */
-	package.header.hops++;
+	package->header.hops++;
 
 	peisk_incommingBroadcastConnection = connection;
-	peisk_sendBroadcastPackage(&package.header,ntohs(package.header.datalen),package.data,PEISK_SEND_ROUTED);
+	peisk_sendBroadcastPackage(&package->header,ntohs(package->header.datalen),package->data,PEISK_SEND_ROUTED);
 	peisk_incommingBroadcastConnection = NULL;
 	break;
   case ePeisDirectPackage:
 	/* Propagation of all routed packages */
-	package.header.hops++;
+	package->header.hops++;
 
 	if(destination != peiskernel.id) {
 	  /* If package is supposed to be routed then propagate it. */
 
-	  if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long)ntohl(package.header.destination),(void**)(void*)&routingInfo) == 0) {
-	    if(routingInfo->connection == NULL) {
+	  if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long)ntohl(package->header.destination),(void**)(void*)&routingInfo) == 0) {
+	    if(!(outConnection = peisk_selectNextHop(routingInfo,source,port))) {
 	      if(peisk_debugRoutes)
-		printf("Dropping package to special host %d\n",ntohl(package.header.destination));
+		printf("Dropping package to special host %d\n",ntohl(package->header.destination));
 	    } else {
 	      /* Found a valid route to take */
-	      outConnection = routingInfo->connection;
-	      /* \todo See if socket is still open */
 	      /* Propagate message */
 	      peisk_connection_sendPackage(outConnection->id,
-					   &package.header,
-					   ntohs(package.header.datalen),
-					   (void*)package.data,
+					   &package->header,
+					   ntohs(package->header.datalen),
+					   (void*)package->data,
 					   PEISK_SEND_ROUTED);
 	    }
 	  } else {
 	    if(peisk_debugRoutes)
-	      printf("Cannot route package. Unknown route to host %d\n",ntohl(package.header.destination));
+	      printf("Cannot route package. Unknown route to host %d\n",ntohl(package->header.destination));
 	  }
 	}
 	break;
@@ -489,6 +602,10 @@ void peisk_hton_hostInfo(PeisHostInfo *hostInfo) {
     case ePeisBluetooth:
       hostInfo->lowAddr[i].addr.bluetooth.port = htons(hostInfo->lowAddr[i].addr.bluetooth.port);
       break;
+    case ePeisShm:
+      hostInfo->lowAddr[i].addr.shm.hostKey = htonl(hostInfo->lowAddr[i].addr.shm.hostKey);
+      hostInfo->lowAddr[i].addr.shm.port = htonl(hostInfo->lowAddr[i].addr.shm.port);
+      break;
     case ePeisTcpIPv6: PEISK_ASSERT(0,("TcpIPv6 support not yet implemented")); break;
     }
 }
@@ -510,6 +627,10 @@ void peisk_ntoh_hostInfo(PeisHostInfo *hostInfo) {
     case ePeisBluetooth:
       hostInfo->lowAddr[i].addr.bluetooth.port = ntohs(hostInfo->lowAddr[i].addr.bluetooth.port);
       break;
+    case ePeisShm:
+      hostInfo->lowAddr[i].addr.shm.hostKey = ntohl(hostInfo->lowAddr[i].addr.shm.hostKey);
+      hostInfo->lowAddr[i].addr.shm.port = ntohl(hostInfo->lowAddr[i].addr.shm.port);
+      break;
     case ePeisTcpIPv6: PEISK_ASSERT(0,("TcpIPv6 support not yet implemented")); break;
     }
 }
@@ -562,7 +683,8 @@ void peisk_handleBroadcastedHostInfo(PeisHostInfo *newHostInfo) {
 }
 
 void peisk_step() {
-  int i;
+  int i, j;
+  PeisConnection *connection;
   int received;
   int nPending;
   int maxInLoops;
@@ -588,7 +710,8 @@ void peisk_step() {
 
     /* check for new incomming TCP and UDP connections */
     peisk_acceptTCPConnections();
-    /*peisk_acceptUDPConnections();*/
+    peisk_acceptUDPConnections();
+    peisk_acceptShmConnections();
 
     /* see if we have read new broadcasted hosts packages, but not too often */
     if(peiskernel.tick % 5 == 0)
@@ -598,10 +721,10 @@ void peisk_step() {
     for(i=0;i<peiskernel.nAutohosts;i++)
       if(peiskernel.autohosts[i].isConnected == -1 &&
 	 peisk_timeNow - peiskernel.autohosts[i].lastAttempt > PEISK_AUTHOST_PERIOD) {
-	peiskernel.autohosts[i].isConnected =
-	  peisk_connect(peiskernel.autohosts[i].url,PEISK_CONNECT_FLAG_FORCE_BCAST|PEISK_CONNECT_FLAG_FORCED_CL) 
-	  == NULL ? 0 : 1;
-	/** \todo If connections take long time these autoconnection might make the step function unresponsive */
+	/* Connections are only started here and finished by later steps,
+	   failing ones are retried after PEISK_AUTHOST_PERIOD */
+	connection=peisk_connect(peiskernel.autohosts[i].url,PEISK_CONNECT_FLAG_FORCE_BCAST|PEISK_CONNECT_FLAG_FORCED_CL);
+	peiskernel.autohosts[i].isConnected = connection ? connection->id : -1;
 	peiskernel.autohosts[i].lastAttempt = peisk_timeNow;
       }
   }
@@ -631,9 +754,9 @@ void peisk_step() {
        faster clearing of the queues. */
     if(!peiskernel.doShutdown)
       for(i=0;i<=peiskernel.highestConnection;i++)
-	if(peiskernel.connections[i].id != -1) {
-	  if(peisk_connection_processIncomming(&peiskernel.connections[i]))
-	    received=1;
+	for(j=0;j<PEISK_MAX_INCOMMING_BURST && peiskernel.connections[i].id != -1;j++) {
+	  if(!peisk_connection_processIncomming(&peiskernel.connections[i])) break;
+	  received=1;
 	}
 
     /*                                                */
@@ -644,6 +767,8 @@ void peisk_step() {
 	  peisk_connection_processOutgoing(&peiskernel.connections[i]);
       }
   }
+  /* Connections are read until empty before waiting for new data */
+  peiskernel.moreIncomming = received;
 
   /* Some actions are only performed unless we are in the process of shutting down */
   if(!peiskernel.doShutdown) {
@@ -673,7 +798,6 @@ int peisk_broadcastSpecial(int port,int len,void *data,int flags) {
   return peisk_broadcastSpecialFrom(peiskernel.id,port,len,data,flags);
 }
 int peisk_broadcastSpecialFrom(int from,int port,int len,void *data,int flags) {
-  int pkgid;
   PeisPackageHeader header;
 
   if(len > PEISK_MAX_PACKAGE_SIZE) {
@@ -682,12 +806,8 @@ int peisk_broadcastSpecialFrom(int from,int port,int len,void *data,int flags) {
     return 0;
   }
 
-  /* Generate a random, previously unused id-number for this package */
-  do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
   if(!data) len=0;
 
-  header.id=htonl(pkgid);
-  header.ackID = htonl(pkgid);
   header.type=ePeisBroadcastPackage;
   header.hops=1;
   header.datalen=htons(len);
@@ -698,6 +818,8 @@ int peisk_broadcastSpecialFrom(int from,int port,int len,void *data,int flags) {
   header.seqlen=0;
   header.seqid=0;
   header.seqnum=0;
+  peisk_assignPackageId(&header);
+  header.ackID = header.id;
 
   /** Spoof that a broadcasted package is one hop older than it is,
       neccessary to avoid seeing broadcasted packages as coming from a
@@ -705,9 +827,6 @@ int peisk_broadcastSpecialFrom(int from,int port,int len,void *data,int flags) {
       packages, modifying them and retransmitting) */
   if(flags & PEISK_BPACKAGE_SPOOF_HOPS) header.hops += 1;
 
-  /** Mark this package as repeated since it's from local origin */
-  peisk_markAsRepeated(pkgid);
-
   flags = flags & (PEISK_BPACKAGE_HIPRI | PEISK_BPACKAGE_BULK);
 
   peisk_sendBroadcastPackage(&header,len,(void*)data,flags);
@@ -776,7 +895,6 @@ int peisk_sendBroadcastPackage(PeisPackageHeader *header,int datalen,void *data,
 }
 
 int peisk_sendLinkPackage(int port,PeisConnection *connection,int len,void *data) {
-  int pkgid;
   PeisPackageHeader header;
 
   if(len > PEISK_MAX_PACKAGE_SIZE) {
@@ -784,11 +902,7 @@ int peisk_sendLinkPackage(int port,PeisConnection *connection,int len,void *data
       printf("peisk: error - attempt to send too large link layer message on port %d\n",port);
     return 0;
   }
-  /* Generate a random, previously unused id-number for this package */
-  do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
   if(!data) len=0;
-  header.id=htonl(pkgid);
-  header.ackID = htonl(pkgid);
   header.type=ePeisLinkPackage;
   header.hops=1;
   header.datalen=htons(len);
@@ -799,9 +913,9 @@ int peisk_sendLinkPackage(int port,PeisConnection *connection,int len,void *data
   header.seqlen=0;
   header.seqid=0;
   header.seqnum=0;
+  peisk_assignPackageId(&header);
+  header.ackID = header.id;
 
-  /** Mark this package as repeated since it's from local origin */
-  peisk_markAsRepeated(pkgid);
   peisk_connection_sendPackage(connection->id,&header,len,(void*) data,0);
   return 0;
 }
@@ -810,12 +924,168 @@ int peisk_sendMessage(int port,int destination,int len,void *data,int flags) {
   return peisk_sendMessageFrom(peiskernel.id,port,destination,len,data,flags);
 }
 
+static int peisk_sendMessageGather(int from,int port,int destination,int len,void *data,PeisPayload *payload,int flags);
+
+/** Schedules to create a direct connection towards a host we are
+    sending routed messages to, if possible */
+static void peisk_scheduleDirectConnection(int destination) {
+  int i;
+
+  if(peiskernel.nDirConnReqs < PEISK_MAX_DIR_CONN_REQS) {
+    for(i=0;i < peiskernel.nDirConnReqs;i++)
+      if(peiskernel.dirConnReqs[i] == destination) break;
+    if(peiskernel.nDirConnReqs == 0 || i != peiskernel.nDirConnReqs) {
+      /*printf("Scheduling connection towards %d, request: %d\n",destination,peiskernel.nDirConnReqs);*/
+      peiskernel.dirConnReqs[peiskernel.nDirConnReqs++]=destination;
+    }
+  }
+}
+
+/** Estimates how many seconds it takes before data given to the
+    connection now is sent, from the queued packages and the rate
+    allowed by the congestion control. */
+static double peisk_connection_queueDelay(PeisConnection *connection) {
+  int i, nQueued;
+
+  for(i=0,nQueued=0;i<PEISK_NQUEUES;i++) nQueued += connection->nQueuedPackages[i];
+  if(connection->type == eShmConnection)
+    return nQueued * sizeof(PeisPackage) / PEISK_CC_MAX_RATE;
+  return nQueued * sizeof(PeisPackage) / connection->maxOutgoing;
+}
+
+/** Gives the connection on which a package from source to the given
+    port of a routed destination is sent, or NULL if there is no
+    usable route. New flows are spread by hash over the main route and
+    the alternative next hops that still are as good. A flow then
+    stays on its next hop, and is only moved when that one is much
+    more loaded than the others. See \ref Multipath. */
+static PeisConnection *peisk_selectNextHop(PeisRoutingInfo *routingInfo,int source,int port) {
+  PeisConnection *candidates[PEISK_ROUTING_ALTERNATIVES+1];
+  PeisConnection *connection, *best;
+  PeisRoutingInfo *route;
+  PeisFlowInfo *flow;
+  double delay, queueDelay, bestDelay;
+  unsigned int hash;
+  int i, n;
+
+  n=0;
+  connection = routingInfo->connection;
+  if(connection && connection->id != -1) candidates[n++] = connection;
+  if(routingInfo->hops < 250)
+    for(i=0;i<PEISK_ROUTING_ALTERNATIVES;i++) {
+      if(routingInfo->alternatives[i] == PEISK_NO_ALTERNATIVE) continue;
+      connection = &peiskernel.connections[routingInfo->alternatives[i]];
+      /* Skip connections that have been closed, and routes that got worse since */
+      if(connection->id == -1 || connection->isPending || connection == routingInfo->connection ||
+	 !(route = peisk_sortedArray_find(&connection->routingTable,routingInfo->id)) ||
+	 route->hops != routingInfo->hops ||
+	 route->sequenceNumber - route->hops < routingInfo->sequenceNumber - routingInfo->hops)
+	continue;
+      candidates[n++] = connection;
+    }
+  if(n < 2) return n ? candidates[0] : NULL;
+
+  hash = (((unsigned int) source * 31 + (unsigned int) routingInfo->id) * 31 + (unsigned int) port) * 2654435761U;
+  flow = &peiskernel.flows[(hash >> 16) & (PEISK_MULTIPATH_FLOWS-1)];
+  if(flow->source != source || flow->destination != routingInfo->id || flow->port != port) {
+    /* Another flow used this entry, forget it */
+    flow->source = source;
+    flow->destination = routingInfo->id;
+    flow->port = port;
+    flow->connectionId = -1;
+  }
+
+  /* Keep the flow on the next hop it used before, if it still is one */
+  for(i=0;i<n;i++) if(candidates[i]->id == flow->connectionId) break;
+  if(i < n) {
+    connection = candidates[i];
+    if(flow->moved + PEISK_MULTIPATH_HOLD > peisk_timeNow) return connection;
+  } else
+    connection = candidates[(hash >> 8) % n];
+
+  best = connection;
+  bestDelay = delay = peisk_connection_queueDelay(connection);
+  for(i=0;i<n;i++)
+    if((queueDelay = peisk_connection_queueDelay(candidates[i])) < bestDelay) {
+      best = candidates[i];
+      bestDelay = queueDelay;
+    }
+  if(delay > bestDelay + PEISK_MULTIPATH_SLACK) connection = best;
+  if(connection->id != flow->connectionId) {
+    flow->connectionId = connection->id;
+    flow->moved = peisk_timeNow;
+  }
+  return connection;
+}
+
+/** Gives the connection on which packages to the given destination
+    are sent, or NULL if no route is known. Sets *direct if it is a
+    direct connection to the destination. Always uses the main route. */
+static PeisConnection *peisk_nextHop(int destination,int *direct) {
+  PeisRoutingInfo *routingInfo;
+  int i;
+
+  for(i = 0;i<=peiskernel.highestConnection;i++)
+    if(peiskernel.connections[i].id != -1 &&
+       peiskernel.connections[i].neighbour.id == destination) {
+      *direct=1;
+      return &peiskernel.connections[i];
+    }
+  *direct=0;
+  if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long)destination,(void**)(void*)&routingInfo) != 0)
+    return NULL;
+  if(routingInfo->connection && routingInfo->connection->id == -1) return NULL;
+  return routingInfo->connection;
+}
+
+PeisPayload *peisk_payload_create(int len) {
+  PeisPayload *payload;
+
+  payload=(PeisPayload*) malloc(sizeof(PeisPayload)+len);
+  if(!payload) return NULL;
+  payload->refs=1;
+  payload->len=len;
+  return payload;
+}
+
+void peisk_payload_retain(PeisPayload *payload) {
+  payload->refs++;
+}
+
+void peisk_payload_release(PeisPayload *payload) {
+  PEISK_ASSERT(payload->refs > 0,("Releasing a payload with %d references\n",payload->refs));
+  if(--payload->refs == 0) free(payload);
+}
+
 int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,int flags) {
-  int pkgid,i,seqlen,thislen;
+  PeisPayload *payload;
+  int ret;
+
+  /* Small messages are copied directly into a single queued package */
+  if(len <= PEISK_MAX_PACKAGE_SIZE)
+    return peisk_sendMessageGather(from,port,destination,len,data,NULL,flags);
+
+  /* Large messages are copied once, all fragments refer to the copy */
+  payload=peisk_payload_create(len);
+  if(!payload) return -1;
+  memcpy(payload->data,data,len);
+  ret=peisk_sendMessageGather(from,port,destination,len,payload->data,payload,flags);
+  peisk_payload_release(payload);
+  return ret;
+}
+
+int peisk_sendPayloadFrom(int from,int port,int destination,PeisPayload *payload,int flags) {
+  return peisk_sendMessageGather(from,port,destination,payload->len,payload->data,payload,flags);
+}
+
+/** Sends a message, the data of which is either copied or (if
+    payload is non NULL) referenced from the given payload */
+static int peisk_sendMessageGather(int from,int port,int destination,int len,void *data,PeisPayload *payload,int flags) {
+  int i,seqlen,thislen;
   PeisPackageHeader header;
   PeisConnection *connection;
-  double fillrate, dropchance;
   PeisRoutingInfo *routingInfo;
+  PeisSentLongMessage *sent;
 
   /* See if we have a direct connection to the destination... */
   for(i = 0;i<=peiskernel.highestConnection;i++) {
@@ -833,22 +1103,14 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
 	printf("peisk: warning: sending to %d failed, no route to destination (no route recorded)\n",destination);
       return -1;
     }
-    connection = routingInfo->connection;
+    connection = peisk_selectNextHop(routingInfo,from,port);
     if(!connection) {
       if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
 	printf("peisk: warning: sending to %d failed, no route to destination (NULL pointer)\n",destination);
       return -1;
     }
 
-    /* Schedule to create a direct connection towards target if possible */
-    if(peiskernel.nDirConnReqs < PEISK_MAX_DIR_CONN_REQS) {
-      for(i=0;i < peiskernel.nDirConnReqs;i++)
-	if(peiskernel.dirConnReqs[i] == destination) break;
-      if(peiskernel.nDirConnReqs == 0 || i != peiskernel.nDirConnReqs) {
-	/*printf("Scheduling connection towards %d, request: %d\n",destination,peiskernel.nDirConnReqs);*/
-	peiskernel.dirConnReqs[peiskernel.nDirConnReqs++]=destination;
-      }
-    }
+    peisk_scheduleDirectConnection(destination);
   }
   /* See if socket towards target is still open */
   if(connection->id == -1) {
@@ -858,11 +1120,6 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
     return -1;
   }
 
-  /* Generate a random, previously unused id-number for this package */
-  do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
-
-  header.id=htonl(pkgid);
-  header.ackID = htonl(pkgid);
   header.type=ePeisDirectPackage;
   header.hops= from == peiskernel.id? 1 : 2;
   header.datalen=htons(len);
@@ -873,11 +1130,12 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
   header.seqid=0;
   header.seqnum=0;
   header.flags = htons(flags);
+  peisk_assignPackageId(&header);
+  header.ackID = header.id;
 
   /* If we are requesting ACK's then make sure to use a unique ackID */
   if(flags & PEISK_PACKAGE_REQUEST_ACK) {
-    do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
-    header.ackID = htonl(pkgid);
+    peisk_assignAckId(&header);
     peiskernel.lastGeneratedAckID = header.ackID;
   }
 
@@ -886,45 +1144,59 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
   if(len <= PEISK_MAX_PACKAGE_SIZE) {
 
     /* Always *attempt* to send small packages, they might just fit in */
-
-    /* Mark this package as from local origin */
-    peisk_markAsRepeated(pkgid);
-    return peisk_connection_sendPackage(connection->id,&header,len,(void*)data,0);
+    return peisk_connection_sendPayloadPackage(connection->id,&header,len,data,payload,0);
   }
+  PEISK_ASSERT(payload,("Sending a large message without a payload\n"));
 
 
   /* Otherwise, message is long so divide message into multiple packages */
   seqlen = (len + PEISK_MAX_PACKAGE_SIZE - 1) / PEISK_MAX_PACKAGE_SIZE;
   header.seqlen = htons(seqlen);
 
-  header.seqid=htons((rand() % 32767)+1);
+  /* Number our long messages in sequence, giving them unique seqid's
+     among all recent messages from us */
+  peiskernel.nextSeqid = peiskernel.nextSeqid % 32767 + 1;
+  header.seqid=htons(peiskernel.nextSeqid);
   /* Force packages to use BULK transfer method when large */
-  flags |= PEISK_PACKAGE_BULK;
-  header.flags = htons(flags);
+  header.flags = htons(ntohs(header.flags) | PEISK_PACKAGE_BULK);
 
-  /* See if *all* packages fit into queue, otherwise discard whole package */
+  /* See if *all* packages fit into queue, otherwise discard whole
+     package. Queued packages wait for the pacer, see \ref CongestionControl */
   if(connection->nQueuedPackages[PEISK_QUEUE_BULK] + seqlen >= PEISK_MAX_QUEUE_SIZE) {
     if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
       printf("peisk: warning - cannot fit large package into queue, discarding it\n");
     return -1; /* Sorry, too many packages... */
   }
-  /* Adjust for the use of RED (Random Early Detection) */
-  fillrate=peisk_connection_fillrate(connection,PEISK_QUEUE_BULK) + seqlen * 1.0 / PEISK_MAX_QUEUE_SIZE;
-  /*printf("fillrate: %f\n",fillrate);*/
-  if(fillrate > 0.5) {
-    if(fillrate > 1.0) return -1; /* No chance at all we can fit all of the package */
-    /* Compute the chance that none of the packages will be dropped */
-    dropchance = 1.0 - pow(1.0 - (2.0 * (fillrate - 0.5)), seqlen);
-    /* If it's too small (< 80%) then drop the whole package */
-    if(dropchance < 0.80) return -1;
+
+  /* Remember messages from us so that lost parts can be resent when
+     the receiver asks for them */
+  sent=NULL;
+  if(from == peiskernel.id) {
+    sent=&peiskernel.sentLongMessages[peiskernel.nextSeqid % PEISK_MAX_SENT_LONG_MESSAGES];
+    if(sent->payload) peisk_payload_release(sent->payload);
+    if(sent->allocatedAckIDs < seqlen) {
+      sent->allocatedAckIDs = seqlen;
+      sent->ackIDs = (int*) realloc(sent->ackIDs,seqlen*sizeof(int));
+      sent->partSent = (unsigned char*) realloc(sent->partSent,seqlen);
+    }
+    memset(sent->partSent,0,seqlen);
+    sent->nPartsSent = 0;
+    sent->seqid = peiskernel.nextSeqid;
+    sent->seqlen = seqlen;
+    sent->destination = destination;
+    sent->datalen = len;
+    sent->header = header;
+    sent->payload = payload;
+    peisk_payload_retain(payload);
   }
 
   PeisAcknowledgementHook *oldHookZero=NULL;
   void *oldDataZero=NULL;
-  int oldNHooks;
+  int oldNHooks=0;
   PeisLargePackageHookData *hookData;
 
-  if(peiskernel.withAckHook) {
+  int haveHooks = peiskernel.nAckHooks > 0;
+  if(haveHooks) {
     oldHookZero = peiskernel.withAckHook[0];
     oldDataZero = peiskernel.withAckHookData[0];
     oldNHooks = peiskernel.nAckHooks;
@@ -937,10 +1209,11 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
     hookData->nHooks = peiskernel.nAckHooks;
     hookData->counter = seqlen;
     hookData->success = 1;
-    hookData->data = (void*) malloc(len+sizeof(PeisPackageHeader));
-    memcpy(hookData->data,(void*)&header,sizeof(PeisPackageHeader));
+    /* Keep the whole message alive until all parts are acknowledged */
+    hookData->header = header;
     hookData->datalen = len;
-    memcpy(hookData->data+sizeof(PeisPackageHeader),data,len);
+    hookData->payload = payload;
+    peisk_payload_retain(payload);
     
     peiskernel.withAckHook[0] = peisk_largePackageHook;
     peiskernel.withAckHookData[0] = (void*) hookData;
@@ -949,30 +1222,26 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
 
   for(i=0;i<seqlen;i++) {
     header.seqnum=htons(i);
-    /* Generate a random, previously unused id-number for this package */
-    do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
-    header.id=htonl(pkgid);
+    peisk_assignPackageId(&header);
+    header.ackID = header.id;
 
     /*printf("Sending large message, seqnum: %d (%x) seqid: %d, seqlen=%d (%x), id: %d\n",
       ntohs(header.seqnum),header.seqnum,ntohs(header.seqid),seqlen,header.seqlen,ntohl(header.id));*/
 
     /* If we are requesting ACK's then make sure to use a unique ackID
        _for each package part_ */
-    if(flags & PEISK_PACKAGE_REQUEST_ACK) {
-      do { pkgid=rand() & 0x7fffffff; } while(peisk_isRepeated(pkgid));
-      header.ackID = htonl(pkgid);
-    }
+    if(flags & PEISK_PACKAGE_REQUEST_ACK)
+      peisk_assignAckId(&header);
+    if(sent) sent->ackIDs[i] = header.ackID;
 
     if(i == seqlen - 1) thislen = len - (seqlen - 1)*PEISK_MAX_PACKAGE_SIZE;
     else thislen = PEISK_MAX_PACKAGE_SIZE;
     header.datalen=htons(thislen);
-    /* Mark this package as from local origin */
-    peisk_markAsRepeated(pkgid);
     /* \todo Is it an error to use specialFlags=0 for all these sequenced packages?? */
-    peisk_connection_sendPackage(connection->id,&header,thislen,data+i*PEISK_MAX_PACKAGE_SIZE,0);
+    peisk_connection_sendPayloadPackage(connection->id,&header,thislen,data+i*PEISK_MAX_PACKAGE_SIZE,payload,0);
   }
   /* Restore any old hooks */
-  if(peiskernel.withAckHook) {
+  if(haveHooks) {
     peiskernel.withAckHook[0] = oldHookZero;
     peiskernel.withAckHookData[0] = oldDataZero;
     peiskernel.nAckHooks = oldNHooks;
@@ -981,6 +1250,203 @@ int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,i
   return 0; /* Success */
 }
 
+/** Sends a message to targets that are all reached through the same
+    connection. The targets are packed into as few multicast packages
+    as possible, a lone target is sent an ordinary direct package.
+
+    If payload is given we are the source of the message. The
+    acknowledgement of each multicast target is then awaited by a
+    package in the pending queue that refers to the payload, and it is
+    resent to that target alone if no acknowledgement arrives. */
+static void peisk_sendMulticastGroup(PeisConnection *connection,PeisPackageHeader *header,int flags,
+				     int nTargets,PeisMulticastTarget *targets,int len,void *data,PeisPayload *payload) {
+  static char buffer[PEISK_MAX_PACKAGE_SIZE];
+  PeisMulticastHeader *mheader = (PeisMulticastHeader*) buffer;
+  PeisPackageHeader pheader;
+  int maxTargets, n, i, nHooks, total;
+
+  maxTargets = (PEISK_MAX_PACKAGE_SIZE - (int) sizeof(PeisMulticastHeader) - len) / (int) sizeof(PeisMulticastTarget);
+  /* Older kernels cannot parse multicast packages, send them one direct package per target */
+  if(!connection->multicasts) maxTargets = 1;
+  while(nTargets > 0) {
+    n = nTargets <= maxTargets ? nTargets : maxTargets;
+    /* Avoid leaving a single target for the last package */
+    if(nTargets - n == 1 && n > 2) n--;
+    if(n < 2) n = 1;
+
+    pheader = *header;
+    pheader.seqlen = 0;
+    pheader.seqid = 0;
+    pheader.seqnum = 0;
+
+    if(n == 1) {
+      pheader.type = ePeisDirectPackage;
+      pheader.destination = targets->destination;
+      pheader.ackID = targets->ackID;
+      pheader.flags = htons(flags);
+      pheader.datalen = htons(len);
+      peisk_assignPackageId(&pheader);
+      peisk_connection_sendPayloadPackage(connection->id,&pheader,len,data,payload,0);
+    } else {
+      mheader->nTargets = htonl(n);
+      mheader->flags = htons(flags);
+      mheader->padding[0] = mheader->padding[1] = 0;
+      memcpy(buffer+sizeof(PeisMulticastHeader),(void*)targets,n*sizeof(PeisMulticastTarget));
+      memcpy(buffer+sizeof(PeisMulticastHeader)+n*sizeof(PeisMulticastTarget),data,len);
+      total = sizeof(PeisMulticastHeader)+n*sizeof(PeisMulticastTarget)+len;
+
+      pheader.type = ePeisMulticastPackage;
+      pheader.destination = htonl(-1);
+      /* The multicast package itself is never acknowledged, each
+	 target acknowledges the message with its own ackID */
+      pheader.flags = htons(flags & ~(PEISK_PACKAGE_REQUEST_ACK|PEISK_PACKAGE_SEQ_ACK));
+      pheader.datalen = htons(total);
+      peisk_assignPackageId(&pheader);
+      pheader.ackID = pheader.id;
+      nHooks = peiskernel.nAckHooks;
+      peiskernel.nAckHooks = 0;
+      peisk_connection_sendPackage(connection->id,&pheader,total,buffer,0);
+      peiskernel.nAckHooks = nHooks;
+
+      if(payload && (flags & PEISK_PACKAGE_REQUEST_ACK))
+	for(i=0;i<n;i++) {
+	  pheader.type = ePeisDirectPackage;
+	  pheader.destination = targets[i].destination;
+	  pheader.ackID = targets[i].ackID;
+	  pheader.flags = htons(flags);
+	  pheader.datalen = htons(len);
+	  peisk_connection_sendPayloadPackage(connection->id,&pheader,len,data,payload,PEISK_SEND_PENDING);
+	}
+    }
+    targets += n;
+    nTargets -= n;
+  }
+}
+
+void peisk_multicastPayload(int port,int nDestinations,int *destinations,PeisPayload *payload,int flags,int *status) {
+  static PeisMulticastTarget *targets=NULL;
+  static PeisConnection **hops=NULL;
+  static int allocated=0;
+  PeisPackageHeader header;
+  PeisConnection *connection;
+  int i, j, n, direct;
+
+  /* Without at least two targets fitting into one package there is
+     nothing to gain from multicasting */
+  if(nDestinations < 2 || 
+     (int) sizeof(PeisMulticastHeader) + 2 * (int) sizeof(PeisMulticastTarget) + payload->len > PEISK_MAX_PACKAGE_SIZE) {
+    for(i=0;i<nDestinations;i++)
+      status[i] = peisk_sendPayloadFrom(peiskernel.id,port,destinations[i],payload,flags);
+    return;
+  }
+
+  if(nDestinations > allocated) {
+    allocated = nDestinations * 2;
+    targets = (PeisMulticastTarget*) realloc(targets,allocated*sizeof(PeisMulticastTarget));
+    hops = (PeisConnection**) realloc(hops,allocated*sizeof(PeisConnection*));
+  }
+
+  for(i=0;i<nDestinations;i++) {
+    hops[i] = peisk_nextHop(destinations[i],&direct);
+    if(!hops[i]) {
+      if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+	printf("peisk: warning: sending to %d failed, no route to destination\n",destinations[i]);
+      status[i] = -1;
+      continue;
+    }
+    if(!direct) peisk_scheduleDirectConnection(destinations[i]);
+    status[i] = 0;
+  }
+
+  header.sync = PEISK_SYNC;
+  header.linkCnt = 0;
+  header.hops = 1;
+  header.port = htons(port);
+  header.source = htonl(peiskernel.id);
+  /* The ackID of each target is numbered from our sequence */
+  flags |= PEISK_PACKAGE_SEQ_ACK;
+
+  /* Send one group of packages for each distinct next hop */
+  for(i=0;i<nDestinations;i++) {
+    if(!hops[i]) continue;
+    connection = hops[i];
+    for(j=i,n=0;j<nDestinations;j++)
+      if(hops[j] == connection) {
+	targets[n].destination = htonl(destinations[j]);
+	targets[n].ackID = htonl(peisk_nextSequence());
+	hops[j] = NULL;
+	n++;
+      }
+    peisk_sendMulticastGroup(connection,&header,flags,n,targets,payload->len,payload->data,payload);
+  }
+}
+
+/** Forwards an incomming multicast package towards all targets other
+    than ourselves. Returns non zero if we also are one of the targets,
+    in which case the package has been turned into an ordinary direct
+    package to us. */
+static int peisk_relayMulticastPackage(PeisPackage *package) {
+  static PeisMulticastTarget groupTargets[PEISK_MAX_PACKAGE_SIZE / sizeof(PeisMulticastTarget)];
+  static PeisConnection *hops[PEISK_MAX_PACKAGE_SIZE / sizeof(PeisMulticastTarget)];
+  PeisMulticastHeader mheader;
+  PeisMulticastTarget *targets;
+  PeisPackageHeader header;
+  PeisConnection *connection;
+  int i, j, n, nTargets, datalen, len, self, direct, destination;
+  int32 ackID;
+  char *data;
+
+  datalen = ntohs(package->header.datalen);
+  if(datalen < (int) sizeof(PeisMulticastHeader)) return 0;
+  memcpy((void*)&mheader,(void*)package->data,sizeof(mheader));
+  nTargets = ntohl(mheader.nTargets);
+  if(nTargets < 1 || sizeof(PeisMulticastHeader) + nTargets * sizeof(PeisMulticastTarget) > datalen) {
+    if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+      printf("peisk: warning - malformed multicast package with %d targets and %d bytes\n",nTargets,datalen);
+    return 0;
+  }
+  targets = (PeisMulticastTarget*) (package->data + sizeof(PeisMulticastHeader));
+  data = (char*) (targets + nTargets);
+  len = datalen - sizeof(PeisMulticastHeader) - nTargets * sizeof(PeisMulticastTarget);
+
+  self = -1;
+  for(i=0;i<nTargets;i++) {
+    destination = ntohl(targets[i].destination);
+    hops[i] = NULL;
+    if(destination == peiskernel.id) { self = i; continue; }
+    /* Don't route package if it has reached maximum number of hops */
+    if(package->header.hops >= PEISK_MAX_HOPS-1) continue;
+    hops[i] = peisk_nextHop(destination,&direct);
+    if(!hops[i] && peisk_debugRoutes)
+      printf("Cannot route multicast package. Unknown route to host %d\n",destination);
+  }
+
+  header = package->header;
+  header.hops++;
+  for(i=0;i<nTargets;i++) {
+    if(!hops[i]) continue;
+    connection = hops[i];
+    for(j=i,n=0;j<nTargets;j++)
+      if(hops[j] == connection) {
+	groupTargets[n++] = targets[j];
+	hops[j] = NULL;
+      }
+    peisk_sendMulticastGroup(connection,&header,ntohs(mheader.flags),n,groupTargets,len,data,NULL);
+  }
+
+  if(self == -1) return 0;
+
+  /* Continue processing this as a direct package to us */
+  ackID = targets[self].ackID;
+  package->header.type = ePeisDirectPackage;
+  package->header.destination = htonl(peiskernel.id);
+  package->header.ackID = ackID;
+  package->header.flags = mheader.flags;
+  package->header.datalen = htons(len);
+  memmove((void*)package->data,(void*)data,len);
+  return 1;
+}
+
 void peisk_largePackageHook(int success,int datalen,PeisPackage *package,void *user) {
   int i;
   PeisLargePackageHookData *hookData = (PeisLargePackageHookData *) user;
@@ -988,24 +1454,126 @@ void peisk_largePackageHook(int success,int datalen,PeisPackage *package,void *u
   hookData->counter--;
   if(!success) hookData->success = 0;
   if(hookData->counter == 0) {
-    /* Hook is finished */
+    /* Hook is finished, give the whole message to the hooks as one package */
+    hookData->payload->header = hookData->header;
     for(i=0;i<hookData->nHooks;i++)
-      (hookData->hooks[i])(hookData->success,hookData->datalen,(PeisPackage *)hookData->data,hookData->users[i]);
-    free(hookData->data);
+      (hookData->hooks[i])(hookData->success,hookData->datalen,(PeisPackage *)&hookData->payload->header,hookData->users[i]);
+    peisk_payload_release(hookData->payload);
     free(hookData);
   }  
 }
 
-double peisk_connection_fillrate(PeisConnection *connection,int priority) {
-  int i;
-  double fillrate = 0.0;
-  for(i=0;i<priority;i++)
-    fillrate += connection->nQueuedPackages[i] * 1.0 / PEISK_MAX_QUEUE_SIZE;
-  return fillrate;
+/** Largest number of bytes the pacer of a connection lets it send at once */
+static double peisk_connection_burst(PeisConnection *connection) {
+  double burst = connection->maxOutgoing * PEISK_CC_BURST_TIME;
+  return burst > PEISK_CC_MIN_BURST ? burst : PEISK_CC_MIN_BURST;
+}
+
+double peisk_connection_pace(PeisConnection *connection) {
+  double burst = peisk_connection_burst(connection);
+
+  /* Nothing is lost on shared memory, a full ring stops us instead */
+  if(connection->type == eShmConnection) {
+    connection->isThrottled = 0;
+    return PEISK_SHM_RING_SIZE;
+  }
+
+  /* Token bucket: sent bytes drain away at the rate given by the
+     congestion control */
+  connection->outgoing -= (peisk_timeNow - connection->pacingUpdated) * connection->maxOutgoing;
+  if(connection->outgoing < 0.0) connection->outgoing = 0.0;
+  connection->pacingUpdated = peisk_timeNow;
+
+  connection->isThrottled = connection->outgoing >= burst;
+  if(connection->isThrottled) connection->rateLimited=1;
+  return burst - connection->outgoing;
+}
+
+double peisk_connection_pacingDeadline(PeisConnection *connection) {
+  return connection->pacingUpdated +
+    (connection->outgoing - peisk_connection_burst(connection)) / connection->maxOutgoing;
+}
+
+
+void peisk_queuedPackage_callHooks(PeisQueuedPackage *qpackage,int success) {
+  PeisPackage *package=&qpackage->package;
+  int i, datalen=ntohs(qpackage->package.header.datalen);
+
+  if(!qpackage->nHooks) return;
+  PEISK_ASSERT(qpackage->nHooks<=PEISK_MAX_ACKHOOKS,("Found a queue package with %d hooks\n",qpackage->nHooks));
+  /* Hooks expect the data to follow the header. If the package is the
+     whole payload we can use the scratch header of the payload for
+     this. Parts of large messages only have the peisk_largePackageHook
+     which does not use the data. */
+  if(qpackage->payload && qpackage->payloadData == qpackage->payload->data && 
+     datalen == qpackage->payload->len) {
+    qpackage->payload->header = qpackage->package.header;
+    package = (PeisPackage*) &qpackage->payload->header;
+  }
+  for(i=0;i<qpackage->nHooks;i++)
+    (qpackage->hook[i])(success,datalen,package,qpackage->hookData[i]);
+}
+
+void peisk_connection_enqueue(PeisConnection *connection,int queue,PeisQueuedPackage *qpackage) {
+  PeisQueuedPackage *other;
+
+  connection->nQueuedPackages[queue]++;
+  qpackage->connection = connection;
+  qpackage->next = NULL;
+  qpackage->prev = connection->outgoingQueueLast[queue];
+  *(connection->outgoingQueueLast[queue])=qpackage;
+  connection->outgoingQueueLast[queue]=&qpackage->next;
+
+  if(queue == PEISK_QUEUE_PENDING) {
+    if(peisk_hashTable_getValue(peiskernel.pendingAcks,(void*)(intA)qpackage->package.header.ackID,(void**)(void*)&other))
+      other=NULL;
+    qpackage->ackNext = other;
+    peisk_hashTable_insert(peiskernel.pendingAcks,(void*)(intA)qpackage->package.header.ackID,(void*)qpackage);
+  }
 }
 
+void peisk_connection_dequeue(PeisConnection *connection,int queue,PeisQueuedPackage *qpackage) {
+  PeisQueuedPackage *other, **prev;
+
+  connection->nQueuedPackages[queue]--;
+  *qpackage->prev=qpackage->next;
+  /* Be carefull when removing the lastmost element of the queues */
+  if(qpackage->next) qpackage->next->prev=qpackage->prev;
+  else connection->outgoingQueueLast[queue]=qpackage->prev;
+
+  if(queue == PEISK_QUEUE_PENDING &&
+     peisk_hashTable_getValue(peiskernel.pendingAcks,(void*)(intA)qpackage->package.header.ackID,(void**)(void*)&other) == 0) {
+    if(other == qpackage) {
+      if(qpackage->ackNext)
+	peisk_hashTable_insert(peiskernel.pendingAcks,(void*)(intA)qpackage->package.header.ackID,(void*)qpackage->ackNext);
+      else
+	peisk_hashTable_remove(peiskernel.pendingAcks,(void*)(intA)qpackage->package.header.ackID);
+    } else {
+      /* Several packages with the same ackID, unlink it from the chain */
+      for(prev=&other->ackNext;*prev && *prev != qpackage;prev=&(*prev)->ackNext) {}
+      if(*prev) *prev=qpackage->ackNext;
+    }
+  }
+}
+
+PeisQueuedPackage *peisk_lookupPendingAck(int ackID) {
+  PeisQueuedPackage *qpackage;
+  if(peisk_hashTable_getValue(peiskernel.pendingAcks,(void*)(intA)ackID,(void**)(void*)&qpackage)) return NULL;
+  return qpackage;
+}
+
+void peisk_queuedPackage_free(PeisQueuedPackage *qpackage) {
+  if(qpackage->payload) peisk_payload_release(qpackage->payload);
+  qpackage->payload = NULL;
+  qpackage->next = peiskernel.freeQueuedPackages;
+  peiskernel.freeQueuedPackages = qpackage;
+}
 
 int peisk_connection_sendPackage(int id,PeisPackageHeader *package,int datalen,void *data,int specialFlags) {
+  return peisk_connection_sendPayloadPackage(id,package,datalen,data,NULL,specialFlags);
+}
+
+int peisk_connection_sendPayloadPackage(int id,PeisPackageHeader *package,int datalen,void *data,PeisPayload *payload,int specialFlags) {
   int index;
   PeisConnection *connection;
   PeisQueuedPackage *qpackage;
@@ -1067,6 +1635,7 @@ int peisk_connection_sendPackage(int id,PeisPackageHeader *package,int datalen,v
   /* Copy package to it */
   qpackage->package.header = *package;
   qpackage->package.header.sync = PEISK_SYNC;
+  peisk_connection_legacyId(connection,&qpackage->package.header);
   /* Also copy any hooks which have been requested for this package */
   qpackage->nHooks = peiskernel.nAckHooks;
   for(i=0;i<qpackage->nHooks;i++) {
@@ -1080,11 +1649,25 @@ int peisk_connection_sendPackage(int id,PeisPackageHeader *package,int datalen,v
 
   /* qpackage->package.header.datalen = htons(datalen); This is redundant? */
   qpackage->t0 = peisk_gettimef();
-  if(data) {
+  qpackage->payload = payload;
+  if(payload) {
+    /* Refer to the shared payload instead of copying it */
+    peisk_payload_retain(payload);
+    qpackage->payloadData = (char*) data;
+  } else if(data) {
     memcpy((void*)qpackage->package.data,data,datalen);
   }
 
 
+  /* Packages that already have been sent only wait for their
+     acknowledgement in the pending queue */
+  if(specialFlags & PEISK_SEND_PENDING) {
+    priority=PEISK_QUEUE_PENDING;
+    qpackage->sent = qpackage->t0;
+    qpackage->t0 += peisk_retransmissionTimeout(ntohl(package->destination),0);
+    qpackage->retries = 0;
+  }
+
   /* If we have too many packages then abort */
   if(connection->nQueuedPackages[priority] > PEISK_MAX_QUEUE_SIZE) {
     if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
@@ -1093,42 +1676,19 @@ int peisk_connection_sendPackage(int id,PeisPackageHeader *package,int datalen,v
     goto sendPackage_failed;
   }
 
-  /* Use the RED (Random Early Detection) congestion algorithm from TCP/IP here.
-     This discards random packets with probability 0.0 for 50% fillrate going up to
-     probability 1.0 for 100% fillrate.
-     The problem here is the definition of "fillrate" since we have multiple queues.
-     For now, I try by summing the fillrate for all higher (lower numbered) priority queues.
-     This might give a fillrate > 100% but that's ok.
-  */
-  double fillrate = peisk_connection_fillrate(connection,priority);
-  double dropchance = 2.0 * (fillrate - 0.5);
-  if((rand() % 10000) / 10000.0 < dropchance) {
-    if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
-      /* Note - this is not exactly an error, remove this in the future... */
-      fprintf(stderr,"peisk:peisk_connection_sendPackage: RED drop");
-    peiskernel.ackHookFailureType = eAckHookFailureRED;
-    goto sendPackage_failed;
-  }
-
   /* Place package in queue */
-  connection->nQueuedPackages[priority]++;
-  qpackage->next = NULL;
-  *(connection->outgoingQueueLast[priority])=qpackage;
-  connection->outgoingQueueLast[priority]=&qpackage->next;
+  peisk_connection_enqueue(connection,priority,qpackage);
+
+  /* Packages queued by other threads are sent directly */
+  if(peiskernel.reactorSleeping) peisk_reactorWakeup();
 
   /* Success */
   return 0; 
  sendPackage_failed:
   /* Failure, alert hook */
-  if(qpackage->nHooks) {
-
-    /* Note: peiskernel.ackHooKFailureType *have* been initialized before reaching here */
-
-    /* Trigger failure hook(s) for this package */
-    PEISK_ASSERT(qpackage->nHooks<PEISK_MAX_ACKHOOKS,("Found a queue package with %d hooks\n",qpackage->nHooks));
-    for(i=0;i<qpackage->nHooks;i++)
-      (qpackage->hook[i])(0,qpackage->package.header.datalen,&qpackage->package,qpackage->hookData[i]);
-  }
+  /* Note: peiskernel.ackHooKFailureType *have* been initialized before reaching here */
+  peisk_queuedPackage_callHooks(qpackage,0);
+  peisk_queuedPackage_free(qpackage);
   return -1; 
 }
 
@@ -1175,13 +1735,121 @@ void peisk_markAsRepeated(int pkgid) {
   loopInfo->hashPrev = &peiskernel.loopHashTable[hash];
 }
 
+int peisk_nextSequence() {
+  int seq;
+  /* Sequence numbers are positive 31 bit numbers, so that they also
+     are valid as ids for older kernels */
+  do { seq = (int) (peiskernel.nextSequence++ & 0x7fffffff); } while(seq == 0);
+  return seq;
+}
+
+int peisk_sequenceSeen(int source,int seq,int tooOld) {
+  PeisSequenceWindow *window;
+  int diff, index;
+
+  if(peisk_hashTable_getValue(peiskernel.sequenceWindows,(void*)(intA)source,(void**)(void*)&window) != 0) {
+    window = (PeisSequenceWindow*) malloc(sizeof(PeisSequenceWindow));
+    memset((void*)window,0,sizeof(PeisSequenceWindow));
+    window->highest = seq;
+    peisk_hashTable_insert(peiskernel.sequenceWindows,(void*)(intA)source,(void*)window);
+  }
+
+  /* Distance from the newest number seen, modulo 2^31 */
+  diff = ((int) (((unsigned int) seq - window->highest) << 1)) >> 1;
+  if(diff > 0) {
+    /* Slide window forward, forgetting the numbers that fall out of it */
+    if(diff >= PEISK_SEQ_WINDOW_SIZE)
+      memset((void*)window->bits,0,sizeof(window->bits));
+    else
+      while(window->highest != (unsigned int) seq) {
+	window->highest = (window->highest + 1) & 0x7fffffff;
+	index = window->highest & (PEISK_SEQ_WINDOW_SIZE-1);
+	window->bits[index/32] &= ~(1U << (index%32));
+      }
+    window->highest = seq;
+  } else if(diff <= -PEISK_SEQ_WINDOW_SIZE) {
+    /* Only fresh package ids count towards a restart, ackID's of late
+       retransmissions are expected to be old */
+    if(diff > -PEISK_SEQ_RESTART_DISTANCE && (!tooOld || ++window->nTooOld < PEISK_SEQ_RESTART_RUN))
+      return tooOld;
+    /* Far behind the window, or behind it for many ids in a row, the
+       source has been restarted */
+    memset((void*)window->bits,0,sizeof(window->bits));
+    window->highest = seq;
+  }
+  if(tooOld) window->nTooOld = 0;
+
+  index = seq & (PEISK_SEQ_WINDOW_SIZE-1);
+  if(window->bits[index/32] & (1U << (index%32))) return 1;
+  window->bits[index/32] |= 1U << (index%32);
+  return 0;
+}
+
+void peisk_assignPackageId(PeisPackageHeader *header) {
+  int pkgid, flags;
+
+  flags = ntohs(header->flags);
+  if(ntohl(header->source) == peiskernel.id) {
+    header->id = htonl(peisk_nextSequence());
+    flags |= PEISK_PACKAGE_SEQ_ID;
+  } else {
+    /* We cannot number packages on behalf of other hosts. Generate a
+       random, previously unused id-number and mark it as seen since
+       it's from local origin */
+    do { pkgid=rand() & 0x7fffffff; } while(pkgid == 0 || peisk_isRepeated(pkgid));
+    peisk_markAsRepeated(pkgid);
+    header->id = htonl(pkgid);
+    flags &= ~PEISK_PACKAGE_SEQ_ID;
+  }
+  header->flags = htons(flags);
+}
+
+void peisk_assignAckId(PeisPackageHeader *header) {
+  int pkgid, flags;
+
+  flags = ntohs(header->flags);
+  if(ntohl(header->source) == peiskernel.id) {
+    header->ackID = htonl(peisk_nextSequence());
+    flags |= PEISK_PACKAGE_SEQ_ACK;
+  } else {
+    do { pkgid=rand() & 0x7fffffff; } while(pkgid == 0 || peisk_isRepeated(pkgid));
+    peisk_markAsRepeated(pkgid);
+    header->ackID = htonl(pkgid);
+    flags &= ~PEISK_PACKAGE_SEQ_ACK;
+  }
+  header->flags = htons(flags);
+}
+
+int peisk_legacyId(int source,int seq) {
+  unsigned int id;
+
+  /* Derive the id from source and sequence number, that way all
+     kernels translate the same package to the same id */
+  id = (unsigned int) seq * 2654435761U ^ (unsigned int) source * 40503U;
+  id = (id ^ (id >> 15)) & 0x7fffffff;
+  if(id == 0) id = 1;
+  return (int) id;
+}
+
+void peisk_connection_legacyId(PeisConnection *connection,PeisPackageHeader *header) {
+  int id, flags;
+
+  flags = ntohs(header->flags);
+  if(connection->sequencedIds || !(flags & PEISK_PACKAGE_SEQ_ID)) return;
+
+  id = peisk_legacyId(ntohl(header->source),ntohl(header->id));
+  peisk_markAsRepeated(id);
+  if(header->ackID == header->id) header->ackID = htonl(id);
+  header->id = htonl(id);
+  header->flags = htons(flags & ~PEISK_PACKAGE_SEQ_ID);
+}
+
 
 
 void peisk_closeConnection(int id) {
-  int i,j,index,queue;
+  int i,j,e,index,queue;
   PeisConnection *connection;
   PeisQueuedPackage *qpackage;
-  PeisQueuedPackage *next;
   PeisHashTableIterator iterator;
   PeisRoutingInfo *routingInfo;
   PeisRoutingInfo *routingInfo2;
@@ -1219,11 +1887,15 @@ void peisk_closeConnection(int id) {
   /* Close the connection */
   switch(connection->type) {
   case eTCPConnection:
-    close(connection->connection.tcp.socket);
+    /* Pending connections have no socket while resolving */
+    if(connection->connection.tcp.socket != -1) close(connection->connection.tcp.socket);
     break;
   case eUDPConnection:
     close(connection->connection.udp.socket);
     break;
+  case eShmConnection:
+    peisk_shmCloseConnection(connection);
+    break;
   case eBluetoothConnection:
     peisk_bluetoothCloseConnection(connection);
   default:  /** \todo Handle other connection types */
@@ -1236,9 +1908,8 @@ void peisk_closeConnection(int id) {
 
   /* Remove all old routes using this connection */
   /* Iterate over all routes that was tied to this connection */
-  peisk_hashTableIterator_first(connection->routingTable,&iterator);
-  while(peisk_hashTableIterator_next(&iterator)) {
-    peisk_hashTableIterator_value_generic(&iterator,&destination,&routingInfo);
+  for(e=0;e<connection->routingTable.count;e++) {
+    destination = ((PeisRoutingInfo*) peisk_sortedArray_get(&connection->routingTable,e))->id;
     /* Now lookup this destination in the main routing table */
     if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)destination,(void**)(void*)&routingInfo) == 0) {
       if(routingInfo->connection == connection) {
@@ -1253,8 +1924,7 @@ void peisk_closeConnection(int id) {
 	   update routingInfo if there is anyone else */
 	for(j=0;j<PEISK_MAX_CONNECTIONS;j++)
 	  if(peiskernel.connections[j].id != -1 &&
-	     peisk_hashTable_getValue(peiskernel.connections[j].routingTable,
-				      (void*)destination,(void**)(void*) &routingInfo2) == 0 &&
+	     (routingInfo2 = peisk_sortedArray_find(&peiskernel.connections[j].routingTable,destination)) &&
 	     routingInfo2->sequenceNumber-routingInfo2->hops > sequenceNumber-metric) {
 	    metric=routingInfo2->hops;
 	    sequenceNumber=routingInfo2->sequenceNumber;
@@ -1265,6 +1935,8 @@ void peisk_closeConnection(int id) {
 	routingInfo->hops = metric;
 	routingInfo->sequenceNumber = sequenceNumber;
 	routingInfo->magic = magic;
+	peisk_findRoutingAlternatives(routingInfo);
+	peisk_routingChanged(destination);
 	/*
 	if(metric < 250)
 	  printf("Route to %d rescued to %d hops using connection #%d instead\n",destination,metric,bestConnection->id);
@@ -1275,7 +1947,7 @@ void peisk_closeConnection(int id) {
 #ifdef OLD
 	for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
 	  if(peiskernel.connections[i].id != -1 &&
-	     peisk_hashTable_getValue(peiskernel.connections[i].routingTable,(void*)destination,(void**)(void*) &routingInfo2) == 0) {
+	     (routingInfo2 = peisk_sortedArray_find(&peiskernel.connections[i].routingTable,destination))) {
 	    /* Method 1: Reroute to this connection if it has exactly
 	       not 3 hops. This does not create loops, but it fails to
 	       recover a few valid routes under special
@@ -1312,30 +1984,26 @@ void peisk_closeConnection(int id) {
    But we DO need to trigger the hooks of any pending packages...
   */
   for(queue=0;queue<PEISK_NQUEUES;queue++) {
-    for(qpackage=connection->outgoingQueueFirst[queue];qpackage;) {
+    while((qpackage=connection->outgoingQueueFirst[queue])) {
       if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
 	printf("Giving up on ackID %x, closed connection\n",ntohl(qpackage->package.header.ackID));
-      if(qpackage->hook) {
-	/* Trigger failure hook for this package */
-	peiskernel.ackHookFailureType=eAckHookFailureDeadConnection;
-
-	PEISK_ASSERT(qpackage->nHooks<PEISK_MAX_ACKHOOKS,("Found a queue package with %d hooks\n",qpackage->nHooks));
-	for(i=0;i<qpackage->nHooks;i++)
-	  (qpackage->hook[i])(0,qpackage->package.header.datalen,&qpackage->package,qpackage->hookData[i]);
-      }
-      next=qpackage->next;
-      qpackage->next=peiskernel.freeQueuedPackages;
-      peiskernel.freeQueuedPackages=qpackage;
-      qpackage=next;
+      peisk_connection_dequeue(connection,queue,qpackage);
+      /* Trigger failure hook for this package */
+      peiskernel.ackHookFailureType=eAckHookFailureDeadConnection;
+      peisk_queuedPackage_callHooks(qpackage,0);
+      peisk_queuedPackage_free(qpackage);
     }
   }
+  /* The partially sent package is not in any queue */
+  if(connection->sendPartial) {
+    peiskernel.ackHookFailureType=eAckHookFailureDeadConnection;
+    peisk_queuedPackage_callHooks(connection->sendPartial,0);
+    peisk_queuedPackage_free(connection->sendPartial);
+    connection->sendPartial=NULL;
+  }
 
   /* Cleanup internal routing table of this connection */
-  peisk_hashTableIterator_first(connection->routingTable,&iterator);
-  while(peisk_hashTableIterator_next(&iterator)) {
-    peisk_hashTableIterator_value_generic(&iterator,&destination,&routingInfo);
-    routingInfo->hops = 255;
-  }
+  peisk_sortedArray_clear(&connection->routingTable);
 
   /* Trigger routing periodic to send to neighbours immediatly, but do not age hosts or resend queries */
   peisk_do_routing(2,NULL);
@@ -1345,87 +2013,150 @@ void peisk_closeConnection(int id) {
 
 
 
+/** Key of a long message in PeisKernel::assemblyHT and
+    PeisKernel::assembledHT. Integer keys only keep 32 bits, so the
+    source and seqid are mixed together and different messages can
+    share a key. */
+#define peisk_assemblyKey(source,seqid) ((void*) (intA) (int) (((unsigned int) (source)) * 2654435761U ^ ((seqid) & 0xffff)))
+
+/** Finds the assembly buffer of a long message, or NULL */
+static PeisAssemblyBuffer *peisk_findAssemblyBuffer(int source,short seqid) {
+  PeisAssemblyBuffer *buffer;
+
+  if(peisk_hashTable_getValue(peiskernel.assemblyHT,peisk_assemblyKey(source,seqid),(void**)(void*)&buffer) != 0)
+    return NULL;
+  for(;;) {
+    if(buffer->source == source && buffer->seqid == seqid) return buffer;
+    if(buffer->nextSameKey == -1) return NULL;
+    buffer = &peiskernel.assemblyBuffers[buffer->nextSameKey];
+  }
+}
+
+/** Returns an assembly buffer to the list of unused buffers */
+static void peisk_freeAssemblyBuffer(PeisAssemblyBuffer *buffer) {
+  PeisAssemblyBuffer *first, *prev;
+  void *key = peisk_assemblyKey(buffer->source,buffer->seqid);
+
+  /* Unlink it from the buffers sharing its key */
+  if(peisk_hashTable_getValue(peiskernel.assemblyHT,key,(void**)(void*)&first) == 0) {
+    if(first == buffer) {
+      if(buffer->nextSameKey == -1) peisk_hashTable_remove(peiskernel.assemblyHT,key);
+      else peisk_hashTable_insert(peiskernel.assemblyHT,key,(void*)&peiskernel.assemblyBuffers[buffer->nextSameKey]);
+    } else {
+      for(prev=first;prev->nextSameKey != -1;prev=&peiskernel.assemblyBuffers[prev->nextSameKey])
+	if(&peiskernel.assemblyBuffers[prev->nextSameKey] == buffer) {
+	  prev->nextSameKey = buffer->nextSameKey;
+	  break;
+	}
+    }
+  }
+  buffer->seqid = 0;
+  buffer->nextFree = peiskernel.freeAssemblyBuffers;
+  peiskernel.freeAssemblyBuffers = buffer - peiskernel.assemblyBuffers;
+}
+
+/** True if the long message was recently assembled */
+static int peisk_isAssembled(int source,short seqid) {
+  PeisAssembledMessage *message;
+  void *value;
+
+  if(peisk_hashTable_getValue(peiskernel.assembledHT,peisk_assemblyKey(source,seqid),&value) != 0) return 0;
+  message = &peiskernel.assembledLongMessages[(int) (intA) value - 1];
+  return message->source == source && message->seqid == seqid;
+}
+
+/** Remembers a long message as assembled, forgetting the oldest one */
+static void peisk_markAssembled(int source,short seqid) {
+  PeisAssembledMessage *message = &peiskernel.assembledLongMessages[peiskernel.nextAssembled];
+  void *value;
+
+  if(message->source != -1 &&
+     peisk_hashTable_getValue(peiskernel.assembledHT,peisk_assemblyKey(message->source,message->seqid),&value) == 0 &&
+     (int) (intA) value == peiskernel.nextAssembled + 1)
+    peisk_hashTable_remove(peiskernel.assembledHT,peisk_assemblyKey(message->source,message->seqid));
+  message->source = source;
+  message->seqid = seqid;
+  /* A message with the same key takes over the key, the older one is
+     then assembled again should any late parts of it arrive */
+  peisk_hashTable_insert(peiskernel.assembledHT,peisk_assemblyKey(source,seqid),(void*) (intA) (peiskernel.nextAssembled + 1));
+  peiskernel.nextAssembled = (peiskernel.nextAssembled + 1) % PEISK_MAX_ASSEMBLED_LONG_MESSAGES;
+}
+
 int peisk_assembleLongMessage(PeisPackageHeader *package,int datalen,void *data) {
-  int i,j,seqlen,seqnum;
+  int seqlen,seqnum;
   int port,destination,source;
+  short seqid;
   PeisHookList *hooklist;
+  PeisAssemblyBuffer *buffer, *first;
 
   /*printf("Assemble Long Message %d\n",ntohs(package->seqid));*/
 
-  /** \todo If we get a new long message from a given sender then delete all old partial long messages from that sender */
-
-
   seqlen = ntohs(package->seqlen);
   seqnum = ntohs(package->seqnum);
+  seqid = ntohs(package->seqid);
+  source = ntohl(package->source);
   /*printf("Assembling package %d, seqnum %d\n",ntohs(package->seqid),seqnum);*/
 
 
   if(seqlen > 10000)
     fprintf(stderr,"peisk: warning - received a *very* long message (%d packages)\n",seqlen);
+  if(seqnum >= seqlen) return 0;                               /* Bad seqnum of this package */
 
   /* First, see if package belongs to a buffer already allocated */
-  for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++)
-    if(peiskernel.assemblyBuffers[i].seqid == ntohs(package->seqid)) break;
-  if(i == PEISK_MAX_LONG_MESSAGES) {
+  buffer = peisk_findAssemblyBuffer(source,seqid);
+  if(!buffer) {
+    /* Parts of messages we already have assembled can still arrive
+       when they were resent */
+    if(peisk_isAssembled(source,seqid)) return 0;
     /* No it didn't, allocate a new buffer */
+    if(peiskernel.freeAssemblyBuffers == -1) {
+      /* Ooops, we're out of buffers */
+      if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+	fprintf(stderr,"peisk: warning - no free buffers for long messages\n");
+      return 0;
+    }
+    buffer = &peiskernel.assemblyBuffers[peiskernel.freeAssemblyBuffers];
+    peiskernel.freeAssemblyBuffers = buffer->nextFree;
 
-    /* First, see if there is one already with the exact right size of allocated buffers */
-    for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++)
-      if(peiskernel.assemblyBuffers[i].seqid == 0 && peiskernel.assemblyBuffers[i].allocated_seqlen == seqlen)
-	goto found_buffer;
-
-    /* Otherwise, see if there is one already with a sufficiently large size of allocated buffers */
-    for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++)
-      if(peiskernel.assemblyBuffers[i].seqid == 0 && peiskernel.assemblyBuffers[i].allocated_seqlen >= seqlen)
-	goto found_buffer;
-
-    /* Otherwise, just grab one that is free */
-    for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++)
-      if(peiskernel.assemblyBuffers[i].seqid == 0) goto found_buffer;
-
-    /* Ooops, we're out of buffers */
-    if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
-      fprintf(stderr,"peisk: warning - no free buffers for long messages\n");
-    return 0;
-
-  found_buffer:
-    if(peiskernel.assemblyBuffers[i].allocated_seqlen < seqlen) {
-      peiskernel.assemblyBuffers[i].allocated_seqlen = seqlen;
-      peiskernel.assemblyBuffers[i].seqlen = seqlen;
-      peiskernel.assemblyBuffers[i].received = realloc(peiskernel.assemblyBuffers[i].received,seqlen);
-      peiskernel.assemblyBuffers[i].data = realloc(peiskernel.assemblyBuffers[i].data,seqlen*PEISK_MAX_PACKAGE_SIZE);
+    if(buffer->allocated_seqlen < seqlen) {
+      buffer->allocated_seqlen = seqlen;
+      buffer->received = realloc(buffer->received,seqlen);
+      buffer->data = realloc(buffer->data,seqlen*PEISK_MAX_PACKAGE_SIZE);
     }
-    memset(peiskernel.assemblyBuffers[i].received,0,seqlen);
-    peiskernel.assemblyBuffers[i].seqid=ntohs(package->seqid);
-    /*printf("starting to assemble long message %d (num = %d, id = %d, ack id=%d)\n",peiskernel.assemblyBuffers[i].seqid,package->seqnum,package->id, package->ackID);*/
+    memset(buffer->received,0,seqlen);
+    buffer->seqid = seqid;
+    buffer->source = source;
+    buffer->seqlen = seqlen;
+    buffer->missing = seqlen;
+    buffer->nNacks = 0;
+    /* Put it first among the buffers sharing its key */
+    if(peisk_hashTable_getValue(peiskernel.assemblyHT,peisk_assemblyKey(source,seqid),(void**)(void*)&first) == 0)
+      buffer->nextSameKey = first - peiskernel.assemblyBuffers;
+    else
+      buffer->nextSameKey = -1;
+    peisk_hashTable_insert(peiskernel.assemblyHT,peisk_assemblyKey(source,seqid),(void*)buffer);
+    /*printf("starting to assemble long message %d (num = %d, id = %d, ack id=%d)\n",buffer->seqid,package->seqnum,package->id, package->ackID);*/
   }
 
-  /*
-  if(package->seqnum == 0)
-	printf("Assembling. seqid=%d, seqlen=%d\t seqnum=%d, id = %d, ackID = %d\n",ntohs(package->seqid),seqlen,package->seqnum,package->id,package->ackID);
-  */
-
-  /*printf("seqlen: %d, aseqlen %d, seqnum: %d\n",seqlen,peiskernel.assemblyBuffers[i].seqlen,package->seqnum);*/
-
-  if(seqlen > peiskernel.assemblyBuffers[i].seqlen) return 0;  /* Bad seqlen of this package */
-  if(seqnum >= seqlen) return 0;                               /* Bad seqnum of this package */
+  if(seqlen != buffer->seqlen) return 0;                       /* Bad seqlen of this package */
   /** \todo check the case when we get too little data for package inside a long message */
   /* Compute total length of long message */
-  if(seqnum == seqlen - 1) peiskernel.assemblyBuffers[i].totalsize = PEISK_MAX_PACKAGE_SIZE * (seqlen - 1) + datalen;
-
-  peiskernel.assemblyBuffers[i].timeout = peisk_gettimef() + PEISK_TIMEOUT_LONG_MESSAGE;
-  peiskernel.assemblyBuffers[i].received[seqnum] = 1;
-  memcpy(peiskernel.assemblyBuffers[i].data+PEISK_MAX_PACKAGE_SIZE*seqnum,data,datalen);
+  if(seqnum == seqlen - 1) buffer->totalsize = PEISK_MAX_PACKAGE_SIZE * (seqlen - 1) + datalen;
 
-  /*printf("Assembling seqid %d, seqlen %d\n",ntohs(package->seqid),seqlen);*/
+  buffer->timeout = peisk_gettimef() + PEISK_TIMEOUT_LONG_MESSAGE;
+  buffer->lastReceived = peisk_timeNow;
+  if(buffer->received[seqnum]) return 0;                       /* Retransmitted package we already have */
+  buffer->received[seqnum] = 1;
+  buffer->missing--;
+  memcpy(buffer->data+PEISK_MAX_PACKAGE_SIZE*seqnum,data,datalen);
 
   /* See if all packages has been received and give correct return code */
-  for(j=0;j<seqlen;j++)
-    if(peiskernel.assemblyBuffers[i].received[j] == 0) return 0;
+  if(buffer->missing > 0) return 0;
 
   /*printf("FINISHED seqid %d, seqlen %d\n",ntohs(package->seqid),package->seqlen);*/
 
   /* Package has been received in full, see if it should be intercepted by us */
+  peisk_markAssembled(source,seqid);
   peisk_lastPackage = package;
   port = ntohs(package->port);
   hooklist=peisk_lookupHook(port);
@@ -1433,11 +2164,10 @@ int peisk_assembleLongMessage(PeisPackageHeader *package,int datalen,void *data)
   /* Trigger all hooks registered to this long message */
   while(hooklist) {
     destination = ntohl(package->destination);
-    source = ntohl(package->source);
-    (hooklist->hook)(port,destination,source,peiskernel.assemblyBuffers[i].totalsize,peiskernel.assemblyBuffers[i].data);
+    (hooklist->hook)(port,destination,source,buffer->totalsize,buffer->data);
     hooklist=hooklist->next;
   }
-  peiskernel.assemblyBuffers[i].seqid = 0;
+  peisk_freeAssemblyBuffer(buffer);
   return 1;
 }
 
@@ -1446,7 +2176,98 @@ void peisk_periodic_clearAssemblyBuffers(void *data) {
   double timenow=peisk_gettimef();
   for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++)
     if(peiskernel.assemblyBuffers[i].seqid && peiskernel.assemblyBuffers[i].timeout < timenow)
-      peiskernel.assemblyBuffers[i].seqid=0;
+      peisk_freeAssemblyBuffer(&peiskernel.assemblyBuffers[i]);
+}
+
+void peisk_periodic_nackLongMessages(void *data) {
+  static char message[PEISK_MAX_PACKAGE_SIZE];
+  PeisNackHeader *nack = (PeisNackHeader*) message;
+  short *seqnums = (short*) (message + sizeof(PeisNackHeader));
+  int maxMissing = (PEISK_MAX_PACKAGE_SIZE - sizeof(PeisNackHeader)) / sizeof(short);
+  PeisAssemblyBuffer *buffer;
+  PeisSentLongMessage *sent;
+  int i,j,n;
+
+  /* Ask for the missing parts of messages that have stopped arriving */
+  for(i=0;i<PEISK_MAX_LONG_MESSAGES;i++) {
+    buffer = &peiskernel.assemblyBuffers[i];
+    if(!buffer->seqid || buffer->nNacks >= PEISK_MAX_NACKS ||
+       buffer->lastReceived + PEISK_NACK_DELAY > peisk_timeNow) continue;
+    for(j=0,n=0;j<buffer->seqlen && n<maxMissing;j++)
+      if(!buffer->received[j]) seqnums[n++] = htons(j);
+    nack->seqid = htons(buffer->seqid);
+    nack->nMissing = htons(n);
+    if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+      printf("peisk: requesting %d of %d missing parts of long message %d from %d\n",n,buffer->missing,buffer->seqid,buffer->source);
+    peisk_sendMessage(PEISK_PORT_NACK,buffer->source,sizeof(PeisNackHeader)+n*sizeof(short),message,PEISK_PACKAGE_HIPRI);
+    buffer->nNacks++;
+    buffer->lastReceived = peisk_timeNow;
+  }
+
+  /* Forget our own long messages that can no longer be asked for */
+  for(i=0;i<PEISK_MAX_SENT_LONG_MESSAGES;i++) {
+    sent = &peiskernel.sentLongMessages[i];
+    if(sent->payload && sent->nPartsSent == sent->seqlen && sent->timeout < peisk_timeNow) {
+      peisk_payload_release(sent->payload);
+      sent->payload = NULL;
+      sent->seqid = 0;
+    }
+  }
+}
+
+int peisk_hook_nack(int port,int destination,int sender,int datalen,void *data) {
+  PeisNackHeader nack;
+  PeisSentLongMessage *sent;
+  PeisPackageHeader header;
+  PeisQueuedPackage *qpackage;
+  PeisConnection *connection;
+  short seqnum;
+  int i,n,seqid,direct,thislen,nHooks;
+
+  if(destination != peiskernel.id || datalen < (int) sizeof(PeisNackHeader)) return 0;
+  memcpy((void*)&nack,data,sizeof(nack));
+  seqid = ntohs(nack.seqid);
+  n = ntohs(nack.nMissing);
+  if(datalen < (int) (sizeof(PeisNackHeader) + n*sizeof(short))) return 0;
+
+  sent = &peiskernel.sentLongMessages[seqid % PEISK_MAX_SENT_LONG_MESSAGES];
+  if(sent->seqid != seqid || sent->destination != sender || !sent->payload) return 0;
+  connection = peisk_nextHop(sender,&direct);
+  if(!connection) return 0;
+
+  /* The retransmitted parts are not part of the acknowledgement hooks
+     of the original message */
+  nHooks = peiskernel.nAckHooks;
+  peiskernel.nAckHooks = 0;
+  for(i=0;i<n;i++) {
+    memcpy((void*)&seqnum,(char*)data+sizeof(PeisNackHeader)+i*sizeof(short),sizeof(short));
+    seqnum = ntohs(seqnum);
+    if(seqnum < 0 || seqnum >= sent->seqlen) continue;
+    /* Parts still waiting in our queues will arrive without help */
+    if(!sent->partSent[seqnum]) continue;
+
+    /* Parts sent reliably are still in the pending queue unless given
+       up upon, let the queue resend them right away */
+    if(ntohs(sent->header.flags) & PEISK_PACKAGE_REQUEST_ACK) {
+      qpackage = peisk_lookupPendingAck(ntohl(sent->ackIDs[seqnum]));
+      if(qpackage) { qpackage->t0 = peisk_timeNow; continue; }
+    }
+
+    /* Otherwise resend the part from our copy of the message. It
+       keeps its ackID so that the receiver detects duplicates, but
+       is not acknowledged again. */
+    header = sent->header;
+    header.seqnum = htons(seqnum);
+    header.flags = htons(ntohs(header.flags) & ~PEISK_PACKAGE_REQUEST_ACK);
+    peisk_assignPackageId(&header);
+    header.ackID = (ntohs(sent->header.flags) & PEISK_PACKAGE_REQUEST_ACK) ? sent->ackIDs[seqnum] : header.id;
+    if(seqnum == sent->seqlen - 1) thislen = sent->datalen - (sent->seqlen - 1)*PEISK_MAX_PACKAGE_SIZE;
+    else thislen = PEISK_MAX_PACKAGE_SIZE;
+    header.datalen = htons(thislen);
+    peisk_connection_sendPayloadPackage(connection->id,&header,thislen,sent->payload->data+seqnum*PEISK_MAX_PACKAGE_SIZE,sent->payload,0);
+  }
+  peiskernel.nAckHooks = nHooks;
+  return 0;
 }
 
 PeisConnection *peisk_lookupConnection(int connid) {
@@ -1509,6 +2330,7 @@ void peisk_deleteHost(int id,int why) {
   }
 
   /* Remove host from main routing table */   
+  peisk_routingChanged(id);
   if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long)id,(void**)(void*)&routingInfo) == 0) {
     PEISK_ASSERT(routingInfo->id == id,("invalid id %d in routing table for %d\n",routingInfo->id,id));
     peisk_hashTable_remove(peiskernel.routingTable,(void*)(long)id);
@@ -1520,11 +2342,9 @@ void peisk_deleteHost(int id,int why) {
   /* Remove host from all connection routing tables */   
   for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
     if(peiskernel.connections[i].id != -1) {
-      if(peisk_hashTable_getValue(peiskernel.connections[i].routingTable,
-				  (void*)(long)id,(void**)(void*)&routingInfo) == 0) {
-	peisk_hashTable_remove(peiskernel.connections[i].routingTable,(void*)(intA)id);
-	free(routingInfo);
-      }
+      peisk_sortedArray_remove(&peiskernel.connections[i].routingTable,id);
+      /* Neighbours still knowing the host bring it back with their next routing update */
+      peiskernel.connections[i].routingRedecode=1;
     }
 
   /*
@@ -1559,20 +2379,30 @@ void peisk_registerDeadhostHook(PeisDeadhostHook *fn,void *arg) {
 }
 
 
+/** Adds an acknowledgement to the batch of its destination, sending
+    the batch when it is full. */
+static void peisk_bufferAcknowledgement(int destination,int ackID,int priority) {
+  PeisAckBatch *batch;
+
+  if(peisk_hashTable_getValue(peiskernel.ackBatchHT,(void*)(intA)destination,(void**)(void*)&batch)) {
+    if(peiskernel.nAckBatches == PEISK_MAX_ACK_DESTINATIONS) peisk_sendAcknowledgementsNow();
+    batch = &peiskernel.ackBatches[peiskernel.nAckBatches++];
+    batch->destination = destination;
+    batch->priority = 0;
+    batch->nAcks = 0;
+    peisk_hashTable_insert(peiskernel.ackBatchHT,(void*)(intA)destination,(void*)batch);
+  }
+  batch->ackIDs[batch->nAcks++] = ackID;
+  batch->priority += priority;
+  if(batch->nAcks == PEISK_MAX_ACK_PACKAGES) peisk_sendAckBatch(batch);
+}
+
 void peisk_sendAcknowledgement(int destination,int ackID) {
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].destination = destination;
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].ackID = ackID;
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].priority = 1;
-  if(++peiskernel.nAcknowledgementPackages >= PEISK_MAX_ACK_PACKAGES)
-    peisk_sendAcknowledgementsNow();
+  peisk_bufferAcknowledgement(destination,ackID,1);
 }
 
 void peisk_sendBulkAcknowledgement(int destination,int ackID) {
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].destination = destination;
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].ackID = ackID;
-  peiskernel.acknowledgementPackages[peiskernel.nAcknowledgementPackages].priority = 0;
-  if(++peiskernel.nAcknowledgementPackages >= PEISK_MAX_ACK_PACKAGES)
-    peisk_sendAcknowledgementsNow();
+  peisk_bufferAcknowledgement(destination,ackID,0);
 }
 
 void peisk_periodic_connectCluster(void *data) {
@@ -1649,6 +2479,23 @@ void peisk_periodic_connectCluster(void *data) {
   }
 }
 
+/** True if the given address should be skipped when connecting
+    with the given connection manager info */
+static int peisk_avoidLowaddr(PeisConnectionMgrInfo *connMgrInfo,PeisLowlevelAddress *laddr) {
+  if(laddr->type == ePeisShm) return connMgrInfo->avoidShm || !peisk_linkIsConnectable(laddr);
+  return laddr->type == ePeisUdpIPv4 && (peiskernel.udp_serverPort == 0 || connMgrInfo->avoidUdpUntil > peisk_timeNow);
+}
+
+/** Gives the shared memory address to use for connecting to the
+    given host, or NULL if it is not on this computer. */
+static PeisLowlevelAddress *peisk_shmLowaddr(PeisHostInfo *hostInfo,PeisConnectionMgrInfo *connMgrInfo) {
+  int j;
+  for(j=0;j<hostInfo->nLowlevelAddresses;j++)
+    if(hostInfo->lowAddr[j].type == ePeisShm && !peisk_avoidLowaddr(connMgrInfo,&hostInfo->lowAddr[j]))
+      return &hostInfo->lowAddr[j];
+  return NULL;
+}
+
 void peisk_periodic_connectionManager(void *data) {
   int i, j, id;
   int nConnections;
@@ -1690,6 +2537,11 @@ void peisk_periodic_connectionManager(void *data) {
 	  PeisConnection *closeCon = NULL;
 	  if(peiskernel.connections[i].isPending) closeCon = &peiskernel.connections[i];
 	  else if(peiskernel.connections[j].isPending) closeCon = &peiskernel.connections[j];
+	  /* Keep shared memory links, they replace other links to the same computer */
+	  else if(peiskernel.connections[i].type == eShmConnection && peiskernel.connections[j].type != eShmConnection)
+	    closeCon = &peiskernel.connections[j];
+	  else if(peiskernel.connections[j].type == eShmConnection && peiskernel.connections[i].type != eShmConnection)
+	    closeCon = &peiskernel.connections[i];
 	  else if(peiskernel.connections[i].totalIncomming < peiskernel.connections[j].totalIncomming) 
 	    closeCon = &peiskernel.connections[i];
 	  else closeCon = &peiskernel.connections[j];
@@ -1698,6 +2550,25 @@ void peisk_periodic_connectionManager(void *data) {
 	    fprintf(stdout,"peisk: connManager - closing redundant connection to %d\n",closeCon->neighbour.id);
 	  peisk_closeConnection(closeCon->id);
 	}
+
+  /* Move links to PEIS on this computer over to shared memory, the
+     old link is closed as redundant once the new one is up. One new
+     connection per period is enough. */
+  for(i=0;i<PEISK_MAX_CONNECTIONS;i++) {
+    connection = &peiskernel.connections[i];
+    if(connection->id == -1 || connection->isPending || connection->type == eShmConnection ||
+       connection->neighbour.id == -1) continue;
+    connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
+    if(!connMgrInfo || connMgrInfo->nextRetry > peisk_timeNow ||
+       !peisk_shmLowaddr(&connection->neighbour,connMgrInfo)) continue;
+    for(j=0;j<PEISK_MAX_CONNECTIONS;j++)
+      if(j != i && peiskernel.connections[j].id != -1 &&
+	 peiskernel.connections[j].neighbour.id == connection->neighbour.id) break;
+    if(j != PEISK_MAX_CONNECTIONS) continue;
+    if(peisk_connectToGivenLowaddr(&connection->neighbour,connMgrInfo,peisk_shmLowaddr(&connection->neighbour,connMgrInfo),
+				   PEISK_CONNECT_FLAG_FORCED_CL))
+      break;
+  }
   
   
   /* Set the value of each connection to zero, unless we are routing
@@ -1769,7 +2640,7 @@ void peisk_periodic_connectionManager(void *data) {
     if(connection && routingInfo->hops*100+100 > connection->value) {
       for(bestAlternativeMetric=1000,i=0;i<PEISK_MAX_CONNECTIONS;i++)
 	if(peiskernel.connections[i].id != -1 && &peiskernel.connections[i] != connection &&
-	   peisk_hashTable_getValue(peiskernel.connections[i].routingTable,(void*)(long)id,(void**)(void*) &routingInfo2) == 0 &&
+	   (routingInfo2 = peisk_sortedArray_find(&peiskernel.connections[i].routingTable,id)) &&
 	   routingInfo2->hops < bestAlternativeMetric) {
 	  bestAlternativeMetric = routingInfo2->hops;
 	  if(routingInfo->hops - bestAlternativeMetric <= connection->value) break;
@@ -1915,7 +2786,7 @@ int peisk_hostIsConnectable(PeisHostInfo *hostInfo) {
 
   if(peisk_hostIsMe(hostInfo)) return 1;
   for(i=0;i<hostInfo->nLowlevelAddresses;i++)
-    if(!hostInfo->lowAddr[i].isLoopback &&
+    if((!hostInfo->lowAddr[i].isLoopback || hostInfo->lowAddr[i].type == ePeisShm) &&
        peisk_linkIsConnectable(&hostInfo->lowAddr[i])) return 1;
 
   return 0;
@@ -1923,24 +2794,31 @@ int peisk_hostIsConnectable(PeisHostInfo *hostInfo) {
 }
 
 PeisConnection *peisk_connectToGivenHostInfo(PeisHostInfo *hostInfo,int flags) {
-  int r,j;
+  int r,j,k;
   PeisConnectionMgrInfo *connMgrInfo;
+  PeisLowlevelAddress *laddr;
 
   /*printf("Connect to hostinfo: %d (connectable: %d)\n",hostInfo->id,peisk_hostIsConnectable(hostInfo));*/
 
   connMgrInfo = peisk_lookupConnectionMgrInfo(hostInfo->id);
   if(!connMgrInfo) return NULL;
   if(hostInfo->nLowlevelAddresses == 0) return NULL;
+  /* Shared memory is the fastest link to PEIS on this computer */
+  laddr = peisk_shmLowaddr(hostInfo,connMgrInfo);
+  if(laddr) return peisk_connectToGivenLowaddr(hostInfo,connMgrInfo,laddr,flags);
   if(peisk_hostIsMe(hostInfo)) {
     /* Attempting to connect to a PEIS on the same host, make sure to
        use a loopback device if one is available */
     /** \todo Pick a suitable loopback device instead of the first
        one. This would be needed if we have many loopback devices and
        not all beeing accessible by all components on the same CPU. */
-    for(j=0;j<hostInfo->nLowlevelAddresses;j++)
-      if(hostInfo->lowAddr[j].isLoopback) break;
-    if(j != hostInfo->nLowlevelAddresses) {
-      return peisk_connectToGivenLowaddr(hostInfo,connMgrInfo,&hostInfo->lowAddr[j],flags);
+    for(j=0,k=-1;j<hostInfo->nLowlevelAddresses;j++)
+      if(hostInfo->lowAddr[j].isLoopback && !peisk_avoidLowaddr(connMgrInfo,&hostInfo->lowAddr[j])) {
+	/* Prefer UDP, it avoids head of line blocking */
+	if(k == -1 || hostInfo->lowAddr[j].type == ePeisUdpIPv4) k=j;
+      }
+    if(k != -1) {
+      return peisk_connectToGivenLowaddr(hostInfo,connMgrInfo,&hostInfo->lowAddr[k],flags);
     }
   }
   /* Otherwise, cannot use a loopback device for connecting */
@@ -1957,13 +2835,20 @@ PeisConnection *peisk_connectToGivenHostInfo(PeisHostInfo *hostInfo,int flags) {
   /* If we accidentally picked a loopback interface or an interface
      that is not connectable, then pick another device or return if
      there is no other such device. */
-  while(hostInfo->lowAddr[j].isLoopback || !peisk_linkIsConnectable(&hostInfo->lowAddr[j])) {
+  k=-1;
+  do {
+    if(!hostInfo->lowAddr[j].isLoopback && !peisk_avoidLowaddr(connMgrInfo,&hostInfo->lowAddr[j]) &&
+       peisk_linkIsConnectable(&hostInfo->lowAddr[j])) {
+      /* Connectable IP addresses are on our own LAN, where UDP gives
+	 lower latency than TCP */
+      if(k == -1 || (hostInfo->lowAddr[j].type == ePeisUdpIPv4 && hostInfo->lowAddr[k].type != ePeisUdpIPv4)) k=j;
+    }
     j = (j+1) % hostInfo->nLowlevelAddresses;
-    if(j == r)
-      /* Error, no address to connect to was found */
-      return NULL;
-  }
-  return peisk_connectToGivenLowaddr(hostInfo,connMgrInfo,&hostInfo->lowAddr[j],flags);
+  } while(j != r);
+  if(k == -1)
+    /* Error, no address to connect to was found */
+    return NULL;
+  return peisk_connectToGivenLowaddr(hostInfo,connMgrInfo,&hostInfo->lowAddr[k],flags);
 }
 
 PeisConnection *peisk_connectToGivenLowaddr(PeisHostInfo *hostinfo,
@@ -2000,6 +2885,9 @@ PeisConnection *peisk_connectToGivenLowaddr(PeisHostInfo *hostinfo,
 	    laddr->addr.bluetooth.baddr[5],
 	    (int) laddr->addr.bluetooth.port);
     break;
+  case ePeisShm:
+    sprintf(url,"shm://%d",laddr->addr.shm.port);
+    break;
   default:
     return NULL;
   }
@@ -2058,6 +2946,7 @@ PeisConnection *peisk_connectToGivenLowaddr(PeisHostInfo *hostinfo,
 void peisk_outgoingConnectFinished(PeisConnection *connection,int flags) {
   int previousRoutes;
   connection->isPending=0;
+  peisk_reactorWatchConnection(connection);
 
   if(flags & PEISK_CONNECT_FLAG_FORCE_BCAST) 
     connection->forceBroadcasts = 1;
@@ -2086,6 +2975,7 @@ void peisk_incommingConnectFinished(PeisConnection *connection,PeisConnectMessag
   int previousRoutes;
 
   connection->isPending=0;
+  peisk_reactorWatchConnection(connection);
   connection->neighbour.id = connectMessage->id;
   connMgrInfo=peisk_lookupConnectionMgrInfo(connectMessage->id);
   if(!connMgrInfo) {
@@ -2103,6 +2993,11 @@ void peisk_incommingConnectFinished(PeisConnection *connection,PeisConnectMessag
     connection->forceBroadcasts=1;
   else
     connection->forceBroadcasts=0;
+  /* The connecting side learns this from the first sequence numbered
+     package we send, since connect messages are only sent one way */
+  connection->sequencedIds = (connectMessage->flags & PEISK_CONNECT_FLAG_SEQUENCED) ? 1 : 0;
+  connection->routingDeltas = (connectMessage->flags & PEISK_CONNECT_FLAG_ROUTING_DELTA) ? 1 : 0;
+  connection->multicasts = (connectMessage->flags & PEISK_CONNECT_FLAG_MULTICAST) ? 1 : 0;
 
   /* Send our host information along connection */
   peisk_sendLinkHostInfo(connection);
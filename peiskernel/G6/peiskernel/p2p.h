@@ -100,8 +100,20 @@ void peisk_initP2PLayer();
 /** Receives notification of appended tuples */
 #define PEISK_PORT_PUSH_APPENDED_TUPLE 16
 
+/** Requests retransmission of the missing parts of a long message */
+#define PEISK_PORT_NACK             17
+
+/** Port number for incremental updates of routing information, see \ref peisk_hook_routingDelta */
+#define PEISK_PORT_ROUTING_DELTA    18
+
+/** Pushes a tuple as the difference to a version the subscriber already has */
+#define PEISK_PORT_PUSH_TUPLE_DELTA 19
+
+/** Requests a full push of a tuple after a difference could not be applied */
+#define PEISK_PORT_REQUEST_TUPLE    20
+
 /** If we receive packages with a higher port number we know they are wrong */
-#define PEISK_HIGHEST_PORT_NUMBER   20
+#define PEISK_HIGHEST_PORT_NUMBER   21
 
 /** The number of possible ports that can be used */
 #define PEISK_NPORTS                256
@@ -109,6 +121,14 @@ void peisk_initP2PLayer();
 /** Maximum number of connections that can be maintained by the peiskernel */
 #define PEISK_MAX_CONNECTIONS        64
 
+/** Maximum number of packages processed from each connection before
+    giving the other connections and outgoing queues a chance */
+#define PEISK_MAX_INCOMMING_BURST    64
+
+/** Maximum number of queued packages given to the link layer at once
+    by peisk_connection_processOutgoing */
+#define PEISK_MAX_SEND_BATCH         64
+
 /** Highest priority queue, used for control flow packages */
 #define PEISK_QUEUE_HIGHPRI           0                                   
 /** Special queue for pending messages */
@@ -121,11 +141,28 @@ void peisk_initP2PLayer();
 #define PEISK_NQUEUES                 4                                   
 
 /** \brief Size of local store of previously seen packages. 
-    Help eliminate loops in broadcasted or incorrectly routed packages. */
+    Help eliminate loops in broadcasted or incorrectly routed packages. 
+    Only used for packages that are not numbered by their source, see
+    PeisSequenceWindow. */
 #define PEISK_LOOPINFO_SIZE         4096
 
 #define PEISK_LOOPINFO_HASH_SIZE    256
 
+/** \brief Number of sequence numbers remembered for each source for
+    duplicate and loop detection. Must be a power of two. */
+#define PEISK_SEQ_WINDOW_SIZE       4096
+
+/** \brief A sequence number this far behind the newest one seen from
+    a source means that the source has been restarted. */
+#define PEISK_SEQ_RESTART_DISTANCE  (1<<20)
+
+/** \brief This many package ids in a row behind the window of a
+    source also means that the source has been restarted, in case its
+    new numbers start closer than PEISK_SEQ_RESTART_DISTANCE behind
+    the old ones. The reused ackID's of late retransmissions do not
+    count. */
+#define PEISK_SEQ_RESTART_RUN       32
+
 /** \brief Maxmimum number of periodic functions that can be registered */
 #define PEISK_MAX_PERIODICS         64
 
@@ -135,10 +172,74 @@ void peisk_initP2PLayer();
 /** \brief Timeout after the latest package received for a long message. After the timeout the message is discarded. */
 #define PEISK_TIMEOUT_LONG_MESSAGE  10.0
 
-/**  \brief How long to wait between tries when sending a message with guaranteed delivery. 
-    Accumulates as 1+2+3+4... times constant. */
+/** \brief Time without receiving any part of an incomplete long
+    message before the missing parts are requested from the sender. */
+#define PEISK_NACK_DELAY            0.3
+
+/** \brief Maximum number of times the missing parts of a long message are requested */
+#define PEISK_MAX_NACKS             5
+
+/** \brief Number of long messages sent by us that are remembered for
+    answering retransmission requests. */
+#define PEISK_MAX_SENT_LONG_MESSAGES 64
+
+/** \brief How many recently assembled long messages are remembered,
+    so that late retransmitted parts of them are not assembled again */
+#define PEISK_MAX_ASSEMBLED_LONG_MESSAGES 256
+
+/** \brief How long a sent long message is remembered for answering
+    retransmission requests, counted from when its last part left our
+    queues */
+#define PEISK_TIMEOUT_SENT_LONG_MESSAGE (PEISK_NACK_DELAY * (PEISK_MAX_NACKS + 1))
+
+/**  \brief Initial retransmission timeout for a message with
+    guaranteed delivery, used until the round trip time to its
+    destination has been measured. Doubles for each retry. */
 #define PEISK_PENDING_RETRY_TIME    0.4 /* MB - was 0.5 */
 
+/** \brief Lower bound on the retransmission timeout computed from measured round trip times */
+#define PEISK_RTO_MIN               0.1
+
+/** \brief Upper bound on the retransmission timeout, including backoff */
+#define PEISK_RTO_MAX               5.0
+
+/** \brief Gain used when updating the smoothed round trip time (1/8) */
+#define PEISK_RTT_ALPHA             0.125
+
+/** \brief Gain used when updating the round trip time variation (1/4) */
+#define PEISK_RTT_BETA              0.25
+
+/** \brief Sending rate of new connections, in bytes per second,
+    before the congestion control has adapted it. */
+#define PEISK_CC_INITIAL_RATE       65536.0
+
+/** \brief Upper bound on the sending rate of a connection, in bytes per second */
+#define PEISK_CC_MAX_RATE           1e9
+
+/** \brief How much sending time the pacer lets a connection save up
+    and send as one burst. */
+#define PEISK_CC_BURST_TIME         0.01
+
+/** \brief Smallest burst in bytes allowed by the pacer, should hold a
+    few full packages. */
+#define PEISK_CC_MIN_BURST          8192.0
+
+/** \brief Fraction of lost packages reported by the neighbour that is
+    treated as congestion */
+#define PEISK_CC_LOSS_THRESHOLD     0.02
+
+/** \brief How strongly the sending rate is decreased per lost
+    fraction of packages. */
+#define PEISK_CC_LOSS_GAIN          0.5
+
+/** \brief Smallest factor by which the sending rate is decreased on
+    congestion */
+#define PEISK_CC_DECREASE           0.5
+
+/** \brief Smallest round trip time used by the congestion control,
+    keeps the rate increase bounded on very fast links */
+#define PEISK_CC_MIN_RTT            0.01
+
 /**  \brief How many tries to send a package we can maximum do before giving up */
 #define PEISK_PENDING_MAX_RETRIES   6
 
@@ -151,8 +252,16 @@ void peisk_initP2PLayer();
 /**  \brief Special flag for sending packages that are routed, will not add any ack requests */
 #define PEISK_SEND_ROUTED          1
 
-/**  \brief Upper limit of how many pages of routing data that can be sent. This
-    limits the total number of hosts to be max 32*70 = 2240 hosts */
+/**  \brief Special flag for packages that have already been
+     transmitted by other means (eg. as part of a multicast package)
+     and only are placed in the pending queue, to be resent if no
+     acknowledgement arrives in time. */
+#define PEISK_SEND_PENDING         2
+
+/**  \brief Upper limit of how many pages of routing data that can be
+    sent to and received from older kernels. This limits the total
+    number of hosts to be max 32*70 = 2240 hosts for them, incremental
+    routing updates have no such limit. */
 #define PEISK_MAX_ROUTING_PAGES      32
 /**  \brief Number of entries (hosts) per routing page */
 #define PEISK_ROUTING_PER_PAGE       70
@@ -160,6 +269,10 @@ void peisk_initP2PLayer();
 #define PEISK_ROUTING_BYTES_PER_ENTRY  14
 /**  \brief How large a routing package can maximum be */
 #define PEISK_ROUTING_PAGE_SIZE     (PEISK_ROUTING_PER_PAGE*PEISK_ROUTING_BYTES_PER_ENTRY+sizeof(PeisRoutingPackage))
+/**  \brief How large an incremental routing package can maximum be */
+#define PEISK_ROUTING_DELTA_SIZE    1000
+/**  \brief Upper limit of the size of one entry in incremental routing packages */
+#define PEISK_ROUTING_DELTA_MAX_ENTRY  16
 
 /**  \brief  After what "metric cost" to giveup finding a route to a host. 
     Enforces an upper limit to metric costs allowed on the network 
@@ -169,6 +282,21 @@ void peisk_initP2PLayer();
 #define PEISK_ROUTING_SIZE         1024
 #define PEISK_ROUTING_HASH_SIZE     256
 
+/**  \brief Number of other connections remembered for each destination
+    that have an equally short route as the main one, see \ref Multipath */
+#define PEISK_ROUTING_ALTERNATIVES    2
+/**  \brief Marks an unused alternative next hop of a PeisRoutingInfo */
+#define PEISK_NO_ALTERNATIVE        255
+/**  \brief Seconds of queued data a connection may have more than the
+    least loaded next hop before flows are moved away from it, see
+    \ref Multipath */
+#define PEISK_MULTIPATH_SLACK       0.05
+/**  \brief Seconds a flow stays on a next hop before it may be moved
+    again, see \ref Multipath */
+#define PEISK_MULTIPATH_HOLD        1.0
+/**  \brief Number of flows whose next hop is remembered. Must be a power of two. */
+#define PEISK_MULTIPATH_FLOWS       256
+
 /**  \brief Flag for PeisHostInfo structure showing that it is contested, we have seen him with different magic IDs before */
 #define PEISK_HOSTINFO_CONTESTED  1
 
@@ -241,11 +369,56 @@ typedef struct PeisRoutingInfo {
   /** Time before we will resend a hostInfo query if this host is not
       known */
   unsigned char timeToQuery;
-  unsigned char padding[2];
+  /** Index of other connections with an equally short route to this
+      destination, or PEISK_NO_ALTERNATIVE. Only used in the main routing
+      table, see \ref Multipath */
+  unsigned char alternatives[PEISK_ROUTING_ALTERNATIVES];
   /** Outgoing connection to use */
   struct PeisConnection *connection;
 } PeisRoutingInfo;
 
+/** One entry of routing information as sent between neighbours. Used
+    to remember what was last sent about each destination, so that
+    incremental routing updates contain only the entries that changed,
+    and to hold the entries received in such updates. Kept in
+    PeisSortedArray's by id. */
+typedef struct PeisRoutingEntry {
+  /** ID number of PEIS */
+  int id;
+  /** Sequence number of the route */
+  int sequenceNumber;
+  /** Magic number of PEIS */
+  int magic;
+  /** Number of hops to destination, see PeisRoutingInfo */
+  unsigned char hops;
+  /** Number of connections the PEIS has, 255 if unknown */
+  unsigned char nConnections;
+  /** Non zero if the destination has been removed from our routing table */
+  char isRemoved;
+  unsigned char padding;
+  /** Version of our routing table in which this entry last changed */
+  int version;
+} PeisRoutingEntry;
+
+/** A change of an entry in PeisKernel::routingSent. Kept in
+    PeisKernel::routingChanges so that an incremental routing update
+    only needs to look at the entries that changed since its base
+    version. */
+typedef struct PeisRoutingChange {
+  int version;                    /**< Version of our routing table in which the entry changed */
+  int id;                         /**< Destination of the entry */
+} PeisRoutingChange;
+
+/** The next hop last used by a flow of routed packages, stored in
+    PeisKernel::flows at a hash of the flow. See \ref Multipath */
+typedef struct PeisFlowInfo {
+  int source;                     /**< Source of the flow */
+  int destination;                /**< Destination of the flow */
+  int port;                       /**< Port of the flow */
+  int connectionId;               /**< Id of the connection last used, or -1 */
+  double moved;                   /**< When the flow last got a new next hop */
+} PeisFlowInfo;
+
 /** Structure used for remembering previously seen packages, this allows for a simple form of loop detection. */
 typedef struct PeisLoopInfo {
   /** Id of package */
@@ -256,6 +429,22 @@ typedef struct PeisLoopInfo {
   int *hashPrev;                    
 } PeisLoopInfo;
 
+/** Remembers which of the most recent sequence numbers have been seen
+    from one source. Packages sent with the PEISK_PACKAGE_SEQ_ID flag
+    (and ackID's with PEISK_PACKAGE_SEQ_ACK) are numbered from a single
+    increasing counter of their source, so a bitmap sliding along with
+    the newest number is enough for detecting repeated packages
+    regardless of how much traffic other hosts produce. */
+typedef struct PeisSequenceWindow {
+  /** Newest sequence number seen from this source */
+  unsigned int highest;
+  /** One bit for each sequence number in the window, indexed modulo
+      PEISK_SEQ_WINDOW_SIZE */
+  unsigned int bits[PEISK_SEQ_WINDOW_SIZE/32];
+  /** Number of package ids in a row that were behind the window */
+  int nTooOld;
+} PeisSequenceWindow;
+
 /** Stores information about all registered periodic functions */
 typedef struct PeisPeriodicInfo {
   double periodicity;                     /**< Delay in seconds between invokations or -1.0 if unused */
@@ -266,7 +455,7 @@ typedef struct PeisPeriodicInfo {
 } PeisPeriodicInfo;
 
 /** The different types of routing of packages available in the P2P network */
-typedef enum { ePeisLinkPackage=0, ePeisBroadcastPackage, ePeisDirectPackage } PeisPackageType;
+typedef enum { ePeisLinkPackage=0, ePeisBroadcastPackage, ePeisDirectPackage, ePeisMulticastPackage } PeisPackageType;
 
 /** The different types of ackHookFailure types (see peiskernel_private.h) */
 enum { eAckHookFailureNone=0, eAckHookFailureRED, eAckHookFailureDeadConnection, eAckHookFailureTooManyPackages, eAckHookFailureTooManyRetries };
@@ -282,7 +471,8 @@ typedef struct PeisPackageHeader {
   /** A special sync character transmitted first in all packages. Special byte-order. */
   int32 sync;
 
-  /** Pseudo-unique id-number of package. Network byte-order. */
+  /** Pseudo-unique id-number of package, or a sequence number of
+      the source if flag PEISK_PACKAGE_SEQ_ID is set. Network byte-order. */
   int32 id;
 
   /** Counter used to monitor link quality, increments for each
@@ -315,6 +505,51 @@ typedef struct PeisPackage {
   char data[PEISK_MAX_PACKAGE_SIZE];
 } PeisPackage;
 
+/** \brief Start of the data of multicast packages.
+
+    A multicast package carries the same message to a list of
+    destinations that are all reached through the same connection. The
+    data starts with this header, followed by nTargets
+    PeisMulticastTarget's and finally the message itself. Each node
+    delivers the message locally if it is one of the targets and
+    forwards it to the other targets grouped by their next hop.
+    Multicast packages are only sent to neighbours that announced
+    PEISK_CONNECT_FLAG_MULTICAST, or have sent us multicast packages. */
+typedef struct PeisMulticastHeader {
+  /** Number of targets following this header. NETWORK BYTE ORDER */
+  int32 nTargets;
+  /** The PEISK_PACKAGE_* flags to use for delivery to each
+      target. NETWORK BYTE ORDER */
+  short flags;
+  unsigned char padding[2];
+} PeisMulticastHeader;
+
+/** One of the destinations of a multicast package */
+typedef struct PeisMulticastTarget {
+  /** Destination host. NETWORK BYTE ORDER */
+  int32 destination;
+  /** The ackID this destination acknowledges the message with. NETWORK BYTE ORDER */
+  int32 ackID;
+} PeisMulticastTarget;
+
+/** \brief Immutable and reference counted data of a message.
+
+    Lets the same serialized message be queued as any number of
+    packages (fragments and/or destinations) without copying it. The
+    data must not be modified once the payload have been queued. The
+    header in front of the data is only scratch space, it lets the
+    whole payload be given to acknowledgement hooks as a PeisPackage. */
+typedef struct PeisPayload {
+  /** Number of users, the payload is freed when this reaches zero */
+  int refs;
+  /** Length of data in bytes */
+  int len;
+  /** Scratch header, see above */
+  PeisPackageHeader header;
+  /** The message data, allocated to len bytes */
+  char data[1];
+} PeisPayload;
+
 /** Private callback hook triggered when "reliable" packages have
     either been acknowledged, or failed permanently. Whole package
     (headers+data) is given to allow more parameters to be
@@ -326,10 +561,13 @@ typedef void PeisAcknowledgementHook(int success,int dataLen,PeisPackage *packag
     packages at the same time. */
 #define PEISK_MAX_ACKHOOKS       3
 
-/** Maximum number of acknowledgement packages to queue in each
-    connection */
+/** Maximum number of acknowledgements to buffer for each
+    destination before sending them */
 #define PEISK_MAX_ACK_PACKAGES 100
 
+/** Maximum number of destinations with buffered acknowledgements */
+#define PEISK_MAX_ACK_DESTINATIONS 32
+
 /** Macro for running code with one more hooks pushed onto the hook
     stack. Sending one or more packages with given acknowledgement hook applied to all packages. 
 
@@ -347,16 +585,26 @@ typedef void PeisAcknowledgementHook(int success,int dataLen,PeisPackage *packag
 }
 
 /** Used for remembering acknowledgements to be sent back to the
-    sender of incomming messages. */
-typedef struct PeisPendingAck {
-  int destination, ackID, priority;
-} PeisPendingAck;
+    sender of incomming messages, all acknowledgements to the same
+    destination are sent together in one package. */
+typedef struct PeisAckBatch {
+  int destination;
+  /** Number of acknowledgements that were marked as priority */
+  int priority;
+  int nAcks;
+  /** The acknowledged ackID's, network byte order */
+  int ackIDs[PEISK_MAX_ACK_PACKAGES];
+} PeisAckBatch;
 
 /** Datastructure for remembering all pending acknowledgements for a large package */
 typedef struct PeisLargePackageHookData {
   int counter, success, datalen, nHooks;
   PeisAcknowledgementHook *hooks[PEISK_MAX_ACKHOOKS];
-  void *data, *users[PEISK_MAX_ACKHOOKS];
+  void *users[PEISK_MAX_ACKHOOKS];
+  /** Header emulating the whole message as one package */
+  PeisPackageHeader header;
+  /** The whole message, shared with all the queued packages */
+  PeisPayload *payload;
 } PeisLargePackageHookData;
 
 /** \ingroup P2PLayer @{ */
@@ -367,6 +615,7 @@ typedef struct PeisLargePackageHookData {
     used for this. */
 typedef struct PeisQueuedPackage {
   double t0;                       /**< Timepoint package was added to outgoing queue or when an ACK request was last sent */
+  double sent;                     /**< Timepoint package was first sent, used for round trip time estimation */
   unsigned char retries;           /**< How many times package has been sent (only used if it's a request-ack package) */
   unsigned char padding[3];
   PeisPackage package;             /**< The actual data for each package */
@@ -381,8 +630,25 @@ typedef struct PeisQueuedPackage {
   void *hookData[PEISK_MAX_ACKHOOKS];
   /** Number of hooks in the stack of hooks to be called */
   int nHooks;
+  /** If non NULL, the data of this package is not copied into
+      package.data but is read from this shared payload starting at
+      payloadData. */
+  PeisPayload *payload;
+  char *payloadData;
+
+  /** Points to the pointer referencing this package in its queue,
+      lets it be unlinked without searching the queue. */
+  struct PeisQueuedPackage **prev;
+  /** The connection whose queue this package is in */
+  struct PeisConnection *connection;
+  /** Next package in the pending queues with the same ackID, see
+      PeisKernel::pendingAcks */
+  struct PeisQueuedPackage *ackNext;
 } PeisQueuedPackage;
 
+/** Gives the data part of a queued package */
+#define peisk_queuedPackage_data(qpackage) ((qpackage)->payload ? (qpackage)->payloadData : (qpackage)->package.data)
+
 
 
 /** Information about _active_ connections to other nodes */
@@ -420,49 +686,119 @@ typedef struct PeisConnection {
   int incomingIdLo;
   /** Total number of incoming packages since last congestion check */
   int incomingIdSuccess;
-  /** Maximum outgoing speed counted in bytes per second. Note: each
-      package is counted as having an additional protocoll overhead of
-      X bytes. */
+  /** Sending rate in bytes per second allowed by the congestion
+      control, see \ref CongestionControl */
   double maxOutgoing;
-  /** How many bytes have been sent out this time interval. Modified
-      periodically according to speedlimit. */
+  /** Rate above which maxOutgoing is only increased linearly (slow
+      start threshold) */
+  double ssthresh;
+  /** Time of the last decrease of maxOutgoing */
+  double lastDecrease;
+  /** Bytes sent that the pacer has not yet let drain away at
+      maxOutgoing bytes per second. */
   double outgoing;
+  /** When outgoing was last drained */
+  double pacingUpdated;
   /** Is this connection currently speed limited. */
   char isThrottled;
+  /** Non zero if the pacer has deferred packages since the last
+      connection control period */
+  char rateLimited;
 
   /** Force broadcasts to always be sent on this connection */
   char forceBroadcasts;
 
+  /** Non zero if the neighbour detects repeated packages by source
+      sequence numbers. Otherwise sequence numbered ids are replaced
+      before sending, see peisk_connection_legacyId */
+  char sequencedIds;
+
+  /** Non zero if the neighbour understands multicast packages.
+      Otherwise each target of a multicast gets a direct package. */
+  char multicasts;
+
   /** Current metric cost for using this link */
   char metricCost;
 
-  unsigned char padding2[5];
+  unsigned char padding2[2];
 
-  /** Routing table last received from neighbour */
-  PeisHashTable *routingTable;
-  unsigned char padding3[4];
+  /** Routing table last received from neighbour, PeisRoutingInfo's sorted by id */
+  PeisSortedArray routingTable;
 
 
   /** Stores incommming routingTable packages until they have been
       assembled correctly. */
   unsigned char *routingPages[PEISK_MAX_ROUTING_PAGES];
 
+  /** Non zero if the neighbour understands incremental routing
+      updates. We then send it only the entries that changed since the
+      version of our routing table it last acknowledged. */
+  char routingDeltas;
+  /** Non zero if the next incremental update must be decoded together
+      with all routing entries of the neighbour, eg. since the metric
+      cost of the connection has changed */
+  char routingRedecode;
+  /** Metric cost of the connection when its routing table was last decoded */
+  char routingMetricCost;
+  unsigned char padding4;
+  /** Latest version of our routing table the neighbour has
+      acknowledged, or zero if it needs the full table */
+  int routingAcked;
+  /** Version of the neighbour's routing table held in
+      routingEntries, zero while we have no complete table */
+  int routingReceived;
+  /** Version, serial number and number of parts of the incremental
+      update currently being assembled */
+  int routingAssembling;
+  int routingSerial;
+  int routingNParts;
+  /** Number of parts of the update still missing, and a bitmap of the
+      parts received so far with room for routingPartsAllocated parts */
+  int routingPartsMissing;
+  int routingPartsAllocated;
+  unsigned char *routingParts;
+  /** PeisRoutingEntry's last received from a neighbour sending
+      incremental updates, sorted by id */
+  PeisSortedArray routingEntries;
+
   PeisHostInfo neighbour;                /**< Info about neighbour */
   PeisConnectionType type;               /**< What type of connection this is */
   /** Contains linklayer connection type specific data inside a PeisConnection structure */
   union PeisConnectionInternal {
     /** Internal information for connections of type TCP */
     struct {
-      /** Unix TCP/IP socket to remote node */
+      /** Unix TCP/IP socket to remote node, -1 while resolving */
       int socket;                        
+      /** Marks how far a pending connection has come */
+      PeisTCPStatus status;
+      /** Connect flags of pending outgoing connections */
+      int flags;
+      /** Non-zero while a pending incomming connection waits for the connect message */
+      int accepting;
+      /** Port to connect to once the hostname is resolved */
+      int port;
+      /** Entry of the hostname in the resolver cache while resolving */
+      int name;
+      /** Timepoint when a pending connection is given up */
+      double timeout;
     } tcp;                               
     /** For connections of type UDP */
     struct {
       /** Marks connection status, pending if not yet fully connected. */
       PeisUDPStatus status;              
       int socket;
+      /** Address of the peer. For outgoing connections this is the
+	  server port until the peer answers from its own socket. */
       struct sockaddr addr;
       socklen_t len;
+      /** Connect flags of pending outgoing connections */
+      int flags;
+      /** Non-zero while a pending incomming connection waits for the connect message */
+      int accepting;
+      /** Timepoint when a pending connection is given up */
+      double timeout;
+      /** Timepoint when the connect message is next repeated */
+      double nextAttempt;
     } udp;                               
     /** Internal information for connections of type Serial */
     struct {
@@ -475,10 +811,52 @@ typedef struct PeisConnection {
       /** Index to which adaptor is tied to this socket */
       struct PeisBluetoothAdaptor *adaptor;
     } bluetooth;
+    /** For connections of type shared memory */
+    struct {
+      /** The mapped segment shared with the peer */
+      struct PeisShmSegment *segment;
+      /** Ring we read packages from */
+      struct PeisShmRing *rx;
+      /** Ring we write packages to */
+      struct PeisShmRing *tx;
+      /** Signaled by the peer when it has written to rx or read from tx */
+      int eventFd;
+      /** Signaled by us when we have written to tx or read from rx */
+      int peerEventFd;
+      /** Unix socket used while connecting. It is kept open
+	  afterwards, its end means that the peer is gone. */
+      int socket;
+      /** Connect flags of pending outgoing connections */
+      int flags;
+      /** Non-zero while a pending incomming connection waits for the connect message */
+      int accepting;
+      /** Timepoint when a pending connection is given up */
+      double timeout;
+    } shm;
   } connection;                          
 
   /** If true, connection is not yet ready for reading/sending data */
   int isPending;
+  /** True while the reactor wakes us up when the connection becomes writable */
+  int watchesOutput;
+
+  /** Data received on stream based connections that is not yet
+      processed. Allocated on first use and kept when the connection
+      structure is reused. */
+  char *inBuffer;
+  /** Offset of the first unprocessed byte in inBuffer */
+  int inStart;
+  /** Offset after the last received byte in inBuffer */
+  int inEnd;
+
+  /** Package that have only partially been written to a stream based
+      connection. It is removed from the queues and must be finished
+      before anything else is sent. */
+  struct PeisQueuedPackage *sendPartial;
+  /** The queue sendPartial was taken from */
+  int sendPartialQueue;
+  /** Number of bytes of sendPartial already written */
+  int sendOffset;
 
   /** Queues for outgoing packages, sorted after priority */
   PeisQueuedPackage *outgoingQueueFirst[PEISK_NQUEUES];
@@ -500,23 +878,73 @@ typedef struct PeisHookList {
 /** Assembled packages belong to a long message and calls intercept routines when the full message has been received. */
 int peisk_assembleLongMessage(PeisPackageHeader *package,int datalen,void *data);
 void peisk_periodic_clearAssemblyBuffers(void *data);  /**< Peridoric function to delete old (failed) long messages */
-
-/** Compute the current fillrate for a given connection and priority setting. */
-double peisk_connection_fillrate(PeisConnection *connection,int priority);
-
-/** Stores incomming packages when receiving longer messages (over 1kb). */
+/** Periodic function requesting the missing parts of long messages
+    that have stopped arriving, and forgetting old sent long messages */
+void peisk_periodic_nackLongMessages(void *data);
+/** Resends the parts of one of our long messages requested by its receiver */
+int peisk_hook_nack(int port,int destination,int sender,int datalen,void *data);
+
+/** Drains the pacer of a connection and gives the number of bytes
+    it may send right now, zero or less if it has to wait. */
+double peisk_connection_pace(PeisConnection *connection);
+/** Time when the pacer of a throttled connection lets it send again */
+double peisk_connection_pacingDeadline(PeisConnection *connection);
+
+/** Stores incomming packages when receiving longer messages (over
+    1kb). Buffers in use are found in PeisKernel::assemblyHT by
+    peisk_assemblyKey of their source and seqid. Buffers whose keys
+    collide are linked through nextSameKey, the unused ones through
+    nextFree. */
 typedef struct PeisAssemblyBuffer {
   short seqid;                    /**< Null or the pseudo-unique id-number of the messages. Host byte order */
   short seqlen;                   /**< Number of packages that are part of this message. */
   short allocated_seqlen;         /**< Size of memory allocated for buffers below. */
-  unsigned char padding[2];
+  short missing;                  /**< Number of packages of this message not yet received */
   char *received;                 /**< Pointer to boolean buffer for storing which packages have been received */
   void *data;                     /**< Pointer to buffer for the received and assembled data */
   double timeout;                 /**< Timeout for when this message can be discarded */
+  double lastReceived;            /**< When a part was last received, or the missing parts last requested */
   int totalsize;                  /**< The total size for this message in bytes */
-  unsigned char padding2[4];
+  int source;                     /**< Host sending this message */
+  int nNacks;                     /**< Number of times the missing parts have been requested */
+  int nextFree;                   /**< Index of next unused buffer, or -1 */
+  int nextSameKey;                /**< Index of next buffer in use with the same key, or -1 */
 } PeisAssemblyBuffer;
 
+/** Source and seqid of a recently assembled long message. Stored in
+    PeisKernel::assembledLongMessages, and found through
+    PeisKernel::assembledHT by peisk_assemblyKey. */
+typedef struct PeisAssembledMessage {
+  int source;                     /**< Host that sent the message, or -1 */
+  short seqid;                    /**< The seqid of the message. Host byte order */
+  unsigned char padding[2];
+} PeisAssembledMessage;
+
+/** A long message sent by us, kept for a while to answer requests
+    for its missing parts. Stored in PeisKernel::sentLongMessages at
+    index seqid modulo PEISK_MAX_SENT_LONG_MESSAGES. */
+typedef struct PeisSentLongMessage {
+  short seqid;                    /**< Null or the seqid of the message. Host byte order */
+  short seqlen;                   /**< Number of packages of the message */
+  int destination;                /**< Destination of the message */
+  int datalen;                    /**< Total length of the message */
+  int allocatedAckIDs;            /**< Size of the ackIDs and partSent buffers */
+  int *ackIDs;                    /**< ackID of each package if sent reliably. Network byte order */
+  unsigned char *partSent;        /**< Non zero for each package that has left our queues */
+  int nPartsSent;                 /**< Number of packages that have left our queues */
+  PeisPackageHeader header;       /**< Header used for all packages of the message */
+  PeisPayload *payload;           /**< Data of the message */
+  double timeout;                 /**< When the message can be forgotten, once all packages are sent */
+} PeisSentLongMessage;
+
+/** \brief Data of a request for retransmission of a long message,
+    followed by nMissing seqnums (shorts in network byte order) of the
+    missing packages. */
+typedef struct PeisNackHeader {
+  short seqid;                    /**< The seqid of the message. NETWORK BYTE ORDER */
+  short nMissing;                 /**< Number of seqnums following. NETWORK BYTE ORDER */
+} PeisNackHeader;
+
 /** Information for storing connection attempts for different PEIS ID. Stored in the peiskernel.connectionMgrHT. */
 typedef struct PeisConnectionMgrInfo {
   /** Total number of tries since last successfull connection */
@@ -532,6 +960,21 @@ typedef struct PeisConnectionMgrInfo {
   int usefullTraffic;
   /** How many connections do we belive this host to have? */
   unsigned char nConnections;
+  /** Number of round trip time samples measured for acknowledged packages to this host */
+  int nRttSamples;
+  /** Smoothed round trip time to this host, in seconds */
+  double srtt;
+  /** Smoothed mean deviation of the round trip time, in seconds */
+  double rttvar;
+  /** Current retransmission timeout (before backoff) for packages to this host */
+  double rto;
+  /** Set when an UDP connection to this host got no answer, eg. because of
+      a firewall. Only other link types are used for this host until this
+      time (see PEISK_UDP_AVOID_RETRY). */
+  double avoidUdpUntil;
+  /** Set when a shared memory connection to this host failed, eg.
+      because it runs in another network namespace. */
+  char avoidShm;
 } PeisConnectionMgrInfo;
 
 /** A periodic function responsible for monitoring knownHosts for separate
@@ -547,6 +990,10 @@ int peisk_hostIsConnectable(PeisHostInfo *hostInfo);
 
 /** Initializes a connection structure to sane and default values */
 void peisk_initConnection(PeisConnection *connection);
+/** Replaces a sequence numbered id in the header of a package to be
+    sent on connection by an ordinary pseudo-unique id, unless the
+    neighbour understands sequence numbered ids. */
+void peisk_connection_legacyId(PeisConnection *connection,PeisPackageHeader *header);
 /** Intializes and returns the next usable connection structure. Returns NULL on error. */
 PeisConnection *peisk_newConnection();
 /** Free's this connection structure. */
@@ -559,6 +1006,14 @@ PeisConnection *peisk_connectToGivenLowaddr(PeisHostInfo *,struct PeisConnection
 /** Provides sane initial values for a PeisConnectionMgrInfo structure */
 void peisk_initConnectionMgrInfo(PeisConnectionMgrInfo *connMgrInfo);
 
+/** Adds a round trip time sample for a package acknowledged by
+    destination and recomputes its retransmission timeout */
+void peisk_updateRtt(int destination,double rtt);
+/** Gives the time to wait for an acknowledgement from destination
+    before retransmitting a package that has been sent retries times
+    before. */
+double peisk_retransmissionTimeout(int destination,int retries);
+
 
 /** Finializes an outgoing connection. Called by linklayer connection establishement functions when the connections are released from pendin state. */
 void peisk_outgoingConnectFinished(PeisConnection *connection,int flags);
@@ -639,6 +1094,34 @@ void peisk_abortConnect(PeisConnection *connection);
     to hosts that have been deleted and restarted.  
 */
 
+/** \ingroup Routing */
+/** \defgroup Multipath Multipath routing
+    Besides the connection of the main route, each destination in the
+    main routing table remembers up to PEISK_ROUTING_ALTERNATIVES other
+    connections whose routing tables give the same metric and an
+    equally fresh sequence number. They are found whenever routing
+    information for the destination is decoded. Since the neighbours
+    along such routes are strictly closer to the destination than we
+    are, using them cannot create routing loops.
+
+    Routed packages and our own messages are spread over these next
+    hops by flow, ie. by source, destination and port, so that the
+    packages of a flow (and all parts of a long message) normally keep
+    their order. A new flow is given a next hop by a hash of the flow.
+    The next hops of the last PEISK_MULTIPATH_FLOWS flows are
+    remembered in PeisKernel::flows, and a flow stays on its next hop
+    as long as it remains usable. It is only moved to another one when
+    its own has PEISK_MULTIPATH_SLACK seconds more data queued,
+    estimated from the queued packages and the sending rate allowed by
+    the congestion control, than the least loaded one, and at most once
+    every PEISK_MULTIPATH_HOLD seconds. Next hops whose connection is
+    closed or whose route got worse are skipped, so traffic fails over
+    to the remaining ones at once.
+
+    Multicast groups, link packages and retransmissions of long
+    messages always use the main route.
+*/
+
 /** \ingroup P2PLayer */
 /** \defgroup Connections
     All connections between PEIS hosts are currently one-to-one links that uses the linklayer of the PEIS-kernel to send messages. 
@@ -701,11 +1184,13 @@ void peisk_abortConnect(PeisConnection *connection);
     acknowledged within a given timeframe or they are
     retransmitted. In order to not flood this stack, packages will
     only be retranmissted maximum of PEISK_PENDING_MAX_RETRIES
-    times. The retransmission are with an increasing period of
-    PEISK_PENDING_RETRY_TIME seconds for the first retry, twice that
-    for the second retry, three times that for the third etc. The
-    total time packages are kept on the stack are thus
-    PEISK_PENDING_RETRY_TIME*(1+2+3+...+PEISK_PENDING_MAX_RETRIES) 
+    times. The retransmission timeout (RTO) is estimated per
+    destination from the round trip times of acknowledged packages
+    (Jacobson/Karels, see peisk_updateRtt) and doubled for each retry,
+    bounded by PEISK_RTO_MAX. Before any round trip time has been
+    measured PEISK_PENDING_RETRY_TIME is used as RTO. Packages that
+    have been retransmitted give no round trip time samples since
+    their acknowledgements are ambiguous (Karn's algorithm).
 
     After receiving an acknowledgement or giving up on a package, a
     peiskernel/expert user defined function may be called with a
@@ -738,9 +1223,37 @@ void peisk_abortConnect(PeisConnection *connection);
 
   Long messages cannot be intercepted.
 
+  Parts of a long message that are lost are requested by the receiver
+  with a NACK (PEISK_PORT_NACK) once no more parts have arrived for
+  PEISK_NACK_DELAY seconds. The sender then retransmits only those
+  parts, directly from the pending queue for reliable messages or
+  otherwise from its copy of the message.
+
   See also \ref LargeAcknowledgement "acknowledgement of long messages". 
 */
 
+/** \ingroup P2PLayer */
+/** \defgroup CongestionControl Congestion control
+
+    Packages are sent on each connection at the rate
+    PeisConnection::maxOutgoing, enforced by a token bucket pacer (see
+    peisk_connection_pace) that lets at most PEISK_CC_BURST_TIME
+    seconds worth of data out at once. Packages the pacer does not
+    let out wait in their queues, packages are only discarded when
+    the queues are full.
+
+    The rate is adapted with AIMD. Every
+    PEISK_CONNECTION_CONTROL_PERIOD_2 seconds the neighbour reports
+    how many of the packages sent to it arrived, based on the link
+    counters of the packages (PEISK_PORT_UDP_SPEED). A loss above
+    PEISK_CC_LOSS_THRESHOLD decreases the rate in proportion to the
+    loss, at most once per round trip. Connections that used all of
+    their rate increase it, doubling it each round trip (slow start)
+    until the first loss and afterwards by one package per round
+    trip. The round trip time is taken from the acknowledgements of
+    the neighbour, see \ref Acknowledgements.
+*/
+
 /** \ingroup P2PLayer */
 /** \defgroup ConnectionManagement Connection mangement
     Goals: To keep the diameter of the P2P network small (increases
@@ -788,13 +1301,8 @@ void peisk_abortConnect(PeisConnection *connection);
     If we have more than a suitable number connections (eg. 7) then
     close the connection with the lowest value (if it not infinite). 
 
-    Idea for load balancing: Keep track of the two or three
-    connections which have the lowest metric to any given hosts. Send
-    some of the packages through the other metric connections
-    (depending on relative metric costs), this might reduce the load
-    of the routing hosts and may establish new direct links... 
-    Hmm, could be dangerous if bandwidth along each connection becomes too
-    low, so the connections get a low value...
+    Traffic to hosts that can be reached equally fast through several
+    connections is spread over them, see \ref Multipath. 
  */
 
 /** @} P2PLayer */
@@ -73,6 +73,7 @@
 #include "peiskernel.h"
 #include "peiskernel_tcpip.h"
 
+#include "shm.h"
 #include "bluetooth.h"
 
 /* Global variables */
@@ -128,6 +129,8 @@ PeisOptArg peisk_cliOptions[] = {
   {"load",1},
   {"time-master",0},
   {"package-loss",1},
+  {"no-udp",0},
+  {"no-shm",0},
   {"net-metric",1},
   {"bluetooth",1},
   {NULL,-1},
@@ -254,6 +257,10 @@ void peisk_parseOptions(FILE *fp,char *filename) {
       peisk_printPortStatistics=1;
     else if(strcmp(token,"time-master") == 0)
       peiskernel.isTimeMaster=1;
+    else if(strcmp(token,"no-udp") == 0)
+      peiskernel.useUdp=0;
+    else if(strcmp(token,"no-shm") == 0)
+      peiskernel.useShm=0;
     else if(strcmp(token,"package-loss") == 0) {
       arg=peisk_getNextOption(&pos,fp);
       peiskernel.simulatePackageLoss=atof(arg);
@@ -325,6 +332,8 @@ void peisk_printUsage(FILE *stream,short argc,char **args) {
   fprintf(stream," --peis-silent                  Suppress all printouts to stdout\n");
   fprintf(stream," --peis-time-master             Overrides time synchronisation of ecology\n");
   fprintf(stream," --peis-package-loss <float>    Introduces an artifical package loss for debugging\n");
+  fprintf(stream," --peis-no-udp                  Only use TCP for IP connections\n");
+  fprintf(stream," --peis-no-shm                  Use loopback IP instead of shared memory on this computer\n");
   fprintf(stream," --peis-print-status            Enable printing status info (default off)\n");
   fprintf(stream," --peis-print-connections       Enable printing connection info (default off)\n");
   fprintf(stream," --peis-print-package-errors    Enable printing package errors (default off)\n");
@@ -360,6 +369,8 @@ void peisk_initialize(int *argc,char **args) {
   /* Shutdown any previously running peiskernel */
   if(peisk_int_isRunning) peisk_shutdown();
 
+  peisk_reactorInitialize();
+
   /* Initialize random numbers */
   peisk_getrawtime2(&t0,&t1);
   /*srand((int) time(NULL));*/
@@ -377,13 +388,18 @@ void peisk_initialize(int *argc,char **args) {
   peiskernel.highestConnection=0;
   hostname = NULL;
   peiskernel.isLeaf=0;
+  peiskernel.useUdp=1;
+  peiskernel.useShm=1;
+  peiskernel.shm_serverSocket=-1;
   peiskernel.timeOffset[0]=0;
   peiskernel.timeOffset[1]=0;
   peiskernel.isTimeMaster=0;
   peiskernel.avgStepTime=0.1;
   peiskernel.incomingTraffic=0;
   peiskernel.outgoingTraffic=0;
-  peiskernel.nAcknowledgementPackages=0;
+  peiskernel.nAckBatches=0;
+  peiskernel.ackBatchHT = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peiskernel.pendingAcks = peisk_hashTable_create(PeisHashTableKey_Integer);
   peiskernel.deadhostHook = NULL;
   peiskernel.nAckHooks = 0;
   peiskernel.tick = 0;
@@ -403,7 +419,10 @@ void peisk_initialize(int *argc,char **args) {
   /* Clear old connections */
   for(i=0;i<PEISK_MAX_CONNECTIONS;i++) {
     peiskernel.connections[i].id=-1;
-    peiskernel.connections[i].routingTable = NULL;
+    peisk_sortedArray_init(&peiskernel.connections[i].routingTable,sizeof(PeisRoutingInfo));
+    peisk_sortedArray_init(&peiskernel.connections[i].routingEntries,sizeof(PeisRoutingEntry));
+    peiskernel.connections[i].routingParts = NULL;
+    peiskernel.connections[i].routingPartsAllocated = 0;
     for(j=0;j<PEISK_MAX_ROUTING_PAGES;j++)
       peiskernel.connections[i].routingPages[j] = NULL;
   }
@@ -426,7 +445,22 @@ void peisk_initialize(int *argc,char **args) {
 	peiskernel.assemblyBuffers[i].allocated_seqlen = 0;
 	peiskernel.assemblyBuffers[i].received = NULL;
 	peiskernel.assemblyBuffers[i].data = NULL;
+	peiskernel.assemblyBuffers[i].nextFree = i+1 < PEISK_MAX_LONG_MESSAGES ? i+1 : -1;
+  }
+  peiskernel.freeAssemblyBuffers = 0;
+  peiskernel.assemblyHT = peisk_hashTable_create(PeisHashTableKey_Integer);
+  for(i=0;i<PEISK_MAX_SENT_LONG_MESSAGES;i++) {
+	peiskernel.sentLongMessages[i].seqid = 0;
+	peiskernel.sentLongMessages[i].allocatedAckIDs = 0;
+	peiskernel.sentLongMessages[i].ackIDs = NULL;
+	peiskernel.sentLongMessages[i].partSent = NULL;
+	peiskernel.sentLongMessages[i].payload = NULL;
   }
+  peiskernel.nextSeqid = rand() % 32767;
+  for(i=0;i<PEISK_MAX_ASSEMBLED_LONG_MESSAGES;i++)
+	peiskernel.assembledLongMessages[i].source = -1;
+  peiskernel.assembledHT = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peiskernel.nextAssembled = 0;
 
   /* Initialize routing information */
   peiskernel.routingTable = peisk_hashTable_create(PeisHashTableKey_Integer);
@@ -436,9 +470,20 @@ void peisk_initialize(int *argc,char **args) {
     fprintf(stderr,"peisk: error, failed to create routing table\n");
     exit(-1);
   }
+  peisk_sortedArray_init(&peiskernel.routingSent,sizeof(PeisRoutingEntry));
+  peisk_sortedArray_init(&peiskernel.routingDirty,sizeof(int));
+  peiskernel.routingChanges = NULL;
+  peiskernel.nRoutingChanges = 0;
+  peiskernel.allocatedRoutingChanges = 0;
+  peiskernel.routingVersion = 0;
+  peiskernel.routingHorizon = 0;
+  peiskernel.routingRounds = 0;
+  peiskernel.routingSerial = 0;
+  for(i=0;i<PEISK_MULTIPATH_FLOWS;i++) peiskernel.flows[i].connectionId = -1;
 
   for(i=0;i<PEISK_LOOPINFO_HASH_SIZE;i++) peiskernel.loopHashTable[i]=-1;
   for(i=0;i<PEISK_LOOPINFO_SIZE;i++) peiskernel.loopTable[i].id=-1;
+  peiskernel.sequenceWindows = peisk_hashTable_create(PeisHashTableKey_Integer);
 
   /**                     **/
   /** Initialize modules  **/
@@ -464,11 +509,15 @@ void peisk_initialize(int *argc,char **args) {
 
   /* Startup server */
   peisk_restartServer();
+  peisk_shmRestartServer();
   if(peiskernel.tcp_isListening)
     if(peisk_printLevel & PEISK_PRINT_STATUS)
       printf("peisk: serving at port %d\n",peiskernel.tcp_serverPort);
   peisk_id = peiskernel.id;
   peiskernel.magicId = rand();
+  /* Start at a random sequence number, so that our packages are not
+     taken as repeated by hosts that saw us before a restart */
+  peiskernel.nextSequence = rand();
 
   /* Start services that need all commandline options to have been
      parsed first */
@@ -546,28 +595,42 @@ void peisk_initialize(int *argc,char **args) {
 	 which are not loopback interfaces */
       if(peiskernel.isLeaf && !peisk_inetInterface[i].isLoopback) continue;
 
-      /* DEBUG - we are disabling UDP for now... */
-      if(peiskernel.udp_serverPort != 0  && 0) {
-	peiskernel.hostInfo.lowAddr[j].type = ePeisUdpIPv4;
-	ip = (unsigned char *)&peisk_inetInterface[i].ip;
-	peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[0]=ip[0];
-	peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[1]=ip[1];
-	peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[2]=ip[2];
-	peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[3]=ip[3];
-	peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.port=peiskernel.udp_serverPort;
-      } else {
-	peiskernel.hostInfo.lowAddr[j].type = ePeisTcpIPv4;
-	ip = (unsigned char *)&peisk_inetInterface[i].ip;
-	peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[0]=ip[0];
-	peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[1]=ip[1];
-	peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[2]=ip[2];
-	peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[3]=ip[3];
-	peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.port=peiskernel.tcp_serverPort;
-      }
+      peiskernel.hostInfo.lowAddr[j].type = ePeisTcpIPv4;
+      ip = (unsigned char *)&peisk_inetInterface[i].ip;
+      peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[0]=ip[0];
+      peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[1]=ip[1];
+      peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[2]=ip[2];
+      peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.ip[3]=ip[3];
+      peiskernel.hostInfo.lowAddr[j].addr.tcpIPv4.port=peiskernel.tcp_serverPort;
       strncpy(peiskernel.hostInfo.lowAddr[j].deviceName,peisk_inetInterface[i].name,sizeof(peiskernel.hostInfo.lowAddr[i].deviceName));
       peiskernel.hostInfo.lowAddr[j].isLoopback = peisk_inetInterface[i].isLoopback ? 1 : 0;
       j++;
     }
+    /* UDP addresses are listed after all TCP addresses, older kernels
+       use the first loopback address and cannot connect with UDP */
+    for(i=0;i<peisk_nInetInterfaces && peiskernel.udp_serverPort != 0 && j<PEISK_MAX_LOWLEVEL_ADDRESSES;i++) {
+      if(peiskernel.isLeaf && !peisk_inetInterface[i].isLoopback) continue;
+      peiskernel.hostInfo.lowAddr[j].type = ePeisUdpIPv4;
+      ip = (unsigned char *)&peisk_inetInterface[i].ip;
+      peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[0]=ip[0];
+      peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[1]=ip[1];
+      peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[2]=ip[2];
+      peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.ip[3]=ip[3];
+      peiskernel.hostInfo.lowAddr[j].addr.udpIPv4.port=peiskernel.udp_serverPort;
+      strncpy(peiskernel.hostInfo.lowAddr[j].deviceName,peisk_inetInterface[i].name,sizeof(peiskernel.hostInfo.lowAddr[j].deviceName));
+      peiskernel.hostInfo.lowAddr[j].isLoopback = peisk_inetInterface[i].isLoopback ? 1 : 0;
+      j++;
+    }
+    /* Shared memory is only reachable from this computer, so it is
+       marked as loopback */
+    if(peiskernel.shm_serverSocket != -1 && j<PEISK_MAX_LOWLEVEL_ADDRESSES) {
+      peiskernel.hostInfo.lowAddr[j].type = ePeisShm;
+      peiskernel.hostInfo.lowAddr[j].addr.shm.hostKey=peisk_shmHostKey();
+      peiskernel.hostInfo.lowAddr[j].addr.shm.port=peiskernel.tcp_serverPort;
+      strncpy(peiskernel.hostInfo.lowAddr[j].deviceName,"shm",sizeof(peiskernel.hostInfo.lowAddr[j].deviceName));
+      peiskernel.hostInfo.lowAddr[j].isLoopback = 1;
+      j++;
+    }
     peiskernel.hostInfo.nLowlevelAddresses=j;
   }
 
@@ -581,6 +644,7 @@ void peisk_initialize(int *argc,char **args) {
   peisk_insertHostInfo(peiskernel.id,&peiskernel.hostInfo);
   connMgrInfo = (PeisConnectionMgrInfo*) malloc(sizeof(PeisConnectionMgrInfo));
   peisk_insertConnectionMgrInfo(peiskernel.id,connMgrInfo);
+  peisk_initConnectionMgrInfo(connMgrInfo);
   connMgrInfo->nTries = 0;
   connMgrInfo->nextRetry = peisk_timeNow;
   connMgrInfo->usefullTraffic=0;
@@ -633,9 +697,12 @@ void peisk_shutdown() {
   if(peiskernel.tcp_isListening) { peiskernel.tcp_isListening=0; close(peiskernel.tcp_serverSocket); }
 
   if(peiskernel.tcp_broadcast_receiver != -1) { close(peiskernel.tcp_broadcast_receiver); peiskernel.tcp_broadcast_receiver=-1; }
+  peisk_shmShutdownServer();
 
   /* Close bluetooth devices */
   peisk_closeBluetooth();
+
+  peisk_reactorShutdown();
 }
 
 void peisk_trapCtrlC(int Sig) {
@@ -771,6 +838,16 @@ void peisk_wait(int useconds) {
       t0 += offset2-offset; offset=offset2;
     }
 
+#ifdef WITH_EPOLL
+    if(peiskernel.epollFd != -1) {
+      /* Sleep until something happens instead of polling */
+      if(t0 - peisk_gettimef() <= 0.0) break;
+      peisk_reactorWait(t0 - peisk_gettimef());
+      peisk_step();
+      continue;
+    }
+#endif
+
     timeout.tv_sec = 0;
 #ifdef GUMSTIX
     timeout.tv_usec = MIN((int)1e4,
@@ -835,6 +912,12 @@ void peisk_waitOneCycle(int maxUSeconds) {
   struct timespec timeout;
 #endif
 
+#ifdef WITH_EPOLL
+  if(peiskernel.epollFd != -1) {
+    if(maxUSeconds > 0) peisk_reactorWait(1e-6*maxUSeconds);
+    return;
+  }
+#endif
 
   timeout.tv_sec = 0;
 #ifdef GUMSTIX
@@ -1111,6 +1194,13 @@ void peisk_printHostInfo(PeisHostInfo *hostInfo) {
 	     hostInfo->lowAddr[i].addr.tcpIPv4.ip[0],hostInfo->lowAddr[i].addr.tcpIPv4.ip[1],
 	     hostInfo->lowAddr[i].addr.tcpIPv4.ip[2],hostInfo->lowAddr[i].addr.tcpIPv4.ip[3],
 	     (int) hostInfo->lowAddr[i].addr.tcpIPv4.port);
+    else if(hostInfo->lowAddr[i].type == ePeisUdpIPv4)
+      printf("udp://%d.%d.%d.%d:%d ",
+	     hostInfo->lowAddr[i].addr.udpIPv4.ip[0],hostInfo->lowAddr[i].addr.udpIPv4.ip[1],
+	     hostInfo->lowAddr[i].addr.udpIPv4.ip[2],hostInfo->lowAddr[i].addr.udpIPv4.ip[3],
+	     (int) hostInfo->lowAddr[i].addr.udpIPv4.port);
+    else if(hostInfo->lowAddr[i].type == ePeisShm)
+      printf("shm://%d ",hostInfo->lowAddr[i].addr.shm.port);
     else if(hostInfo->lowAddr[i].type == ePeisBluetooth) {
       for(j=0;j<6;j++) printf("%02X%c",hostInfo->lowAddr[i].addr.bluetooth.baddr[j],j==6?';':':');
       printf("%d ",hostInfo->lowAddr[i].addr.bluetooth.port);
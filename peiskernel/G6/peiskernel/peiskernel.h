@@ -69,6 +69,8 @@
   - --peis-silent                Suppress all printouts to stdout
   - --peis-time-master           Overrides time synchronisation of ecology
   - --peis-package-loss float    Introduces an artifical package loss for debugging
+  - --peis-no-udp                Only use TCP for IP connections
+  - --peis-no-shm                Use loopback IP instead of shared memory on this computer
   - --peis-print-status          Enable printing status info (default off)
   - --peis-print-connections     Enable printing connection info (default off)
   - --peis-print-package-errors  Enable printing package errors (default off)
@@ -123,7 +123,25 @@ void peiskmt_kernel_thread_fn(void* data) {
   FD_ZERO(&writeSet);
   FD_ZERO(&excpSet);
 
-  double laststep=0.0, timenow, avgStepTime=0.1;
+#ifdef WITH_EPOLL
+  if(peiskernel.epollFd != -1) {
+    int ready;
+    /* Step whenever the reactor reports that something happened. The
+       sleep itself is done without holding the lock, packages queued
+       by other threads in the meantime wakes us up. The sleep is
+       bounded so we notice when another thread have shutdown the
+       kernel. */
+    while(peisk_isRunning()) {
+      pthread_mutex_lock(&peiskmt_kernel_mutex);
+      peiskernel.reactorSleeping=0;
+      peisk_step();
+      ready=peisk_reactorPrepare();
+      pthread_mutex_unlock(&peiskmt_kernel_mutex);
+      if(!ready) peisk_reactorSleep(1.0);
+    }
+    return;
+  }
+#endif
 
   while(peisk_isRunning()) {
 
@@ -136,16 +154,13 @@ void peiskmt_kernel_thread_fn(void* data) {
     ret=pselect(n,&readSet,&writeSet,&excpSet,&timeout,NULL); /* added last argument --AS 060818 */
 #endif
 
-    /* Prevent multithreaded kernel from running more than 200
-       steps/second. This is to prevent from using up all CPU when the
-       pselect call is wrongly triggered early. UGLY HACK! */
-    timenow=peisk_getrawtimef();
-    if(laststep!=0.0) avgStepTime = 0.99*avgStepTime+0.01*(timenow-laststep);
-    laststep=timenow;
-    if(avgStepTime < 5e-3) usleep(5000);
-
     pthread_mutex_lock(&peiskmt_kernel_mutex);  
     peisk_step();
+    /* The previous select modified the sets, build them from scratch */
+    n=0;
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    FD_ZERO(&excpSet);
     peisk_setSelectReadSignals(&n,&readSet,&writeSet,&excpSet);
     pthread_mutex_unlock(&peiskmt_kernel_mutex);    
   }
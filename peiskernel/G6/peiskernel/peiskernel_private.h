@@ -162,19 +162,52 @@ typedef struct PeisKernel {
   char isLeaf;
   /** Filled when an AckHook is called in the P2P layer with the specific type of error (or success) */
   char ackHookFailureType;
-  unsigned char padding2[2];
+  /** False if UDP connections are disabled by the --peis-no-udp option */
+  char useUdp;
+  /** False if shared memory connections are disabled by the --peis-no-shm option */
+  char useShm;
 
   /** Hashtable giving routing information for all destinations. */
   PeisHashTable *routingTable;
+  /** PeisRoutingEntry's for all destinations we have sent routing information about, sorted by id */
+  PeisSortedArray routingSent;
+  /** Ids of the destinations whose routing information might have
+      changed since the last routing period, sorted. See peisk_routingChanged */
+  PeisSortedArray routingDirty;
+  /** Changes of routingSent in the last PEISK_ROUTING_KEEP_CHANGES
+      versions, oldest first */
+  PeisRoutingChange *routingChanges;
+  int nRoutingChanges;
+  int allocatedRoutingChanges;
+  /** Version of our routing table, increased whenever an entry sent to neighbours changes */
+  int routingVersion;
+  /** Neighbours that acknowledged an older version than this
+      might have missed the removal of some destinations */
+  int routingHorizon;
+  /** Counts routing periods, see PEISK_ROUTING_SEQNO_PERIODS */
+  int routingRounds;
+  /** Serial number of the next routing update */
+  int routingSerial;
+  /** Next hops of recent flows spread over several routes, see \ref Multipath */
+  PeisFlowInfo flows[PEISK_MULTIPATH_FLOWS];
 
   /* Loop detection */
   int nextLoopIndex;                                          /**< Index of next free loopinfo struct */
   unsigned char padding3[4];
   int loopHashTable[PEISK_LOOPINFO_HASH_SIZE];                /**< Hashtble for loop detection */
   PeisLoopInfo loopTable[PEISK_LOOPINFO_SIZE];                /**< Preallocated memory for loopdetection hashtable entries */
+  unsigned int nextSequence;                                  /**< Next sequence number for packages and ackID's from us */
+  struct PeisHashTable *sequenceWindows;                      /**< PeisSequenceWindow of each source, by source id */
 
   /* Long messages */
   PeisAssemblyBuffer assemblyBuffers[PEISK_MAX_LONG_MESSAGES]; /** Stores incomming packages when receiving longer messages (over 1kb). */
+  struct PeisHashTable *assemblyHT;                            /**< Assembly buffers in use, by source and seqid */
+  int freeAssemblyBuffers;                                     /**< Index of first unused assembly buffer, or -1 */
+  int nextSeqid;                                               /**< Last seqid used for our long messages */
+  PeisSentLongMessage sentLongMessages[PEISK_MAX_SENT_LONG_MESSAGES]; /**< Recently sent long messages, for answering NACK's */
+  PeisAssembledMessage assembledLongMessages[PEISK_MAX_ASSEMBLED_LONG_MESSAGES]; /**< Recently assembled long messages */
+  struct PeisHashTable *assembledHT;                           /**< Index+1 in assembledLongMessages, by source and seqid */
+  int nextAssembled;                                           /**< Where in assembledLongMessages the next message is stored */
   /* Autohost */
   PeisAutoHost autohosts[PEISK_MAX_AUTOHOSTS];                 /**< List of hosts will that regularly be attempted to connect to. */
   int nAutohosts;                                              /**< Current size of autohost list */
@@ -188,6 +221,9 @@ typedef struct PeisKernel {
   int udp_serverPort;                                         /**< UDP/IP port number listening for incomming connections */
   int udp_serverSocket;
 
+  /* Shared memory connections to PEIS on the same computer */
+  int shm_serverSocket;                                       /**< Unix socket listening for incomming shared memory connections */
+
   /* Connections */
   int nextConnectionId;
   /** Contains data for all _active_ connections */
@@ -219,10 +255,17 @@ typedef struct PeisKernel {
   unsigned char padding5[3];
 
   /** Pending acknowledgement packages to send. These are buffered for
-      efficiency. */
-  PeisPendingAck acknowledgementPackages[PEISK_MAX_ACK_PACKAGES];
-  /** Number of (currently) stored acknowledgement packages. */
-  int nAcknowledgementPackages;
+      efficiency, one batch per destination. */
+  PeisAckBatch ackBatches[PEISK_MAX_ACK_DESTINATIONS];
+  /** Number of (currently) used batches in ackBatches. */
+  int nAckBatches;
+  /** Index of ackBatches by destination */
+  struct PeisHashTable *ackBatchHT;
+
+  /** All packages in the pending queues of all connections, indexed
+      by their ackID (network byte order). Packages with the same
+      ackID are chained with their ackNext field. */
+  struct PeisHashTable *pendingAcks;
 
   /** The id of the last generated acknowledgement ID, useful for
       functions that spoof the sender of messages. Ie, the TinyGateway */
@@ -275,6 +318,24 @@ typedef struct PeisKernel {
   /** Main storage for information about connection attempts to hosts, contains PeisConnectionMgrInfo
       structures indexed by the PEIS ID. */
   struct PeisHashTable *connectionMgrInfoHT;
+
+  /** The epoll instance used when waiting for events, or -1 if
+      waiting uses select. See peisk_reactorInitialize */
+  int epollFd;
+  /** timerfd armed for when the next periodic function is due */
+  int timerFd;
+  /** eventfd used to wake up a kernel waiting in another thread */
+  int wakeupFd;
+  /** True while the kernel thread is (about to be) sleeping in the reactor */
+  int reactorSleeping;
+  /** Timepoint the timerFd is currently armed for */
+  double timerDeadline;
+  /** True if the last step stopped reading before all incomming
+      packages were processed */
+  int moreIncomming;
+  /** True if a watched socket was hung up since the last step, see
+      peisk_acceptShmConnections */
+  int hangups;
 } PeisKernel;
 
 /** Internalized access to the ID variable. \todo  Should (in the future) be moved replaced everywhere with peiskernel.id instead */
@@ -332,6 +393,22 @@ int peisk_lookupRoutingInfo(int id);                /**< Looks for routing infor
 int peisk_allocateRoutingInfo(int id);              /**< Allocates and inserts a routing info into hash table */
 
 int peisk_connection_sendPackage(int id,PeisPackageHeader *package,int datalen,void *data,int specialFlags); /**< Send a package+data on given connection. Returns zero on success. */
+/** Same as peisk_connection_sendPackage, but the data (datalen bytes
+    starting at data) lies inside the given payload and is referenced
+    instead of copied. */
+int peisk_connection_sendPayloadPackage(int id,PeisPackageHeader *package,int datalen,void *data,PeisPayload *payload,int specialFlags);
+/** Calls all acknowledgement hooks of a queued package */
+void peisk_queuedPackage_callHooks(PeisQueuedPackage *qpackage,int success);
+/** Appends a package to the given queue of a connection. Packages in
+    the pending queue are also indexed by their ackID. */
+void peisk_connection_enqueue(PeisConnection *connection,int queue,PeisQueuedPackage *qpackage);
+/** Removes a package from the queue of the connection it is in */
+void peisk_connection_dequeue(PeisConnection *connection,int queue,PeisQueuedPackage *qpackage);
+/** Returns the first package in the pending queues that waits for
+    the given ackID (network byte order), or NULL if there is none. */
+PeisQueuedPackage *peisk_lookupPendingAck(int ackID);
+/** Returns a queued package to the list of free packages */
+void peisk_queuedPackage_free(PeisQueuedPackage *qpackage);
 int peisk_sendBroadcastPackage(PeisPackageHeader *header,int len,void *data,int flags); /** Sends a package on (all/a subset of all) connections */
 
 /** Waits until it is possible to read something from given
@@ -365,6 +442,29 @@ int peisk_isRepeated(int pkgId);
 /** Adds package id to memory for loop detection. */
 void peisk_markAsRepeated(int pkgId);
 
+/** Gives the next number in the sequence shared by the ids and
+    ackID's of all packages originating from us. */
+int peisk_nextSequence();
+
+/** Returns non zero if sequence number seq already has been seen from
+    the given source, otherwise remembers it. Numbers too old to be in
+    the window count as seen if tooOld is non zero. */
+int peisk_sequenceSeen(int source,int seq,int tooOld);
+
+/** Gives the id that a package with the given sequence numbered id
+    from source gets when it is sent to older kernels, see
+    peisk_connection_legacyId. */
+int peisk_legacyId(int source,int seq);
+
+/** Gives a package about to be sent a fresh id. Packages with
+    ourselves as source are numbered by sequence and flagged with
+    PEISK_PACKAGE_SEQ_ID, others get a random unused id. */
+void peisk_assignPackageId(PeisPackageHeader *header);
+
+/** Gives a package about to be sent a fresh ackID, like
+    peisk_assignPackageId but using PEISK_PACKAGE_SEQ_ACK */
+void peisk_assignAckId(PeisPackageHeader *header);
+
 
 /** Determines the amount of printouts done by the peiskernel. Logical or of
     the different printout flags PEISK_PRINT_* */
@@ -388,6 +488,8 @@ extern int peisk_printLevel;
 #define PEISK_PACKAGE_IS_ACK        (1<<1)    /**< Signals that this package is an ACK package. The remaing data is discarded */
 #define PEISK_PACKAGE_BULK          (1<<2)    /**< Package has lower priority */
 #define PEISK_PACKAGE_HIPRI         (1<<3)    /**< Package has the highest priority */
+#define PEISK_PACKAGE_SEQ_ID        (1<<4)    /**< The id is a sequence number of the package source, see peisk_sequenceSeen */
+#define PEISK_PACKAGE_SEQ_ACK       (1<<5)    /**< The ackID is a sequence number of the package source */
 
 /** Broadcasted package has lower priority */
 #define PEISK_BPACKAGE_BULK         (1<<2)    
@@ -407,6 +509,18 @@ extern int peisk_printLevel;
 /* Asks a connection attempt to be forced due to clusters even if the receiving PEIS have too many connections */
 #define PEISK_CONNECT_FLAG_FORCED_CL (1<<2)
 
+/* Tells that the connecting kernel understands sequence numbered
+   package ids (PEISK_PACKAGE_SEQ_ID). Always set by newer kernels. */
+#define PEISK_CONNECT_FLAG_SEQUENCED (1<<3)
+
+/* Tells that the connecting kernel understands incremental routing
+   updates (PEISK_PORT_ROUTING_DELTA). Always set by newer kernels. */
+#define PEISK_CONNECT_FLAG_ROUTING_DELTA (1<<4)
+
+/* Tells that the connecting kernel understands multicast packages
+   (ePeisMulticastPackage). Always set by newer kernels. */
+#define PEISK_CONNECT_FLAG_MULTICAST (1<<5)
+
 
 /** Time in seconds of inactivity before a known host is removed / node is deleted from the topology */
 #define PEISK_ROUTE_TIMEOUT             15.0
@@ -414,6 +528,16 @@ extern int peisk_printLevel;
 #define PEISK_ROUTE_TIMEOUT_SEQ          3 /* was 2 */
 /** How often routing information should be broadcasted. Must be less than \ref PEISK_ROUTE_TIMEOUT */
 #define PEISK_ROUTE_BROADCAST_PERIOD    10.0
+/** Number of routing periods between increasing our own routing
+    sequence number when the topology around us has not changed. Each
+    increase changes our entry in every routing table and hence
+    forces an incremental update through the whole network. */
+#define PEISK_ROUTING_SEQNO_PERIODS       6
+/** Number of versions of our routing table for which changes and
+    removed destinations are remembered. Neighbours that have not
+    acknowledged a version this recent are sent the full table
+    instead. */
+#define PEISK_ROUTING_KEEP_CHANGES       16
 /** Interval for broadcasting our precence on local (ethernet) network. Must be less than \ref PEISK_ROUTE_TIMEOUT */
 #define PEISK_INET_BROADCAST_PERIOD      1.0
 /** Minumum number of connections to maintain */
@@ -449,9 +573,9 @@ extern int peisk_printLevel;
 
 /** Interval for managing speed control on connections */
 #define PEISK_CONNECTION_CONTROL_PERIOD     0.1
-/** How often allowable speed is recomputed */
-#define PEISK_CONNECTION_CONTROL_PERIOD_2   2.0
-/** Smallest/initial UDP speed setting possible, counted in number of bytes per second. */
+/** How often neighbours report package losses for recomputing the allowable speed */
+#define PEISK_CONNECTION_CONTROL_PERIOD_2   0.5
+/** Smallest speed setting possible, counted in number of bytes per second. */
 #define PEISK_MIN_CONTROL_SPEED          1000
 
 
@@ -475,6 +599,36 @@ typedef struct PeisRoutingPackage {
   int sequenceNumber;
 } PeisRoutingPackage;
 
+/** Incremental update of the routing table, sent instead of
+    PeisRoutingPackage's to neighbours that set
+    PEISK_CONNECT_FLAG_ROUTING_DELTA. An update is split into nparts
+    packages that all share the same version and serial number, there
+    is no limit on how many.
+
+    Each package is followed by entries sorted by destination. Entries
+    are written as the difference from the previous destination in
+    the package (from zero for the first) and the sequence number,
+    both as varints with seven bits per byte and the lowest bits
+    first, then the magic number (network byte order), the hops and
+    the number of connections of the destination as one byte each. An
+    entry with 255 hops removes the destination. */
+typedef struct PeisRoutingDeltaPackage {
+  /** Version of the sender's routing table after this update */
+  int version;
+  /** Version this update is relative to, zero if it contains the full table */
+  int baseVersion;
+  /** Latest version of the receiver's routing table that the sender holds */
+  int ackVersion;
+  /** Counts up for every update sent, so parts of different updates are not mixed */
+  short serial;
+  /** Which part of the update this is */
+  short part;
+  /** How many parts there are */
+  short nparts;
+  /** How many entries in this part */
+  short entries;
+} PeisRoutingDeltaPackage;
+
 /** Package used when answering a query for host information. */
 typedef struct PeisHostInfoPackage {
   PeisHostInfo hostInfo;
@@ -507,6 +661,26 @@ int peisk_sendMessage(int port,int destination,int len,void *data,int flags);
 /** Special form of sendMessage allowing spoofed source
     address. Returns zero on success. */
 int peisk_sendMessageFrom(int from,int port,int destination,int len,void *data,int flags);
+/** Same as peisk_sendMessageFrom, but sends the data of the given
+    payload without copying it. The payload can be sent any number of
+    times, and the caller keeps its own reference to it. */
+int peisk_sendPayloadFrom(int from,int port,int destination,PeisPayload *payload,int flags);
+/** Sends the data of the given payload to all nDestinations
+    destinations. Destinations sharing the same next hop are reached
+    through shared multicast packages when the payload is small
+    enough, otherwise one message is sent to each destination. The
+    current acknowledgement hooks are applied once for every
+    destination. The status of each destination is stored in status,
+    zero on success. */
+void peisk_multicastPayload(int port,int nDestinations,int *destinations,PeisPayload *payload,int flags,int *status);
+
+/** Allocates a new payload able to hold len bytes, with a reference
+    count of one. Returns NULL if out of memory. */
+PeisPayload *peisk_payload_create(int len);
+/** Adds one more reference to a payload */
+void peisk_payload_retain(PeisPayload *payload);
+/** Drops one reference to a payload, freeing it when no references remain */
+void peisk_payload_release(PeisPayload *payload);
 
 /** Gives the local port used to receive incomming
     connections. Returns -1 if no server port used. */
@@ -520,6 +694,8 @@ extern char *peisk_networkString;
 void peisk_registerDefaultServices();
 void peisk_registerDefaultServices2();
 int peisk_hook_routing(int port,int destination,int sender,int datalen,void *data);
+/** Receives incremental routing updates from neighbours, see PeisRoutingDeltaPackage */
+int peisk_hook_routingDelta(int port,int destination,int sender,int datalen,void *data);
 
 /** Triggered by incomming hostinfo query packages. Generates a
     response hostinfo package back to sender. */
@@ -548,6 +724,16 @@ void peisk_ntoh_hostInfo(PeisHostInfo *hostInfo);
 /** Recomputes current cluster ID and triggers a retransmission if neccessary */
 void peisk_checkClusters();
 
+/** Finds the other connections that have a route to the destination
+    of a main routing table entry as good as the main route, see \ref
+    Multipath */
+void peisk_findRoutingAlternatives(PeisRoutingInfo *routingInfo);
+
+/** Notes that the main routing table entry of the destination, or
+    the number of connections it has, might have changed. Only such
+    destinations are compared with what was last sent to neighbours. */
+void peisk_routingChanged(int destination);
+
 /** Checks for occurrance of kernel.do-quit and performs a shutdown if
     given any value other than "","no" or "nil". */
 void peisk_callback_kernel_quit(PeisTuple *tuple,void *arg);
@@ -569,6 +755,8 @@ int peisk_hook_acknowledgments(int port,int destination,int sender,int datalen,v
 /** Periodic for sending acknowledgement packages or when enough have
     been collected. */
 void peisk_sendAcknowledgementsNow();
+/** Sends the acknowledgements buffered for one destination and empties the batch */
+void peisk_sendAckBatch(PeisAckBatch *batch);
 
 /** Creates a tuple containing our routing table, used for debugging
     and visualization purposes. */
@@ -616,8 +804,8 @@ void peisk_insertConnectionMgrInfo(int id,PeisConnectionMgrInfo *connMgrInfo);
 
 /** \ingroup LargeAcknowledgement
     Wrapper hook for handling acknowledgents/rejections of large
-    packages. Works by creating a copy of the whole message (which can
-    be large!) and a counter. Calls the user defined hook when the
+    packages. Works by keeping a reference to the payload of the whole
+    message and a counter. Calls the user defined hook when the
     counter has reached zero and passed the original whole message and
     an emulated package header (with the whole length) to the user. */
 void peisk_largePackageHook(int success,int datalen,PeisPackage *package,void *user);
@@ -22,11 +22,14 @@
     02110-1301  USA
 */
 
+/* Needed for getaddrinfo_a */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -59,6 +62,7 @@
 #include "p2p.h"
 #include "linklayer.h"
 #include "peiskernel_tcpip.h"
+#include "udp.h"
 
 struct peiskernel_inetinfo peisk_inetInterface[32];
 int peisk_nInetInterfaces;
@@ -262,13 +266,18 @@ void peisk_restartServer() {
     close(peiskernel.tcp_serverSocket);
     return;
   }
+  /* Only one connection is accepted per step, so keep on waking up
+     while more are waiting */
+  peisk_reactorWatch(peiskernel.tcp_serverSocket,0);
 
-  peiskernel.udp_serverSocket = socket(AF_INET,SOCK_DGRAM,0);
+  /* UDP uses the same port as TCP unless it is taken */
+  peiskernel.udp_serverPort=peiskernel.tcp_serverPort;
+  peiskernel.udp_serverSocket = peiskernel.useUdp ? socket(AF_INET,SOCK_DGRAM,0) : -1;
   serverAddr.sin_family=AF_INET;
   serverAddr.sin_addr.s_addr=INADDR_ANY;
   bzero(&(serverAddr.sin_zero),8);
   /* Attempt to bind a port until we have succeeded */
-  while(1) {
+  while(peiskernel.udp_serverSocket != -1) {
     serverAddr.sin_port=htons(peiskernel.udp_serverPort);
     if(bind(peiskernel.udp_serverSocket,(struct sockaddr*)&serverAddr,sizeof(struct sockaddr))==-1) {
       /*fprintf(stderr,"peisk: Warning, failed to bind port %d\n",peiskernel.serverPort);*/
@@ -276,10 +285,17 @@ void peisk_restartServer() {
     } else break;
   }
   /* Make udp server socket nonblocking */
-  if(fcntl(peiskernel.udp_serverSocket,F_SETFL,O_NONBLOCK) == -1) {
+  if(peiskernel.udp_serverSocket != -1 && fcntl(peiskernel.udp_serverSocket,F_SETFL,O_NONBLOCK) == -1) {
     fprintf(stderr,"peisk: error setting UDP serverSocket nonblocking, continuing without it\n");
     close(peiskernel.udp_serverSocket);
-    peiskernel.udp_serverPort=0;
+    peiskernel.udp_serverSocket=-1;
+  }
+  if(peiskernel.udp_serverSocket == -1) peiskernel.udp_serverPort=0;
+  else {
+    on=PEISK_UDP_SOCKET_BUFFER;
+    setsockopt(peiskernel.udp_serverSocket,SOL_SOCKET,SO_RCVBUF,&on,sizeof(on));
+    /* Connect messages are read in batches, keep on waking up while more are waiting */
+    peisk_reactorWatch(peiskernel.udp_serverSocket,0);
   }
 
 
@@ -327,25 +343,165 @@ void peisk_restartServer() {
     perror("Error joining multicast group");
   }
   /* succeded */
-  else if(peisk_printLevel & PEISK_PRINT_STATUS)
-    printf("peisk: listening for multicasts on %s:%d\n",
-	   PEISK_MULTICAST_IP,PEISK_MULTICAST_PORT);
+  else {
+    /* Announcements are only read every few steps, waking up on
+       each new one is enough. */
+    peisk_reactorWatch(peiskernel.tcp_broadcast_receiver,1);
+    if(peisk_printLevel & PEISK_PRINT_STATUS)
+      printf("peisk: listening for multicasts on %s:%d\n",
+	     PEISK_MULTICAST_IP,PEISK_MULTICAST_PORT);
+  }
 }
 
 /*********************************/
 /*        TCP CONNECTIONS        */
 /*********************************/
 
-PeisConnection *peisk_tcpConnect(char *name,int port,int flags) {
-  struct hostent *hostent;
+/** States of the entries in the hostname cache */
+typedef enum { eTCPNameUnused=0, eTCPNameResolving, eTCPNameResolved, eTCPNameFailed } PeisTCPNameStatus;
+
+/** A hostname remembered by peisk_tcpConnect */
+typedef struct PeisTCPName {
+  char name[256];
+  PeisTCPNameStatus status;
+  /** Address of the host once resolved */
+  struct in_addr addr;
+  /** Timepoint when the name is looked up again */
+  double expire;
+#ifdef WITH_GETADDRINFO_A
+  /** Background lookup of the name, owned by the C library while resolving */
+  struct gaicb request;
+  struct addrinfo hints;
+#endif
+} PeisTCPName;
+
+static PeisTCPName peisk_tcpNames[PEISK_TCP_NAME_CACHE];
+
+/** Stores the outcome of a lookup in the cache */
+static void peisk_tcpNameResolved(PeisTCPName *entry,int ret,struct addrinfo *result) {
+  if(ret == 0 && result) {
+    entry->addr = ((struct sockaddr_in*) result->ai_addr)->sin_addr;
+    entry->status = eTCPNameResolved;
+    entry->expire = peisk_timeNow + PEISK_TCP_NAME_TTL;
+  } else {
+    fprintf(stdout,"peisk: failed to resolve %s: %s\n",entry->name,gai_strerror(ret));
+    entry->status = eTCPNameFailed;
+    entry->expire = peisk_timeNow + PEISK_TCP_NAME_RETRY;
+  }
+  if(result) freeaddrinfo(result);
+}
+
+/** Starts looking up the address of a cache entry */
+static void peisk_tcpStartLookup(PeisTCPName *entry) {
+#ifdef WITH_GETADDRINFO_A
+  struct gaicb *requests[1];
+  int ret;
+
+  memset(&entry->hints,0,sizeof(entry->hints));
+  entry->hints.ai_family = AF_INET;
+  entry->hints.ai_socktype = SOCK_STREAM;
+  memset(&entry->request,0,sizeof(entry->request));
+  entry->request.ar_name = entry->name;
+  entry->request.ar_request = &entry->hints;
+  requests[0] = &entry->request;
+  ret=getaddrinfo_a(GAI_NOWAIT,requests,1,NULL);
+  if(ret == 0) entry->status = eTCPNameResolving;
+  else peisk_tcpNameResolved(entry,ret,NULL);
+#else
+  struct addrinfo hints, *result=NULL;
+  int ret;
+
+  /* Without background lookups every lookup blocks, the cache only
+     makes them rare */
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  ret=getaddrinfo(entry->name,NULL,&hints,&result);
+  peisk_tcpNameResolved(entry,ret,result);
+#endif
+}
+
+/** Checks if a background lookup has finished */
+static void peisk_tcpPollLookup(PeisTCPName *entry) {
+#ifdef WITH_GETADDRINFO_A
+  int ret;
+
+  ret=gai_error(&entry->request);
+  if(ret == EAI_INPROGRESS) return;
+  peisk_tcpNameResolved(entry,ret,entry->request.ar_result);
+#endif
+}
+
+/** Gives the cache entry of a hostname, starting a lookup of it
+    unless it is known already. Returns -1 if the cache is full of
+    lookups in progress. */
+static int peisk_tcpLookupName(char *name) {
+  PeisTCPName *entry;
+  int i, oldest;
+
+  /* Find the name, or else the entry that expired first */
+  oldest=-1;
+  for(i=0;i<PEISK_TCP_NAME_CACHE;i++) {
+    entry=&peisk_tcpNames[i];
+    if(entry->status != eTCPNameUnused && strcmp(entry->name,name) == 0) break;
+    if(entry->status == eTCPNameResolving) continue;
+    if(oldest == -1 || entry->expire < peisk_tcpNames[oldest].expire) oldest=i;
+  }
+  if(i != PEISK_TCP_NAME_CACHE) {
+    if(entry->status == eTCPNameResolving) peisk_tcpPollLookup(entry);
+    if(entry->status == eTCPNameResolving || entry->expire > peisk_timeNow) return i;
+  } else {
+    if(oldest == -1) return -1;
+    i=oldest;
+    entry=&peisk_tcpNames[i];
+    strncpy(entry->name,name,sizeof(entry->name)-1);
+    entry->name[sizeof(entry->name)-1]=0;
+  }
+  peisk_tcpStartLookup(entry);
+  return i;
+}
+
+/** Starts a non-blocking connect of a pending connection to the
+    given address. Returns zero on success. */
+static int peisk_tcpStartConnect(PeisConnection *connection,struct in_addr addr) {
   struct sockaddr_in peerAddr;
   int sock;
 
-  int retval;
-  socklen_t retlen;
-  fd_set writeSet, readSet, exepSet;
-  struct timeval timeout;
+  /* Prepare OS socket */
+  sock=socket(AF_INET,SOCK_STREAM,0);
+  if(sock == -1) {
+    perror("Failed to create a new socket\n");
+    return -1;
+  }
+  /* Set socket non blocking before connecting */
+  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
+    fprintf(stderr,"peisk: error setting socket nonblocking, not connecting\n");
+    close(sock);
+    return -1;
+  }
+  memset(&peerAddr,0,sizeof(peerAddr));
+  peerAddr.sin_family = AF_INET;
+  peerAddr.sin_port = htons(connection->connection.tcp.port);
+  peerAddr.sin_addr = addr;
+  /* Start connecting, the reactor wakes us up when it has finished */
+  if(connect(sock,(struct sockaddr*)&peerAddr,sizeof(peerAddr)) == -1 && errno != EINPROGRESS) {
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      fprintf(stdout,"peisk: failed to connect to %s:%d, errno: %d\n",
+	      inet_ntoa(addr),connection->connection.tcp.port,errno);
+    close(sock);
+    return -1;
+  }
+  connection->connection.tcp.socket=sock;
+  connection->connection.tcp.status=eTCPConnecting;
+  connection->connection.tcp.timeout=peisk_timeNow+PEISK_TCP_CONNECT_TIMEOUT;
+  peisk_reactorWatchConnect(sock);
+  return 0;
+}
+
+PeisConnection *peisk_tcpConnect(char *name,int port,int flags) {
+  struct in_addr addr;
   PeisConnection *connection;
+  int index;
 
   /** \todo peisk_tcpConnect - refuse to connect to hosts we already
       are connected to. */
@@ -356,129 +512,189 @@ PeisConnection *peisk_tcpConnect(char *name,int port,int flags) {
       strcmp(name,"127.0.0.1") == 0 ||
       strcmp(name,peiskernel.hostInfo.hostname) == 0)) return NULL;
 
-  /* Lookup hostname */
-  h_errno=0;
-  hostent=gethostbyname(name);
-  if(!hostent) {
-    fprintf(stdout,
-	    "peisk: gethostbyname(%s)  failed. h_errno=%d hostent=%x\n",
-	    name,h_errno,(unsigned int)(unsigned long) hostent);
-    return NULL;
+  /* Addresses given as numbers need no lookup, others are taken from
+     the cache or looked up in the background */
+  index=-1;
+  if(!inet_aton(name,&addr)) {
+    index=peisk_tcpLookupName(name);
+    if(index == -1) {
+      fprintf(stdout,"peisk: too many hostname lookups in progress, not connecting to %s\n",name);
+      return NULL;
+    }
+    if(peisk_tcpNames[index].status == eTCPNameFailed) return NULL;
+    addr=peisk_tcpNames[index].addr;
   }
  
   /* Create connection structure to use. This will allocate and
      place the connection in PENDING mode. */
   connection = peisk_newConnection();
-
-  /* Prepare OS socket */
-  sock=socket(AF_INET,SOCK_STREAM,0);
-  if(sock == -1) {
-    perror("Failed to create a new socket\n");
+  if(!connection) return NULL;
+  connection->type=eTCPConnection;
+  connection->connection.tcp.socket=-1;
+  connection->connection.tcp.flags=flags;
+  connection->connection.tcp.port=port;
+  connection->connection.tcp.name=index;
+
+  if(index != -1 && peisk_tcpNames[index].status == eTCPNameResolving) {
+    connection->connection.tcp.status=eTCPResolving;
+    connection->connection.tcp.timeout=peisk_timeNow+PEISK_TCP_RESOLVE_TIMEOUT;
+  } else if(peisk_tcpStartConnect(connection,addr) != 0) {
+    peisk_abortConnect(connection);
     return NULL;
   }
-  peerAddr.sin_family = AF_INET;
-  peerAddr.sin_port = htons(port);
-  peerAddr.sin_addr.s_addr = INADDR_ANY;
-  bzero(&(peerAddr.sin_zero),8);
-  bcopy((char *)hostent->h_addr,(char *)&peerAddr.sin_addr,hostent->h_length);
-  /* Set socket non blocking before connecting */
-  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
-    fprintf(stderr,"peisk: error setting socket nonblocking, not connecting\n");
-    close(sock);
-    return NULL;
+
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: connecting with tcp/ip to %s:%d as connection #%d, flags=%d\n",
+	    name,port,connection->id,flags);
+  return connection;
+}
+
+/** Continues a pending outgoing connection whose hostname is being looked up */
+static void peisk_tcpProcessResolving(PeisConnection *connection) {
+  PeisTCPName *entry=&peisk_tcpNames[connection->connection.tcp.name];
+
+  if(entry->status == eTCPNameResolving) peisk_tcpPollLookup(entry);
+  if(entry->status == eTCPNameResolving) {
+    if(connection->connection.tcp.timeout < peisk_timeNow) {
+      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	fprintf(stdout,"peisk: tcp/ip connection #%d gave up waiting for lookup of %s\n",
+		connection->id,entry->name);
+      peisk_abortConnect(connection);
+    }
+    return;
   }
-  /* Start connecting */
-  connect(sock,(struct sockaddr*)&peerAddr,sizeof(struct sockaddr));
-  /** For now, wait and see if connection has succeeded within 100ms and continue afterwards.
-      \todo Handle queued connection attempts better, eg. by placing them on a queue of pending connections */
-  timeout.tv_sec=0;
-  timeout.tv_usec=100000;  /* Use a timeout of 100ms */
-  FD_ZERO(&readSet);
-  FD_ZERO(&writeSet);
-  FD_ZERO(&exepSet);
-  FD_SET(sock,&writeSet);
-  retval=select(sock+1, &readSet, &writeSet, &exepSet, &timeout);
-  if(retval <= 0) {
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: failed to connect to %s:%d.\n   Select returned: %d\n",name,port,retval);
-    return NULL;
+  if(entry->status != eTCPNameResolved || peisk_tcpStartConnect(connection,entry->addr) != 0)
+    peisk_abortConnect(connection);
+}
+
+/** Finishes a pending outgoing connection once the connect has
+    succeeded, by sending our connect message to the peer */
+static void peisk_tcpProcessConnecting(PeisConnection *connection) {
+  struct pollfd pfd;
+  PeisConnectMessage message;
+  int sock, retval;
+  socklen_t retlen;
+
+  sock=connection->connection.tcp.socket;
+  pfd.fd=sock;
+  pfd.events=POLLOUT;
+  pfd.revents=0;
+  if(poll(&pfd,1,0) == 0) {
+    if(connection->connection.tcp.timeout < peisk_timeNow) {
+      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	fprintf(stdout,"peisk: tcp/ip connection #%d timed out\n",connection->id);
+      peisk_abortConnect(connection);
+      close(sock);
+    }
+    return;
   }
   retlen=sizeof(int);
-  if(getsockopt(sock,SOL_SOCKET,SO_ERROR,&retval,&retlen) == -1) {
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: failed to connect to %s:%d.\n   Getsockopt failed, errno: %d\n",name,port,errno);
-    return NULL;
-  }
+  if(getsockopt(sock,SOL_SOCKET,SO_ERROR,&retval,&retlen) == -1) retval=errno;
   if(retval) {
     if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,
-	      "peisk: failed to connect to %s:%d.\n SO_ERROR is %d\n",
-	      name,port,retval);
-    return NULL;
+      fprintf(stdout,"peisk: tcp/ip connection #%d failed, SO_ERROR is %d\n",connection->id,retval);
+    peisk_abortConnect(connection);
+    close(sock);
+    return;
   }
 
-  connection->type=eTCPConnection;
-  connection->connection.tcp.socket=sock;
-
-  PeisConnectMessage message;
-  peisk_initConnectMessage(&message,flags);
-  send(sock,&message,sizeof(message),MSG_NOSIGNAL);
-  peisk_outgoingConnectFinished(connection,flags);
+  /* A fresh socket always has room for the connect message */
+  peisk_initConnectMessage(&message,connection->connection.tcp.flags);
+  if(send(sock,&message,sizeof(message),MSG_NOSIGNAL) != sizeof(message)) {
+    peisk_abortConnect(connection);
+    close(sock);
+    return;
+  }
+  connection->connection.tcp.status=eTCPConnected;
+  peisk_outgoingConnectFinished(connection,connection->connection.tcp.flags);
 
   if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-    fprintf(stdout,"peisk: new outbound tcp/ip connection #%d to %s:%d established, flags=%d\n",
-	    connection->id,name,port,flags);
-  return connection;
+    fprintf(stdout,"peisk: new outbound tcp/ip connection #%d established, flags=%d\n",
+	    connection->id,connection->connection.tcp.flags);
 }
 
-void peisk_acceptTCPConnections() {
-  int sin_size=sizeof(struct sockaddr_in);
-  int sock;
-  struct sockaddr_in peerAddr;
-  PeisConnection *connection;
+/** Finishes a pending incomming connection once the connect message
+    of the peer has arrived */
+static void peisk_tcpProcessAccepting(PeisConnection *connection) {
   PeisConnectMessage message;
-
-  if(!peiskernel.tcp_isListening)  return;
-
-  sock=accept(peiskernel.tcp_serverSocket,(struct sockaddr *)&peerAddr,(socklen_t*) &sin_size);
-  if(sock <= 0) return;
-
-  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-    printf("peisk: incomming TCP connection ...\n");
-  
-  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
-    fprintf(stderr,"peisk: error setting socket nonblocking, closing connection\n");
-    close(sock);
+  int sock, size;
+
+  sock=connection->connection.tcp.socket;
+  /* Leave the message in the socket until all of it has arrived */
+  size=recv(sock,&message,sizeof(message),MSG_PEEK|MSG_DONTWAIT|MSG_NOSIGNAL);
+  if(size != sizeof(message)) {
+    if(size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+       connection->connection.tcp.timeout < peisk_timeNow) {
+      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	printf("Timeout on incomming connection (1)\n");
+      peisk_freeConnection(connection);
+      close(sock);
+    }
     return;
   }
-  
-  /* Create connection structure to use */
-  connection = peisk_newConnection();
-  if(!connection) return;
-  
-  /* Wait up to 200ms for data - otherwise drop connection */    
-  if(!peisk_recvBlocking(sock,&message,sizeof(message),0,0.2) && (peisk_printLevel & PEISK_PRINT_CONNECTIONS)) {
-    printf("Timeout on incomming connection (1)\n");
-    peisk_freeConnection(connection);
-    close(sock); return;
-  }
+  recv(sock,&message,sizeof(message),MSG_DONTWAIT|MSG_NOSIGNAL);
+
   /* Check that it's ok to accept this connection */
   if(peisk_verifyConnectMessage(connection,&message) != 0) {
     peisk_freeConnection(connection);
     close(sock); return;
   }
     
-  /* Store TCP information in connection */
-  connection->type = eTCPConnection;
-  connection->connection.tcp.socket=sock;
-  
   /* Let P2P layer handle this connection */    
+  connection->connection.tcp.status=eTCPConnected;
   peisk_incommingConnectFinished(connection,&message);
     
   if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
     printf("peisk: accepted new connection to %d with index: %d, flags=%d\n",
 	   message.id,connection->id,message.flags);
+}
+
+void peisk_acceptTCPConnections() {
+  int sin_size=sizeof(struct sockaddr_in);
+  int i, sock;
+  struct sockaddr_in peerAddr;
+  PeisConnection *connection;
+
+  for(i=0;i<=peiskernel.highestConnection;i++) {
+    connection=&peiskernel.connections[i];
+    if(connection->id == -1 || connection->type != eTCPConnection || !connection->isPending) continue;
+    switch(connection->connection.tcp.status) {
+    case eTCPResolving: peisk_tcpProcessResolving(connection); break;
+    case eTCPConnecting: peisk_tcpProcessConnecting(connection); break;
+    case eTCPAccepting: peisk_tcpProcessAccepting(connection); break;
+    default: break;
+    }
+  }
+
+  if(!peiskernel.tcp_isListening)  return;
+
+  for(;;) {
+    sock=accept(peiskernel.tcp_serverSocket,(struct sockaddr *)&peerAddr,(socklen_t*) &sin_size);
+    if(sock <= 0) return;
+
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      printf("peisk: incomming TCP connection ...\n");
   
+    if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
+      fprintf(stderr,"peisk: error setting socket nonblocking, closing connection\n");
+      close(sock);
+      continue;
+    }
+  
+    /* Create connection structure to use */
+    connection = peisk_newConnection();
+    if(!connection) { close(sock); return; }
+
+    /* Store TCP information in connection, it stays pending until
+       the connect message of the peer has arrived */
+    connection->type = eTCPConnection;
+    connection->connection.tcp.socket=sock;
+    connection->connection.tcp.status=eTCPAccepting;
+    connection->connection.tcp.timeout=peisk_timeNow+PEISK_TCP_ACCEPT_TIMEOUT;
+    peisk_reactorWatch(sock,1);
+    /* The message is often sent right after connecting */
+    peisk_tcpProcessAccepting(connection);
+  }
 }
 
 
@@ -570,12 +786,14 @@ int peisk_ipIsConnectable(unsigned char ip[4],int port) {
   return 0;
 }
 
-int peisk_tcpSendAtomic(PeisConnection *connection,PeisPackage *package,int len) {
-  int status, timeout, value;
-  void *data = (void*) package;
+int peisk_tcpSendQueued(PeisConnection *connection,PeisQueuedPackage **packages,int n,int *offset) {
+  static struct iovec iov[2*PEISK_MAX_SEND_BATCH];
+  static int wireLen[PEISK_MAX_SEND_BATCH];
   PeisPackageHeader *header;
+  struct msghdr msg;
+  int i, nPackages, status, value, budget, len, total, sent;
 
-  /* First check if this data would fit into buffer. Might have
+  /* First check how much data would fit into buffer. Might have
      portability issues to other platforms but a reasonable fallback
      is to not do these tests. The other code below should handle the
      remaining cases somewhat worse. */
@@ -586,87 +804,121 @@ int peisk_tcpSendAtomic(PeisConnection *connection,PeisPackage *package,int len)
   /* MACOS X does not have these...  --MB 061120 */
 #ifndef __MACH__
   status=ioctl(connection->connection.tcp.socket, SIOCOUTQ, &value);
-  /* todo - use SIOCINQ on input from tcp sockets... */
-  if(status) perror("peisk_connection_sendAtomic::ioctl(SIOCOUTQ)");
-  /* todo - use getsockopt(SO_RCVBUFFER) to know the buffer size */
-  if(value > 20000) return -1; /* Too much data in buffer, come back later */
+  if(status) perror("peisk_tcpSendQueued::ioctl(SIOCOUTQ)");
 #endif
 #endif
-
-  header=&package->header;
-  header->linkCnt = htonl(connection->outgoingIdCnt++);
-
-  status=send(connection->connection.tcp.socket,(void*) data,len,MSG_DONTWAIT|MSG_NOSIGNAL);
-  if(status != -1 && status < len) {
-    if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
-      printf("Warning! Package sent only partially errno=%d, Status=%d\n",errno,status);
-    timeout=0;
-    while(1) {
-      if(status != -1) { data += status; len -= status; if(!len) break; }
-      if(++timeout > 100*2) { printf("Warning - forced to break package! (2s timeout)\n"); errno=EPIPE; break; }
-      peisk_waitForWrite(connection->connection.tcp.socket,0.01);
-      errno=0;
-      status=send(connection->connection.tcp.socket,(void*) data,len,MSG_DONTWAIT|MSG_NOSIGNAL);
-      if(errno == EPIPE) break;
-      if(status == -1 && errno != EAGAIN) {
-	/* todo - make this printout dependent on debug level? */
-	printf("error sending package - errno=%d '%s'\n",errno,strerror(errno));
-	break;
+  budget = PEISK_TCP_MAX_UNSENT - value;
+  /* Too much data in buffer, come back later. Partially sent packages
+     are always finished since nothing else can be sent before them. */
+  if(budget <= 0 && *offset == 0) return 0;
+
+  /* Gather the headers and data of as many packages as fits directly from where they are stored */
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  total=0;
+  for(i=0;i<n;i++) {
+    header = &packages[i]->package.header;
+    len = sizeof(PeisPackageHeader) + ntohs(header->datalen);
+    if(i > 0 && total + len > budget) break;
+    if(i > 0 || *offset == 0) {
+      header->linkCnt = htonl(connection->outgoingIdCnt++);
+      if(peiskernel.simulatePackageLoss > 0.0 && (rand()%1000) < (peiskernel.simulatePackageLoss*1000.0)) {
+	/* Introduces a fake packet loss on outgoing packages, used for
+	   debugging robustness */
+	wireLen[i]=0;
+	continue;
       }
     }
+    wireLen[i]=len;
+    total += len;
+    iov[msg.msg_iovlen].iov_base = (void*) header;
+    iov[msg.msg_iovlen++].iov_len = sizeof(PeisPackageHeader);
+    if(len > sizeof(PeisPackageHeader)) {
+      iov[msg.msg_iovlen].iov_base = peisk_queuedPackage_data(packages[i]);
+      iov[msg.msg_iovlen++].iov_len = len - sizeof(PeisPackageHeader);
+    }
   }
-  if(errno == EPIPE || errno == EBADF || errno == EINVAL) {
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: tcp connection %d broken pipe (header)\n",connection->id);
-    peisk_closeConnection(connection->id);
-    return -1;
-  } else if(errno == EAGAIN) {
-    if(status > 0) { if(peisk_printLevel & PEISK_PRINT_PACKAGE_ERR) printf("send - EAGAIN, status=%d\n",status); }
-    /* Package was not sent - don't remove it from queue and don't attempt any more packages for now */
-    /* Also, decrease outgoingIdCnt so we do not count this package
-       multiple times */
-    connection->outgoingIdCnt--;
-    return -1;
+  nPackages=i;
+  peisk_iovecAdvance(&msg,*offset);
+
+  status=0;
+  if(msg.msg_iovlen > 0) {
+    errno=0;
+    status=sendmsg(connection->connection.tcp.socket,&msg,MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(status == -1) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	  fprintf(stdout,"peisk: tcp connection %d broken pipe (errno=%d '%s')\n",connection->id,errno,strerror(errno));
+	peisk_closeConnection(connection->id);
+	return -1;
+      }
+      /* Nothing was sent, try again when the socket is writable */
+      status=0;
+    }
   }
-  return 0;
+
+  /* See how many packages were completely sent */
+  sent = *offset + status;
+  for(i=0;i<nPackages && sent >= wireLen[i];i++) sent -= wireLen[i];
+  if(sent > 0 && peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+    printf("Package sent only partially, %d of %d bytes\n",sent,wireLen[i]);
+
+  /* Packages that were not started are sent again later, so don't
+     count their link counters */
+  connection->outgoingIdCnt -= nPackages - i - (sent > 0 ? 1 : 0);
+  *offset = sent;
+  return i;
 }
 
-int peisk_tcpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage *package) {
-  int status;
-  
-  errno=0;
-  status=recv(connection->connection.tcp.socket,(void*)package,sizeof(PeisPackage),MSG_PEEK|MSG_NOSIGNAL);
-  if(errno == EAGAIN) return 0;                 /* Nothing received, come back later */
-  if(errno == EPIPE || status == -1) {          /* Error - close socket */
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      printf("peisk: warning - error (1) in receive, closing socket\n");
-    peisk_closeConnection(connection->id);
-    return 0;
+int peisk_tcpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage **package) {
+  PeisPackageHeader header;
+  char *data;
+  int status, len, packageLen;
+
+  if(!connection->inBuffer) {
+    connection->inBuffer = (char*) malloc(PEISK_STREAM_BUFFER_SIZE);
+    connection->inStart = connection->inEnd = 0;
   }
-  if(status < sizeof(package->header)) return 0; /* We have not yet received the full header, come back later */
 
-  if(ntohs(package->header.datalen) > PEISK_MAX_PACKAGE_SIZE) { /* Check for bad package length */
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: error, too large (%d) package received on connection %d\n",package->header.datalen,connection->id);
-    /*peisk_syncflush(connection);*/
-    peisk_closeConnection(connection->id);
-    return 0;
-  }
-
-  if(status < sizeof(package->header) + ntohs(package->header.datalen))
-    /* We have not yet received the full data, come back later */
-    return 0;
-
-  /* Ok, we have all the data we wanted, read it once again without MSG_PEEK to get rid of it */
-  errno=0;
-  status=recv(connection->connection.tcp.socket,
-	      (void*)package,sizeof(package->header) + ntohs(package->header.datalen),MSG_NOSIGNAL);
-  if(errno == EAGAIN || errno == EPIPE || status == -1 ||
-     status < sizeof(package->header) + ntohs(package->header.datalen)) {
-    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      printf("peisk: warning - error (2) in receive, closing socket. status=%d\n",status);
-    peisk_closeConnection(connection->id);
-    return 0;
+  while(1) {
+    len = connection->inEnd - connection->inStart;
+    if(len >= sizeof(PeisPackageHeader)) {
+      /* The buffered header might not be aligned, so read it from a copy */
+      data = connection->inBuffer + connection->inStart;
+      memcpy(&header,data,sizeof(PeisPackageHeader));
+      if(header.sync != PEISK_SYNC || ntohs(header.datalen) > PEISK_MAX_PACKAGE_SIZE) {
+	/* Bad package, skip to the next sync and try again */
+	peisk_syncflush(connection);
+	continue;
+      }
+      packageLen = sizeof(PeisPackageHeader) + ntohs(header.datalen);
+      if(len >= packageLen) {
+	/* We have a full package, use it directly from the buffer when possible */
+	connection->inStart += packageLen;
+	if(((intA) data) % sizeof(int32) == 0) *package = (PeisPackage*) data;
+	else memcpy(*package,data,packageLen);
+	return 1;
+      }
+    }
+
+    /* No full package in the buffer, move the partial package to
+       the beginning and read as much as is available. */
+    if(connection->inStart > 0) {
+      memmove(connection->inBuffer,connection->inBuffer+connection->inStart,len);
+      connection->inStart = 0;
+      connection->inEnd = len;
+    }
+    errno=0;
+    status=recv(connection->connection.tcp.socket,connection->inBuffer+connection->inEnd,
+		PEISK_STREAM_BUFFER_SIZE-connection->inEnd,MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 0;                                 /* Nothing received, come back later */
+    if(status <= 0) {                           /* Error or closed by peer - close socket */
+      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	printf("peisk: warning - error (1) in receive, closing socket. status=%d\n",status);
+      peisk_closeConnection(connection->id);
+      return 0;
+    }
+    connection->inEnd += status;
   }
-  return 1;
 }
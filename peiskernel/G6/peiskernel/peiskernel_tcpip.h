@@ -68,15 +68,43 @@ extern int peisk_nInetInterfaces;
 
 /** Initializes all TCP/IP interfaces */
 void peiskernel_initNetInterfaces();
-/** Checks for new incomming tcp connections */
+/** Checks for new incomming tcp connections, and advances all
+    pending tcp connections that are resolving, connecting or waiting
+    for the connect message of the peer. */
 void peisk_acceptTCPConnections();                  
-
-/** Attempts to create a TCP/IP connection towards target. Returns a PENDING connection structure, or NULL on failure.  */
+/** Listens for udp multicasts of available hosts on the local tcp/ip networks */
+void peisk_acceptUDPMulticasts();                   
+
+/** Attempts to create a TCP/IP connection towards target. Returns a
+    PENDING connection structure, or NULL on failure. Nothing here
+    blocks the kernel: hostnames are looked up in the background (see
+    PEISK_TCP_NAME_CACHE), the connect is left in progress and the
+    connection is finished by peisk_acceptTCPConnections once the
+    socket becomes writable. Without getaddrinfo_a the lookups
+    themselves still block, see PEISK_TCP_NAME_CACHE. */
 struct PeisConnection *peisk_tcpConnect(char *name,int port,int flags);
-#ifdef OLD
-/** Returns -1 if failed, otherwise connection id  number */
-int peisk_udpConnect(char *name,int port,int flags);
-#endif
+
+/** Number of hostnames whose addresses are remembered by
+    peisk_tcpConnect. Names are looked up with getaddrinfo_a when
+    available. Otherwise they are looked up with a blocking
+    getaddrinfo, which happens when a name is first used, when its
+    address expires after PEISK_TCP_NAME_TTL and, for names that could
+    not be resolved, every PEISK_TCP_NAME_RETRY seconds while it is
+    used. Failed lookups are remembered too, so that unreachable
+    autohosts do not cost a lookup on every attempt. */
+#define PEISK_TCP_NAME_CACHE       16
+/** Seconds a resolved hostname is used before it is looked up again */
+#define PEISK_TCP_NAME_TTL         300.0
+/** Seconds before a hostname that could not be resolved is tried again */
+#define PEISK_TCP_NAME_RETRY       20.0
+/** Seconds between checks if a background lookup has finished */
+#define PEISK_TCP_RESOLVE_POLL     0.05
+/** Seconds to wait for a hostname lookup before giving up on a connection */
+#define PEISK_TCP_RESOLVE_TIMEOUT  10.0
+/** Seconds to wait for the TCP handshake of an outgoing connection */
+#define PEISK_TCP_CONNECT_TIMEOUT  3.0
+/** Seconds an accepted connection may take to send its connect message */
+#define PEISK_TCP_ACCEPT_TIMEOUT   1.0
 
 
 /** Restarts the TCP/UDP/IPv4 server listening for connecting peers */
@@ -91,14 +119,25 @@ void peisk_restartServer();
     better implementation should be made in the future. */
 int peisk_ipIsConnectable(unsigned char ip[4],int port);
 
-/** Performs the sending of data on a TCP/IP connection. Package
-    points to a PeisPackage structure including data for a total 
-    length of len bytes. Returns zero on success. */
-int peisk_tcpSendAtomic(PeisConnection *connection,PeisPackage *package,int len);
-
-/** Attempts to read a package from the connection. 
+/** Maximum number of bytes we let wait in the socket send buffer. Any
+    more are kept in our own queues, so that packages with higher
+    priority queued later are not delayed behind them. */
+#define PEISK_TCP_MAX_UNSENT 20000
+
+/** Performs the sending of queued packages on a TCP/IP connection, see
+    peisk_connection_sendQueued. As many of the packages as fits in
+    the socket are sent with one gathering write, and a package that
+    is only partially written is continued by the next call instead
+    of waiting for the socket. */
+int peisk_tcpSendQueued(PeisConnection *connection,struct PeisQueuedPackage **packages,int n,int *offset);
+
+/** Attempts to read a package from the connection. Data is received
+    into the buffer of the connection with as few system calls as
+    possible and packages are parsed directly from it. *package is
+    changed to point into the buffer unless the package is not
+    properly aligned there, in which case it is copied to *package.
     Returns non-zero if there was a package.  */
-int peisk_tcpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage *package);
+int peisk_tcpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage **package);
 
 /* @} TCP/IPv4 */
 
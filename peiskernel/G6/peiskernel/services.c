@@ -46,6 +46,8 @@
 void peisk_registerDefaultServices() {
   /* Clear buffer for long messages from outdated partial messages */
   peisk_registerPeriodic(PEISK_TIMEOUT_LONG_MESSAGE/5.0,NULL,peisk_periodic_clearAssemblyBuffers);
+  peisk_registerPeriodic(PEISK_NACK_DELAY/2.0,NULL,peisk_periodic_nackLongMessages);
+  peisk_registerHook(PEISK_PORT_NACK,peisk_hook_nack);
 
   /* Acknowledgements of important packages */
   peisk_registerPeriodic(0.2,NULL,peisk_sendAcknowledgementsNow);
@@ -60,6 +62,7 @@ void peisk_registerDefaultServices() {
   peisk_registerPeriodic(PEISK_ROUTE_BROADCAST_PERIOD,NULL,peisk_periodic_routing);
   peisk_registerPeriodic(PEISK_FLUSH_PERIOD,NULL,peisk_periodic_flushPipes);
   peisk_registerHook(PEISK_PORT_ROUTING,peisk_hook_routing);
+  peisk_registerHook(PEISK_PORT_ROUTING_DELTA,peisk_hook_routingDelta);
 
   /* Synchronize timing information periodically */
   peisk_registerPeriodic(PEISK_TIMESYNC_PERIOD,NULL,peisk_periodic_timeSync);
@@ -117,6 +120,9 @@ void peisk_periodic_kernelInfo(void *data) {
   char *s;
   int i,a;
   PeisConnection *connection;
+  PeisConnectionMgrInfo *connMgrInfo;
+  PeisHashTableIterator iterator;
+  intA key;
 
   snprintf(str,sizeof(str),"%.4f",peiskernel.avgStepTime);
   peisk_setStringTuple("kernel.step-time",str);
@@ -153,6 +159,27 @@ void peisk_periodic_kernelInfo(void *data) {
   *s = 0;
   peisk_setStringTuple("kernel.connections",str);
 
+  /* Round trip time estimates and retransmission timeouts for all
+     hosts we have received acknowledgements from */
+  s=str;
+  sprintf(s,"("); s+=strlen(s);
+  peisk_hashTableIterator_first(peiskernel.connectionMgrInfoHT,&iterator);
+  for(a=0;peisk_hashTableIterator_next(&iterator);) {
+    peisk_hashTableIterator_value_generic(&iterator,&key,&connMgrInfo);
+    if(connMgrInfo->nRttSamples == 0) continue;
+    sprintf(s,"(%d %.3f %.3f %.3f)",(int)key,connMgrInfo->srtt,connMgrInfo->rttvar,connMgrInfo->rto);
+    s+=strlen(s);
+    a++;
+    if((a % 5) == 0) { sprintf(s,"\n"); s++; }
+    if(s >= str+8000) break;
+  }
+  sprintf(s,")"); s+=strlen(s);
+  *s = 0;
+  peisk_setStringTuple("kernel.rtt",str);
+
+  peisk_slabStatistics(str,sizeof(str));
+  peisk_setStringTuple("kernel.slab",str);
+
 
   if(peisk_printPortStatistics) {
     static int cnt=0;
@@ -551,20 +578,305 @@ void peisk_periodic_routing(void *arg) {
   peisk_do_routing(0,NULL);
   peisk_updateRoutingTuple();
 }
+/** Fills in the routing information about one destination the way it
+    is sent to neighbours */
+static void peisk_makeRoutingEntry(int destination,PeisRoutingInfo *routingInfo,PeisRoutingEntry *entry) {
+  int j, nConnections;
+  PeisConnectionMgrInfo *connMgrInfo;
+
+  /* See how many connections this host have */
+  if(destination == peiskernel.id) {
+    for(j=0,nConnections=0;j<=peiskernel.highestConnection;j++)
+      if(peiskernel.connections[j].id != -1) nConnections++;
+  } else {
+    connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
+    if(connMgrInfo) nConnections = connMgrInfo->nConnections;
+    else nConnections = 255; /* Aka. -1 */
+  }
+
+  entry->id = destination;
+  entry->sequenceNumber = routingInfo->sequenceNumber;
+  entry->magic = routingInfo->magic;
+  entry->hops = routingInfo->hops;
+  entry->nConnections = nConnections;
+}
+
+/** Packs a routing entry as sent in PeisRoutingPackage's */
+static void peisk_packRoutingEntry(PeisRoutingEntry *entry,unsigned char *p) {
+  int destination, sequenceNumber, magic;
+
+  destination = htonl(entry->id);
+  sequenceNumber = htonl(entry->sequenceNumber);
+  magic = htonl(entry->magic);
+  memcpy((void*)&p[0],(void*)&destination,4);
+  memcpy((void*)&p[4],(void*)&sequenceNumber,4);
+  memcpy((void*)&p[8],(void*)&magic,4);
+  p[12] = entry->hops;
+  p[13] = entry->nConnections;
+}
+
+/** Unpacks a routing entry received in a PeisRoutingPackage */
+static void peisk_unpackRoutingEntry(unsigned char *p,PeisRoutingEntry *entry) {
+  int foo[3];
+
+  memcpy((void*)foo,(void*)&p[0],12);
+  entry->id = ntohl(foo[0]);
+  entry->sequenceNumber = ntohl(foo[1]);
+  entry->magic = ntohl(foo[2]);
+  entry->hops = p[12];
+  entry->nConnections = p[13];
+}
+
+/** Writes value with seven bits per byte, lowest bits first. Returns
+    the number of bytes written, at most five. */
+static int peisk_packVarint(unsigned int value,unsigned char *p) {
+  int n=0;
+  while(value >= 0x80) {
+    p[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[n++] = value;
+  return n;
+}
+
+/** Reads a value written by peisk_packVarint. Returns the number of
+    bytes read, or zero if the value does not end before end. */
+static int peisk_unpackVarint(unsigned char *p,unsigned char *end,unsigned int *value) {
+  int n;
+  *value = 0;
+  for(n=0;p+n < end && n < 5;n++) {
+    *value |= (unsigned int) (p[n] & 0x7f) << (7*n);
+    if(!(p[n] & 0x80)) return n+1;
+  }
+  return 0;
+}
+
+/** Packs a routing entry as sent in PeisRoutingDeltaPackage's, see
+    there. Returns the number of bytes written, at most
+    PEISK_ROUTING_DELTA_MAX_ENTRY. */
+static int peisk_packRoutingDeltaEntry(PeisRoutingEntry *entry,int previousId,unsigned char *p) {
+  int n, magic;
+
+  n = peisk_packVarint((unsigned int) entry->id - (unsigned int) previousId,p);
+  n += peisk_packVarint((unsigned int) entry->sequenceNumber,p+n);
+  magic = htonl(entry->magic);
+  memcpy((void*)&p[n],(void*)&magic,4);
+  p[n+4] = entry->hops;
+  p[n+5] = entry->nConnections;
+  return n+6;
+}
+
+/** Unpacks a routing entry received in a PeisRoutingDeltaPackage.
+    Returns the number of bytes read, or zero if the entry does not
+    end before end. */
+static int peisk_unpackRoutingDeltaEntry(unsigned char *p,unsigned char *end,int previousId,PeisRoutingEntry *entry) {
+  int n, len, magic;
+  unsigned int value;
+
+  if(!(n = peisk_unpackVarint(p,end,&value))) return 0;
+  entry->id = (int) ((unsigned int) previousId + value);
+  if(!(len = peisk_unpackVarint(p+n,end,&value))) return 0;
+  entry->sequenceNumber = (int) value;
+  n += len;
+  if(p+n+6 > end) return 0;
+  memcpy((void*)&magic,(void*)&p[n],4);
+  entry->magic = ntohl(magic);
+  entry->hops = p[n+4];
+  entry->nConnections = p[n+5];
+  return n+6;
+}
+
+void peisk_routingChanged(int destination) {
+  peisk_sortedArray_insert(&peiskernel.routingDirty,destination);
+}
+
+/** Gives an entry of routingSent the given version and records the
+    change in routingChanges. */
+static void peisk_recordRoutingChange(PeisRoutingEntry *sent,int version) {
+  PeisRoutingChange *changes;
+  int allocated;
+
+  sent->version = version;
+  if(peiskernel.nRoutingChanges == peiskernel.allocatedRoutingChanges) {
+    allocated = peiskernel.allocatedRoutingChanges * 2 + 64;
+    changes = (PeisRoutingChange*) realloc(peiskernel.routingChanges,allocated*sizeof(PeisRoutingChange));
+    if(!changes) {
+      /* Without the change no incremental update can be made from an older version */
+      peiskernel.routingHorizon = version;
+      return;
+    }
+    peiskernel.routingChanges = changes;
+    peiskernel.allocatedRoutingChanges = allocated;
+  }
+  peiskernel.routingChanges[peiskernel.nRoutingChanges].version = version;
+  peiskernel.routingChanges[peiskernel.nRoutingChanges].id = sent->id;
+  peiskernel.nRoutingChanges++;
+}
+
+/** Compares the destinations given to peisk_routingChanged since the
+    last routing period with what was last sent about them and gives
+    all entries that changed the next version of the routing table. */
+static void peisk_updateRoutingSent() {
+  PeisRoutingInfo *routingInfo;
+  PeisRoutingEntry *sent, entry;
+  PeisRoutingChange *change;
+  int e, destination, forgotten;
+  int version = peiskernel.routingVersion+1;
+  int changed = 0;
+
+  /* Our own entry depends on our connections, so it is always compared */
+  peisk_routingChanged(peiskernel.id);
+  for(e=0;e<peiskernel.routingDirty.count;e++) {
+    destination = *(int*) peisk_sortedArray_get(&peiskernel.routingDirty,e);
+    sent = (PeisRoutingEntry*) peisk_sortedArray_find(&peiskernel.routingSent,destination);
+    if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(intA)destination,(void**)(void*)&routingInfo) != 0) {
+      /* Destinations that are no longer in the routing table are sent
+	 as removed until the change is forgotten */
+      if(!sent || sent->isRemoved) continue;
+      sent->isRemoved = 1;
+      sent->hops = 255;
+    } else {
+      peisk_makeRoutingEntry(destination,routingInfo,&entry);
+      if(sent && !sent->isRemoved && sent->sequenceNumber == entry.sequenceNumber && sent->magic == entry.magic &&
+	 sent->hops == entry.hops && sent->nConnections == entry.nConnections)
+	continue;
+      if(!sent && !(sent = (PeisRoutingEntry*) peisk_sortedArray_insert(&peiskernel.routingSent,destination))) continue;
+      entry.isRemoved = 0;
+      *sent = entry;
+    }
+    peisk_recordRoutingChange(sent,version);
+    changed = 1;
+  }
+  peisk_sortedArray_clear(&peiskernel.routingDirty);
+  if(!changed) return;
+  peiskernel.routingVersion = version;
+
+  /* Forget the changes made PEISK_ROUTING_KEEP_CHANGES versions ago,
+     and the destinations they removed. Changes that were made again
+     later are no longer needed anyway. */
+  for(forgotten=0;forgotten<peiskernel.nRoutingChanges;forgotten++) {
+    change = &peiskernel.routingChanges[forgotten];
+    if(change->version > version - PEISK_ROUTING_KEEP_CHANGES) break;
+    sent = (PeisRoutingEntry*) peisk_sortedArray_find(&peiskernel.routingSent,change->id);
+    if(!sent || sent->version != change->version) continue;
+    if(change->version > peiskernel.routingHorizon) peiskernel.routingHorizon = change->version;
+    if(sent->isRemoved) peisk_sortedArray_remove(&peiskernel.routingSent,change->id);
+  }
+  if(forgotten) {
+    peiskernel.nRoutingChanges -= forgotten;
+    memmove(peiskernel.routingChanges,peiskernel.routingChanges+forgotten,peiskernel.nRoutingChanges*sizeof(PeisRoutingChange));
+  }
+}
+
+static int peisk_compareRoutingEntries(const void *a,const void *b) {
+  return (*(PeisRoutingEntry*const*)a)->id - (*(PeisRoutingEntry*const*)b)->id;
+}
+
+/** Packs the given entries of routingSent into the parts of an
+    incremental update relative to base for the given connection. The
+    parts are only sent if nparts is non zero, and must then be the
+    number of parts returned when first called with nparts zero. */
+static int peisk_packRoutingDelta(PeisConnection *connection,PeisRoutingEntry **entries,int nentries,int base,int serial,int nparts) {
+  unsigned char data[PEISK_ROUTING_DELTA_SIZE],*p;
+  PeisRoutingDeltaPackage *package;
+  PeisRoutingEntry *sent;
+  int e, part, packed, previousId;
+
+  package = (PeisRoutingDeltaPackage*) data;
+  package->version = htonl(peiskernel.routingVersion);
+  package->baseVersion = htonl(base);
+  package->ackVersion = htonl(connection->routingReceived);
+  package->serial = htons(serial);
+  package->nparts = htons(nparts);
+
+  part = 0;
+  packed = 0;
+  previousId = 0;
+  p = data+sizeof(PeisRoutingDeltaPackage);
+  for(e=0;e<=nentries;e++) {
+    sent = e < nentries ? entries[e] : NULL;
+    /* Send the part when it is full or all entries are packed */
+    if(!sent || p+PEISK_ROUTING_DELTA_MAX_ENTRY > data+PEISK_ROUTING_DELTA_SIZE) {
+      if(nparts) {
+	package->part = htons(part);
+	package->entries = htons(packed);
+	peisk_sendLinkPackage(PEISK_PORT_ROUTING_DELTA,connection,p-data,data);
+      }
+      if(!sent) break;
+      part++;
+      packed = 0;
+      previousId = 0;
+      p = data+sizeof(PeisRoutingDeltaPackage);
+    }
+    p += peisk_packRoutingDeltaEntry(sent,previousId,p);
+    previousId = sent->id;
+    packed++;
+  }
+  return part+1;
+}
+
+/** Sends the neighbour on the given connection all entries that
+    changed since the version of our routing table it last
+    acknowledged, or the full table if it cannot apply such an
+    update. Something is always sent since it also acknowledges the
+    routing table of the neighbour. */
+static void peisk_sendRoutingDelta(PeisConnection *connection) {
+  static PeisRoutingEntry **entries=NULL;
+  static int allocated=0;
+  PeisRoutingEntry **newEntries, *sent;
+  PeisRoutingChange *change;
+  int e, base, nentries, nparts;
+
+  base = connection->routingAcked;
+  if(base < peiskernel.routingHorizon || base > peiskernel.routingVersion) base = 0;
+
+  if(peiskernel.routingSent.count > allocated) {
+    newEntries = (PeisRoutingEntry**) realloc(entries,peiskernel.routingSent.count*2*sizeof(PeisRoutingEntry*));
+    if(!newEntries) return;
+    entries = newEntries;
+    allocated = peiskernel.routingSent.count*2;
+  }
+
+  nentries = 0;
+  if(base) {
+    /* Each entry that changed after base once, from its latest change */
+    for(e=peiskernel.nRoutingChanges-1;e>=0 && peiskernel.routingChanges[e].version > base;e--) {
+      change = &peiskernel.routingChanges[e];
+      sent = (PeisRoutingEntry*) peisk_sortedArray_find(&peiskernel.routingSent,change->id);
+      if(sent && sent->version == change->version) entries[nentries++] = sent;
+    }
+    /* Sorted by id, the ids are packed as small differences */
+    qsort(entries,nentries,sizeof(PeisRoutingEntry*),peisk_compareRoutingEntries);
+  } else {
+    for(e=0;e<peiskernel.routingSent.count;e++) {
+      sent = (PeisRoutingEntry*) peisk_sortedArray_get(&peiskernel.routingSent,e);
+      if(!sent->isRemoved) entries[nentries++] = sent;
+    }
+  }
+
+  nparts = peisk_packRoutingDelta(connection,entries,nentries,base,peiskernel.routingSerial,0);
+  if(nparts > 0x7fff) {
+    if(peisk_printLevel & PEISK_PRINT_WARNINGS)
+      printf("peisk: warning, routing table too large to send (%d parts)\n",nparts);
+    return;
+  }
+  peisk_packRoutingDelta(connection,entries,nentries,base,peiskernel.routingSerial,nparts);
+  peiskernel.routingSerial = (peiskernel.routingSerial+1) & 0x7fff;
+}
+
 void peisk_do_routing(int kind,PeisConnection *targetConnection) {
-  int i,j;
+  int i;
 
   PeisRoutingPackage *package;
   PeisHashTableIterator iterator;
   PeisRoutingInfo *routingInfo;
   unsigned char data[PEISK_ROUTING_PAGE_SIZE],*p;
   int destination;
-  int sequenceNumber;
-  int magic;
   PeisHostInfo *hostInfo;
   int skipnext;
-  int nConnections;
-  PeisConnectionMgrInfo *connMgrInfo;
+  PeisConnection *connection;
+  PeisRoutingEntry entry;
+  int sendPages;
 
   int entries,pages,page;
   entries = peisk_hashTable_count(peiskernel.routingTable);
@@ -585,7 +897,13 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
   /*********************************************/
   if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long)peiskernel.id,(void**)(void*) &routingInfo) == 0) {
     routingInfo->hops = 0;
-    routingInfo->sequenceNumber++;
+    /* Only count up when our connections changed or once every few
+       periods, otherwise our entry would change in every update sent
+       through the network */
+    if(kind != 0 || ++peiskernel.routingRounds >= PEISK_ROUTING_SEQNO_PERIODS) {
+      routingInfo->sequenceNumber++;
+      peiskernel.routingRounds = 0;
+    }
     routingInfo->timeToQuery=0;
     /*printf("Setting seqno for myself %d to %d\n",routingInfo->id,routingInfo->sequenceNumber);
       printf("updating routinginfo: %x\n",routingInfo);*/
@@ -599,6 +917,7 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
     routingInfo->sequenceNumber = 0;
     routingInfo->connection = NULL;
     routingInfo->timeToQuery=0;
+    memset(routingInfo->alternatives,PEISK_NO_ALTERNATIVE,sizeof(routingInfo->alternatives));
     peisk_hashTable_insert(peiskernel.routingTable,(void*)(long)peiskernel.id,(void*) routingInfo);
   }
   localSequenceNumber = routingInfo->sequenceNumber;
@@ -607,8 +926,23 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
   /* Send routing information to neighbours */
   /******************************************/
 
-  /* Compute how many pages we are sending */
-  pages = (peisk_hashTable_count(peiskernel.routingTable) - 1) / PEISK_ROUTING_PER_PAGE + 1;
+  /* Neighbours understanding incremental updates get only what
+     changed since the last version they acknowledged, older ones get
+     the full routing table as pages below */
+  peisk_updateRoutingSent();
+  sendPages = 0;
+  for(i=0;i<PEISK_MAX_CONNECTIONS;i++) {
+    connection = &peiskernel.connections[i];
+    if(connection->id == -1 || (kind == 1 && connection != targetConnection)) continue;
+    if(connection->routingDeltas) peisk_sendRoutingDelta(connection);
+    else sendPages = 1;
+  }
+  if(!sendPages) pages = 0;
+  else {
+    /* Compute how many pages we are sending */
+    pages = (peisk_hashTable_count(peiskernel.routingTable) - 1) / PEISK_ROUTING_PER_PAGE + 1;
+  }
+
   /* Iterate over all destinations and split into pages */
   peisk_hashTableIterator_first(peiskernel.routingTable,&iterator);
   short pages_net = htons(pages);
@@ -627,34 +961,11 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
 
     for(i=0;i<PEISK_ROUTING_PER_PAGE && peisk_hashTableIterator_next(&iterator);i++) {
       peisk_hashTableIterator_value_fast(&iterator,&destination,&routingInfo);
-	/*printf("sending seqno %d for dest
-	  %d\n",routingInfo->sequenceNumber,destination);*/
-
 	/*printf("Sending dest %d seq %d hops %d\n",destination,routingInfo->sequenceNumber,routingInfo->hops+1);*/
 
 	package->entries++;
-
-	/* See how many connections this host have */
-	if(destination == peiskernel.id) {
-	  for(j=0,nConnections=0;j<=peiskernel.highestConnection;j++)
-	    if(peiskernel.connections[j].id != -1) nConnections++;
-	} else {
-	  connMgrInfo = peisk_lookupConnectionMgrInfo(destination);
-	  if(connMgrInfo) nConnections = connMgrInfo->nConnections;
-	  else nConnections = 255; /* Aka. -1 */
-	}
-
-	destination = htonl(destination);
-	sequenceNumber = htonl(routingInfo->sequenceNumber);
-	magic = htonl(routingInfo->magic);
-	memcpy((void*)&p[0],(void*)&destination,4);
-	memcpy((void*)&p[4],(void*)&sequenceNumber,4);
-	memcpy((void*)&p[8],(void*)&magic,4);
-	/*if(routingInfo->hops == 255) p[12] = 255;
-	  else */
-	p[12] = routingInfo->hops;
-	p[13] = nConnections;
-
+	peisk_makeRoutingEntry(destination,routingInfo,&entry);
+	peisk_packRoutingEntry(&entry,p);
 	p += PEISK_ROUTING_BYTES_PER_ENTRY;
     }
     /*printf("Sending %d bytes (%d entries, page %d)\n",p-data,package->entries,page);*/
@@ -666,14 +977,13 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
     /* Send routing data along each connection */
     if(kind == 0 || kind == 2) {
       for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
-	if(peiskernel.connections[i].id != -1)
+	if(peiskernel.connections[i].id != -1 && !peiskernel.connections[i].routingDeltas)
 	  peisk_sendLinkPackage(PEISK_PORT_ROUTING,&peiskernel.connections[i],p-data,data);
     } else if(kind == 1) {
       peisk_sendLinkPackage(PEISK_PORT_ROUTING,targetConnection,p-data,data);
     }
   }
 
-
   /*****************************************************/
   /* Handle outdated routes and routes to unknown hosts*/
   /*****************************************************/
@@ -697,6 +1007,7 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
 	/*routingInfo->sequenceNumber = 0;*/
 	/* Count down until the host will be "deleted" */
 	routingInfo->hops++;
+	peisk_routingChanged(destination);
 	if(routingInfo->hops == 254) {
 	  /* Mark this route as "deleted" */
 	  if(peisk_debugRoutes)
@@ -731,6 +1042,9 @@ void peisk_do_routing(int kind,PeisConnection *targetConnection) {
 }
 
 extern int peisk_decodeRoutingPages(int npages,PeisConnection *connection);
+extern int peisk_decodeRoutingEntries(PeisConnection *connection);
+static int peisk_decodeRoutingEntry(PeisConnection *connection,PeisConnectionMgrInfo *connMgrInfo,PeisRoutingEntry *entry);
+static void peisk_dropConnectionRoute(PeisConnection *connection,int destination);
 
 int peisk_hook_routing(int port,int dest,int sender,int datalen,void *data) {
   int page;
@@ -782,35 +1096,139 @@ int peisk_hook_routing(int port,int dest,int sender,int datalen,void *data) {
   }
   return 0;
 }
-int peisk_decodeRoutingPages(int npages,PeisConnection *connection) {
-  int j, e, skipnext, entry, page;
-  PeisConnection *bestConnection;
-  int nentries;
-  unsigned char *p;
+int peisk_hook_routingDelta(int port,int dest,int sender,int datalen,void *data) {
+  PeisRoutingDeltaPackage package;
+  PeisConnection *connection;
+  PeisConnectionMgrInfo *connMgrInfo;
+  PeisRoutingEntry entry, *received;
+  PeisRoutingInfo *routingInfo;
+  unsigned char *p, *end, *parts;
+  int i, len, ackVersion, previousId, decodeNow;
+
+  if(datalen < sizeof(PeisRoutingDeltaPackage)) {
+    fprintf(stderr,"peisk::hook_routingDelta - bad length of received package\n");
+    return -1;
+  }
+  package = *(PeisRoutingDeltaPackage*)data;
+  package.version = ntohl(package.version);
+  package.baseVersion = ntohl(package.baseVersion);
+  ackVersion = ntohl(package.ackVersion);
+  package.serial = ntohs(package.serial);
+  package.part = ntohs(package.part);
+  package.nparts = ntohs(package.nparts);
+  package.entries = ntohs(package.entries);
+  if(package.nparts < 1 || package.part < 0 || package.part >= package.nparts || package.entries < 0) {
+    fprintf(stderr,"peisk::hook_routingDelta - received bad routing update part %d of %d\n",package.part,package.nparts);
+    return -1;
+  }
+
+  connection = peisk_lookupConnection(peisk_lastConnection);
+  if(!connection) return 0;
+  /* Only newer kernels send these, so our neighbour understands them too */
+  connection->routingDeltas = 1;
+  if(ackVersion > connection->routingAcked) connection->routingAcked = ackVersion;
+
+  /* Ignore updates we already have, and incremental updates relative
+     to a version we do not have. A later update will be relative to
+     the version we acknowledge. */
+  if(package.version <= connection->routingReceived ||
+     package.baseVersion > connection->routingReceived) return 0;
+
+  if(package.version != connection->routingAssembling ||
+     package.serial != connection->routingSerial ||
+     package.nparts != connection->routingNParts) {
+    len = (package.nparts+7)/8;
+    if(len > connection->routingPartsAllocated) {
+      parts = (unsigned char*) realloc(connection->routingParts,len);
+      if(!parts) return -1;
+      connection->routingParts = parts;
+      connection->routingPartsAllocated = len;
+    }
+    memset(connection->routingParts,0,len);
+    connection->routingAssembling = package.version;
+    connection->routingSerial = package.serial;
+    connection->routingNParts = package.nparts;
+    connection->routingPartsMissing = package.nparts;
+    if(package.baseVersion == 0) {
+      /* The full table replaces whatever we had */
+      peisk_sortedArray_clear(&connection->routingEntries);
+      connection->routingReceived = 0;
+    }
+  }
+  if(connection->routingParts[package.part/8] & (1<<(package.part%8))) return 0;
+
+  /* A full table is decoded once all of it has arrived. The entries
+     of an incremental update are distinct and final, so they are
+     decoded as soon as they arrive. */
+  decodeNow = package.baseVersion != 0 && !connection->routingRedecode &&
+    connection->routingMetricCost == connection->metricCost;
+  connMgrInfo = connection->neighbour.id != -1 ? peisk_lookupConnectionMgrInfo(connection->neighbour.id) : NULL;
+
+  p = (unsigned char*) data + sizeof(PeisRoutingDeltaPackage);
+  end = (unsigned char*) data + datalen;
+  for(i=0,previousId=0;i<package.entries;i++,p+=len) {
+    if(!(len = peisk_unpackRoutingDeltaEntry(p,end,previousId,&entry))) {
+      fprintf(stderr,"peisk::hook_routingDelta - truncated routing update part %d of %d\n",package.part,package.nparts);
+      return -1;
+    }
+    previousId = entry.id;
+    if(entry.hops == 255) {
+      peisk_sortedArray_remove(&connection->routingEntries,entry.id);
+      if(decodeNow) peisk_dropConnectionRoute(connection,entry.id);
+      continue;
+    }
+    if(!(received = (PeisRoutingEntry*) peisk_sortedArray_insert(&connection->routingEntries,entry.id))) return -1;
+    *received = entry;
+    if(decodeNow) {
+      /* Marking the old route outdated lets the entry replace it, as when decoding the full table */
+      if((routingInfo = peisk_sortedArray_find(&connection->routingTable,entry.id))) routingInfo->hops = 255;
+      if(!peisk_decodeRoutingEntry(connection,connMgrInfo,received))
+	peisk_dropConnectionRoute(connection,entry.id);
+    }
+  }
+  if(decodeNow && package.entries) peisk_checkClusters();
+
+  connection->routingParts[package.part/8] |= 1<<(package.part%8);
+  if(--connection->routingPartsMissing == 0) {
+    connection->routingReceived = package.version;
+    if(!decodeNow) peisk_decodeRoutingEntries(connection);
+  }
+  return 0;
+}
+
+/** Marks all old routing information in the connection's routingTable
+    as outdated (metric=255) before a new routing table from the
+    neighbour is decoded. Returns the connection manager info of the
+    neighbour, if known. */
+static PeisConnectionMgrInfo *peisk_beginRoutingDecode(PeisConnection *connection) {
+  int e;
+  PeisConnectionMgrInfo *connMgrInfo;
+
+  for(e=0;e<connection->routingTable.count;e++)
+    ((PeisRoutingInfo*) peisk_sortedArray_get(&connection->routingTable,e))->hops=255;
+  connection->routingMetricCost=connection->metricCost;
+  connection->routingRedecode=0;
+
+  connMgrInfo = connection->neighbour.id != -1 ? peisk_lookupConnectionMgrInfo(connection->neighbour.id) : NULL;
+  if(connMgrInfo) {
+    connMgrInfo->nConnections=0;
+    peisk_routingChanged(connection->neighbour.id);
+  }
+  return connMgrInfo;
+}
+
+/** Merges one entry of a routing table received from the neighbour
+    on the given connection into the connection and main routing
+    tables. Returns non zero if the entry gives a route through the
+    connection. */
+static int peisk_decodeRoutingEntry(PeisConnection *connection,PeisConnectionMgrInfo *connMgrInfo,PeisRoutingEntry *entry) {
   intA destination;
   unsigned char metric;
-
-  PeisHashTableIterator iterator;
   PeisRoutingInfo *routingInfo;
-  PeisRoutingInfo *routingInfo2;
   int sequenceNumber, magic;
   PeisHostInfo *hostInfo;
-  /* ConnectionMgrInfo for the host from which routing tables came */
-  PeisConnectionMgrInfo *connMgrInfo;
   int nConnections;
 
-
-  /* All pages received and with the same sequence number, we can
-     now decode the pages. */
-  
-  /* First, mark all old routing information in this connection's routingTable as
-     outdated (metric=255) */
-  peisk_hashTableIterator_first(connection->routingTable,&iterator);
-  while(peisk_hashTableIterator_next(&iterator)) {
-    peisk_hashTableIterator_value_fast(&iterator,&destination,&routingInfo);
-    routingInfo->hops=255;
-  }
-    
   /** General idea is that the routingInfo magic that is propagated always comes from the 
      shortest route informtion. */        
   /** Invariant:  This function always maximize sequenceNumber - metric. 
@@ -818,259 +1236,308 @@ int peisk_decodeRoutingPages(int npages,PeisConnection *connection) {
        - If a short route to someone is lost, longer routes won't be considered until the seqno has increased.
        - If someone is lost, metrics will increase and seqno stay same => conn RT not updated => eventual delete from global RT
   */
-  /* Go through all routing info we received metric */
 
-  connMgrInfo = connection->neighbour.id != -1 ? peisk_lookupConnectionMgrInfo(connection->neighbour.id) : NULL;
-  if(connMgrInfo) connMgrInfo->nConnections=0;
+  destination=entry->id;
+  sequenceNumber=entry->sequenceNumber;
+  magic=entry->magic;
+  metric = entry->hops;
+  nConnections = entry->nConnections;
+  /* TODO - only do this if we have a high enough seqno */
+  if(connMgrInfo && destination == connection->neighbour.id && connMgrInfo->nConnections != nConnections) {
+    connMgrInfo->nConnections = nConnections;
+    peisk_routingChanged(destination);
+  }
 
-  for(entry=0,page=0;page<npages;page++) {
-    p=connection->routingPages[page]+sizeof(PeisRoutingPackage);
-    nentries = ((PeisRoutingPackage*)connection->routingPages[page])->entries;
-    for(e=0;e<nentries;e++) {	
-
-      int foo[3];
-      memcpy((void*)foo,(void*)&p[0],12);
-      destination=foo[0];
-      sequenceNumber=foo[1];
-      magic=foo[2];
-
-      /*
-      memcpy((void*)&destination,(void*)&p[0],4);
-      memcpy((void*)&sequenceNumber,(void*)&p[4],4);
-      memcpy((void*)&magic,(void*)&p[8],4);
-      */
-
-      destination=ntohl(destination);
-      sequenceNumber=ntohl(sequenceNumber);
-      magic=ntohl(magic);
-      metric = p[12];
-      nConnections = p[13];
-      /* TODO - only do this if we have a high enough seqno */
-      if(connMgrInfo) connMgrInfo->nConnections = nConnections;
-
-      PEISK_ASSERT(connection->metricCost>0,("Connection %d have metricCost %d\n",connection->id,connection->metricCost));
-      if(metric < 250) metric += connection->metricCost;
-      if(metric >= PEISK_METRIC_GIVEUP) metric=255;
-      p+=PEISK_ROUTING_BYTES_PER_ENTRY;
-      PEISK_ASSERT(metric > 0,("Invalid metric %d received in routing package, for dest %d\n",metric,(int)destination));
-      
-      /*printf("Routing decoded: dest %d seq %d hops %d\n",destination,sequenceNumber,metric);*/
-
-      /*printf("conn %d got hops %d seqno %d magic %x for dest %d\n",connection->id,metric,sequenceNumber,magic,destination);*/
-      
-      /* Detect duplicate PEIS with same ID */
-      if(destination == peiskernel.id && magic != peiskernel.magicId) {
-	if((peisk_hashTable_getValue(peiskernel.routingTable,
-				     (void*)(long)peiskernel.id,(void**)(void*) &routingInfo) == 0 &&
-	    routingInfo->hops > 3)) {
-	  /* Some other guy with our ID might exist on the network... very bad! */
-	  fprintf(stderr,"peisk::routing hook: Warning! Another PEIS with our ID (%d) seem to exist on network.\n Suggest doing a proper (soft) shutdown and restart.\n",peiskernel.id);
-	} /* Else: This might just old routingInformation lying around. */
+  PEISK_ASSERT(connection->metricCost>0,("Connection %d have metricCost %d\n",connection->id,connection->metricCost));
+  if(metric < 250) metric += connection->metricCost;
+  if(metric >= PEISK_METRIC_GIVEUP) metric=255;
+  PEISK_ASSERT(metric > 0,("Invalid metric %d received in routing package, for dest %d\n",metric,(int)destination));
+
+  /*printf("Routing decoded: dest %d seq %d hops %d\n",destination,sequenceNumber,metric);*/
+
+  /*printf("conn %d got hops %d seqno %d magic %x for dest %d\n",connection->id,metric,sequenceNumber,magic,destination);*/
+
+  /* Detect duplicate PEIS with same ID */
+  if(destination == peiskernel.id && magic != peiskernel.magicId) {
+    if((peisk_hashTable_getValue(peiskernel.routingTable,
+				 (void*)(long)peiskernel.id,(void**)(void*) &routingInfo) == 0 &&
+	routingInfo->hops > 3)) {
+      /* Some other guy with our ID might exist on the network... very bad! */
+      fprintf(stderr,"peisk::routing hook: Warning! Another PEIS with our ID (%d) seem to exist on network.\n Suggest doing a proper (soft) shutdown and restart.\n",peiskernel.id);
+    } /* Else: This might just old routingInformation lying around. */
+  }
+  /* Check if we have a possible conflict of multiple PEIS with same ID and different magic */
+  /* This is checked by the information in the knownHosts information */
+  hostInfo = peisk_lookupHostInfo(destination);
+  if(hostInfo && 
+     destination != peiskernel.id &&
+     hostInfo->magic != magic) {
+
+    /* Magic info for this host does not correspond with old known host information,
+       send a query to this new host using a new routing to him.
+       If he responds (it is truly a new host) then 
+       the response will trigger a deleteHost and a refresh. If not (he is just an 
+       old remnant in the routes), then no harm done. */
+    /* We are forced to decrease the seqno value down to what this information provides.
+       This makes the seqno - metric decrease, but it only happens due to a restarted host so that should be ok. 
+       As soon as the hostinfo query has responded back to us we will be monotonically increasing again... 
+    */
+
+    /** Heuristic:
+       1. Temporarily update route to use this new path
+       2. Sends a hostQuery (this will append the query message
+       to this connection)
+       3. Restore route to be what it was previously.
+
+       4. When we receive the reply from the host, then
+       hostinfo, route and magic will be updated
+       permanently. Host will be reborn. (dead+alive)
+
+       Case A: Host has disappeared and a new host has appeared.
+       * First time we see the new host magic, we will query him
+       using the new path (since old path is older than X
+       seconds). After a while he responds, makes him reborn etc. 
+
+       Case B: We get an incorrect route to a "new" instance of
+       the host. 
+       * We send a query to him, but do not change routing table
+       * Hence, we will not propagate further any incorrect path
+       to this host. 
+    */
+
+    PeisConnection *prevConnection = NULL;
+    routingInfo=NULL;
+    if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,
+				(void**)(void*)&routingInfo) == 0) {
+      prevConnection = routingInfo->connection;
+      /* Set a new temporary route */
+      routingInfo->connection = connection;
+      /* We don't care to update hops, seqno, magic etc. */
+    }
+    /* Actual query is done after changes to routing */
+
+    /* Only perform query if it is better then the current best global routing, 
+       or if it is the current global routing. This reduces the total number of queries significantly */
+    if(routingInfo && ((metric < routingInfo->hops) || prevConnection == connection)) {
+      int oldMagic = hostInfo->magic;
+      hostInfo->magic = magic;
+      peisk_queryHostInfo(destination);
+      hostInfo->magic = oldMagic;
+    }
+    if(prevConnection && routingInfo) {
+      /* Restore old route */
+      routingInfo->connection = prevConnection;
+    }
+  }
+  /* Insert into connection routing table */
+  if(metric < 250) {
+    if((routingInfo = peisk_sortedArray_find(&connection->routingTable,destination))) {
+      /* Old destination found */
+      /* update metric value if this routingInfo is fresh */
+      if(sequenceNumber-metric >= routingInfo->sequenceNumber-routingInfo->hops) {
+
+	routingInfo->hops = metric;
+	/*printf("updating connection %d metric to %d to be %d\n",connection->id,destination,metric);*/
+
+	/*PEISK_ASSERT(sequenceNumber>=routingInfo->sequenceNumber,
+	  ("receiving older sequence number for host %d was: %d (%x) received: %d, metric: %d?\n",destination,
+	  routingInfo->sequenceNumber,routingInfo,sequenceNumber,metric));*/
+	/*if(sequenceNumber<routingInfo->sequenceNumber) exit(0);*/ /* DEBUG */
+
+	routingInfo->sequenceNumber = sequenceNumber;
+
+	/*printf("(1) updating routinginfo: %x to %dn",routingInfo,sequenceNumber);*/
       }
-      /* Check if we have a possible conflict of multiple PEIS with same ID and different magic */
-      /* This is checked by the information in the knownHosts information */
-      hostInfo = peisk_lookupHostInfo(destination);
-      if(hostInfo && 
-	 destination != peiskernel.id &&
-	 hostInfo->magic != magic) {
-	
-	/* Magic info for this host does not correspond with old known host information,
-	   send a query to this new host using a new routing to him.
-	   If he responds (it is truly a new host) then 
-	   the response will trigger a deleteHost and a refresh. If not (he is just an 
-	   old remnant in the routes), then no harm done. */
-	/* We are forced to decrease the seqno value down to what this information provides.
-	   This makes the seqno - metric decrease, but it only happens due to a restarted host so that should be ok. 
-	   As soon as the hostinfo query has responded back to us we will be monotonically increasing again... 
-	*/
-	
-	/** Heuristic:
-	   1. Temporarily update route to use this new path
-	   2. Sends a hostQuery (this will append the query message
-	   to this connection)
-	   3. Restore route to be what it was previously.
-	   
-	   4. When we receive the reply from the host, then
-	   hostinfo, route and magic will be updated
-	   permanently. Host will be reborn. (dead+alive)
-	   
-	   Case A: Host has disappeared and a new host has appeared.
-	   * First time we see the new host magic, we will query him
-	   using the new path (since old path is older than X
-	   seconds). After a while he responds, makes him reborn etc. 
-	   
-	   Case B: We get an incorrect route to a "new" instance of
-	   the host. 
-	   * We send a query to him, but do not change routing table
-	   * Hence, we will not propagate further any incorrect path
-	   to this host. 
-	*/
-
-	PeisConnection *prevConnection = NULL;
-	routingInfo=NULL;
-	if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,
-				    (void**)(void*)&routingInfo) == 0) {
-	  prevConnection = routingInfo->connection;
-	  /* Set a new temporary route */
-	  routingInfo->connection = connection;
-	  /* We don't care to update hops, seqno, magic etc. */
-	}
-	/* Actual query is done after changes to routing */
 
-	/* Only perform query if it is better then the current best global routing, 
-	   or if it is the current global routing. This reduces the total number of queries significantly */
-	if(routingInfo && ((metric < routingInfo->hops) || prevConnection == connection)) {
-	  int oldMagic = hostInfo->magic;
-	  hostInfo->magic = magic;
-	  peisk_queryHostInfo(destination);
-	  hostInfo->magic = oldMagic;
-	}
-	if(prevConnection && routingInfo) {
-	  /* Restore old route */
-	  routingInfo->connection = prevConnection;
-	}
+    } else {
+      /*printf("setting connection %d metric to %d to be %d\n",connection->id,destination,metric);*/
+
+      /* This destination didn't exist previously in connection routing table */
+      routingInfo = (PeisRoutingInfo*) peisk_sortedArray_insert(&connection->routingTable,destination);
+      if(!routingInfo) return 0;
+      routingInfo->timeToQuery=0;
+      routingInfo->id = destination;
+      routingInfo->hops = metric;
+      routingInfo->connection = connection;
+      routingInfo->magic = magic;
+      PEISK_ASSERT(routingInfo->connection->id != -1,("Bad connection that we received new routing info from. peisk_lastConnection = %d\n",peisk_lastConnection));
+      routingInfo->sequenceNumber = sequenceNumber;
+
+      /*printf("(2) updating routinginfo: %x to %d\n",routingInfo,sequenceNumber);
+	printf("setting connection dest: %d to seq %d\n",routingInfo->id,routingInfo->sequenceNumber);*/
+    }
+
+    /* Insert/update in main routing table */
+    if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,(void**)(void*)&routingInfo) == 0) {
+
+      /* If old route was using this connection, then update old route to whatever this connection is now. */
+      if(routingInfo->connection == connection) {
+	if(routingInfo->sequenceNumber != sequenceNumber || routingInfo->hops != metric || routingInfo->magic != magic)
+	  peisk_routingChanged(destination);
+	routingInfo->sequenceNumber = sequenceNumber;
+	routingInfo->hops = metric;
+	routingInfo->magic = magic;
+      }
+      /* Else, if this route is strictly better than the old route, update it */
+      else if(sequenceNumber-metric > routingInfo->sequenceNumber-routingInfo->hops) {
+	/*printf("Updating global metric to %d to be %d and use #%d\n",destination,metric,connection->id);*/
+	peisk_routingChanged(destination);
+	routingInfo->sequenceNumber = sequenceNumber;
+	routingInfo->hops = metric;
+	routingInfo->magic = magic;
+	routingInfo->connection = connection;
       }
-      /* Insert into connection routing table */
+      peisk_findRoutingAlternatives(routingInfo);
+    } else {
+      /* This destination didn't exist previously in main routing
+	 table */
       if(metric < 250) {
-	if(peisk_hashTable_getValue(connection->routingTable,(void*)(long) destination,
-				    (void**)(void*)&routingInfo) == 0) {
-	  /* Old destination found */
-	  /* update metric value if this routingInfo is fresh */
-	  if(sequenceNumber-metric >= routingInfo->sequenceNumber-routingInfo->hops) {
-	    
-	    routingInfo->hops = metric;
-	    /*printf("updating connection %d metric to %d to be %d\n",connection->id,destination,metric);*/
-	    
-	    /*PEISK_ASSERT(sequenceNumber>=routingInfo->sequenceNumber,
-	      ("receiving older sequence number for host %d was: %d (%x) received: %d, metric: %d?\n",destination,
-	      routingInfo->sequenceNumber,routingInfo,sequenceNumber,metric));*/
-	    /*if(sequenceNumber<routingInfo->sequenceNumber) exit(0);*/ /* DEBUG */
-
-	    routingInfo->sequenceNumber = sequenceNumber;
-
-	    /*printf("(1) updating routinginfo: %x to %dn",routingInfo,sequenceNumber);*/
-	  }
-	  
-	} else {
-	  /*printf("setting connection %d metric to %d to be %d\n",connection->id,destination,metric);*/
-	  
-	  /* This destination didn't exist previously in connection routing table */
-	  routingInfo = (PeisRoutingInfo*) malloc(sizeof(struct PeisRoutingInfo));
-	  routingInfo->timeToQuery=0;
-	  routingInfo->id = destination;
-	  routingInfo->hops = metric;
-	  routingInfo->connection = connection;
-	  routingInfo->magic = magic;
-	  PEISK_ASSERT(routingInfo->connection->id != -1,("Bad connection that we received new routing info from. peisk_lastConnection = %d\n",peisk_lastConnection));
-	  routingInfo->sequenceNumber = sequenceNumber;
-	  
-	  /*printf("(2) updating routinginfo: %x to %d\n",routingInfo,sequenceNumber);
-	    printf("setting connection dest: %d to seq %d\n",routingInfo->id,routingInfo->sequenceNumber);*/
-	  peisk_hashTable_insert(connection->routingTable,(void*)(long)destination,routingInfo);
-	}
-	
-	/* Insert/update in main routing table */
-	if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,(void**)(void*)&routingInfo) == 0) {
-	  
-	  /* If old route was using this connection, then update old route to whatever this connection is now. */
-	  if(routingInfo->connection == connection) {
-	    routingInfo->sequenceNumber = sequenceNumber;
-	    routingInfo->hops = metric;
-	    routingInfo->magic = magic;
-	  }
-	  /* Else, if this route is strictly better than the old route, update it */
-	  else if(sequenceNumber-metric > routingInfo->sequenceNumber-routingInfo->hops) {
-	    /*printf("Updating global metric to %d to be %d and use #%d\n",destination,metric,connection->id);*/
-	    routingInfo->sequenceNumber = sequenceNumber;
-	    routingInfo->hops = metric;
-	    routingInfo->magic = magic;
-	    routingInfo->connection = connection;
-	  }
-	} else {
-	  /* This destination didn't exist previously in main routing
-	     table */
-	  if(metric < 250) {
-	    routingInfo = (PeisRoutingInfo*) malloc(sizeof(struct PeisRoutingInfo));
-	    routingInfo->id = destination;
-	    routingInfo->hops = metric;
-	    routingInfo->connection = connection;
-	    routingInfo->sequenceNumber = sequenceNumber;
-	    routingInfo->magic = magic;
-	    routingInfo->timeToQuery=0;
-
-	    peisk_hashTable_insert(peiskernel.routingTable,(void*)(long)destination,routingInfo);
-	    if(peisk_debugRoutes)
-	      printf("Creating new route to %d using connection #%d\n",(int)destination,connection->id);
-	  }
-	}
+	routingInfo = (PeisRoutingInfo*) malloc(sizeof(struct PeisRoutingInfo));
+	routingInfo->id = destination;
+	routingInfo->hops = metric;
+	routingInfo->connection = connection;
+	routingInfo->sequenceNumber = sequenceNumber;
+	routingInfo->magic = magic;
+	routingInfo->timeToQuery=0;
+	peisk_findRoutingAlternatives(routingInfo);
+
+	peisk_hashTable_insert(peiskernel.routingTable,(void*)(long)destination,routingInfo);
+	peisk_routingChanged(destination);
+	if(peisk_debugRoutes)
+	  printf("Creating new route to %d using connection #%d\n",(int)destination,connection->id);
       }
     }
   }
-  
-  /* Go through all old routes, see which ones where not updated and
-     remove them from connection routingTable */
-  peisk_hashTableIterator_first(connection->routingTable,&iterator);
-  skipnext=0;
-  while(skipnext || peisk_hashTableIterator_next(&iterator)) {
-    skipnext=0;
-    if(!peisk_hashTableIterator_value_generic(&iterator,&destination,&routingInfo)) continue;
-
-    if(routingInfo->hops == 255) {
-      /* Remove this route from connection routingTable */
-      skipnext=peisk_hashTableIterator_next(&iterator);
-      peisk_hashTable_remove(connection->routingTable,(void*)(long)destination);
-      free(routingInfo);
-      
-      /* See if it needs to be "removed" from main routing table */
-      /* "Removing" a connection from the main routing table
-	 corresponds to settings it's hops to 250 or higher. A periodic
-	 function checks hops in the main routing table, depending
-	 on the value it can treat the route as "lost" and take
-	 appropriate actions. */
-      
-      /* This overwrites old value of the routingInfo pointer - take care, we still have destination ok */
-      if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,(void**)(void*)&routingInfo) == 0) {
-	if(routingInfo->connection == connection && routingInfo->hops < 250) {
-	  /*printf("Setting hops to %d in main routingtable to 250\n",destination);*/
-	  routingInfo->hops=250;
-	  metric = 250;
-	  sequenceNumber = routingInfo->sequenceNumber;
-	  bestConnection = NULL;
-	  magic = routingInfo->magic;
-	  
-	  /* Search through all other connections and 
-	     update routingInfo if there is anyone else */
-	  for(j=0;j<=peiskernel.highestConnection;j++)
-	    if(peiskernel.connections[j].id != -1 &&
-	       peisk_hashTable_getValue(peiskernel.connections[j].routingTable,
-					(void*)(long) destination,(void**)(void*) &routingInfo2) == 0 &&
-	       routingInfo2->sequenceNumber-routingInfo2->hops > sequenceNumber-metric) {
-	      metric=routingInfo2->hops;
-	      sequenceNumber=routingInfo2->sequenceNumber;
-	      bestConnection = &peiskernel.connections[j]; /*routingInfo2->connection;*/
-	      magic = routingInfo2->magic;
-	    }
-	  routingInfo->connection = bestConnection;
-	  routingInfo->hops = metric;
-	  routingInfo->sequenceNumber = sequenceNumber;
-	  routingInfo->magic = magic;
-	  /*if(metric < 250)
-	    q
-	    printf("Route to %d rescued to %d hops using connection #%d instead\n",destination,metric,bestConnection->id);
-	    else
-	    printf("Route to %d is (temporarily?) lost\n",destination);*/
+  return metric < 250;
+}
+
+void peisk_findRoutingAlternatives(PeisRoutingInfo *routingInfo) {
+  int i, j;
+  PeisConnection *connection;
+  PeisRoutingInfo *route;
+
+  i=0;
+  if(routingInfo->hops < 250)
+    for(j=0;j<=peiskernel.highestConnection && i<PEISK_ROUTING_ALTERNATIVES;j++) {
+      connection = &peiskernel.connections[j];
+      if(connection->id == -1 || connection == routingInfo->connection) continue;
+      /* Only routes as short and as fresh as the main route lead
+	 strictly closer to the destination */
+      if(!(route = peisk_sortedArray_find(&connection->routingTable,routingInfo->id)) ||
+	 route->hops != routingInfo->hops ||
+	 route->sequenceNumber - route->hops < routingInfo->sequenceNumber - routingInfo->hops)
+	continue;
+      routingInfo->alternatives[i++] = j;
+    }
+  for(;i<PEISK_ROUTING_ALTERNATIVES;i++) routingInfo->alternatives[i] = PEISK_NO_ALTERNATIVE;
+}
+
+/** Removes the route to the given destination from the connection's
+    routingTable, and reroutes or marks as lost the main route if it
+    was using the connection. */
+static void peisk_dropConnectionRoute(PeisConnection *connection,int destination) {
+  int j, sequenceNumber, magic;
+  PeisConnection *bestConnection;
+  unsigned char metric;
+  PeisRoutingInfo *routingInfo;
+  PeisRoutingInfo *routingInfo2;
+
+  if(peisk_sortedArray_remove(&connection->routingTable,destination)) return;
+
+  /* See if it needs to be "removed" from main routing table */
+  /* "Removing" a connection from the main routing table
+     corresponds to settings it's hops to 250 or higher. A periodic
+     function checks hops in the main routing table, depending
+     on the value it can treat the route as "lost" and take
+     appropriate actions. */
+
+  if(peisk_hashTable_getValue(peiskernel.routingTable,(void*)(long) destination,(void**)(void*)&routingInfo) == 0) {
+    if(routingInfo->connection == connection && routingInfo->hops < 250) {
+      /*printf("Setting hops to %d in main routingtable to 250\n",destination);*/
+      routingInfo->hops=250;
+      peisk_routingChanged(destination);
+      metric = 250;
+      sequenceNumber = routingInfo->sequenceNumber;
+      bestConnection = NULL;
+      magic = routingInfo->magic;
+
+      /* Search through all other connections and 
+	 update routingInfo if there is anyone else */
+      for(j=0;j<=peiskernel.highestConnection;j++)
+	if(peiskernel.connections[j].id != -1 &&
+	   (routingInfo2 = peisk_sortedArray_find(&peiskernel.connections[j].routingTable,destination)) &&
+	   routingInfo2->sequenceNumber-routingInfo2->hops > sequenceNumber-metric) {
+	  metric=routingInfo2->hops;
+	  sequenceNumber=routingInfo2->sequenceNumber;
+	  bestConnection = &peiskernel.connections[j]; /*routingInfo2->connection;*/
+	  magic = routingInfo2->magic;
 	}
-      } else {
-	if (peisk_printLevel & PEISK_PRINT_WARNINGS)
-	  PEISK_ASSERT(0,("Removing route to %d from connection #%d routingtable, but it didn't exist in main routing table\n",(int)destination,connection->id));
-      }
+      routingInfo->connection = bestConnection;
+      routingInfo->hops = metric;
+      routingInfo->sequenceNumber = sequenceNumber;
+      routingInfo->magic = magic;
+      peisk_findRoutingAlternatives(routingInfo);
+      /*if(metric < 250)
+	q
+	printf("Route to %d rescued to %d hops using connection #%d instead\n",destination,metric,bestConnection->id);
+	else
+	printf("Route to %d is (temporarily?) lost\n",destination);*/
     }
+  } else {
+    if (peisk_printLevel & PEISK_PRINT_WARNINGS)
+      PEISK_ASSERT(0,("Removing route to %d from connection #%d routingtable, but it didn't exist in main routing table\n",(int)destination,connection->id));
+  }
+}
+
+/** Removes the routes that were not refreshed by the routing table
+    just decoded from the connection's routingTable. */
+static void peisk_finishRoutingDecode(PeisConnection *connection) {
+  int e;
+  PeisRoutingInfo *routingInfo;
+
+  /* Go through all old routes, see which ones where not updated and
+     remove them. Removing moves the routes after it, so go backwards. */
+  for(e=connection->routingTable.count-1;e>=0;e--) {
+    routingInfo = (PeisRoutingInfo*) peisk_sortedArray_get(&connection->routingTable,e);
+    if(routingInfo->hops == 255) peisk_dropConnectionRoute(connection,routingInfo->id);
   }
   
   /* See if our network cluster have changed due to new routing
      information */
   /*printf("CHECKING CLUSTERS\n");*/
   peisk_checkClusters();
+}
+
+int peisk_decodeRoutingPages(int npages,PeisConnection *connection) {
+  int e, page;
+  int nentries;
+  unsigned char *p;
+  PeisConnectionMgrInfo *connMgrInfo;
+  PeisRoutingEntry entry;
+
+  /* All pages received and with the same sequence number, we can
+     now decode the pages. */
+  connMgrInfo = peisk_beginRoutingDecode(connection);
+  for(page=0;page<npages;page++) {
+    p=connection->routingPages[page]+sizeof(PeisRoutingPackage);
+    nentries = ((PeisRoutingPackage*)connection->routingPages[page])->entries;
+    for(e=0;e<nentries;e++,p+=PEISK_ROUTING_BYTES_PER_ENTRY) {
+      peisk_unpackRoutingEntry(p,&entry);
+      peisk_decodeRoutingEntry(connection,connMgrInfo,&entry);
+    }
+  }
+  peisk_finishRoutingDecode(connection);
+  return 0;
+}
+
+int peisk_decodeRoutingEntries(PeisConnection *connection) {
+  int e;
+  PeisConnectionMgrInfo *connMgrInfo;
+
+  connMgrInfo = peisk_beginRoutingDecode(connection);
+  for(e=0;e<connection->routingEntries.count;e++)
+    peisk_decodeRoutingEntry(connection,connMgrInfo,(PeisRoutingEntry*) peisk_sortedArray_get(&connection->routingEntries,e));
+  peisk_finishRoutingDecode(connection);
   return 0;
 }
 
@@ -1091,7 +1558,7 @@ void peisk_updateRoutingTuple() {
     /*
     PeisConnection *connection = routingInfo->connection;
     if(connection && 
-       peisk_hashTable_getValue(connection->routingTable,(void*)(long) destination,(void**)(void*)&routingInfo) == 0) {
+       (routingInfo = peisk_sortedArray_find(&connection->routingTable,destination))) {
       sprintf(s," %d sq %d m %d",connection->id,routingInfo->sequenceNumber,routingInfo->hops);
     } else {
       sprintf(s,"0 0");
@@ -1226,20 +1693,41 @@ int peisk_hook_trace(int port,int destination,int sender,int datalen,void *data)
 /* STATUS:                                                                    */
 /*                                                                            */
 /* PORTS: PEISK_PORT_UDP_SPEED                                                */
-/* VARIABLES: Manages congestion control on connections requiring it.         */
+/* VARIABLES: Manages congestion control on all connections.                  */
 /*                                                                            */
 /*                                                                            */
 /******************************************************************************/
 
+/** Round trip time towards the neighbour of a connection as used by
+    the congestion control. */
+static double peisk_connectionRtt(PeisConnection *connection) {
+  PeisConnectionMgrInfo *connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
+  if(!connMgrInfo || connMgrInfo->nRttSamples == 0) return PEISK_CONNECTION_CONTROL_PERIOD;
+  return connMgrInfo->srtt < PEISK_CC_MIN_RTT ? PEISK_CC_MIN_RTT : connMgrInfo->srtt;
+}
+
 void peisk_periodic_connectionControl1(void *data) {
   int i;
   PeisConnection *connection;
+  double rtt, gain;
 
   for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
     if(peiskernel.connections[i].id != -1) {
       connection=&peiskernel.connections[i];
-      connection->outgoing -= PEISK_CONNECTION_CONTROL_PERIOD * connection->maxOutgoing;
-      if(connection->outgoing < 0.0) connection->outgoing=0.0;
+      /* Only connections that had more to send than the pacer allowed
+	 probe for more bandwidth */
+      if(!connection->rateLimited) continue;
+      connection->rateLimited=0;
+      rtt=peisk_connectionRtt(connection);
+      if(connection->maxOutgoing < connection->ssthresh) {
+	/* Slow start, doubling the rate each round trip */
+	gain = PEISK_CONNECTION_CONTROL_PERIOD / rtt;
+	connection->maxOutgoing *= 1.0 + (gain < 1.0 ? gain : 1.0);
+      } else
+	/* Congestion avoidance, one more package each round trip */
+	connection->maxOutgoing += (sizeof(PeisPackageHeader)+PEISK_MAX_PACKAGE_SIZE) *
+	  PEISK_CONNECTION_CONTROL_PERIOD / (rtt * rtt);
+      if(connection->maxOutgoing > PEISK_CC_MAX_RATE) connection->maxOutgoing = PEISK_CC_MAX_RATE;
     }
 }
 void peisk_periodic_connectionControl2(void *data) {
@@ -1249,13 +1737,16 @@ void peisk_periodic_connectionControl2(void *data) {
   for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
     if(peiskernel.connections[i].id != -1) {
       connection=&peiskernel.connections[i];
-      if(peiskernel.connections[i].type == eUDPConnection) {
+      /* Older kernels only expect these reports on UDP connections,
+	 shared memory connections are never paced and need none */
+      if(!connection->isPending && connection->type != eShmConnection &&
+	 (connection->sequencedIds || connection->type == eUDPConnection) &&
+	 connection->incomingIdHi - connection->incomingIdLo > 0) {
 	/* Send a message containing total number of expected packages (hi - lo) and successfully received packages (succ)
 	   for the last time period. */
-	message[0] = connection->incomingIdHi - connection->incomingIdLo;
-	message[1] = connection->incomingIdSuccess;
+	message[0] = htonl(connection->incomingIdHi - connection->incomingIdLo);
+	message[1] = htonl(connection->incomingIdSuccess);
 	peisk_sendLinkPackage(PEISK_PORT_UDP_SPEED, connection, sizeof(message), (void*) message);
-	printf("Sending UDP speed: %d/%d=%f\n",message[1],message[0],((float)message[1])/message[0]);
       }
       if(connection->incomingIdHi - connection->incomingIdLo > 0)
 	connection->estimatedPacketLoss = connection->estimatedPacketLoss*0.9 +
@@ -1268,16 +1759,31 @@ void peisk_periodic_connectionControl2(void *data) {
 }
 int peisk_hook_udp_speed(int port,int destination,int sender,int datalen,void *data) {
   int *message = (int*) data;
-  double ratio = ((double) message[1]) / message[0];
+  int expected, received;
+  double loss, factor;
   PeisConnection *connection = peisk_lookupConnection(peisk_lastConnection);
-  if(!connection) return 1;
-  printf("Got UDP speed control: %d/%d=%f, thr: %d maxOutgoing=%f\n",message[1],message[0],ratio,connection->isThrottled,connection->maxOutgoing);
-
-  if(ratio < 0.75 && connection->isThrottled) connection->maxOutgoing = PEISK_MIN_CONTROL_SPEED > connection->maxOutgoing/1.5 ? PEISK_MIN_CONTROL_SPEED : connection->maxOutgoing/1.1;
-  else if(ratio > 0.95 && connection->isThrottled) connection->maxOutgoing *= 1.1;
-
-  connection->isThrottled=0;
-
+  if(!connection || datalen < sizeof(int)*2) return 1;
+
+  expected = ntohl(message[0]);
+  received = ntohl(message[1]);
+  if(expected <= 0) return 1;
+  loss = 1.0 - ((double) received) / expected;
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    printf("peisk: connection %d lost %d/%d packages, rate: %.0f bytes/s\n",
+	   connection->id,expected-received,expected,connection->maxOutgoing);
+
+  /* Multiplicative decrease on congestion, at most once per round
+     trip since losses during it were caused by the old rate. The
+     decrease is proportional to the loss so that links with some
+     random loss, eg. wireless, are not throttled to a standstill. */
+  if(loss > PEISK_CC_LOSS_THRESHOLD &&
+     peisk_timeNow - connection->lastDecrease > peisk_connectionRtt(connection)) {
+    factor = 1.0 - loss * PEISK_CC_LOSS_GAIN;
+    connection->maxOutgoing *= factor > PEISK_CC_DECREASE ? factor : PEISK_CC_DECREASE;
+    if(connection->maxOutgoing < PEISK_MIN_CONTROL_SPEED) connection->maxOutgoing = PEISK_MIN_CONTROL_SPEED;
+    connection->ssthresh = connection->maxOutgoing;
+    connection->lastDecrease = peisk_timeNow;
+  }
   return 1;
 }
 
@@ -1450,68 +1956,42 @@ void peisk_callback_kernel_quit(PeisTuple *tuple,void *arg) {
 /*                                                                            */
 /******************************************************************************/
 
-void peisk_sendAcknowledgementsNow() {
-  int i,j,total;
+void peisk_sendAckBatch(PeisAckBatch *batch) {
   int v;
-  int destination;
-  unsigned char buff[1024];
-  unsigned char *data;
-  int priority;
-
-  /* Iterate over all ack's to send */
-  for(i=0;i<peiskernel.nAcknowledgementPackages;i++)
-    if(peiskernel.acknowledgementPackages[i].destination > 0) {
-      destination = peiskernel.acknowledgementPackages[i].destination;
-      data = buff;
-      data += sizeof(int);
-      /* Iterate over all remaining ack's, add them to the list to send
-	 and mark as already sent (.dest=-1) */
-      for(total=0,j=i,priority=0;j<peiskernel.nAcknowledgementPackages&&total<200;j++) {
-	if(peiskernel.acknowledgementPackages[j].destination == destination) {
-	  total++;
-	  priority += peiskernel.acknowledgementPackages[j].priority;
-	  memcpy(data,&peiskernel.acknowledgementPackages[j].ackID,sizeof(int));
-	  data += sizeof(int);
-	  peiskernel.acknowledgementPackages[j].destination=-1;
-	}
-      }
-      v = htonl(total);
-      memcpy(buff,&v,sizeof(int));
-      
-      /*printf("Sending %d acks to %d\n",total,destination);*/
-
-      /* Depending on how many packages was marked as a priority-to-acknowledge package
-	 we send in acknowledged or just normal mode.
-	 Note that pure acknowledgement packages always register as non priorty-to-ack packages. 
-      */
-      if(priority > 0)
-	peisk_sendMessage(PEISK_PORT_ACKNOWLEDGEMENTS,destination,sizeof(int)*(1+total),
-			  (void*)buff,PEISK_PACKAGE_RELIABLE);
-      else
-	peisk_sendMessage(PEISK_PORT_ACKNOWLEDGEMENTS,destination,sizeof(int)*(1+total),(void*)buff,0);
-    }
-  peiskernel.nAcknowledgementPackages=0;
-  /*
-  ack.header.id = htonl(rand() & 0x7fffffff);
-  ack.header.ackID = ackID;
-  ack.header.flags = htons(PEISK_PACKAGE_IS_ACK);
-  ack.header.type = ePeisDirectPackage;
-  ack.header.hops=0;
-  ack.header.source=htonl(peiskernel.id);
-  ack.header.destination=destination;
-  ack.header.port=0;
-  ack.header.datalen=htons(0);
-  ack.header.seqlen=htons(0);
-  ack.header.seqid=0;
-  ack.header.seqnum=htons(0);
-  peisk_connection_sendPackage(connection->id,&ack.header,0,NULL,PEISK_PACKAGE_HIPRI);
+  unsigned char buff[sizeof(int)*(1+PEISK_MAX_ACK_PACKAGES)];
+
+  if(batch->nAcks == 0) return;
+  v = htonl(batch->nAcks);
+  memcpy(buff,&v,sizeof(int));
+  memcpy(buff+sizeof(int),batch->ackIDs,sizeof(int)*batch->nAcks);
+
+  /*printf("Sending %d acks to %d\n",batch->nAcks,batch->destination);*/
+
+  /* Depending on how many packages was marked as a priority-to-acknowledge package
+     we send in acknowledged or just normal mode.
+     Note that pure acknowledgement packages always register as non priorty-to-ack packages. 
   */
+  if(batch->priority > 0)
+    peisk_sendMessage(PEISK_PORT_ACKNOWLEDGEMENTS,batch->destination,sizeof(int)*(1+batch->nAcks),
+		      (void*)buff,PEISK_PACKAGE_RELIABLE);
+  else
+    peisk_sendMessage(PEISK_PORT_ACKNOWLEDGEMENTS,batch->destination,sizeof(int)*(1+batch->nAcks),(void*)buff,0);
+  batch->nAcks=0;
+  batch->priority=0;
 }
+
+void peisk_sendAcknowledgementsNow() {
+  int i;
+
+  /* Send one package to each destination with all ack's to it */
+  for(i=0;i<peiskernel.nAckBatches;i++)
+    peisk_sendAckBatch(&peiskernel.ackBatches[i]);
+  peiskernel.nAckBatches=0;
+  peisk_hashTable_clear(peiskernel.ackBatchHT);
+}
+
 int peisk_hook_acknowledgments(int port,int destination,int sender,int datalen,void *data) {
-  PeisConnection *connection2;
   PeisQueuedPackage *qpackage;
-  PeisQueuedPackage **prev;
-  int i;
 
   int nAcks, ackID;
   if(destination != peiskernel.id) return 0;
@@ -1528,44 +2008,20 @@ int peisk_hook_acknowledgments(int port,int destination,int sender,int datalen,v
     memcpy(&ackID,buff,sizeof(int));
     buff += sizeof(int);
 
-    /* Handle this ack package. Remove correspoding entry from "pending" queue from *ALL* connections */
-    for(i=0;i<PEISK_MAX_CONNECTIONS;i++)
-      if(peiskernel.connections[i].id != -1) {
-	connection2=&peiskernel.connections[i];
-	qpackage = connection2->outgoingQueueFirst[PEISK_QUEUE_PENDING];
-	prev = &connection2->outgoingQueueFirst[PEISK_QUEUE_PENDING];
-	while(qpackage) {
-	  /* Remove qpackage if it matches the ACK */
-	  if(qpackage->package.header.ackID == ackID) {
-	    /* If an acknowledgement hook was registered for this
-	       package, invoke it. */
-	    if(qpackage->nHooks) {
-	      /*printf("Found a package with %d ackHooks. datalen: %d data: %s\n",qpackage->nHooks,ntohs(qpackage->package.header.datalen),qpackage->package.data);*/
-	      PEISK_ASSERT(qpackage->nHooks<PEISK_MAX_ACKHOOKS,("Found a queue package with %d hooks\n",qpackage->nHooks));
-
-	      peiskernel.ackHookFailureType=eAckHookFailureNone;
-	      for(i=0;i<qpackage->nHooks;i++)	      
-		(qpackage->hook[i])(1,ntohs(qpackage->package.header.datalen),&qpackage->package,qpackage->hookData[i]);
-	    }
-	    /*printf("Removing a Pending package. ackID = %d\n",ackID);*/
-	    connection2->nQueuedPackages[PEISK_QUEUE_PENDING]--;
-	    *prev=qpackage->next;
-	    /* Be carefull when removing the lastmost element of the queues */
-	    if(&qpackage->next == connection2->outgoingQueueLast[PEISK_QUEUE_PENDING])
-	      connection2->outgoingQueueLast[PEISK_QUEUE_PENDING]=prev;
-	    qpackage->next = peiskernel.freeQueuedPackages;
-	    peiskernel.freeQueuedPackages = qpackage;
-	    qpackage=*prev;
-	  } else {
-	    prev=&qpackage->next;
-	    qpackage=qpackage->next;
-	  }
-	  if(connection2->outgoingQueueFirst[PEISK_QUEUE_PENDING] == NULL)
-	    PEISK_ASSERT(connection2->outgoingQueueLast[PEISK_QUEUE_PENDING] == &connection2->outgoingQueueFirst[PEISK_QUEUE_PENDING],
-			 ("I've just created a bad pending queue\n"));
-	}
-      }
-
+    /* Handle this ack package. Remove correspoding entries from the "pending" queues of *ALL* connections */
+    while((qpackage=peisk_lookupPendingAck(ackID))) {
+      /*printf("Removing a Pending package. ackID = %d\n",ackID);*/
+      /* Only packages that have not been retransmitted give
+	 unambiguous round trip time samples */
+      if(qpackage->retries == 0)
+	peisk_updateRtt(ntohl(qpackage->package.header.destination),peisk_timeNow - qpackage->sent);
+      peisk_connection_dequeue(qpackage->connection,PEISK_QUEUE_PENDING,qpackage);
+      /* If an acknowledgement hook was registered for this
+	 package, invoke it. */
+      peiskernel.ackHookFailureType=eAckHookFailureNone;
+      peisk_queuedPackage_callHooks(qpackage,1);
+      peisk_queuedPackage_free(qpackage);
+    }
   }
   return 0;
 }
@@ -98,7 +98,7 @@ int peisk_hook_timeSync(int port,int destination,int sender,int datalen,void *da
 /** Used to record hosts will regularly be attempted to connect to. */
 typedef struct PeisAutoHost {
   char *url;                     /**< Pointer to URL of host to attempt to connect to */
-  int isConnected;               /**< Zero if not connected, otherwise id of current connection */
+  int isConnected;               /**< -1 if not connected, otherwise id of current (possibly pending) connection */
   double lastAttempt;            /**< Timepoint of last connection attempt */
 } PeisAutoHost;
 
@@ -0,0 +1,549 @@
+/** \file shm.c
+   Implements a shared memory linklayer interface for PEIS on the same computer
+*/
+/**
+    Copyright (C) 2005 - 2012  Mathias Broxvall
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+*/
+
+/* Needed for memfd_create and accept4 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef WITH_SHM
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#define PEISK_PRIVATE
+#include "peiskernel.h"
+#include "p2p.h"
+#include "linklayer.h"
+#include "shm.h"
+
+#ifdef WITH_SHM
+
+/* The head and tail of a ring are published with release semantics
+   and read with acquire semantics, so that the data written before
+   them is seen by the other process. */
+#define peisk_shmLoad(x)    __atomic_load_n(&(x),__ATOMIC_ACQUIRE)
+#define peisk_shmStore(x,v) __atomic_store_n(&(x),(v),__ATOMIC_RELEASE)
+
+/** Fills in the abstract unix socket address of the kernel listening on port */
+static socklen_t peisk_shmAddress(struct sockaddr_un *addr,int port) {
+  memset(addr,0,sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  /* Leading zero byte gives an address in the abstract namespace */
+  snprintf(addr->sun_path+1,sizeof(addr->sun_path)-1,"peisk-shm-%d",port);
+  return offsetof(struct sockaddr_un,sun_path) + 1 + strlen(addr->sun_path+1);
+}
+
+unsigned int peisk_shmHostKey() {
+  static unsigned int key=0;
+  char bootId[128];
+  unsigned int i;
+  FILE *fp;
+
+  if(key) return key;
+  /* The boot id differs between computers even if they have the same hostname */
+  memset(bootId,0,sizeof(bootId));
+  fp=fopen("/proc/sys/kernel/random/boot_id","r");
+  if(!fp || !fgets(bootId,sizeof(bootId),fp))
+    snprintf(bootId,sizeof(bootId),"%lx-%.100s",(long) gethostid(),peiskernel.hostInfo.hostname);
+  if(fp) fclose(fp);
+  /* FNV-1a hash of the boot id */
+  key=2166136261U;
+  for(i=0;bootId[i] && bootId[i] != '\n';i++) key = (key ^ (unsigned char) bootId[i]) * 16777619U;
+  if(key == 0) key=1;
+  return key;
+}
+
+void peisk_shmRestartServer() {
+  struct sockaddr_un addr;
+  socklen_t len;
+
+  peiskernel.shm_serverSocket = -1;
+  if(!peiskernel.useShm || !peiskernel.tcp_isListening) return;
+
+  peiskernel.shm_serverSocket = socket(AF_UNIX,SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+  if(peiskernel.shm_serverSocket == -1) {
+    perror("peisk::shmRestartServer::socket");
+    return;
+  }
+  /* The TCP port is unique on this computer, use the same number */
+  len=peisk_shmAddress(&addr,peiskernel.tcp_serverPort);
+  if(bind(peiskernel.shm_serverSocket,(struct sockaddr*) &addr,len) == -1 ||
+     listen(peiskernel.shm_serverSocket,8) == -1) {
+    fprintf(stderr,"peisk: could not listen for shared memory connections, continuing without them\n");
+    close(peiskernel.shm_serverSocket);
+    peiskernel.shm_serverSocket = -1;
+    return;
+  }
+  peisk_reactorWatch(peiskernel.shm_serverSocket,0);
+}
+
+void peisk_shmShutdownServer() {
+  if(peiskernel.shm_serverSocket == -1) return;
+  close(peiskernel.shm_serverSocket);
+  peiskernel.shm_serverSocket = -1;
+}
+
+int peisk_shmIsConnectable(unsigned int hostKey,int port) {
+  return peiskernel.shm_serverSocket != -1 && hostKey == peisk_shmHostKey() && port != peiskernel.tcp_serverPort;
+}
+
+/** Wakes up the other side of the connection */
+static void peisk_shmSignal(PeisConnection *connection) {
+  uint64_t value=1;
+  if(write(connection->connection.shm.peerEventFd,&value,sizeof(value)) != sizeof(value) && errno != EAGAIN)
+    perror("peisk::shmSignal::write");
+}
+
+/** Releases everything a shared memory connection uses */
+static void peisk_shmRelease(PeisConnection *connection) {
+  if(connection->connection.shm.segment)
+    munmap(connection->connection.shm.segment,sizeof(PeisShmSegment));
+  connection->connection.shm.segment = NULL;
+  if(connection->connection.shm.socket != -1) close(connection->connection.shm.socket);
+  if(connection->connection.shm.eventFd != -1) close(connection->connection.shm.eventFd);
+  if(connection->connection.shm.peerEventFd != -1) close(connection->connection.shm.peerEventFd);
+  connection->connection.shm.socket = -1;
+  connection->connection.shm.eventFd = -1;
+  connection->connection.shm.peerEventFd = -1;
+}
+
+/** Sends a connect message over the unix socket, with the given
+    file descriptors attached. Returns zero on success. */
+static int peisk_shmSendConnectMessage(int sock,PeisConnectMessage *message,int *fds,int nfds) {
+  char control[CMSG_SPACE(3*sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+
+  iov.iov_base = message;
+  iov.iov_len = sizeof(PeisConnectMessage);
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if(nfds > 0) {
+    memset(control,0,sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+    memcpy(CMSG_DATA(cmsg),fds,nfds*sizeof(int));
+  }
+  return sendmsg(sock,&msg,MSG_NOSIGNAL) == sizeof(PeisConnectMessage) ? 0 : -1;
+}
+
+PeisConnection *peisk_shmConnect(int port,int flags) {
+  PeisConnection *connection;
+  PeisConnectMessage message;
+  PeisShmSegment *segment;
+  struct sockaddr_un addr;
+  socklen_t len;
+  int fds[3];
+
+  if(peiskernel.shm_serverSocket == -1 || port == peiskernel.tcp_serverPort) return NULL;
+
+  connection = peisk_newConnection();
+  if(!connection) return NULL;
+  connection->type = eShmConnection;
+  connection->connection.shm.segment = NULL;
+  connection->connection.shm.socket = -1;
+  connection->connection.shm.eventFd = -1;
+  connection->connection.shm.peerEventFd = -1;
+
+  /* The segment is anonymous, it only lives as long as someone has it mapped */
+  fds[0] = memfd_create("peisk-shm",MFD_CLOEXEC);
+  if(fds[0] == -1 || ftruncate(fds[0],sizeof(PeisShmSegment)) == -1) {
+    perror("peisk::shmConnect::memfd_create");
+    if(fds[0] != -1) close(fds[0]);
+    peisk_abortConnect(connection);
+    return NULL;
+  }
+  segment = (PeisShmSegment*) mmap(NULL,sizeof(PeisShmSegment),PROT_READ|PROT_WRITE,MAP_SHARED,fds[0],0);
+  if(segment == MAP_FAILED) {
+    perror("peisk::shmConnect::mmap");
+    close(fds[0]);
+    peisk_abortConnect(connection);
+    return NULL;
+  }
+  /* A new memfd is zero filled, which is an empty ring */
+  segment->magic = PEISK_SHM_MAGIC;
+  connection->connection.shm.segment = segment;
+  connection->connection.shm.tx = &segment->rings[0];
+  connection->connection.shm.rx = &segment->rings[1];
+  connection->connection.shm.eventFd = fds[1] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  connection->connection.shm.peerEventFd = fds[2] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  connection->connection.shm.socket = socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+
+  len = peisk_shmAddress(&addr,port);
+  peisk_initConnectMessage(&message,flags);
+  if(fds[1] == -1 || fds[2] == -1 || connection->connection.shm.socket == -1 ||
+     connect(connection->connection.shm.socket,(struct sockaddr*) &addr,len) == -1 ||
+     peisk_shmSendConnectMessage(connection->connection.shm.socket,&message,fds,3) != 0) {
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      fprintf(stdout,"peisk: failed to connect with shared memory to port %d (%s)\n",port,strerror(errno));
+    close(fds[0]);
+    peisk_shmRelease(connection);
+    peisk_abortConnect(connection);
+    return NULL;
+  }
+  /* The peer has its own references now */
+  close(fds[0]);
+  fcntl(connection->connection.shm.socket,F_SETFL,O_NONBLOCK);
+
+  connection->connection.shm.flags = flags;
+  connection->connection.shm.accepting = 0;
+  connection->connection.shm.timeout = peisk_timeNow + PEISK_SHM_CONNECT_TIMEOUT;
+  /* The answer is handled by peisk_acceptShmConnections */
+  peisk_reactorWatch(connection->connection.shm.socket,1);
+
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: connecting with shared memory to port %d as connection #%d, flags=%d\n",
+	    port,connection->id,flags);
+  return connection;
+}
+
+/** Finishes a pending outgoing connection once the peer answered, or
+    gives it up. */
+static void peisk_shmProcessPending(PeisConnection *connection) {
+  PeisConnectMessage message;
+  PeisConnectionMgrInfo *connMgrInfo;
+  int size;
+
+  size=recv(connection->connection.shm.socket,&message,sizeof(message),MSG_DONTWAIT);
+  if(size == -1 && errno == EAGAIN && connection->connection.shm.timeout > peisk_timeNow) return;
+
+  /* Containers share the boot id, so the address can belong to
+     another kernel in another network namespace */
+  if(size != sizeof(message) || ntohl(message.version) != peisk_protocollVersion ||
+     (connection->neighbour.id != -1 && ntohl(message.id) != connection->neighbour.id)) {
+    /* Refused, wrong peer or no answer in time. Other processes on
+       this computer might be in another network namespace, use other
+       links to them. */
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      fprintf(stdout,"peisk: shared memory connection #%d refused\n",connection->id);
+    connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
+    if(size != 0 && connMgrInfo) connMgrInfo->avoidShm = 1;
+    peisk_shmRelease(connection);
+    peisk_abortConnect(connection);
+    return;
+  }
+
+  connection->sequencedIds = (ntohl(message.flags) & PEISK_CONNECT_FLAG_SEQUENCED) ? 1 : 0;
+  connection->routingDeltas = (ntohl(message.flags) & PEISK_CONNECT_FLAG_ROUTING_DELTA) ? 1 : 0;
+  connection->multicasts = (ntohl(message.flags) & PEISK_CONNECT_FLAG_MULTICAST) ? 1 : 0;
+  peisk_outgoingConnectFinished(connection,connection->connection.shm.flags);
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: new outbound shared memory connection #%d established\n",connection->id);
+}
+
+/** Finishes a pending incomming connection once the connect message
+    of the peer, with the segment and eventfd's attached, has arrived */
+static void peisk_shmProcessAccepting(PeisConnection *connection) {
+  char control[CMSG_SPACE(3*sizeof(int))];
+  PeisConnectMessage message, answer;
+  PeisShmSegment *segment;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  struct stat st;
+  int i, sock, size, fds[3], nfds;
+
+  sock = connection->connection.shm.socket;
+  iov.iov_base = &message;
+  iov.iov_len = sizeof(message);
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  size = recvmsg(sock,&msg,MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+  if(size == -1 && errno == EAGAIN && connection->connection.shm.timeout > peisk_timeNow) return;
+  if(size != sizeof(message)) {
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      printf("Timeout on incomming shared memory connection\n");
+    peisk_shmRelease(connection);
+    peisk_freeConnection(connection);
+    return;
+  }
+  nfds=0;
+  for(cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if(nfds > 3) nfds = 3;
+      memcpy(fds,CMSG_DATA(cmsg),nfds*sizeof(int));
+    }
+  if(nfds != 3) {
+    for(i=0;i<nfds;i++) close(fds[i]);
+    peisk_shmRelease(connection);
+    peisk_freeConnection(connection);
+    return;
+  }
+
+  /* Map the segment, checking that it is what we expect */
+  segment = MAP_FAILED;
+  if(fstat(fds[0],&st) == 0 && st.st_size >= sizeof(PeisShmSegment))
+    segment = (PeisShmSegment*) mmap(NULL,sizeof(PeisShmSegment),PROT_READ|PROT_WRITE,MAP_SHARED,fds[0],0);
+  close(fds[0]);
+  connection->connection.shm.peerEventFd = fds[1];
+  connection->connection.shm.eventFd = fds[2];
+  if(segment == MAP_FAILED || segment->magic != PEISK_SHM_MAGIC) {
+    if(segment != MAP_FAILED) munmap(segment,sizeof(PeisShmSegment));
+    peisk_shmRelease(connection);
+    peisk_freeConnection(connection);
+    return;
+  }
+  connection->connection.shm.segment = segment;
+  connection->connection.shm.rx = &segment->rings[0];
+  connection->connection.shm.tx = &segment->rings[1];
+
+  /* Check that it's ok to accept this connection */
+  if(peisk_verifyConnectMessage(connection,&message) != 0) {
+    peisk_shmRelease(connection);
+    peisk_freeConnection(connection);
+    return;
+  }
+  peisk_initConnectMessage(&answer,0);
+  if(peisk_shmSendConnectMessage(sock,&answer,NULL,0) != 0) {
+    peisk_shmRelease(connection);
+    peisk_freeConnection(connection);
+    return;
+  }
+  connection->connection.shm.accepting = 0;
+
+  /* Let P2P layer handle this connection */
+  peisk_incommingConnectFinished(connection,&message);
+
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    printf("peisk: accepted new shared memory connection to %d with index: %d, flags=%d\n",
+	   message.id,connection->id,message.flags);
+}
+
+/** Closes a connection whose peer is gone without closing it, which
+    shows as the end of the unix socket. Nothing is sent on the socket
+    once connected. */
+static void peisk_shmCheckPeer(PeisConnection *connection) {
+  char byte;
+  int size;
+
+  size=recv(connection->connection.shm.socket,&byte,sizeof(byte),MSG_DONTWAIT);
+  if(size > 0 || (size == -1 && (errno == EAGAIN || errno == EINTR))) return;
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: shared memory connection %d lost its peer\n",connection->id);
+  peisk_closeConnection(connection->id);
+}
+
+void peisk_acceptShmConnections() {
+  PeisConnection *connection;
+  int i, sock, checkPeers;
+
+  /* Without epoll we cannot tell which socket was hung up */
+  checkPeers = peiskernel.hangups || peiskernel.epollFd == -1;
+  peiskernel.hangups = 0;
+  for(i=0;i<=peiskernel.highestConnection;i++) {
+    connection = &peiskernel.connections[i];
+    if(connection->id == -1 || connection->type != eShmConnection) continue;
+    if(!connection->isPending) {
+      if(checkPeers && connection->connection.shm.socket != -1) peisk_shmCheckPeer(connection);
+    } else if(connection->connection.shm.accepting) peisk_shmProcessAccepting(connection);
+    else peisk_shmProcessPending(connection);
+  }
+
+  if(peiskernel.shm_serverSocket == -1) return;
+  for(;;) {
+    sock=accept4(peiskernel.shm_serverSocket,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(sock == -1) return;
+
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      printf("peisk: incomming shared memory connection ...\n");
+
+    connection = peisk_newConnection();
+    if(!connection) { close(sock); return; }
+
+    /* It stays pending until the connect message of the peer has arrived */
+    connection->type = eShmConnection;
+    connection->connection.shm.segment = NULL;
+    connection->connection.shm.socket = sock;
+    connection->connection.shm.eventFd = -1;
+    connection->connection.shm.peerEventFd = -1;
+    connection->connection.shm.accepting = 1;
+    connection->connection.shm.timeout = peisk_timeNow + PEISK_SHM_CONNECT_TIMEOUT;
+    peisk_reactorWatch(sock,1);
+    /* The message is sent directly after connecting */
+    peisk_shmProcessAccepting(connection);
+  }
+}
+
+/** Copies len bytes to the ring starting at the given position, wrapping around its end */
+static void peisk_shmCopyTo(PeisShmRing *ring,unsigned int pos,void *data,int len) {
+  unsigned int offset = pos & (PEISK_SHM_RING_SIZE-1);
+  unsigned int first = PEISK_SHM_RING_SIZE - offset;
+  if(first >= len) memcpy(ring->data+offset,data,len);
+  else {
+    memcpy(ring->data+offset,data,first);
+    memcpy(ring->data,(char*)data+first,len-first);
+  }
+}
+
+/** Copies len bytes from the ring starting at the given position, wrapping around its end */
+static void peisk_shmCopyFrom(PeisShmRing *ring,unsigned int pos,void *data,int len) {
+  unsigned int offset = pos & (PEISK_SHM_RING_SIZE-1);
+  unsigned int first = PEISK_SHM_RING_SIZE - offset;
+  if(first >= len) memcpy(data,ring->data+offset,len);
+  else {
+    memcpy(data,ring->data+offset,first);
+    memcpy((char*)data+first,ring->data,len-first);
+  }
+}
+
+/** Writes one package to the ring without waking up the peer. Returns
+    zero on success and non-zero if the ring is full. */
+static int peisk_shmWrite(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) {
+  PeisShmRing *ring = connection->connection.shm.tx;
+  unsigned int head, len;
+
+  len = sizeof(PeisPackageHeader) + datalen;
+  head = ring->head;
+  if(PEISK_SHM_RING_SIZE - (head - peisk_shmLoad(ring->tail)) < len) {
+    /* Ask to be woken up when there is room, then check again in
+       case the consumer emptied the ring before seeing the flag */
+    peisk_shmStore(ring->producerWaiting,1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(PEISK_SHM_RING_SIZE - (head - peisk_shmLoad(ring->tail)) < len) return -1;
+  }
+  header->linkCnt = htonl(connection->outgoingIdCnt++);
+  peisk_shmCopyTo(ring,head,header,sizeof(PeisPackageHeader));
+  if(datalen > 0) peisk_shmCopyTo(ring,head+sizeof(PeisPackageHeader),data,datalen);
+  peisk_shmStore(ring->head,head+len);
+  return 0;
+}
+
+int peisk_shmSendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) {
+  if(connection->connection.shm.segment->closed) {
+    peisk_closeConnection(connection->id);
+    return -1;
+  }
+  if(peisk_shmWrite(connection,header,data,datalen) != 0) return -1;
+  peisk_shmSignal(connection);
+  return 0;
+}
+
+int peisk_shmSendQueued(PeisConnection *connection,PeisQueuedPackage **packages,int n) {
+  int i;
+
+  if(connection->connection.shm.segment->closed) {
+    peisk_closeConnection(connection->id);
+    return -1;
+  }
+  for(i=0;i<n;i++)
+    if(peisk_shmWrite(connection,&packages[i]->package.header,peisk_queuedPackage_data(packages[i]),
+		      ntohs(packages[i]->package.header.datalen)) != 0) break;
+  if(i > 0) peisk_shmSignal(connection);
+  return i;
+}
+
+int peisk_shmReceiveIncomming(PeisConnection *connection,PeisPackage **package) {
+  PeisShmRing *ring = connection->connection.shm.rx;
+  PeisPackage *buffer;
+  unsigned int head, tail, datalen;
+  uint64_t value;
+
+  if(!connection->inBuffer) connection->inBuffer = (char*) malloc(PEISK_STREAM_BUFFER_SIZE);
+  buffer = (PeisPackage*) connection->inBuffer;
+
+  tail = ring->tail;
+  head = peisk_shmLoad(ring->head);
+  if(head == tail) {
+    if(connection->connection.shm.segment->closed) {
+      if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+	fprintf(stdout,"peisk: shared memory connection %d closed by peer\n",connection->id);
+      peisk_closeConnection(connection->id);
+      return 0;
+    }
+    /* Reset the wakeup counter before looking at the ring again, so
+       that packages written in between are either seen now or wake
+       us up again */
+    if(read(connection->connection.shm.eventFd,&value,sizeof(value)) == -1 && errno != EAGAIN)
+      perror("peisk::shmReceiveIncomming::read");
+    head = peisk_shmLoad(ring->head);
+    if(head == tail) return 0;
+  }
+
+  peisk_shmCopyFrom(ring,tail,&buffer->header,sizeof(PeisPackageHeader));
+  datalen = ntohs(buffer->header.datalen);
+  if(buffer->header.sync != PEISK_SYNC || datalen > PEISK_MAX_PACKAGE_SIZE ||
+     head - tail < sizeof(PeisPackageHeader) + datalen) {
+    /* Only a broken peer can cause this, the ring cannot be resynchronized */
+    fprintf(stderr,"peisk: corrupt package on shared memory connection %d\n",connection->id);
+    peisk_closeConnection(connection->id);
+    return 0;
+  }
+  if(datalen > 0) peisk_shmCopyFrom(ring,tail+sizeof(PeisPackageHeader),buffer->data,datalen);
+  peisk_shmStore(ring->tail,tail+sizeof(PeisPackageHeader)+datalen);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(peisk_shmLoad(ring->producerWaiting)) {
+    peisk_shmStore(ring->producerWaiting,0);
+    peisk_shmSignal(connection);
+  }
+  *package = buffer;
+  return 1;
+}
+
+void peisk_shmCloseConnection(PeisConnection *connection) {
+  if(connection->connection.shm.segment && !connection->isPending) {
+    connection->connection.shm.segment->closed = 1;
+    peisk_shmSignal(connection);
+  }
+  peisk_shmRelease(connection);
+}
+
+#else
+
+/* Shared memory connections need memfd_create and eventfd */
+void peisk_shmRestartServer() { peiskernel.shm_serverSocket = -1; }
+void peisk_shmShutdownServer() { }
+unsigned int peisk_shmHostKey() { return 0; }
+PeisConnection *peisk_shmConnect(int port,int flags) { return NULL; }
+void peisk_acceptShmConnections() { }
+int peisk_shmIsConnectable(unsigned int hostKey,int port) { return 0; }
+int peisk_shmSendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) { return -1; }
+int peisk_shmSendQueued(PeisConnection *connection,PeisQueuedPackage **packages,int n) { return -1; }
+int peisk_shmReceiveIncomming(PeisConnection *connection,PeisPackage **package) { return 0; }
+void peisk_shmCloseConnection(PeisConnection *connection) { }
+
+#endif
@@ -0,0 +1,135 @@
+/** \file shm.h
+   Declares the shared memory linklayer interface
+*/
+/*
+    Copyright (C) 2005 - 2012  Mathias Broxvall
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+*/
+
+#ifndef SHM_H
+#define SHM_H
+
+/** \ingroup LinkLayer */
+/** \defgroup SharedMemory Shared memory
+
+    This is a linklayer interface for PEIS running on the same
+    computer. Packages are passed through a pair of rings in a shared
+    memory segment, one for each direction, without going through the
+    TCP/IP stack of the operating system. Each ring has a single
+    producer and a single consumer and needs no locks, the producer
+    only writes the head and the consumer only writes the tail of the
+    ring. The receiving side is woken up through an eventfd whenever
+    new packages have been written, and the sending side in the same
+    way when a full ring has been emptied.
+
+    Each kernel listens for connections on a unix socket in the
+    abstract namespace named after its TCP port, and advertises it as
+    an address of type ePeisShm together with a key identifying the
+    computer it runs on. The connecting side creates the segment
+    (with memfd_create) and both eventfd's, and passes them together
+    with its PeisConnectMessage over the unix socket. The socket is
+    closed as soon as the accepting side has answered with its own
+    PeisConnectMessage. Shared memory connections are not paced by
+    the congestion control, a full ring stops the sender instead.
+
+    The connection manager prefers shared memory for all hosts with
+    the same key, and moves existing links to such hosts over to
+    shared memory. Use --peis-no-shm to disable it. Shared memory is
+    only available when configure finds memfd_create and eventfd,
+    ie. on linux with glibc 2.27 or later.
+ */
+/** @{ */
+
+/** Size in bytes of each of the two rings of a connection. Must be a power of two. */
+#define PEISK_SHM_RING_SIZE      262144
+
+/** Marks an initialized shared memory segment */
+#define PEISK_SHM_MAGIC          0x5045534d
+
+/** Time to wait for the answer to a connect message before giving up */
+#define PEISK_SHM_CONNECT_TIMEOUT 2.0
+
+/** One direction of a shared memory connection. The head and the
+    tail are kept in separate cache lines since they are written by
+    different processes. Both count bytes since the connection was
+    created, the position in data is given modulo PEISK_SHM_RING_SIZE. */
+typedef struct PeisShmRing {
+  /** Bytes written by the producer */
+  volatile unsigned int head;
+  /** Set by the producer when it waits for room in the ring */
+  volatile unsigned int producerWaiting;
+  unsigned char padding[56];
+  /** Bytes read by the consumer */
+  volatile unsigned int tail;
+  unsigned char padding2[60];
+  /** Packages (header followed by data) stored back to back */
+  char data[PEISK_SHM_RING_SIZE];
+} PeisShmRing;
+
+/** Shared memory segment of a connection */
+typedef struct PeisShmSegment {
+  /** PEISK_SHM_MAGIC once initialized by the connecting side */
+  int magic;
+  /** Set by the side closing the connection */
+  volatile int closed;
+  unsigned char padding[56];
+  /** Rings for packages from the connecting resp. the accepting side */
+  PeisShmRing rings[2];
+} PeisShmSegment;
+
+/** Starts listening for shared memory connections, unless disabled */
+void peisk_shmRestartServer();
+/** Stops listening for shared memory connections */
+void peisk_shmShutdownServer();
+
+/** Gives the key identifying this computer, advertised with our
+    shared memory address. */
+unsigned int peisk_shmHostKey();
+
+/** Attempts to create a shared memory connection to the kernel on
+    this computer listening on the given port. Returns a PENDING
+    connection structure, or NULL on failure. The connection is
+    finished by peisk_acceptShmConnections once the peer answers. */
+struct PeisConnection *peisk_shmConnect(int port,int flags);
+
+/** Checks for new incomming shared memory connections, and for
+    answers to our pending outgoing connections. */
+void peisk_acceptShmConnections();
+
+/** True if we can connect to this shared memory address */
+int peisk_shmIsConnectable(unsigned int hostKey,int port);
+
+/** Writes a single package to a shared memory connection. Returns zero on success. */
+int peisk_shmSendAtomic(struct PeisConnection *connection,struct PeisPackageHeader *header,void *data,int datalen);
+
+/** Writes as many of the given packages as fits in the ring of a
+    shared memory connection, see peisk_connection_sendQueued. The
+    peer is woken up once for all of them. */
+int peisk_shmSendQueued(struct PeisConnection *connection,struct PeisQueuedPackage **packages,int n);
+
+/** Attempts to read a package from the connection. The package is
+    copied into the buffer of the connection and *package is changed
+    to point to it. Returns non-zero if there was a package.  */
+int peisk_shmReceiveIncomming(struct PeisConnection *connection,struct PeisPackage **package);
+
+/** Releases the shared memory and eventfd's of a connection and
+    tells the peer that it is closed. */
+void peisk_shmCloseConnection(struct PeisConnection *connection);
+
+/* @} SharedMemory */
+
+#endif
@@ -69,8 +69,28 @@ int peisk_tuples_errno;
     tuples are needed.  */
 PeisHashTable *peisk_tuples_primaryHT;
 
-/** TODO: Add other hashtables creating alternative indices for parts
-    of tuple keys. */
+/** Secondary index over all tuples in the primary hashtable, indexed
+    by owner (integer keys). The values are PeisIndexBucket's listing
+    every tuple with that owner. */
+PeisHashTable *peisk_tuples_ownerHT;
+
+/** Secondary index over all tuples in the primary hashtable, indexed
+    by the subkey atom at each level. Eg. all tuples whose second
+    subkey is "boo" share a bucket. Different subkeys can hash to the
+    same bucket. The values are PeisIndexBucket's. */
+PeisHashTable *peisk_tuples_subkeyHT;
+
+/** Index over all tuples in the primary hashtable, using the
+    precomputed key hash of each tuple. Used for fast lookups of
+    concrete tuples without generating their fully qualified names. */
+PeisHashTable *peisk_tuples_keyHashHT;
+
+/** Symbol table of all interned subkeys, indexed by the (case
+    insensitive) subkey. The values are PeisAtom's. */
+PeisHashTable *peisk_atomsHT;
+
+/** Next unused atom number, zero is never used */
+int peisk_nextAtom=1;
 
 /** Hashtable containing all registered callbacks indexed by by
     handle. The value is a pointer to the callback structure. */
@@ -79,8 +99,13 @@ PeisHashTable *peisk_callbacks_primaryHT;
 /** Enumerates all created callbacks - used as their handle */
 PeisCallbackHandle peisk_nextCallbackHandle;
 
-/** TODO: Add other hashtables creating alternative indices for parts
-    of callbacks */
+/** Reverse index from concrete tuples to the PEISK_CALLBACK_CHANGED
+    callbacks whose prototypes might match them. */
+PeisHashTable *peisk_callbacks_changedHT;
+
+/** Reverse index from concrete tuples to the PEISK_CALLBACK_DELETED
+    callbacks whose prototypes might match them. */
+PeisHashTable *peisk_callbacks_deletedHT;
 
 /** Hashtable containing all registered subscribers indexed by
     handle. The value is a pointer to the subscriber structure. */
@@ -89,20 +114,23 @@ PeisHashTable *peisk_subscribers_primaryHT;
 /** Unique enumeration for all subscription handles on this host */
 int peisk_nextSubscriberHandle;
 
-/** TODO: Add other hashtables creating alternative indices for parts
-    of subscribers */
+/** Reverse index from concrete tuples to the subscribers whose
+    prototypes might match them. See peisk_prototypeIndex_insert. */
+PeisHashTable *peisk_subscribers_indexHT;
 
 /** TODO: Each tuple stored in the tuplespace should have a list of
     all the relevant subscribers/callbacks. Need to recompute only
     when a tuple is first inserted into tuplespace. Update when new
     subscribers/callbacks are inserted. */
 
-/** List to keep track of tuples with an explicit expiry date that
-    should be (eventually) deleted */
-PeisExpireList *peisk_expireList;
-/** Free expiry nodes that can be reused when generating the list of
-    tuples that should be (eventually) deleted. */
-PeisExpireList *peisk_expireListFree;
+/** Binary heap (ordered by ts_expire) of all tuples with an explicit
+    expiry date that should be (eventually) deleted. Each tuple stores
+    its own position in the heap so it can be removed in O(log n). */
+PeisStoredTuple **peisk_expireHeap;
+/** Number of tuples in peisk_expireHeap */
+int peisk_expireHeapSize;
+/** Allocated size of peisk_expireHeap */
+int peisk_expireHeapAllocated;
 
 /** A routing table, showing for each known host (index by ID) 
     if we have sent it all subscription messages interesting for it. 
@@ -150,6 +178,14 @@ char *peisk_tupleBuffer=NULL;
 /** Reflects the size of the temporary buffer peisk_tupleBuffer */
 int peisk_tupleBufferSize=0;
 
+/** Buffer used when generating the "kernel.all-keys" tuple. Grows as needed. */
+char *peisk_allKeysBuffer=NULL;
+/** Size of peisk_allKeysBuffer */
+int peisk_allKeysBufferSize=0;
+/** True if our own set of keys have changed since kernel.all-keys was
+    last generated. */
+int peisk_allKeysDirty;
+
 PeisHashTable *peisk_mimetypes;
 
 /*                                               */
@@ -169,7 +205,7 @@ const char *peisk_tuple_errorStrings[PEISK_TUPLE_LAST_ERROR]={
 /*                                               */
 
 char *peisk_getTupleBuffer(int size) {
-  if(size <= peisk_tupleBufferSize) return peisk_tupleBuffer;
+  if(peisk_tupleBuffer && size <= peisk_tupleBufferSize) return peisk_tupleBuffer;
   else {
     free(peisk_tupleBuffer);
     peisk_tupleBuffer = (char*) malloc(size+1024);
@@ -178,11 +214,242 @@ char *peisk_getTupleBuffer(int size) {
   }
 }
 
+void peisk_indexBucket_add(PeisHashTable *ht,void *key,void *item) {
+  PeisIndexBucket *bucket;
+
+  if(peisk_hashTable_getValue(ht,key,(void**)(void*)&bucket)) {
+    bucket = (PeisIndexBucket*) malloc(sizeof(PeisIndexBucket));
+    bucket->n = 0;
+    bucket->allocated = 0;
+    bucket->items = NULL;
+    peisk_hashTable_insert(ht,key,(void*)bucket);
+  }
+  if(bucket->n == bucket->allocated) {
+    bucket->allocated = bucket->allocated ? bucket->allocated*2 : 4;
+    bucket->items = (void**) realloc(bucket->items,sizeof(void*)*bucket->allocated);
+  }
+  bucket->items[bucket->n++] = item;
+}
+
+void peisk_indexBucket_remove(PeisHashTable *ht,void *key,void *item) {
+  PeisIndexBucket *bucket;
+  int i;
+
+  if(peisk_hashTable_getValue(ht,key,(void**)(void*)&bucket)) return;
+  /* Search from the end since recently added items are most likely
+     to be removed again. Order of items is not preserved. */
+  for(i=bucket->n-1;i>=0;i--)
+    if(bucket->items[i] == item) {
+      bucket->items[i] = bucket->items[--bucket->n];
+      break;
+    }
+  if(bucket->n == 0) {
+    peisk_hashTable_remove(ht,key);
+    free(bucket->items);
+    free(bucket);
+  }
+}
+
+PeisIndexBucket *peisk_indexBucket_get(PeisHashTable *ht,void *key) {
+  PeisIndexBucket *bucket;
+  if(peisk_hashTable_getValue(ht,key,(void**)(void*)&bucket)) return NULL;
+  return bucket;
+}
+
+int peisk_internAtom(const char *subkey) {
+  PeisAtom *atom;
+
+  if(peisk_hashTable_getValue(peisk_atomsHT,(void*)subkey,(void**)(void*)&atom)) {
+    atom = (PeisAtom*) malloc(sizeof(PeisAtom));
+    atom->id = peisk_nextAtom++;
+    atom->refs = 0;
+    peisk_hashTable_insert(peisk_atomsHT,(void*)subkey,(void*)atom);
+  }
+  atom->refs++;
+  return atom->id;
+}
+
+void peisk_releaseAtom(const char *subkey) {
+  PeisAtom *atom;
+
+  if(peisk_hashTable_getValue(peisk_atomsHT,(void*)subkey,(void**)(void*)&atom)) return;
+  if(--atom->refs > 0) return;
+  peisk_hashTable_remove(peisk_atomsHT,(void*)subkey);
+  free(atom);
+}
+
+int peisk_findAtom(const char *subkey) {
+  PeisAtom *atom;
+
+  if(peisk_hashTable_getValue(peisk_atomsHT,(void*)subkey,(void**)(void*)&atom)) return 0;
+  return atom->id;
+}
+
+int peisk_tupleAtoms(PeisTuple *tuple,int *atoms) {
+  int i;
+  for(i=0;i<7;i++) {
+    if(!tuple->keys[i]) { atoms[i]=0; continue; }
+    atoms[i]=peisk_findAtom(tuple->keys[i]);
+    if(!atoms[i]) return PEISK_TUPLE_BADKEY;
+  }
+  return 0;
+}
+
+/** Mixes one more value into a 64 bit hash */
+static uint64_t peisk_hashMix(uint64_t hash,uint64_t value) {
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  return hash * 0xff51afd7ed558ccdULL;
+}
+
+uint64_t peisk_tupleKeyHash(int owner,int keyDepth,const int *atoms) {
+  uint64_t hash=peisk_hashMix(0,(uint32_t)owner);
+  int i;
+  hash=peisk_hashMix(hash,(uint32_t)keyDepth);
+  for(i=0;i<7;i++) hash=peisk_hashMix(hash,(uint32_t)atoms[i]);
+  return hash;
+}
+
+/** Folds a 64 bit hash into a key usable for integer hashtables */
+#define peisk_hashKey(hash) ((void*)(long)(int)(((hash) ^ ((hash) >> 32)) & 0x7fffffff))
+
+PeisTuple *peisk_findStoredTuple(PeisTuple *tuple) {
+  PeisIndexBucket *bucket;
+  PeisStoredTuple *stored;
+  int atoms[7];
+  uint64_t hash;
+  int i;
+
+  if(tuple->owner == -1 || tuple->keyDepth == -1) return NULL;
+  if(peisk_tupleAtoms(tuple,atoms)) return NULL;
+  for(i=0;i<tuple->keyDepth;i++) if(!atoms[i]) return NULL;
+
+  hash=peisk_tupleKeyHash(tuple->owner,tuple->keyDepth,atoms);
+  bucket=peisk_indexBucket_get(peisk_tuples_keyHashHT,peisk_hashKey(hash));
+  for(i=0;bucket && i<bucket->n;i++) {
+    stored=(PeisStoredTuple*) bucket->items[i];
+    if(stored->keyHash == hash && stored->tuple.owner == tuple->owner &&
+       stored->tuple.keyDepth == tuple->keyDepth &&
+       memcmp(stored->atoms,atoms,sizeof(atoms)) == 0)
+      return &stored->tuple;
+  }
+  return NULL;
+}
+
+/** Generates the key used in peisk_tuples_subkeyHT for a given level and subkey atom */
+#define peisk_tupleIndex_subkey(level,atom) peisk_hashKey(peisk_hashMix((uint64_t)(level),(uint32_t)(atom)))
+
+void peisk_tupleIndex_insert(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+  int i;
+
+  peisk_indexBucket_add(peisk_tuples_ownerHT,(void*)(long)tuple->owner,(void*)tuple);
+  peisk_indexBucket_add(peisk_tuples_keyHashHT,peisk_hashKey(stored->keyHash),(void*)stored);
+  for(i=0;i<tuple->keyDepth && i<7;i++) {
+    if(!stored->atoms[i]) continue;
+    peisk_indexBucket_add(peisk_tuples_subkeyHT,peisk_tupleIndex_subkey(i,stored->atoms[i]),(void*)tuple);
+  }
+}
+
+void peisk_tupleIndex_remove(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+  int i;
+
+  peisk_indexBucket_remove(peisk_tuples_ownerHT,(void*)(long)tuple->owner,(void*)tuple);
+  peisk_indexBucket_remove(peisk_tuples_keyHashHT,peisk_hashKey(stored->keyHash),(void*)stored);
+  for(i=0;i<tuple->keyDepth && i<7;i++) {
+    if(!stored->atoms[i]) continue;
+    peisk_indexBucket_remove(peisk_tuples_subkeyHT,peisk_tupleIndex_subkey(i,stored->atoms[i]),(void*)tuple);
+  }
+}
+
+int peisk_tupleIndex_candidates(PeisTuple *prototype,const int *atoms,PeisIndexBucket **candidates) {
+  PeisIndexBucket *bucket;
+  int i, constrained=0;
+
+  *candidates=NULL;
+  if(prototype->owner != -1) {
+    constrained=1;
+    *candidates = peisk_indexBucket_get(peisk_tuples_ownerHT,(void*)(long)prototype->owner);
+    if(!*candidates) return 0;
+  }
+  for(i=0;i<prototype->keyDepth && i<7;i++) {
+    if(!atoms[i]) continue;
+    bucket = peisk_indexBucket_get(peisk_tuples_subkeyHT,peisk_tupleIndex_subkey(i,atoms[i]));
+    /* No tuple at all has this subkey, nothing can match */
+    if(!bucket) { *candidates=NULL; return 0; }
+    if(!constrained || bucket->n < (*candidates)->n) *candidates=bucket;
+    constrained=1;
+  }
+  return constrained ? 0 : 1;
+}
+
+/** Generates the key of a bucket in a prototype index from the owner,
+    key depth and first concrete subkey (if any, otherwise zero). */
+static void *peisk_prototypeIndex_key(int owner,int keyDepth,int level,int atom) {
+  uint64_t hash=peisk_hashMix(0,(uint32_t)owner);
+  hash=peisk_hashMix(hash,(uint32_t)keyDepth);
+  if(atom) hash=peisk_hashMix(peisk_hashMix(hash,(uint32_t)level),(uint32_t)atom);
+  return peisk_hashKey(hash);
+}
+
+/** Finds the bucket key under which a prototype with the given atoms is indexed */
+static void *peisk_prototypeIndex_keyOf(PeisTuple *prototype,const int *atoms) {
+  int i;
+  for(i=0;i<prototype->keyDepth && i<7;i++)
+    if(atoms[i]) return peisk_prototypeIndex_key(prototype->owner,prototype->keyDepth,i,atoms[i]);
+  return peisk_prototypeIndex_key(prototype->owner,prototype->keyDepth,0,0);
+}
+
+void peisk_prototypeIndex_insert(PeisHashTable *ht,PeisTuple *prototype,void *item) {
+  peisk_indexBucket_add(ht,peisk_prototypeIndex_keyOf(prototype,peisk_storedTuple(prototype)->atoms),item);
+}
+
+void peisk_prototypeIndex_remove(PeisHashTable *ht,PeisTuple *prototype,void *item) {
+  peisk_indexBucket_remove(ht,peisk_prototypeIndex_keyOf(prototype,peisk_storedTuple(prototype)->atoms),item);
+}
+
+PeisIndexBucket *peisk_prototypeIndex_bucket(PeisHashTable *ht,PeisTuple *prototype) {
+  int atoms[7];
+  /* If some subkey has never been seen, no identical prototype can exist */
+  if(peisk_tupleAtoms(prototype,atoms)) return NULL;
+  return peisk_indexBucket_get(ht,peisk_prototypeIndex_keyOf(prototype,atoms));
+}
+
+int peisk_prototypeIndex_lookup(PeisHashTable *ht,PeisTuple *tuple,PeisIndexBucket **buckets) {
+  int *atoms=peisk_storedTuple(tuple)->atoms;
+  int owners[2]={tuple->owner,-1};
+  int o, i, n=0;
+
+  for(o=0;o<2;o++) {
+    if(o == 1 && tuple->owner == -1) break;
+    /* Prototypes with a wildcard key depth cannot have any concrete subkeys */
+    if((buckets[n] = peisk_indexBucket_get(ht,peisk_prototypeIndex_key(owners[o],-1,0,0)))) n++;
+    if(tuple->keyDepth == -1) continue;
+    /* Prototypes with the same depth, either without concrete subkeys
+       or indexed by one of the subkeys of the tuple */
+    if((buckets[n] = peisk_indexBucket_get(ht,peisk_prototypeIndex_key(owners[o],tuple->keyDepth,0,0)))) n++;
+    for(i=0;i<tuple->keyDepth && i<7;i++) {
+      if(!atoms[i]) continue;
+      buckets[n] = peisk_indexBucket_get(ht,peisk_prototypeIndex_key(owners[o],tuple->keyDepth,i,atoms[i]));
+      /* Hash collisions can make two keys share the same bucket, never
+	 return the same bucket twice */
+      if(buckets[n]) {
+	int j;
+	for(j=0;j<n;j++) if(buckets[j] == buckets[n]) break;
+	if(j == n) n++;
+      }
+    }
+  }
+  return n;
+}
+
 void peisk_tuples_initialize() {
   /* Setup hooks and periodic functions */
   peisk_registerHook(PEISK_PORT_SUBSCRIBE,peisk_hook_subscribe);
   peisk_registerHook(PEISK_PORT_UNSUBSCRIBE,peisk_hook_unsubscribe);
   peisk_registerHook(PEISK_PORT_PUSH_TUPLE,peisk_hook_pushTuple);
+  peisk_registerHook(PEISK_PORT_PUSH_TUPLE_DELTA,peisk_hook_pushTuple);
+  peisk_registerHook(PEISK_PORT_REQUEST_TUPLE,peisk_hook_requestTuple);
   peisk_registerHook(PEISK_PORT_SET_REMOTE_TUPLE,peisk_hook_setTuple);
   peisk_registerHook(PEISK_PORT_PUSH_APPENDED_TUPLE,peisk_hook_pushAppendedTuple);
   peisk_registerHook(PEISK_PORT_SET_APPEND_TUPLE,peisk_hook_setAppendTuple);
@@ -191,21 +458,34 @@ void peisk_tuples_initialize() {
   //peisk_registerPeriodic(PEISK_RESEND_SUBSCRIPTIONS_PERIOD,NULL,peisk_periodic_resendSubscriptions);
   peisk_registerPeriodic(PEISK_DEBUG_TUPLES_PERIOD,NULL,peisk_periodic_debugInfoTuples);
   peisk_registerPeriodic(PEISK_EXPIRE_TUPLES_PERIOD,NULL,peisk_periodic_expireTuples);
+  /* Registered last so that it is invoked after all other periodics
+     that can create or delete tuples in the same step */
+  peisk_registerPeriodic(0.0,NULL,peisk_periodic_allKeys);
 
   /* Create all hashtables */
   peisk_tuples_primaryHT      = peisk_hashTable_create(PeisHashTableKey_String);
+  peisk_tuples_ownerHT        = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peisk_tuples_subkeyHT       = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peisk_tuples_keyHashHT      = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peisk_atomsHT               = peisk_hashTable_create(PeisHashTableKey_String);
   peisk_callbacks_primaryHT   = peisk_hashTable_create(PeisHashTableKey_String);
+  peisk_callbacks_changedHT   = peisk_hashTable_create(PeisHashTableKey_Integer);
+  peisk_callbacks_deletedHT   = peisk_hashTable_create(PeisHashTableKey_Integer);
   peisk_subscribers_primaryHT = peisk_hashTable_create(PeisHashTableKey_String);
+  peisk_subscribers_indexHT   = peisk_hashTable_create(PeisHashTableKey_Integer);
   peisk_hostGivenSubscriptionMessages = peisk_hashTable_create(PeisHashTableKey_Integer);
   peisk_mimetypes             = peisk_hashTable_create(PeisHashTableKey_String);
 
-  /* Setup list of expiring tuples */
-  peisk_expireList = NULL;
-  peisk_expireListFree = NULL;
+  /* Setup heap of expiring tuples */
+  peisk_expireHeap = NULL;
+  peisk_expireHeapSize = 0;
+  peisk_expireHeapAllocated = 0;
 
   peisk_freeFailedTuples = NULL;
   peisk_failedTuples = NULL;
 
+  peisk_allKeysDirty = 0;
+
   /* Initialize default values for some variables */
   peisk_nextCallbackHandle=1;
   peisk_nextSubscriberHandle=1;
@@ -252,7 +532,6 @@ void peisk_appendLocalTuple(PeisTuple *proto,int difflen,const void *diff) {
 
   PeisAppendTupleMessage *message;
   int len;
-  char *key;
 
   /** \todo - optimize the appending of tuple so we only create the space for the
       message if it is actually needed to be sent. */
@@ -298,14 +577,15 @@ void peisk_appendLocalTuple(PeisTuple *proto,int difflen,const void *diff) {
 	/** \todo Allow sending push append tuple requests to include the mimetype? Or perhaps this is redundant? */
 
 	/* Send message to all hosts that are still subscribed to the tuple */      
-	PeisHashTableIterator subIter;
-	char *key;
+	PeisIndexBucket *buckets[PEISK_PROTOTYPE_INDEX_MAX_BUCKETS];
 	PeisSubscriber *subscriber;
-	for(peisk_hashTableIterator_first(peisk_subscribers_primaryHT,&subIter);
-	    peisk_hashTableIterator_next(&subIter);)
-	  if(peisk_hashTableIterator_value_generic(&subIter, &key, &subscriber)) {
+	int b, i, nBuckets;
+	nBuckets = peisk_prototypeIndex_lookup(peisk_subscribers_indexHT,tuple,buckets);
+	for(b=0;b<nBuckets;b++)
+	  for(i=0;i<buckets[b]->n;i++) {
+	    subscriber = (PeisSubscriber*) buckets[b]->items[i];
 	    if(subscriber->subscriber != peisk_id &&
-	       peisk_compareTuples(tuple,subscriber->prototype) == 0) {
+	       peisk_compareStoredTuples(tuple,subscriber->prototype) == 0) {
 	      /* send message to this subscriber */
 	      //printf("Sending update to %d\n",subscriber->subscriber);
 	      peisk_sendMessage(PEISK_PORT_PUSH_APPENDED_TUPLE,subscriber->subscriber,
@@ -321,10 +601,11 @@ void peisk_appendLocalTuple(PeisTuple *proto,int difflen,const void *diff) {
       /*printf("Updating inside our tuplespace. smartUpdate=%d\n",smartUpdate);
       printf("Data before update: %s\n",tuple->data);
       */
-      if(tuple->alloclen < tuple->datalen + difflen) {
-	tuple->data = realloc(tuple->data, tuple->datalen+difflen+(smartUpdate?-1:0));
-	tuple->alloclen=tuple->datalen+difflen+(smartUpdate?-1:0);
-      }
+      peisk_invalidatePushPayload(tuple);
+      /* Subscribers no longer have the base version, only pushes in full are right now */
+      peisk_storedTuple(tuple)->nSent=0;
+      if(tuple->alloclen < tuple->datalen + difflen)
+	tuple->data = peisk_slabRealloc(tuple->data, tuple->datalen+difflen+(smartUpdate?-1:0), &tuple->alloclen);
       memcpy(tuple->data+tuple->datalen+(smartUpdate?-1:0),diff,difflen);
       tuple->datalen += difflen +(smartUpdate?-1:0);
       tuple->appendSeqNo++;
@@ -332,17 +613,7 @@ void peisk_appendLocalTuple(PeisTuple *proto,int difflen,const void *diff) {
       /*      printf("Data after update: %s\n",tuple->data); */
 
       /* Trigger any local callbacks that depend on this tuple */
-      PeisHashTableIterator callIter;
-      PeisCallback *callback;
-      for(peisk_hashTableIterator_first(peisk_callbacks_primaryHT,&callIter);
-	  peisk_hashTableIterator_next(&callIter);)
-	if(peisk_hashTableIterator_value_generic(&callIter, &key, &callback)) {
-	  /* See if this callback matches this tuple */
-	  if(callback->type == PEISK_CALLBACK_CHANGED &&
-	     peisk_compareTuples(tuple,callback->prototype) == 0) {
-	    (callback->fn)(tuple,callback->userdata);
-	  }
-	}
+      peisk_alertCallbacks(tuple);
 
     }
   }  
@@ -414,21 +685,17 @@ int peisk_addToLocalSpace(PeisTuple *tuple) {
 
   //printf("AddToLocalSpace:"); peisk_printTuple(tuple); printf("\n");
 
-  peisk_getTupleFullyQualifiedName(tuple,fullname,512);
   if(tuple->alloclen == 0 && tuple->datalen > 0) tuple->alloclen=tuple->datalen;
 
   //if(strcmp(tuple->keys[0],"kernel") != 0)
   //  printf("%.3f Adding %s to local space\n",peisk_gettimef(),fullname);
   
-  if(!peisk_hashTable_getValue(peisk_tuples_primaryHT, 
-			       fullname, (void**) (void*) &oldTuple)) {
+  if((oldTuple=peisk_findStoredTuple(tuple))) {
     /* An old value existed for this tuple, reuse old tuple and memory if possible.
        Note that we _never_ free+allocate a tuple, this is since tuples 
        should never move in the memory space */
-    if(oldTuple->alloclen < tuple->datalen) { 
-      oldTuple->data = realloc(oldTuple->data, tuple->datalen);
-      oldTuple->alloclen=tuple->datalen;
-    }
+    if(oldTuple->alloclen < tuple->datalen)
+      oldTuple->data = peisk_slabRealloc(oldTuple->data, tuple->datalen, &oldTuple->alloclen);
 
     /* Increment sequence number whenever tuple is assigned a new value */
     if(tuple->seqno>0) oldTuple->seqno=tuple->seqno;
@@ -460,6 +727,7 @@ int peisk_addToLocalSpace(PeisTuple *tuple) {
     }
 
     /* No need to copy the "keys" part */
+    peisk_invalidatePushPayload(oldTuple);
     oldTuple->isNew=1;
     memcpy(oldTuple->data, tuple->data, tuple->datalen);   
     oldTuple->datalen=tuple->datalen;   
@@ -467,7 +735,7 @@ int peisk_addToLocalSpace(PeisTuple *tuple) {
     tuple=oldTuple;    
   } else {
     /* No previous tuple existed, allocate a new one and enter it */
-    tuple = peisk_cloneTuple(tuple);
+    tuple = peisk_newStoredTuple(tuple);
 
     if(!tuple) return PEISK_TUPLE_OUT_OF_MEMORY;
     tuple->isNew=1;
@@ -475,20 +743,22 @@ int peisk_addToLocalSpace(PeisTuple *tuple) {
     //tuple->seqno = 0;
     //tuple->appendSeqNo = 0;
 
-    /* Inserts the tuple to the primary key hash table */
+    /* Inserts the tuple to the primary key hash table and secondary indices */
+    peisk_getTupleFullyQualifiedName(tuple,fullname,512);
     peisk_hashTable_insert(peisk_tuples_primaryHT, fullname, (void*) tuple);
+    peisk_tupleIndex_insert(tuple);
 
     /* Add to list of expiring tuples if neccessary */
     if(tuple->ts_expire[0] != 0) {
       peisk_expireListAdd(tuple);
     }
 
-    /* TODO - add to other hashes here, update pointers to callbacks/subscribers etc. */
+    /* TODO - update pointers to callbacks/subscribers etc. */
 
-    /* If the inserted tuple belongs to us, update the "all-keys" tuple */
-    if(tuple->owner == peiskernel.id) {
-      peisk_generateAllKeysTuple();
-    }
+    /* If the inserted tuple belongs to us, the "all-keys" tuple
+       needs to be regenerated. This is deferred until the end of the
+       current step, see peisk_periodic_allKeys */
+    if(tuple->owner == peiskernel.id) peisk_allKeysDirty=1;
   }
 
   if(tuple->owner == peiskernel.id) peisk_alertSubscribers(tuple);
@@ -496,33 +766,53 @@ int peisk_addToLocalSpace(PeisTuple *tuple) {
   return 0;
 }
 
+/** Used to sort and remove duplicate destinations */
+static int peisk_compareDestinations(const void *a,const void *b) {
+  return ((const PeisPushDestination*)a)->destination - ((const PeisPushDestination*)b)->destination;
+}
+
 void peisk_alertSubscribers(PeisTuple *tuple) {
-  PeisHashTableIterator iter;
-  char *key;
+  PeisIndexBucket *buckets[PEISK_PROTOTYPE_INDEX_MAX_BUCKETS];
   PeisSubscriber *subscriber;
+  static PeisPushDestination *destinations=NULL;
+  static int allocated=0;
+  int b, i, j, nBuckets, nDestinations;
 
   //printf("Alerting subscribers for: "); peisk_printTuple(tuple); printf("\n");
 
-  /* Iterate over all SUBSCRIBERS */
-  for(peisk_hashTableIterator_first(peisk_subscribers_primaryHT,&iter);
-      peisk_hashTableIterator_next(&iter);)
-    if(peisk_hashTableIterator_value_generic(&iter, &key, &subscriber)) {
-      /*printf("stepping over subscriber\n");
-      printf("tuple: \n"); peisk_printTuple(tuple); printf("\n");
-      printf("prototype: \n"); peisk_printTuple(subscriber->prototype); printf("\n");
-      */
+  /* Iterate over all SUBSCRIBERS that could possibly match this tuple */
+  nDestinations = 0;
+  nBuckets = peisk_prototypeIndex_lookup(peisk_subscribers_indexHT,tuple,buckets);
+  for(b=0;b<nBuckets;b++)
+    for(i=0;i<buckets[b]->n;i++) {
+      subscriber = (PeisSubscriber*) buckets[b]->items[i];
 
       /* Unless it is one of our own subscriptions, 
 	 see if this subscriber matches this tuple */
       if(subscriber->subscriber != peisk_id &&
-	 peisk_compareTuples(tuple,subscriber->prototype) == 0) {
-	/* Yes, this subscriber matched the tuple. Send message */
+	 peisk_compareStoredTuples(tuple,subscriber->prototype) == 0) {
+	/* Yes, this subscriber matched the tuple. Remember it */
 	/*printf("alertSubscribers: sending to %d, tuple:",subscriber->subscriber); 
 	  peisk_printTuple(tuple); printf("\n");*/
-	if(peisk_pushTuple(tuple,subscriber->subscriber) != 0)
-	  peisk_insertFailedTuple(tuple,subscriber->subscriber);
+	if(nDestinations == allocated) {
+	  allocated = allocated ? allocated * 2 : 16;
+	  destinations = (PeisPushDestination*) realloc(destinations,allocated*sizeof(PeisPushDestination));
+	}
+	destinations[nDestinations].destination = subscriber->subscriber;
+	destinations[nDestinations++].acceptsDeltas = subscriber->acceptsDeltas;
       }
   }
+  if(!nDestinations) return;
+
+  /* Each host gets the tuple only once, even if it has multiple
+     matching subscriptions */
+  qsort(destinations,nDestinations,sizeof(PeisPushDestination),peisk_compareDestinations);
+  for(i=1,j=1;i<nDestinations;i++)
+    if(destinations[i].destination != destinations[j-1].destination) destinations[j++] = destinations[i];
+    else destinations[j-1].acceptsDeltas |= destinations[i].acceptsDeltas;
+  nDestinations = j;
+
+  peisk_multicastTuple(tuple,nDestinations,destinations);
 }
 void peisk_alertSubscriber(PeisSubscriber *subscriber) {
   PeisHashTableIterator iter;
@@ -544,7 +834,7 @@ void peisk_alertSubscriber(PeisSubscriber *subscriber) {
       //printf("testing tuple: "); peisk_printTuple(tuple); printf("\n");
 
       if(tuple->owner == peiskernel.id &&         
-	 peisk_compareTuples(tuple,subscriber->prototype) == 0) {
+	 peisk_compareStoredTuples(tuple,subscriber->prototype) == 0) {
 	/* Yes, this subscriber matched the tuple. Send message */
 	//printf("tuple '%s' matched a subscriber %d\n",key,subscriber->subscriber);
 
@@ -554,6 +844,8 @@ void peisk_alertSubscriber(PeisSubscriber *subscriber) {
     }
 }
 
+static void peisk_dropSentVersion(PeisStoredTuple *stored,int destination);
+
 void peisk_pushTupleAckHook(int success,int datalen,PeisPackage *package,void *userdata) {
   PeisPushTupleMessage *message;
   int dest;
@@ -592,6 +884,8 @@ void peisk_pushTupleAckHook(int success,int datalen,PeisPackage *package,void *u
       /*printf("failed, tuple does not exist any more\n");*/
       return;
     }
+    /* The destination may not have the version we last sent it */
+    peisk_dropSentVersion(peisk_storedTuple(tuple),dest);
     /* If transmitted tuple has changed, then we do not need to retransmitt it again.
        (it will anyway be triggered by a later ackHook when the changed value has failed, if it fails).
     */
@@ -616,14 +910,194 @@ void peisk_pushTupleAckHook(int success,int datalen,PeisPackage *package,void *u
   }
 }
 
+void peisk_invalidatePushPayload(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+
+  if(stored->deltaPayload) peisk_payload_release(stored->deltaPayload);
+  stored->deltaPayload=NULL;
+  stored->deltaEncoded=0;
+  if(!stored->pushPayload) return;
+
+  /* Keep the pushed version of large tuples as base for the next difference */
+  if(stored->basePayload) peisk_payload_release(stored->basePayload);
+  stored->basePayload=NULL;
+  if(stored->pushPayload->len >= sizeof(PeisPushTupleMessage) + PEISK_TUPLE_DELTA_MIN_SIZE)
+    stored->basePayload=stored->pushPayload;
+  else
+    peisk_payload_release(stored->pushPayload);
+  stored->pushPayload=NULL;
+}
+
+/** Serializes a tuple into a new payload holding a PeisPushTupleMessage */
+static PeisPayload *peisk_serializePushTuple(PeisTuple *tuple) {
+  PeisPushTupleMessage *message;
+  PeisPayload *payload;
+  int ret;
+
+  int mimelength=tuple->mimetype?strlen(tuple->mimetype):0;
+  int suffixLength = tuple->datalen + mimelength;
+  payload=peisk_payload_create(sizeof(PeisPushTupleMessage)+suffixLength);
+  if(!payload) return NULL;
+  message=(PeisPushTupleMessage*) payload->data;
+
+  peisk_tuple_hton(tuple,&message->tuple);
+  /* The payload is kept until the tuple changes, but isNew changes
+     whenever we read the tuple. Every pushed version is new to the
+     receiver. */
+  message->tuple.isNew = htonl(1);
+
+  //printf("Pushing tuple w/ MT %s, len=%d, htonl=%d\n",tuple->mimetype,tuple->mimetype?strlen(tuple->mimetype):-1,message->tuple.mimetypeLength);
+
+  /* Copy the keyname from given tuple to the new message tuple */
+  ret=peisk_getTupleName(tuple,message->tuple.keybuffer,sizeof(message->tuple.keybuffer));
+  PEISK_ASSERT(ret == 0, ("error setting name for PushTupleMessage. '%s'\n",peisk_tuple_strerror(ret)));
+
+  if(tuple->mimetype) memcpy(payload->data+sizeof(PeisPushTupleMessage), (void*) tuple->mimetype, mimelength);
+  memcpy(payload->data+sizeof(PeisPushTupleMessage)+mimelength, (void*) tuple->data, tuple->datalen);
+  return payload;
+}
+
+/** Gives the push message of the current version of a stored
+    tuple. Each version of a tuple is serialized only once, all
+    subscribers and all parts of large messages share the same
+    payload. */
+static PeisPayload *peisk_pushPayload(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+
+  if(!stored->pushPayload) 
+    stored->pushPayload = peisk_serializePushTuple(tuple);
+  return stored->pushPayload;
+}
+
+/** Finds the runs of bytes in data that differ from base, which is
+    baselen bytes long. If out is non-NULL the runs are written to it
+    as PeisTupleDeltaRun headers followed by the new bytes. Returns
+    the number of bytes needed for all runs, and the number of runs in
+    *nRuns. */
+static int peisk_encodeTupleDelta(const char *base,int baselen,const char *data,int datalen,char *out,int *nRuns) {
+  PeisTupleDeltaRun run;
+  int i, start, end, len;
+
+  len=0;
+  *nRuns=0;
+  i=0;
+  while(i < datalen) {
+    /* Skip bytes that are the same as in the base */
+    while(i < datalen && i < baselen && data[i] == base[i]) i++;
+    if(i == datalen) break;
+    /* Extend the run until PEISK_TUPLE_DELTA_GAP bytes in a row are
+       the same again, or the end of the data */
+    start=i;
+    end=i+1;
+    for(i=end;i < datalen && i - end < PEISK_TUPLE_DELTA_GAP;i++)
+      if(i >= baselen || data[i] != base[i]) end=i+1;
+    i=end;
+
+    if(out) {
+      run.offset=htonl(start);
+      run.length=htonl(end-start);
+      memcpy(out+len,&run,sizeof(run));
+      memcpy(out+len+sizeof(run),data+start,end-start);
+    }
+    len += sizeof(run) + end - start;
+    (*nRuns)++;
+  }
+  return len;
+}
+
+/** Gives the push message of the current version of a stored tuple
+    as a difference to its base version, or NULL if there is no base
+    version or if the difference would not be smaller than the full
+    push message. */
+static PeisPayload *peisk_deltaPayload(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+  PeisPushTupleMessage *base;
+  PeisPushTupleDeltaMessage *message;
+  PeisPayload *full, *payload;
+  const char *baseData;
+  int baselen, mimelength, runsLength, nRuns;
+
+  if(stored->deltaEncoded) return stored->deltaPayload;
+  stored->deltaEncoded=1;
+
+  full = peisk_pushPayload(tuple);
+  if(!full || !stored->basePayload || tuple->datalen < PEISK_TUPLE_DELTA_MIN_SIZE) return NULL;
+  base = (PeisPushTupleMessage*) stored->basePayload->data;
+  baselen = ntohl(base->tuple.datalen);
+  baseData = stored->basePayload->data + sizeof(PeisPushTupleMessage) + base->tuple.mimetypeLength;
+  if(!base->tuple.data || baselen <= 0) return NULL;
+
+  runsLength = peisk_encodeTupleDelta(baseData,baselen,tuple->data,tuple->datalen,NULL,&nRuns);
+  mimelength = tuple->mimetype?strlen(tuple->mimetype):0;
+  if(sizeof(PeisPushTupleDeltaMessage) + mimelength + runsLength >= full->len) return NULL;
+
+  payload = peisk_payload_create(sizeof(PeisPushTupleDeltaMessage)+mimelength+runsLength);
+  if(!payload) return NULL;
+  stored->deltaPayload = payload;
+  message = (PeisPushTupleDeltaMessage*) payload->data;
+  /* The new version has the same header as the full push message */
+  message->tuple = ((PeisPushTupleMessage*) full->data)->tuple;
+  message->baseSeqno = base->tuple.seqno;
+  message->baseAppendSeqNo = base->tuple.appendSeqNo;
+  message->nRuns = htonl(nRuns);
+  if(tuple->mimetype) memcpy(payload->data+sizeof(PeisPushTupleDeltaMessage),tuple->mimetype,mimelength);
+  peisk_encodeTupleDelta(baseData,baselen,tuple->data,tuple->datalen,
+			 payload->data+sizeof(PeisPushTupleDeltaMessage)+mimelength,&nRuns);
+  return payload;
+}
+
+/** Used to search the versions pushed to the subscribers of a stored tuple */
+static int peisk_compareSentVersions(const void *a,const void *b) {
+  return ((const PeisSentVersion*)a)->destination - ((const PeisSentVersion*)b)->destination;
+}
+
+/** Returns the version of tuple last pushed to destination, or NULL */
+static PeisSentVersion *peisk_findSentVersion(PeisStoredTuple *stored,int destination) {
+  PeisSentVersion key;
+  if(!stored->nSent) return NULL;
+  key.destination = destination;
+  return (PeisSentVersion*) bsearch(&key,stored->sent,stored->nSent,sizeof(PeisSentVersion),peisk_compareSentVersions);
+}
+
+/** Forgets which version of a stored tuple destination has */
+static void peisk_dropSentVersion(PeisStoredTuple *stored,int destination) {
+  PeisSentVersion *sent;
+  int i;
+
+  sent = peisk_findSentVersion(stored,destination);
+  if(!sent) return;
+  i = sent - stored->sent;
+  memmove(sent,sent+1,(stored->nSent-i-1)*sizeof(PeisSentVersion));
+  stored->nSent--;
+}
+
+/** Remembers that the current version of a large stored tuple has
+    been pushed to destination */
+static void peisk_setSentVersion(PeisStoredTuple *stored,int destination) {
+  PeisSentVersion *sent;
+  int i;
+
+  if(stored->tuple.datalen < PEISK_TUPLE_DELTA_MIN_SIZE) return;
+  sent = peisk_findSentVersion(stored,destination);
+  if(!sent) {
+    if(stored->nSent == stored->allocatedSent) {
+      stored->allocatedSent = stored->allocatedSent ? stored->allocatedSent * 2 : 4;
+      stored->sent = (PeisSentVersion*) realloc(stored->sent,stored->allocatedSent*sizeof(PeisSentVersion));
+    }
+    for(i=stored->nSent;i>0 && stored->sent[i-1].destination > destination;i--)
+      stored->sent[i] = stored->sent[i-1];
+    stored->nSent++;
+    sent = &stored->sent[i];
+    sent->destination = destination;
+  } 
+  sent->seqno = stored->tuple.seqno;
+  sent->appendSeqNo = stored->tuple.appendSeqNo;
+}
+
 int peisk_pushTuple(PeisTuple *tuple,int destination) {
-  PeisPushTupleMessage message;
-  char *buffer;
-  int len,ret;
+  PeisPayload *payload;
+  int ret;
   
-  char tmp[256];
-  peisk_getTupleFullyQualifiedName(tuple,tmp,sizeof(tmp));
-
   /* If destination is self - nothing to do */
   /* Otherwise, send a PeisPushTupleMessage */
   if(destination == peiskernel.id) {
@@ -642,102 +1116,168 @@ int peisk_pushTuple(PeisTuple *tuple,int destination) {
   peisk_printTuple(tuple);
   */
 
-  message.tuple.isNew = htonl(tuple->isNew);
-  message.tuple.seqno = htonl(tuple->seqno);
-  message.tuple.appendSeqNo = htonl(tuple->appendSeqNo);
-  peisk_tuple_hton(tuple,&message.tuple);
-
-  //printf("Pushing tuple w/ MT %s, len=%d, htonl=%d\n",tuple->mimetype,tuple->mimetype?strlen(tuple->mimetype):-1,message.tuple.mimetypeLength);
-
-  /* Copy the keyname from given tuple to the new message tuple */
-  ret=peisk_getTupleName(tuple,message.tuple.keybuffer,sizeof(message.tuple.keybuffer));
-  PEISK_ASSERT(ret == 0, ("error setting name for PushTupleMessage. '%s'\n",peisk_tuple_strerror(ret)));
-
-  int mimelength=tuple->mimetype?strlen(tuple->mimetype):0;
-  int suffixLength = tuple->datalen + mimelength;
-  len=sizeof(message)+suffixLength;
-  buffer = peisk_getTupleBuffer(len);
-  memcpy((void*)buffer, (void*) &message, sizeof(message));
-  if(tuple->mimetype) memcpy((void*)buffer+sizeof(message), (void*) tuple->mimetype, mimelength);
-  memcpy((void*)buffer+sizeof(message)+mimelength, (void*) tuple->data, tuple->datalen);
+  payload = peisk_pushPayload(tuple);
+  if(!payload) return -1;
 
   /*printf("sending push tuple message to %d: ",destination);
   peisk_printTuple(tuple); printf("\n");
-  printf("message: \n");
-  peisk_hexDump(buffer,len);
   */
-
  
   with_ack_hook(peisk_pushTupleAckHook,(void*)tuple,{
-      ret=peisk_sendMessage(PEISK_PORT_PUSH_TUPLE,destination, len, (void*) buffer, PEISK_PACKAGE_RELIABLE);  
+      ret=peisk_sendPayloadFrom(peiskernel.id,PEISK_PORT_PUSH_TUPLE,destination,payload,PEISK_PACKAGE_RELIABLE);  
     });
+  if(ret == 0) peisk_setSentVersion(peisk_storedTuple(tuple),destination);
+  else peisk_dropSentVersion(peisk_storedTuple(tuple),destination);
   return ret;
 }
 
+void peisk_multicastTuple(PeisTuple *tuple,int nDestinations,PeisPushDestination *destinations) {
+  static int *full=NULL, *delta=NULL, *status=NULL;
+  static int allocated=0;
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+  PeisPushTupleMessage *base;
+  PeisPayload *payload, *deltaPayload;
+  PeisSentVersion *sent;
+  int i, nFull, nDelta;
+
+  if(tuple->owner != peiskernel.id) {
+    printf("Attempting to propagate a tuple we shouldn't\n");
+    return;
+  }
+  payload = peisk_pushPayload(tuple);
+  if(!payload) {
+    for(i=0;i<nDestinations;i++) peisk_insertFailedTuple(tuple,destinations[i].destination);
+    return;
+  }
+  if(nDestinations > allocated) {
+    allocated = nDestinations * 2;
+    full = (int*) realloc(full,allocated*sizeof(int));
+    delta = (int*) realloc(delta,allocated*sizeof(int));
+    status = (int*) realloc(status,allocated*sizeof(int));
+  }
+
+  /* Destinations that have been sent the base version get only the
+     difference to it */
+  nFull = nDelta = 0;
+  deltaPayload = NULL;
+  base = stored->basePayload ? (PeisPushTupleMessage*) stored->basePayload->data : NULL;
+  for(i=0;i<nDestinations;i++) {
+    sent = base && destinations[i].acceptsDeltas ? peisk_findSentVersion(stored,destinations[i].destination) : NULL;
+    if(sent && sent->seqno == ntohl(base->tuple.seqno) && sent->appendSeqNo == ntohl(base->tuple.appendSeqNo) &&
+       (deltaPayload || (deltaPayload = peisk_deltaPayload(tuple))))
+      delta[nDelta++] = destinations[i].destination;
+    else
+      full[nFull++] = destinations[i].destination;
+  }
+
+  if(nFull) {
+    with_ack_hook(peisk_pushTupleAckHook,(void*)tuple,{
+	peisk_multicastPayload(PEISK_PORT_PUSH_TUPLE,nFull,full,payload,PEISK_PACKAGE_RELIABLE,status);
+      });
+    for(i=0;i<nFull;i++)
+      if(status[i] != 0) {
+	peisk_dropSentVersion(stored,full[i]);
+	peisk_insertFailedTuple(tuple,full[i]);
+      } else peisk_setSentVersion(stored,full[i]);
+  }
+  if(nDelta) {
+    with_ack_hook(peisk_pushTupleAckHook,(void*)tuple,{
+	peisk_multicastPayload(PEISK_PORT_PUSH_TUPLE_DELTA,nDelta,delta,deltaPayload,PEISK_PACKAGE_RELIABLE,status);
+      });
+    for(i=0;i<nDelta;i++)
+      if(status[i] != 0) {
+	peisk_dropSentVersion(stored,delta[i]);
+	peisk_insertFailedTuple(tuple,delta[i]);
+      } else peisk_setSentVersion(stored,delta[i]);
+  }
+}
+
 void peisk_alertCallbacks(PeisTuple *tuple) {
-  PeisHashTableIterator iter;
-  char *key;
-  PeisCallback *callback;
+  peisk_invokeCallbacks(tuple,PEISK_CALLBACK_CHANGED);
+}
 
-  for(peisk_hashTableIterator_first(peisk_callbacks_primaryHT,&iter);
-      peisk_hashTableIterator_next(&iter);)
-    if(peisk_hashTableIterator_value_generic(&iter, &key, &callback)) {
-      /* See if this callback matches this tuple */
-      if(callback->type == PEISK_CALLBACK_CHANGED &&
-	 peisk_compareTuples(tuple,callback->prototype) == 0) {
-	(callback->fn)(tuple,callback->userdata);
+PeisHashTable *peisk_callbacks_indexOf(int type) {
+  return type == PEISK_CALLBACK_DELETED ? peisk_callbacks_deletedHT : peisk_callbacks_changedHT;
+}
+
+void peisk_invokeCallbacks(PeisTuple *tuple,int type) {
+  PeisIndexBucket *buckets[PEISK_PROTOTYPE_INDEX_MAX_BUCKETS];
+  PeisCallbackHandle matchesBuffer[32], *matches=matchesBuffer;
+  PeisCallback *callback;
+  int b, i, nBuckets, nMatches=0, maxMatches=32;
+
+  /* Collect the handles of all matching callbacks before invoking
+     any of them, since the callbacks themselves may register or
+     unregister callbacks and thereby modify the index buckets. */
+  nBuckets = peisk_prototypeIndex_lookup(peisk_callbacks_indexOf(type),tuple,buckets);
+  for(b=0;b<nBuckets;b++)
+    for(i=0;i<buckets[b]->n;i++) {
+      callback = (PeisCallback*) buckets[b]->items[i];
+      if(peisk_compareStoredTuples(tuple,callback->prototype) != 0) continue;
+      if(nMatches == maxMatches) {
+	maxMatches *= 2;
+	if(matches == matchesBuffer) {
+	  matches = (PeisCallbackHandle*) malloc(sizeof(PeisCallbackHandle)*maxMatches);
+	  memcpy(matches,matchesBuffer,sizeof(matchesBuffer));
+	} else
+	  matches = (PeisCallbackHandle*) realloc(matches,sizeof(PeisCallbackHandle)*maxMatches);
       }
+      matches[nMatches++] = callback->handle;
     }
+
+  for(i=0;i<nMatches;i++) {
+    /* Skip callbacks that were unregistered by an earlier callback */
+    callback = peisk_findCallbackHandle(matches[i]);
+    if(callback) (callback->fn)(tuple,callback->userdata);
+  }
+  if(matches != matchesBuffer) free(matches);
 }
 
 
+void peisk_periodic_allKeys(void *data) {
+  if(!peisk_allKeysDirty) return;
+  peisk_allKeysDirty=0;
+  peisk_generateAllKeysTuple();
+}
+
 void peisk_generateAllKeysTuple() {
-  PeisHashTableIterator iter;
-  char *key;
+  PeisIndexBucket *ownTuples;
   PeisTuple *tuple;
-  
-  int ret, restr;
-  char str[256];
-  static int maxKeylen=1024;
-  char *allKeys;
-  int pos;
-
-  /* Use peisk_tupleBufferSize as the starting value for maxKeylen? */
-  if(maxKeylen < peisk_tupleBufferSize) maxKeylen = peisk_tupleBufferSize;
- peisk_generateAllKeysTuple_restart:
-  allKeys=peisk_getTupleBuffer(maxKeylen);
-  snprintf(allKeys,maxKeylen,"(");
-  pos=strlen(allKeys);
-
-  for(peisk_hashTableIterator_first(peisk_tuples_primaryHT,&iter);
-      peisk_hashTableIterator_next(&iter);)
-    if(peisk_hashTableIterator_value_generic(&iter, &key, &tuple)) {
-      if(tuple->owner != peisk_id) continue;
-      ret=peisk_getTupleName(tuple,str,sizeof(str)); str[255]=0;
-      PEISK_ASSERT(ret == 0, ("Error getting name of tuple '%s', %s\n", str, peisk_tuple_strerror(ret)));
-      snprintf(allKeys+pos,maxKeylen-pos,"%s ", str);
-      pos += strlen(allKeys+pos);
-      if(pos >= maxKeylen) {
-	maxKeylen += 1024;
-	/* TODO, we could just use a realloc here, atleast if we had
-	   explicit control over the buffer which we don't */
-	/* Yes, i know what i'm doing. This is one of those few rare
-	   occasions when a GOTO is acceptable to use. The altnerative
-	   here would be a recursive call, but C doesn't have tail
-	   recursion... so that would not be any good idea */
-	goto peisk_generateAllKeysTuple_restart;
-      }
+  int ret, restr, i, pos;
+
+  /* All our own tuples are found in the owner index, so we only need
+     to visit them and not the whole tuplespace. Since no name can be
+     longer than PEISK_KEYLENGTH we can grow the buffer before writing
+     each name. */
+  ownTuples = peisk_indexBucket_get(peisk_tuples_ownerHT,(void*)(long)peisk_id);
+  pos=0;
+  if(peisk_allKeysBufferSize < 3) {
+    peisk_allKeysBufferSize = 1024;
+    peisk_allKeysBuffer = (char*) realloc(peisk_allKeysBuffer,peisk_allKeysBufferSize);
+  }
+  peisk_allKeysBuffer[pos++]='(';
+
+  for(i=0;ownTuples && i<ownTuples->n;i++) {
+    tuple = (PeisTuple*) ownTuples->items[i];
+    if(pos + PEISK_KEYLENGTH + 2 > peisk_allKeysBufferSize) {
+      peisk_allKeysBufferSize = 2*peisk_allKeysBufferSize + PEISK_KEYLENGTH;
+      peisk_allKeysBuffer = (char*) realloc(peisk_allKeysBuffer,peisk_allKeysBufferSize);
     }
+    ret=peisk_getTupleName(tuple,peisk_allKeysBuffer+pos,PEISK_KEYLENGTH);
+    PEISK_ASSERT(ret == 0, ("Error getting name of tuple, %s\n", peisk_tuple_strerror(ret)));
+    peisk_allKeysBuffer[pos+PEISK_KEYLENGTH-1]=0;
+    pos += strlen(peisk_allKeysBuffer+pos);
+    peisk_allKeysBuffer[pos++]=' ';
+  }
   if(pos == 1) pos=2;
-  allKeys[pos-1]=')';
-  allKeys[pos]=0;  
+  peisk_allKeysBuffer[pos-1]=')';
+  peisk_allKeysBuffer[pos]=0;  
   
-
   /* Before adding tuple to local tuplespace we must enable modifying
      internal tuples with the override variable. */
   restr=peisk_override_setTuple_restrictions;
   peisk_override_setTuple_restrictions=1;
-  peisk_setStringTuple("kernel.all-keys",allKeys);  
+  peisk_setStringTuple("kernel.all-keys",peisk_allKeysBuffer);  
   peisk_override_setTuple_restrictions=restr;
 }
 
@@ -758,19 +1298,17 @@ PeisCallbackHandle peisk_registerAbstractTupleGenericCallback(PeisTuple *tuple,v
   callback->fn = fn;
   callback->userdata = userdata;
   callback->handle = peisk_nextCallbackHandle++;
-  callback->prototype = peisk_cloneTuple(tuple);
+  callback->prototype = peisk_newStoredTuple(tuple);
   if(callback->prototype == NULL) return 0;  
   callback->type = type;
 
-  /** TODO - set indexed key in another callbacks HT to be the (fully)
-      qualified name. The hashtable must be changed to allow multiple
-      entries with the same key. */
   char key[256];
   snprintf(key,sizeof(key),"%d",callback->handle);
   if(peisk_hashTable_insert(peisk_callbacks_primaryHT,key,(void*)callback)) {
     peisk_tuples_errno=PEISK_TUPLE_HASHTABLE_ERROR;
     return 0;
   }
+  peisk_prototypeIndex_insert(peisk_callbacks_indexOf(type),callback->prototype,(void*)callback);
   return callback->handle;
 }
 
@@ -1027,7 +1565,8 @@ void peisk_sendSubscribeMessageTo(PeisSubscriber *subscriber,int forceResend,int
   if(tuple->mimetype) memcpy((void*)message+sizeof(PeisSubscribeMessage), (void*) tuple->mimetype, mimelength);
   memcpy((void*)message+sizeof(PeisSubscribeMessage)+mimelength, (void*) tuple->data, tuple->datalen);
 
-  message->forceResend=forceResend;
+  /* Also tell the owner that we can apply tuple differences */
+  message->forceResend=htonl(forceResend | PEISK_SUBSCRIBE_DELTAS);
 
   if(tuple->data) {
     /* We use the data field to mark if there is data available or
@@ -1080,13 +1619,14 @@ void peisk_sendSubscribeMessageTo(PeisSubscriber *subscriber,int forceResend,int
 void peisk_initSubscriber(PeisSubscriber *subscriber) {
   subscriber->handle=0;
   subscriber->isMeta=0;
+  subscriber->acceptsDeltas=0;
 }
 
 PeisSubscriber *peisk_insertSubscriber(PeisSubscriber *subscriber) {
-  PeisHashTableIterator iter;
+  PeisIndexBucket *bucket;
   PeisSubscriber *subscriber2;
-  char *key;
   char name[128];
+  int i;
 
   /*
   printf("inserting subscriber %d to: ",subscriber->subscriber); 
@@ -1094,12 +1634,14 @@ PeisSubscriber *peisk_insertSubscriber(PeisSubscriber *subscriber) {
   */
 
   /* Iterate over all subscribers and see if we can find an
-   _identical_ one. If so, update it's expiry time */
+   _identical_ one. If so, update it's expiry time. Identical
+   prototypes are always stored in the same index bucket. */
   /* \todo If the subscriber handle is nonzero, then just look it up
      and update the expiry date immediatly */
-  for(peisk_hashTableIterator_first(peisk_subscribers_primaryHT,&iter);
-      peisk_hashTableIterator_next(&iter);)
-    if(peisk_hashTableIterator_value_generic(&iter, &key, &subscriber2)) {
+  bucket = peisk_prototypeIndex_bucket(peisk_subscribers_indexHT,subscriber->prototype);
+  if(bucket)
+    for(i=0;i<bucket->n;i++) {
+      subscriber2 = (PeisSubscriber*) bucket->items[i];
       /* See if they are the same subscriber */
       if(subscriber->subscriber == subscriber2->subscriber && 
 	 peisk_isEqual(subscriber->prototype,subscriber2->prototype)) {
@@ -1107,6 +1649,7 @@ PeisSubscriber *peisk_insertSubscriber(PeisSubscriber *subscriber) {
 	/*printf("Found old matching subscriber: "); peisk_printTuple(subscriber2->prototype); printf("\n");*/
 
 	subscriber2->expire = subscriber->expire;
+	subscriber2->acceptsDeltas = subscriber->acceptsDeltas;
 	return subscriber2;
       }      
     }
@@ -1123,12 +1666,13 @@ PeisSubscriber *peisk_insertSubscriber(PeisSubscriber *subscriber) {
   /* Get a unique subscriber handle */
   subscriber2->handle = peisk_nextSubscriberHandle++; 
   /* Clone the prototype tuple */
-  subscriber2->prototype = peisk_cloneTuple(subscriber->prototype);
+  subscriber2->prototype = peisk_newStoredTuple(subscriber->prototype);
   if(!subscriber2->prototype) return NULL;
   subscriber2->prototype->isNew = subscriber->prototype->isNew;
 
   subscriber2->expire = subscriber->expire;
   subscriber2->subscriber = subscriber->subscriber;
+  subscriber2->acceptsDeltas = subscriber->acceptsDeltas;
   /* When inserted, a subscriber is always non-meta. It must be modified 
      afterwards by inserting eg. the callback function etc. */
   subscriber2->isMeta = 0;
@@ -1142,10 +1686,7 @@ PeisSubscriber *peisk_insertSubscriber(PeisSubscriber *subscriber) {
     peisk_tuples_errno=PEISK_TUPLE_HASHTABLE_ERROR;
     return 0;
   }
-
-  /** TODO - set indexed key in another callbacks HT to be the (fully)
-      qualified name. The hashtable must be changed to allow multiple
-      entries with the same key. */
+  peisk_prototypeIndex_insert(peisk_subscribers_indexHT,subscriber2->prototype,(void*)subscriber2);
 
   /* Since this was a newly inserted subscriber, send copy of existing
      data to it */
@@ -1239,7 +1780,8 @@ int peisk_rawUnsubscribe(PeisSubscriberHandle handle,int propagate) {
     }
   }
 
-  peisk_freeTuple(subscriber->prototype);
+  peisk_prototypeIndex_remove(peisk_subscribers_indexHT,subscriber->prototype,(void*)subscriber);
+  peisk_freeStoredTuple(subscriber->prototype);
   free(subscriber);
   errno=peisk_hashTable_remove(peisk_subscribers_primaryHT,key);
   if(errno) {
@@ -1365,6 +1907,7 @@ int peisk_hook_subscribe(int port,int destination,int sender,int datalen,void *d
   subscriber.expire = peisk_gettimef()+PEISK_MAX_SUBSCRIPTION_TIME;
   subscriber.subscriber = sender;
   subscriber.isMeta=0;
+  subscriber.acceptsDeltas=(ntohl(message->forceResend) & PEISK_SUBSCRIBE_DELTAS) ? 1 : 0;
 
   numSubscribers=peisk_nextSubscriberHandle;
   subscriber2 = peisk_insertSubscriber(&subscriber);
@@ -1448,10 +1991,78 @@ int peisk_hook_unsubscribe(int port,int destination,int sender,int datalen,void
   return 0;
 }
 
+/** Asks the owner of a tuple for a full push of it, after a
+    difference to it could not be applied. */
+static void peisk_sendRequestTuple(PeisTuple *tuple) {
+  PeisRequestTupleMessage message;
+
+  memset(&message,0,sizeof(message));
+  peisk_tuple_hton(tuple,&message.tuple);
+  message.tuple.data=0;
+  message.tuple.datalen=0;
+  message.tuple.mimetypeLength=0;
+  peisk_getTupleName(tuple,message.tuple.keybuffer,sizeof(message.tuple.keybuffer));
+  peisk_sendMessage(PEISK_PORT_REQUEST_TUPLE,tuple->owner,sizeof(message),(void*)&message,PEISK_PACKAGE_RELIABLE);
+}
+
+/** Rebuilds the data of a tuple pushed as a difference from the base
+    version in our tuplespace. Returns a newly allocated buffer with
+    the data of the new version, or NULL if there is nothing to
+    update. If we do not have the base version the full tuple is
+    requested from the owner. */
+static char *peisk_applyTupleDelta(PeisTuple *tuple,PeisPushTupleDeltaMessage *message,char *runs,int runslen) {
+  PeisTupleDeltaRun run;
+  PeisTuple *base;
+  char *data;
+  uint32_t offset, length;
+  int i, nRuns;
+
+  base = peisk_findStoredTuple(tuple);
+  if(base && base->seqno >= tuple->seqno) return NULL;
+  if(tuple->datalen > PEISK_TUPLE_DELTA_MAX_SIZE) {
+    if(peisk_printLevel & PEISK_PRINT_TUPLE_ERR)
+      printf("peisk: warning, got push tuple delta message for a too large tuple\n");
+    return NULL;
+  }
+  if(!base || !base->data || tuple->datalen <= 0 ||
+     base->seqno != ntohl(message->baseSeqno) || base->appendSeqNo != ntohl(message->baseAppendSeqNo)) {
+    peisk_sendRequestTuple(tuple);
+    return NULL;
+  }
+
+  data = (char*) malloc(tuple->datalen);
+  if(!data) return NULL;
+  memcpy(data,base->data,base->datalen < tuple->datalen ? base->datalen : tuple->datalen);
+  nRuns = ntohl(message->nRuns);
+  for(i=0;i<nRuns;i++) {
+    if(runslen < sizeof(run)) break;
+    memcpy(&run,runs,sizeof(run));
+    offset = ntohl(run.offset);
+    length = ntohl(run.length);
+    runs += sizeof(run);
+    runslen -= sizeof(run);
+    if(length > runslen || offset > tuple->datalen || length > tuple->datalen - offset) break;
+    memcpy(data+offset,runs,length);
+    runs += length;
+    runslen -= length;
+  }
+  if(i < nRuns) {
+    if(peisk_printLevel & PEISK_PRINT_TUPLE_ERR)
+      printf("peisk: warning, got invalid push tuple delta message\n");
+    free(data);
+    peisk_sendRequestTuple(tuple);
+    return NULL;
+  }
+  return data;
+}
+
 int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *data) {
   PeisPushTupleMessage *message;
   PeisNetworkTuple netTuple;
   PeisTuple tuple;
+  char *deltaData=NULL;
+  /* Differences have a longer header before the mimetype */
+  int headerLength = port == PEISK_PORT_PUSH_TUPLE_DELTA ? sizeof(PeisPushTupleDeltaMessage) : sizeof(PeisPushTupleMessage);
 
 
   /* If it is not aimed at us, or is a broadcasted message then ignore
@@ -1461,7 +2072,7 @@ int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *d
 
   message = (PeisPushTupleMessage*) data;
 
-  if(datalen < sizeof(PeisPushTupleMessage)) {
+  if(datalen < headerLength) {
     printf("peisk: warning, got invalid push tuple message (too short)\n");
     return 0;
   }
@@ -1504,6 +2115,15 @@ int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *d
     tuple.alloclen=0;
     tuple.data = NULL;
     tuple.datalen = 0;
+  } else if(port == PEISK_PORT_PUSH_TUPLE_DELTA) {
+    /* The length of the new version is given in the message, the
+       data is rebuilt from the base version we have */
+    if(datalen < headerLength + mimelength) return 0;
+    deltaData = peisk_applyTupleDelta(&tuple,(PeisPushTupleDeltaMessage*) data,
+				      data + headerLength + mimelength,datalen - headerLength - mimelength);
+    if(!deltaData) return 0;
+    tuple.data = deltaData;
+    tuple.alloclen = tuple.datalen;
   } else {
     tuple.data = data + sizeof(PeisPushTupleMessage) + mimelength;
     tuple.datalen = datalen - sizeof(PeisPushTupleMessage) - mimelength;
@@ -1518,7 +2138,7 @@ int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *d
   if(netTuple.mimetypeLength == 0)
     tuple.mimetype=NULL;
   else {
-    memcpy(mimetype,data+sizeof(PeisPushTupleMessage),mimelength);
+    memcpy(mimetype,data+headerLength,mimelength);
     mimetype[mimelength]=0;
     tuple.mimetype=mimetype;
   }
@@ -1527,22 +2147,31 @@ int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *d
   if(peisk_tupleIsAbstract(&tuple)) {
     printf("peisk: warning, got a push tuple message with an abstract tuple\n");
     peisk_printTuple(&tuple); printf("\n");
+    free(deltaData);
     return 0;
   }
 
-  /* See if tuple exists previously, if so, verify that seqno is higher than previously */
+  /* See if tuple exists previously, if so, verify that seqno is higher than previously.
+     Look it up without peisk_getTupleByAbstract, since that would mark it as read
+     whenever a duplicate arrives. */
   tuple.isNew = -1;
-  PeisTuple *oldTuple = peisk_getTupleByAbstract(&tuple);
+  PeisTuple *oldTuple = peisk_findStoredTuple(&tuple);
   if(oldTuple && oldTuple->seqno >= tuple.seqno) {    
     /** \todo Save out-of-order tuples an update them when the missing tuple update have been found */
     /*
     printf("Ignoring duplicate or out-of-order (?) tuple\n");
     printf("old seqno: %d new seqno: %d\n",oldTuple->seqno,tuple.seqno);*/
+    free(deltaData);
     return 0;
   }
 
   /*printf("received push from %d: ",sender); peisk_printTuple(tuple); printf("\n");*/
   peisk_addToLocalSpace(&tuple);
+  free(deltaData);
+  /* Storing resets the appendSeqNo, but the pushed version may have
+     been appended to. Keep it so later differences can name it as base. */
+  oldTuple = peisk_findStoredTuple(&tuple);
+  if(oldTuple) oldTuple->appendSeqNo = tuple.appendSeqNo;
 
   /*PeisTuple *tuple2;
   char tmpName[256];
@@ -1553,6 +2182,30 @@ int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *d
 
   return 0;
 }
+int peisk_hook_requestTuple(int port,int destination,int sender,int datalen,void *data) {
+  PeisRequestTupleMessage *message;
+  PeisNetworkTuple netTuple;
+  PeisTuple prototype;
+  PeisTuple *tuple;
+
+  if(destination != peisk_id) return 0;
+  if(datalen < sizeof(PeisRequestTupleMessage)) return 0;
+  message = (PeisRequestTupleMessage*) data;
+  netTuple = message->tuple;
+  peisk_tuple_ntoh(&netTuple,&prototype);
+  peisk_setTupleName(&prototype,netTuple.keybuffer);
+  if(prototype.owner != peisk_id) return 0;
+
+  tuple = peisk_findStoredTuple(&prototype);
+  if(!tuple) return 0;
+
+  /* The sender does not have the version we thought it had, push the
+     full tuple to it instead */
+  peisk_dropSentVersion(peisk_storedTuple(tuple),sender);
+  if(peisk_pushTuple(tuple,sender) != 0)
+    peisk_insertFailedTuple(tuple,sender);
+  return 0;
+}
 int peisk_hook_setTuple(int port,int destination,int sender,int datalen,void *data) {
   PeisPushTupleMessage *message;
   PeisTuple tuple;
@@ -1659,12 +2312,8 @@ int peisk_hook_pushAppendedTuple(int port,int destination,int sender,int datalen
   /* Find the corresponding tuple in our data base.
      Note: the "prototype" above should be a concrete tuple in all
      respects except the data field. */
-  char fullname[PEISK_KEYLENGTH+5];
-  peisk_getTupleFullyQualifiedName(&proto,fullname,sizeof(fullname));
-  int errno;
-  errno=peisk_hashTable_getValue(peisk_tuples_primaryHT,fullname,
-				 (void**) (void*) &tuple);
-  if(errno || !tuple) {
+  tuple=peisk_findStoredTuple(&proto);
+  if(!tuple) {
     printf("Got a push appended tuple for a tuple we do not know about\n");
     return 0;
   }
@@ -1682,10 +2331,9 @@ int peisk_hook_pushAppendedTuple(int port,int destination,int sender,int datalen
 
   int smartUpdate=tuple->encoding == PEISK_ENCODING_ASCII;
   //if(strlen(tuple->data)+1 == tuple->datalen) smartUpdate=1;
-  if(tuple->alloclen < tuple->datalen + difflen) {
-    tuple->data = realloc(tuple->data, tuple->datalen+difflen+(smartUpdate?-1:0));
-    tuple->alloclen=tuple->datalen+difflen+(smartUpdate?-1:0);
-  }
+  peisk_invalidatePushPayload(tuple);
+  if(tuple->alloclen < tuple->datalen + difflen)
+    tuple->data = peisk_slabRealloc(tuple->data, tuple->datalen+difflen+(smartUpdate?-1:0), &tuple->alloclen);
   memcpy(tuple->data+tuple->datalen+(smartUpdate?-1:0),(void*) (message+1),difflen);
   tuple->datalen += difflen+(smartUpdate?-1:0);
   tuple->appendSeqNo = proto.appendSeqNo;
@@ -1694,19 +2342,7 @@ int peisk_hook_pushAppendedTuple(int port,int destination,int sender,int datalen
   /** \todo care about mimetype when appending to a tuple (checking if the append should realy be done or not) */
 
   /* Trigger any local callbacks that depend on this tuple */
-  PeisHashTableIterator callIter;
-  PeisCallback *callback;
-  char *key;
-  for(peisk_hashTableIterator_first(peisk_callbacks_primaryHT,&callIter);
-      peisk_hashTableIterator_next(&callIter);)
-
-    if(peisk_hashTableIterator_value_generic(&callIter, &key, &callback)) {
-      /* See if this callback matches this tuple */
-      if(callback->type == PEISK_CALLBACK_CHANGED &&
-	 peisk_compareTuples(tuple,callback->prototype) == 0) {
-	(callback->fn)(tuple,callback->userdata);
-      }
-    }
+  peisk_alertCallbacks(tuple);
   return 0;
 }
 int peisk_hook_setAppendTuple(int port,int destination,int sender,int datalen,void *data) {
@@ -1746,101 +2382,303 @@ void peisk_periodic_debugInfoTuples(void *data) {
   }
 }
 
-void peisk_expireListRemove(PeisTuple *tuple) {
-  PeisExpireList **prev;
-  PeisExpireList *this;
-
-  for(prev=&peisk_expireList;*prev;prev=&((*prev)->next)){
-    if((*prev)->tuple == tuple) {
-      /* Found tuple to delete */ 
-      this=*prev;
-      /* remove it from the list */
-      *prev=(*prev)->next;
-      /* insert into list of free expire nodes */
-      this->next=peisk_expireListFree;
-      peisk_expireListFree=this;
-      return;
+/*                                          */
+/* SLAB ALLOCATOR for stored tuples and data */
+/*                                          */
+
+/** All size classes for data of stored tuples */
+PeisSlabClass peisk_slabClasses[PEISK_SLAB_CLASSES];
+/** Number of blocks and total bytes allocated directly with malloc
+    since they are larger than all size classes */
+int peisk_slabLargeBlocks, peisk_slabLargeBytes;
+/** Unused stored tuples */
+PeisStoredTuple *peisk_slabFreeTuples;
+/** Number of stored tuples allocated so far, and currently in use */
+int peisk_slabTuplesAllocated, peisk_slabTuplesUsed;
+
+/** Carves a new slab into blocks for the given size class. Returns
+    non zero if out of memory. */
+static int peisk_slabGrow(int sizeClass) {
+  PeisSlabClass *class=&peisk_slabClasses[sizeClass];
+  int blockSize=1<<(sizeClass+PEISK_SLAB_MIN_SHIFT);
+  int i, nBlocks=PEISK_SLAB_SIZE/blockSize;
+  char *slab;
+  PeisSlabBlock *block;
+
+  if(nBlocks < 4) nBlocks=4;
+  /* Slabs are never given back, their blocks are reused by later
+     allocations of the same size class */
+  slab=(char*) malloc(nBlocks*blockSize);
+  if(!slab) return PEISK_TUPLE_OUT_OF_MEMORY;
+  for(i=nBlocks-1;i>=0;i--) {
+    block=(PeisSlabBlock*) (slab+i*blockSize);
+    block->next=class->free;
+    class->free=block;
+  }
+  class->allocated += nBlocks;
+  return 0;
+}
+
+void *peisk_slabAlloc(int size,int *usable) {
+  PeisSlabBlock *block;
+  PeisSlabClass *class;
+  int sizeClass;
+
+  for(sizeClass=0;sizeClass<PEISK_SLAB_CLASSES;sizeClass++)
+    if(size+(int)sizeof(PeisSlabBlock) <= 1<<(sizeClass+PEISK_SLAB_MIN_SHIFT)) break;
+  if(sizeClass == PEISK_SLAB_CLASSES) {
+    block=(PeisSlabBlock*) malloc(sizeof(PeisSlabBlock)+size);
+    if(!block) return NULL;
+    block->info.sizeClass=-1;
+    block->info.size=size;
+    peisk_slabLargeBlocks++;
+    peisk_slabLargeBytes += size;
+  } else {
+    class=&peisk_slabClasses[sizeClass];
+    if(!class->free && peisk_slabGrow(sizeClass)) return NULL;
+    block=class->free;
+    class->free=block->next;
+    class->used++;
+    block->info.sizeClass=sizeClass;
+    block->info.size=(1<<(sizeClass+PEISK_SLAB_MIN_SHIFT))-sizeof(PeisSlabBlock);
+  }
+  if(usable) *usable=block->info.size;
+  return (void*) (block+1);
+}
+
+void peisk_slabFree(void *data) {
+  PeisSlabBlock *block;
+  PeisSlabClass *class;
+
+  if(!data) return;
+  block=((PeisSlabBlock*) data)-1;
+  if(block->info.sizeClass == -1) {
+    peisk_slabLargeBlocks--;
+    peisk_slabLargeBytes -= block->info.size;
+    free(block);
+    return;
+  }
+  PEISK_ASSERT(block->info.sizeClass >= 0 && block->info.sizeClass < PEISK_SLAB_CLASSES,
+	       ("Freeing a block not belonging to the slab allocator\n"));
+  class=&peisk_slabClasses[block->info.sizeClass];
+  class->used--;
+  block->next=class->free;
+  class->free=block;
+}
+
+void *peisk_slabRealloc(void *data,int size,int *usable) {
+  PeisSlabBlock *block;
+  void *newData;
+
+  if(!data) return peisk_slabAlloc(size,usable);
+  block=((PeisSlabBlock*) data)-1;
+  if(block->info.size >= size) {
+    if(usable) *usable=block->info.size;
+    return data;
+  }
+  newData=peisk_slabAlloc(size,usable);
+  if(!newData) return NULL;
+  memcpy(newData,data,block->info.size);
+  peisk_slabFree(data);
+  return newData;
+}
+
+/** Allocates the private part of a stored tuple */
+static PeisStoredTuple *peisk_slabAllocTuple() {
+  PeisStoredTuple *stored, *slab;
+  int i;
+
+  if(!peisk_slabFreeTuples) {
+    slab=(PeisStoredTuple*) malloc(sizeof(PeisStoredTuple)*PEISK_SLAB_TUPLES);
+    if(!slab) return NULL;
+    for(i=PEISK_SLAB_TUPLES-1;i>=0;i--) {
+      slab[i].nextFree=peisk_slabFreeTuples;
+      peisk_slabFreeTuples=&slab[i];
     }
+    peisk_slabTuplesAllocated += PEISK_SLAB_TUPLES;
+  }
+  stored=peisk_slabFreeTuples;
+  peisk_slabFreeTuples=stored->nextFree;
+  stored->nextFree=NULL;
+  peisk_slabTuplesUsed++;
+  return stored;
+}
+
+/** Returns a stored tuple to the free list. The tuple itself is never
+    given back to the system allocator, so other tuples never move. */
+static void peisk_slabFreeTuple(PeisStoredTuple *stored) {
+  stored->nextFree=peisk_slabFreeTuples;
+  peisk_slabFreeTuples=stored;
+  peisk_slabTuplesUsed--;
+}
+
+void peisk_slabStatistics(char *str,int len) {
+  int i, n;
+  PeisSlabClass *class;
+
+  n=snprintf(str,len,"((tuples %d %d) (data",peisk_slabTuplesUsed,peisk_slabTuplesAllocated);
+  for(i=0;i<PEISK_SLAB_CLASSES && n < len;i++) {
+    class=&peisk_slabClasses[i];
+    if(!class->allocated) continue;
+    n+=snprintf(str+n,len-n," (%d %d %d)",1<<(i+PEISK_SLAB_MIN_SHIFT),class->used,class->allocated);
+  }
+  if(n < len) snprintf(str+n,len-n,") (large %d %d))",peisk_slabLargeBlocks,peisk_slabLargeBytes);
+}
+
+PeisTuple *peisk_newStoredTuple(PeisTuple *original) {
+  PeisStoredTuple *stored;
+  PeisTuple header;
+  int i;
+
+  stored=peisk_slabAllocTuple();
+  if(!stored) {
+    peisk_tuples_errno=PEISK_TUPLE_OUT_OF_MEMORY;
+    return NULL;
   }
+  /* Clone everything except the data, which comes from the slabs */
+  header=*original;
+  header.data=NULL;
+  for(i=0;i<7;i++)
+    if(original->keys[i]) header.keys[i]=original->keys[i]-original->keybuffer+header.keybuffer;
+  peisk_cloneTupleInto(&stored->tuple,&header);
+  stored->tuple.alloclen=0;
+  if(original->data) {
+    stored->tuple.data=peisk_slabAlloc(original->datalen,&stored->tuple.alloclen);
+    if(!stored->tuple.data) {
+      peisk_slabFreeTuple(stored);
+      peisk_tuples_errno=PEISK_TUPLE_OUT_OF_MEMORY;
+      return NULL;
+    }
+    memcpy(stored->tuple.data,original->data,original->datalen);
+  }
+  stored->expireIndex=-1;
+  stored->pushPayload=NULL;
+  stored->basePayload=NULL;
+  stored->deltaPayload=NULL;
+  stored->deltaEncoded=0;
+  stored->nSent=stored->allocatedSent=0;
+  stored->sent=NULL;
+  /* Intern all subkeys once, all later comparisons and lookups use
+     the atoms and key hash instead of the strings */
+  for(i=0;i<7;i++)
+    stored->atoms[i] = stored->tuple.keys[i] ? peisk_internAtom(stored->tuple.keys[i]) : 0;
+  stored->keyHash = peisk_tupleKeyHash(stored->tuple.owner,stored->tuple.keyDepth,stored->atoms);
+  return &stored->tuple;
+}
+
+void peisk_freeStoredTuple(PeisTuple *tuple) {
+  PeisStoredTuple *stored;
+  int i;
+  if(!tuple) return;
+  for(i=0;i<7;i++)
+    if(tuple->keys[i]) peisk_releaseAtom(tuple->keys[i]);
+  peisk_invalidatePushPayload(tuple);
+  stored=peisk_storedTuple(tuple);
+  if(stored->basePayload) peisk_payload_release(stored->basePayload);
+  free(stored->sent);
+  peisk_slabFree(tuple->data);
+  peisk_slabFreeTuple(stored);
+}
+
+/** Returns true if tuple t1 expires strictly before tuple t2 */
+static int peisk_expiresBefore(PeisStoredTuple *t1,PeisStoredTuple *t2) {
+  return t1->tuple.ts_expire[0] < t2->tuple.ts_expire[0] ||
+    (t1->tuple.ts_expire[0] == t2->tuple.ts_expire[0] &&
+     t1->tuple.ts_expire[1] < t2->tuple.ts_expire[1]);
+}
+
+/** Places the given tuple at position i in the expiry heap */
+static void peisk_expireHeapSet(int i,PeisStoredTuple *stored) {
+  peisk_expireHeap[i]=stored;
+  stored->expireIndex=i;
+}
+
+/** Restores the heap property by moving the element at position i
+    towards the root or towards the leaves, as needed. */
+static void peisk_expireHeapFix(int i) {
+  PeisStoredTuple *stored=peisk_expireHeap[i];
+  int child;
+
+  /* Move towards root */
+  while(i > 0 && peisk_expiresBefore(stored,peisk_expireHeap[(i-1)/2])) {
+    peisk_expireHeapSet(i,peisk_expireHeap[(i-1)/2]);
+    i=(i-1)/2;
+  }
+  /* Move towards leaves */
+  for(;;) {
+    child=2*i+1;
+    if(child >= peisk_expireHeapSize) break;
+    if(child+1 < peisk_expireHeapSize && 
+       peisk_expiresBefore(peisk_expireHeap[child+1],peisk_expireHeap[child])) child++;
+    if(!peisk_expiresBefore(peisk_expireHeap[child],stored)) break;
+    peisk_expireHeapSet(i,peisk_expireHeap[child]);
+    i=child;
+  }
+  peisk_expireHeapSet(i,stored);
+}
+
+void peisk_expireListRemove(PeisTuple *tuple) {
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
+  int i=stored->expireIndex;
+
+  if(i < 0) return;
+  PEISK_ASSERT(i < peisk_expireHeapSize && peisk_expireHeap[i] == stored,
+	       ("Corrupt expiry heap, index %d of %d\n",i,peisk_expireHeapSize));
+  stored->expireIndex=-1;
+  peisk_expireHeapSize--;
+  if(i == peisk_expireHeapSize) return;
+  /* Move last element into the hole and restore the heap property */
+  peisk_expireHeapSet(i,peisk_expireHeap[peisk_expireHeapSize]);
+  peisk_expireHeapFix(i);
 }
 
 void peisk_expireListAdd(PeisTuple *tuple) {
-  PeisExpireList *this;
-  PeisExpireList **prev;
+  PeisStoredTuple *stored=peisk_storedTuple(tuple);
 
   /* Check that the expiry time is valid (non null) */
   if(tuple->ts_expire[0] == 0) return;
+  /* Already in the heap, just move it to its new position */
+  if(stored->expireIndex >= 0) { peisk_expireHeapFix(stored->expireIndex); return; }
 
-  /* Allocate an expiry entry for this tuple */
-  if(peisk_expireListFree) {
-    this=peisk_expireListFree;
-    peisk_expireListFree=peisk_expireListFree->next;
-  } else {
-    this = (PeisExpireList*) malloc(sizeof(PeisExpireList));
+  if(peisk_expireHeapSize == peisk_expireHeapAllocated) {
+    peisk_expireHeapAllocated = peisk_expireHeapAllocated ? 2*peisk_expireHeapAllocated : 64;
+    peisk_expireHeap = (PeisStoredTuple**) realloc(peisk_expireHeap,sizeof(PeisStoredTuple*)*peisk_expireHeapAllocated);
   }
-  this->tuple=tuple;
-  
-  /* Iterate over list to know where to insert this expiry node */
-  for(prev=&peisk_expireList;*prev;prev=&((*prev)->next)){
-    if(tuple->ts_expire[0] < (*prev)->tuple->ts_expire[0] ||
-       (tuple->ts_expire[0] == (*prev)->tuple->ts_expire[0] &&
-	tuple->ts_expire[1] < (*prev)->tuple->ts_expire[1])) break;
-  }
-  /* Insert it */
-  this->next = *prev;
-  *prev = this;
-
+  peisk_expireHeapSet(peisk_expireHeapSize++,stored);
+  peisk_expireHeapFix(stored->expireIndex);
 }
 
 void peisk_periodic_expireTuples(void *data) {
   int timenow[2];
-  PeisExpireList *this;
-  PeisHashTableIterator iter;
-  char *key;
-  PeisCallback *callback;
+  PeisTuple *tuple;
+  char fullname[512];
 
   peisk_gettime2(&timenow[0],&timenow[1]);
 
-  for(;peisk_expireList;) {
-    if(timenow[0] < peisk_expireList->tuple->ts_expire[0] ||
-       (timenow[0] == peisk_expireList->tuple->ts_expire[0] &&
-	timenow[1] <= peisk_expireList->tuple->ts_expire[1])) break;
+  /* Pop all due tuples from the top of the heap */
+  while(peisk_expireHeapSize > 0) {
+    tuple=&peisk_expireHeap[0]->tuple;
+    if(timenow[0] < tuple->ts_expire[0] ||
+       (timenow[0] == tuple->ts_expire[0] &&
+	timenow[1] <= tuple->ts_expire[1])) break;
 
-    /* Remove and insert into list of free expire nodes */
-    this=peisk_expireList;
-    peisk_expireList = peisk_expireList->next;
-    this->next=peisk_expireListFree;
-    peisk_expireListFree=this;
+    peisk_expireListRemove(tuple);
     
     /* Delete the tuple */
-    char fullname[512];
-    peisk_getTupleFullyQualifiedName(this->tuple,fullname,sizeof(fullname));
+    peisk_getTupleFullyQualifiedName(tuple,fullname,sizeof(fullname));
     /*    printf("Deleting tuple: %s\n",fullname);*/
 
     peisk_hashTable_remove(peisk_tuples_primaryHT,fullname);
-    /* TODO: If we use alternative hashkeys then delete them too */
+    peisk_tupleIndex_remove(tuple);
 
     /* Invoke all deletion callbacks for this tuple. */
-    for(peisk_hashTableIterator_first(peisk_callbacks_primaryHT,&iter);
-	peisk_hashTableIterator_next(&iter);)
-      if(peisk_hashTableIterator_value_generic(&iter, &key, &callback)) {
-	if(callback->type == PEISK_CALLBACK_DELETED &&
-	   peisk_compareTuples(this->tuple,callback->prototype) == 0) {
-	  (callback->fn)(this->tuple,callback->userdata);
-	}
-      }
+    peisk_invokeCallbacks(tuple,PEISK_CALLBACK_DELETED);
 
+    /* If the deleted tuple belongs to us, update the "all-keys" tuple */
+    if(tuple->owner == peiskernel.id) peisk_allKeysDirty=1;
 
-    /* If the inserted tuple belongs to us, update the "all-keys" tuple */
-    if(this->tuple->owner == peiskernel.id) {
-      peisk_generateAllKeysTuple();
-    }
-
-    peisk_freeTuple(this->tuple);
-    if(!peisk_expireList) break;
-    /* TODO: perform the actual delete here... */
+    peisk_freeStoredTuple(tuple);
   }  
-
 }
 
 
@@ -2022,9 +2860,11 @@ void peisk_deleteHostFromSentSubscriptions(int id) {
 
 void peisk_deleteHostFromTuplespace(int id) {
   PeisHashTableIterator iter;
+  PeisIndexBucket *bucket;
   char *key;
   PeisTuple *tuple;
   PeisSubscriber *subscriber;
+  int i;
 
   /*printf("tuples.c::deleteHostFromTuplespace(%d)\n",id);*/
 
@@ -2036,16 +2876,13 @@ void peisk_deleteHostFromTuplespace(int id) {
   /* Expire all tuples with this host as owner.  */
   /* Note that actual removal of tuples will happen on next periodic
      call */
-  for(peisk_hashTableIterator_first(peisk_tuples_primaryHT,&iter);
-      peisk_hashTableIterator_next(&iter);)
-    if(peisk_hashTableIterator_value_generic(&iter, &key, &tuple))
-      if(tuple->owner == id) {
-	if(tuple->ts_expire[0] != 0)
-	  peisk_expireListRemove(tuple);	
-	tuple->ts_expire[0] = PEISK_TUPLE_EXPIRE_NOW;
-	tuple->ts_expire[1] = PEISK_TUPLE_EXPIRE_NOW;
-	peisk_expireListAdd(tuple);	
-      }
+  bucket = peisk_indexBucket_get(peisk_tuples_ownerHT,(void*)(long)id);
+  for(i=0;bucket && i<bucket->n;i++) {
+    tuple = (PeisTuple*) bucket->items[i];
+    tuple->ts_expire[0] = PEISK_TUPLE_EXPIRE_NOW;
+    tuple->ts_expire[1] = PEISK_TUPLE_EXPIRE_NOW;
+    peisk_expireListAdd(tuple);	
+  }
 
   /* Delete all subscriptions *from* this host. */
   for(peisk_hashTableIterator_first(peisk_subscribers_primaryHT,&iter);
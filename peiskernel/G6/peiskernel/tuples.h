@@ -102,6 +102,9 @@
    - peiskernel.name: gives the application name of this component
    - peiskernel.routingTable: gives routing information to tupleview,
    mainly for debugging
+   - peiskernel.slab: gives usage statistics for the memory allocator
+   used by the local tuplespace, as (tuples used allocated) followed by
+   (data (blocksize used allocated) ...) and (large blocks bytes).
    - peiskernel.step-time: gives an indication of how often the kernel
    is executing, must be below 0.1 at all times. Preferably below
    0.01. 
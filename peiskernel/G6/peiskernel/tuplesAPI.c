@@ -160,7 +160,6 @@ void peisk_initAbstractTuple(PeisTuple *tuple) {
 }
 PeisTuple *peisk_cloneTuple(PeisTuple *original) {
   PeisTuple *tuple;
-  int i;
 
   tuple=(PeisTuple*)malloc(sizeof(PeisTuple));
   if(!tuple) { 
@@ -168,13 +167,23 @@ PeisTuple *peisk_cloneTuple(PeisTuple *original) {
     peisk_tuples_errno=PEISK_TUPLE_OUT_OF_MEMORY;
     return NULL; 
   }
+  if(peisk_cloneTupleInto(tuple,original)) { free(tuple); return NULL; }
+  return tuple;
+}
+int peisk_cloneTupleInto(PeisTuple *tuple,PeisTuple *original) {
+  int i;
+
   *tuple=*original;
   tuple->mimetype = original->mimetype?peisk_cloneMimetype(original->mimetype):NULL;
   
   if(original->data) {
     tuple->data=(void*)malloc(original->datalen);
+    if(!tuple->data) { 
+      /* Out of memory */
+      peisk_tuples_errno=PEISK_TUPLE_OUT_OF_MEMORY;
+      return PEISK_TUPLE_OUT_OF_MEMORY; 
+    }
     memcpy(tuple->data,original->data,original->datalen);
-    if(!tuple->data) { free(tuple); return NULL; } /* Out of memory */
   }
   /* Preserve the offsets used for the subkeys */
   for(i=0;i<7;i++) {
@@ -182,7 +191,7 @@ PeisTuple *peisk_cloneTuple(PeisTuple *original) {
       tuple->keys[i] = original->keys[i]-original->keybuffer+tuple->keybuffer;
   }
   tuple->isNew=1;
-  return tuple;
+  return 0;
 }
 void peisk_freeTuple(PeisTuple *tuple) {
   if(!tuple) return;
@@ -396,9 +405,7 @@ PeisTuple *peisk_getTuple(int owner,const char *key,int flags) {
   return tuple;
 }
 PeisTuple *peisk_getTupleByAbstract(PeisTuple *prototype) {
-  char fullname[PEISK_KEYLENGTH+5];
   PeisTuple *tuple;
-  int errno;
   int timenow[2];
 
   int i;
@@ -411,10 +418,8 @@ PeisTuple *peisk_getTupleByAbstract(PeisTuple *prototype) {
     exit(0);    
   }
 
-  peisk_getTupleFullyQualifiedName(prototype,fullname,sizeof(fullname));
-  errno=peisk_hashTable_getValue(peisk_tuples_primaryHT,fullname,
-				 (void**) (void*) &tuple);
-  if(errno) {
+  tuple=peisk_findStoredTuple(prototype);
+  if(!tuple) {
     peisk_tuples_errno=PEISK_TUPLE_BADKEY;
     return NULL;
   }
@@ -446,22 +451,45 @@ int peisk_getTuples(int owner, const char *key,PeisTupleResultSet *rs) {
   return peisk_getTuplesByAbstract(&prototype,rs);
 }
 int peisk_getTuplesByAbstract(PeisTuple *prototype,PeisTupleResultSet *rs) {
-  /* \todo TODO - make a more efficient implementation that does not loop
-     through all tuples. Need to use multiple hashes using different
-     subkeys */
   PeisHashTableIterator primaryIter;
+  PeisIndexBucket *candidates;
   PeisTuple *tuple;
   char *fullname;
-  int cnt=0;
+  int atoms[7];
+  int i, cnt=0;
   int timenow[2];
   peisk_gettime2(&timenow[0],&timenow[1]);
 
+  /* A subkey that has never been interned cannot match any tuple */
+  if(peisk_tupleAtoms(prototype,atoms)) return 0;
+
+  /* Use the secondary indices to only visit tuples that can possibly
+     match the concrete owner/subkeys of the prototype. Fall back to
+     looping through all tuples in the primary hashtable if the
+     prototype is fully abstract. */
+  if(peisk_tupleIndex_candidates(prototype,atoms,&candidates) == 0) {
+    if(!candidates) return 0;
+    for(i=0;i<candidates->n;i++) {
+      tuple = (PeisTuple*) candidates->items[i];
+      if(peisk_compareTupleAtoms(tuple,peisk_storedTuple(tuple)->atoms,prototype,atoms) == 0 &&
+	 /* This second test is to filter out expired tuples pending to
+	    be deleted */
+	 (tuple->ts_expire[0] == 0 || tuple->ts_expire[0] > timenow[0] ||
+	  (tuple->ts_expire[0] == timenow[0] && tuple->ts_expire[1] > timenow[1]))) {
+	peisk_resultSetAdd(rs,tuple);
+	tuple->isNew = 0;
+	cnt++;
+      }
+    }
+    return cnt;
+  }
+
   /* Loop through all tuples in primary tuple hashtable and test if
      they match the prototype, if so then add to result set */
   peisk_hashTableIterator_first(peisk_tuples_primaryHT,&primaryIter);
   for(;peisk_hashTableIterator_next(&primaryIter);) {
     peisk_hashTableIterator_value_generic(&primaryIter,&fullname,&tuple);
-    if(peisk_compareTuples(tuple,prototype) == 0 &&
+    if(peisk_compareTupleAtoms(tuple,peisk_storedTuple(tuple)->atoms,prototype,atoms) == 0 &&
        /* This second test is to filter out expired tuples pending to
 	  be deleted */
        (tuple->ts_expire[0] == 0 || tuple->ts_expire[0] > timenow[0] ||
@@ -535,6 +563,9 @@ int peisk_tupleIsAbstract(PeisTuple *tuple) {
 
 #define PK_CMP(A,B,W) {if((A) != W && (B) != W) { if((A) < (B)) return -1; if((A) > (B)) return 1; }}
 int peisk_compareTuples(PeisTuple *tuple1,PeisTuple *tuple2) {
+  return peisk_compareTupleAtoms(tuple1,NULL,tuple2,NULL);
+}
+int peisk_compareTupleAtoms(PeisTuple *tuple1,const int *atoms1,PeisTuple *tuple2,const int *atoms2) {
   int i,ret;
   PK_CMP(tuple1->owner,tuple2->owner,-1);
   PK_CMP(tuple1->creator,tuple2->creator,-1);
@@ -551,11 +582,18 @@ int peisk_compareTuples(PeisTuple *tuple1,PeisTuple *tuple2) {
   PK_CMP(tuple1->isNew, tuple2->isNew, -1);
   if(tuple1->mimetype && tuple2->mimetype && strcasecmp(tuple1->mimetype,tuple2->mimetype) != 0) return 0;
 
-  for(i=0;i<7;i++)
-    if(tuple1->keys[i] != NULL && tuple2->keys[i] != NULL) {
-      ret=strcasecmp(tuple1->keys[i],tuple2->keys[i]);
-      if(ret != 0) return ret;
-    }
+  if(atoms1 && atoms2) {
+    /* Interned subkeys are equal exactly when their atoms are */
+    for(i=0;i<7;i++)
+      if(atoms1[i] && atoms2[i] && atoms1[i] != atoms2[i])
+	return atoms1[i] < atoms2[i] ? -1 : 1;
+  } else {
+    for(i=0;i<7;i++)
+      if(tuple1->keys[i] != NULL && tuple2->keys[i] != NULL) {
+	ret=strcasecmp(tuple1->keys[i],tuple2->keys[i]);
+	if(ret != 0) return ret;
+      }
+  }
   if(tuple1->data != NULL && tuple2->data != NULL) {
     if(tuple1->datalen < tuple2->datalen) return -1;
     if(tuple1->datalen > tuple2->datalen) return 1;
@@ -655,7 +693,8 @@ int peisk_unregisterTupleCallback(PeisCallbackHandle handle) {
   callback = peisk_findCallbackHandle(handle);
   if(!callback) return peisk_tuples_errno;
 
-  peisk_freeTuple(callback->prototype);
+  peisk_prototypeIndex_remove(peisk_callbacks_indexOf(callback->type),callback->prototype,(void*)callback);
+  peisk_freeStoredTuple(callback->prototype);
   free(callback);
   snprintf(key,sizeof(key),"%d",handle);
   errno=peisk_hashTable_remove(peisk_callbacks_primaryHT,key);
@@ -693,6 +732,7 @@ PeisSubscriberHandle peisk_subscribeByAbstract(PeisTuple *tuple) {
   subscriber.expire = -1.0;
   subscriber.subscriber = peiskernel.id;
   subscriber.isMeta = 0;
+  subscriber.acceptsDeltas = 0;
 
   PeisSubscriber *insertedSubscriber;
   insertedSubscriber = peisk_insertSubscriber(&subscriber);
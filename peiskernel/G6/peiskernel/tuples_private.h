@@ -69,12 +69,33 @@
 /** Default array size for storing target tuples in an iterator */
 #define PEISK_RESULTSET_DEFAULT_MAX_TUPLES 32
 
+/** Maximum number of buckets in a prototype index that a single
+    concrete tuple can match, see peisk_prototypeIndex_lookup. */
+#define PEISK_PROTOTYPE_INDEX_MAX_BUCKETS 18
+
 /** Shows that a callback is for normal tuple changes */
 #define PEISK_CALLBACK_CHANGED 1
 
 /** Shows that a callback is for tuple deletion */
 #define PEISK_CALLBACK_DELETED 2
 
+/** Flag in PeisSubscribeMessage::forceResend showing that the
+    subscriber can apply pushes of tuples given as binary differences,
+    see \ref TupleDeltas */
+#define PEISK_SUBSCRIBE_DELTAS 0x100
+
+/** Tuples with less data than this are always pushed in full */
+#define PEISK_TUPLE_DELTA_MIN_SIZE 256
+
+/** Changed bytes separated by fewer equal bytes than this are sent as
+    one run, which is cheaper than the header of another run. */
+#define PEISK_TUPLE_DELTA_GAP       8
+
+/** Largest tuple a difference can give. Larger tuples could not have
+    been pushed in full either, since all parts of a long message must
+    fit in the send queue. */
+#define PEISK_TUPLE_DELTA_MAX_SIZE (PEISK_MAX_QUEUE_SIZE*PEISK_MAX_PACKAGE_SIZE)
+
 
 /** The representation of tuples used when transmitting them over the network. */
 typedef struct PeisNetworkTuple {
@@ -143,7 +164,8 @@ typedef struct PeisNetworkTuple {
     subscription message. */
 typedef struct PeisSubscribeMessage {
   /** If nonzero always resend any existing data for this tuple when
-      subscription is received. */
+      subscription is received. Newer kernels also set the
+      PEISK_SUBSCRIBE_DELTAS flag here, in network byte order. */
   int forceResend;                  
 
   /** Prototype tuple to subscribe to, notes uses a slightly modified
@@ -190,6 +212,73 @@ typedef struct PeisAppendTupleMessage {
   uint32_t difflen;
 } PeisAppendTupleMessage;
 
+/** \defgroup TupleDeltas Tuple differences
+
+    Large tuples that change only by a few bytes, such as maps or
+    configuration blobs, are pushed to subscribers as the difference
+    to an earlier version. The owner keeps the push message of the
+    previously pushed version as base, and remembers the latest
+    version pushed to each subscriber. The version is forgotten if the
+    push is not acknowledged. Subscribers that have been sent the base,
+    and that announced that they understand differences with
+    PEISK_SUBSCRIBE_DELTAS, get a PeisPushTupleDeltaMessage relative to
+    it instead of the full tuple if it is smaller. Everyone else gets
+    the full tuple.
+
+    We use the version last sent rather than the last acknowledged
+    one, since acknowledgements are sent in batches and are typically
+    a few updates behind fast changing tuples. The difference is
+    applied in peisk_hook_pushTuple. If the receiver does not have
+    exactly the base version, eg. since the push of it is still in
+    flight on another route, it asks the owner for the full tuple with
+    a PEISK_PORT_REQUEST_TUPLE message. 
+
+    Appends to a tuple change its data without a new push, so the owner
+    forgets which versions the subscribers have when appending, and
+    subscribers keep the appendSeqNo of pushed tuples to tell the base
+    versions apart.
+*/
+
+/** Message pushing a new version of a tuple as the difference to a
+    base version that the receiver already has. The tuple describes
+    the new version, including its length, but its data is not
+    included. It is followed by the mimetype and by nRuns runs of
+    changed bytes, each a PeisTupleDeltaRun followed by the new
+    bytes. Bytes not covered by any run are the same as in the base
+    version. See \ref TupleDeltas */
+typedef struct PeisPushTupleDeltaMessage {
+  PeisNetworkTuple tuple;
+  /** Sequence number and append sequence number of the base version */
+  uint32_t baseSeqno;
+  uint32_t baseAppendSeqNo;
+  /** Number of runs following the mimetype */
+  uint32_t nRuns;
+} PeisPushTupleDeltaMessage;
+
+/** Header of one run of changed bytes in a PeisPushTupleDeltaMessage.
+    Stored unaligned, in network byte order. */
+typedef struct PeisTupleDeltaRun {
+  /** Offset of the first changed byte */
+  uint32_t offset;
+  /** Number of bytes following this header */
+  uint32_t length;
+} PeisTupleDeltaRun;
+
+/** Message sent to the owner of a tuple when a difference could not
+    be applied, asking for the full tuple. Only the owner and name of
+    the tuple are used. */
+typedef struct PeisRequestTupleMessage {
+  PeisNetworkTuple tuple;
+} PeisRequestTupleMessage;
+
+/** Latest version of a tuple pushed to one subscriber, see \ref
+    TupleDeltas */
+typedef struct PeisSentVersion {
+  int destination;
+  uint32_t seqno;
+  uint32_t appendSeqNo;
+} PeisSentVersion;
+
 /** Keeps record of a subscriber of data. 
     Used both for recording which tuples peis self is subscribed
     (local subscriptions) to and which tuples others are subscribed to
@@ -209,7 +298,10 @@ typedef struct PeisSubscriber {
 
   /** True of this is a meta subscription */
   char isMeta; 
-  unsigned char padding[3];
+  /** True if the subscriber can apply pushes given as differences,
+      see \ref TupleDeltas */
+  char acceptsDeltas;
+  unsigned char padding[2];
   /** The callback responsible for updating this meta subscription */
   PeisCallbackHandle metaCallback;
   /** Current value of meta subscription */
@@ -243,12 +335,94 @@ typedef struct PeiskPendingTuple {
 } PeiskPendingTuple;
 
 
-/** Datatype of the list to keep track of tuples with an explicit
-    expiry date that should be (eventually) deleted */
-typedef struct PeisExpireList {
-  PeisTuple *tuple;
-  struct PeisExpireList *next;
-} PeisExpireList;
+/** Private bookkeeping for the tuples stored in the local
+    tuplespace. The public tuple is always the first member so that
+    pointers to the two can be converted with a simple cast, see
+    peisk_storedTuple. Stored tuples never move in memory. */
+typedef struct PeisStoredTuple {
+  /** The tuple as seen by all users of the tuplespace */
+  PeisTuple tuple;
+  /** Position of this tuple in peisk_expireHeap, or -1 if the tuple
+      does not expire. */
+  int expireIndex;
+  /** Interned atom of each subkey, zero for wildcards and unused levels */
+  int atoms[7];
+  /** Hash of owner, key depth and atoms. Equal keys give equal hashes */
+  uint64_t keyHash;
+  /** Next unused tuple while this one is in the free list of the slab allocator */
+  struct PeisStoredTuple *nextFree;
+  /** The current version of this tuple serialized as a push message,
+      shared by all pushes to subscribers. NULL until first needed. */
+  struct PeisPayload *pushPayload;
+  /** The push message of the previously pushed version of the tuple,
+      used as base for pushing differences. See \ref TupleDeltas */
+  struct PeisPayload *basePayload;
+  /** The current version as a PeisPushTupleDeltaMessage relative to
+      basePayload, shared by all subscribers having the base */
+  struct PeisPayload *deltaPayload;
+  /** Non zero if deltaPayload has been computed, or found to be no
+      smaller than the full push message */
+  char deltaEncoded;
+  unsigned char padding[3];
+  /** Number of subscribers in sent and the size of it */
+  int nSent, allocatedSent;
+  /** Latest versions pushed to subscribers, sorted by destination */
+  PeisSentVersion *sent;
+} PeisStoredTuple;
+
+/** Entry in the symbol table of interned subkeys */
+typedef struct PeisAtom {
+  /** Unique non zero number identifying the (case folded) subkey */
+  int id;
+  /** Number of stored tuples using this atom */
+  int refs;
+} PeisAtom;
+
+/** Converts a tuple from the local tuplespace to its private bookkeeping */
+#define peisk_storedTuple(t) ((PeisStoredTuple*)(t))
+
+/** Smallest size class (as a power of two) of the slab allocator */
+#define PEISK_SLAB_MIN_SHIFT    5
+/** Largest size class (as a power of two) of the slab allocator,
+    larger data is allocated directly with malloc */
+#define PEISK_SLAB_MAX_SHIFT    16
+/** Number of size classes in the slab allocator */
+#define PEISK_SLAB_CLASSES      (PEISK_SLAB_MAX_SHIFT-PEISK_SLAB_MIN_SHIFT+1)
+/** Minimum size of each slab, a slab contains at least four blocks */
+#define PEISK_SLAB_SIZE         65536
+/** Number of stored tuples allocated together */
+#define PEISK_SLAB_TUPLES       128
+
+/** Header in front of every block of data from the slab allocator */
+typedef union PeisSlabBlock {
+  struct {
+    /** Size class of this block, or -1 if allocated with malloc */
+    int sizeClass;
+    /** Usable size of this block, excluding the header */
+    int size;
+  } info;
+  /** Next unused block while this one is in a free list */
+  union PeisSlabBlock *next;
+  long long align;
+} PeisSlabBlock;
+
+/** Book keeping for one size class of the slab allocator */
+typedef struct PeisSlabClass {
+  /** Unused blocks of this size */
+  PeisSlabBlock *free;
+  /** Number of blocks carved out of slabs so far */
+  int allocated;
+  /** Number of blocks currently used */
+  int used;
+} PeisSlabClass;
+
+/** A growable set of pointers, used as the value in the secondary
+    index hashtables over tuples. The order of items is arbitrary. */
+typedef struct PeisIndexBucket {
+  int n;
+  int allocated;
+  void **items;
+} PeisIndexBucket;
 
 /*                                               */
 /* State variables - affects next created tuple. */
@@ -266,12 +440,20 @@ extern int peisk_override_setTuple_restrictions;
 extern int peisk_debugTuples;
 extern int peisk_tuples_errno;
 extern struct PeisHashTable *peisk_tuples_primaryHT;
+extern struct PeisHashTable *peisk_tuples_ownerHT;
+extern struct PeisHashTable *peisk_tuples_subkeyHT;
+extern struct PeisHashTable *peisk_tuples_keyHashHT;
+extern struct PeisHashTable *peisk_atomsHT;
 extern struct PeisHashTable *peisk_callbacks_primaryHT;
+extern struct PeisHashTable *peisk_callbacks_changedHT;
+extern struct PeisHashTable *peisk_callbacks_deletedHT;
 extern PeisCallbackHandle peisk_nextCallbackHandle;
 extern struct PeisHashTable *peisk_subscribers_primaryHT;
+extern struct PeisHashTable *peisk_subscribers_indexHT;
 extern int peisk_nextSubscriberHandle;
-extern struct PeisExpireList *peisk_expireList;
-extern struct PeisExpireList *peisk_expireListFree;
+extern struct PeisStoredTuple **peisk_expireHeap;
+extern int peisk_expireHeapSize;
+extern int peisk_allKeysDirty;
 extern struct PeisHashTable *peisk_hostGivenSubscriptionMessages;
 
 
@@ -286,6 +468,66 @@ extern struct PeisHashTable *peisk_hostGivenSubscriptionMessages;
     on wildcards */ 
 int peisk_getTupleFullyQualifiedName(PeisTuple *tuple,char *buffer,int buflen);
 
+/** Adds item to the index bucket stored under key in the given
+    hashtable, creating the bucket if needed. */
+void peisk_indexBucket_add(struct PeisHashTable *ht,void *key,void *item);
+/** Removes item from the index bucket stored under key, freeing the
+    bucket when it becomes empty. */
+void peisk_indexBucket_remove(struct PeisHashTable *ht,void *key,void *item);
+/** Returns the index bucket stored under key or NULL if none exists. */
+PeisIndexBucket *peisk_indexBucket_get(struct PeisHashTable *ht,void *key);
+
+/** Adds a tuple from the primary hashtable to the secondary indices */
+void peisk_tupleIndex_insert(PeisTuple *tuple);
+/** Removes a tuple from the secondary indices */
+void peisk_tupleIndex_remove(PeisTuple *tuple);
+/** Finds the smallest index bucket containing all tuples that can
+    match the given prototype, whose subkeys have the given atoms.
+    Returns zero if successfull, in which case *candidates is the
+    bucket or NULL if nothing can match. Returns non zero if the
+    prototype has no concrete owner or subkeys and all tuples must be
+    considered. */
+int peisk_tupleIndex_candidates(PeisTuple *prototype,const int *atoms,PeisIndexBucket **candidates);
+
+/** Returns the atom for the given subkey, creating it if needed, and
+    increases its reference count. */
+int peisk_internAtom(const char *subkey);
+/** Decreases the reference count of an interned subkey */
+void peisk_releaseAtom(const char *subkey);
+/** Returns the atom of an already interned subkey, or zero if unknown */
+int peisk_findAtom(const char *subkey);
+/** Looks up the atoms of all subkeys of any tuple, with zero for
+    wildcards. Returns non zero if some subkey has not been interned. */
+int peisk_tupleAtoms(PeisTuple *tuple,int *atoms);
+/** Computes the key hash used by stored tuples */
+uint64_t peisk_tupleKeyHash(int owner,int keyDepth,const int *atoms);
+/** Finds the stored tuple with the same owner and key as the given
+    concrete tuple, without generating its fully qualified name.
+    Returns NULL if no such tuple exists. */
+PeisTuple *peisk_findStoredTuple(PeisTuple *tuple);
+
+/** Same as peisk_compareTuples, but compares the subkeys using the
+    given atoms if both are non NULL. */
+int peisk_compareTupleAtoms(PeisTuple *tuple1,const int *atoms1,PeisTuple *tuple2,const int *atoms2);
+/** Compares two stored tuples (or stored prototypes) using their atoms */
+#define peisk_compareStoredTuples(t1,t2) peisk_compareTupleAtoms((t1),peisk_storedTuple(t1)->atoms,(t2),peisk_storedTuple(t2)->atoms)
+
+/** Adds an item (subscriber or callback) to a prototype index. Each
+    prototype is stored in exactly one bucket, named by its owner, key
+    depth and first concrete subkey. The prototype must not change
+    while it is in the index. */
+void peisk_prototypeIndex_insert(struct PeisHashTable *ht,PeisTuple *prototype,void *item);
+/** Removes an item from a prototype index */
+void peisk_prototypeIndex_remove(struct PeisHashTable *ht,PeisTuple *prototype,void *item);
+/** Returns the bucket where the given prototype would be stored, or NULL */
+PeisIndexBucket *peisk_prototypeIndex_bucket(struct PeisHashTable *ht,PeisTuple *prototype);
+/** Finds all buckets in a prototype index whose items might match
+    the given concrete tuple. Stores at most
+    PEISK_PROTOTYPE_INDEX_MAX_BUCKETS buckets and returns how many
+    were found. Each item occurs in at most one of the buckets, the
+    caller still has to compare the tuple against each item. */
+int peisk_prototypeIndex_lookup(struct PeisHashTable *ht,PeisTuple *tuple,PeisIndexBucket **buckets);
+
 /** Clones and adds a concrete tuple to the local tuple space. Returns
     zero if successfull. */
 int peisk_addToLocalSpace(PeisTuple *tuple);
@@ -294,6 +536,10 @@ int peisk_addToLocalSpace(PeisTuple *tuple);
     the local tuplespace */ 
 void peisk_generateAllKeysTuple();
 
+/** Regenerates "kernel.all-keys" if our set of keys has changed. Called
+    on every step so that the tuple is generated at most once per step. */
+void peisk_periodic_allKeys(void *data);
+
 /** Sends a message to all subscribers listening to abstract tuples
     matching this tuple. */
 void peisk_alertSubscribers(PeisTuple *tuple);
@@ -302,6 +548,13 @@ void peisk_alertSubscribers(PeisTuple *tuple);
     matching this tuple. */ 
 void peisk_alertCallbacks(PeisTuple *tuple);
 
+/** Invokes all callbacks of the given type (PEISK_CALLBACK_CHANGED
+    or PEISK_CALLBACK_DELETED) whose prototype matches this tuple. */
+void peisk_invokeCallbacks(PeisTuple *tuple,int type);
+
+/** Returns the prototype index holding callbacks of the given type */
+struct PeisHashTable *peisk_callbacks_indexOf(int type);
+
 /** For each tuple matching the given subscriber, sends a message with
     the latest value */
 void peisk_alertSubscriber(PeisSubscriber *subscriber);
@@ -311,6 +564,21 @@ void peisk_alertSubscriber(PeisSubscriber *subscriber);
     destination. Return non-zero on immediate failure, zero on maybe success */
 int peisk_pushTuple(PeisTuple *tuple,int destination);
 
+/** A destination of peisk_multicastTuple */
+typedef struct PeisPushDestination {
+  int destination;
+  /** True if any subscription of the destination accepts differences */
+  int acceptsDeltas;
+} PeisPushDestination;
+
+/** Sends the same push-tuple message to all given destinations.
+    Destinations sharing a next hop get it as one multicast
+    package. Destinations that accept differences and were sent the
+    base version get only the difference, see \ref TupleDeltas.
+    Destinations that fail immediately are added to the failed
+    tuples. */
+void peisk_multicastTuple(PeisTuple *tuple,int nDestinations,PeisPushDestination *destinations);
+
 /** Sends a push-tuple message with given tuple to the given
     destination acting like it was sent from a specific sender */
 void peisk_pushTupleFrom(int from,PeisTuple *tuple,int destination);
@@ -326,6 +594,9 @@ int peisk_hook_subscribe(int port,int destination,int sender,int datalen,void *d
 int peisk_hook_unsubscribe(int port,int destination,int sender,int datalen,void *data);
 int peisk_hook_pushTuple(int port,int destination,int sender,int datalen,void *data);
 int peisk_hook_setTuple(int port,int destination,int sender,int datalen,void *data);
+/** Answers requests for the full value of one of our tuples, when a
+    difference pushed to a subscriber could not be applied */
+int peisk_hook_requestTuple(int port,int destination,int sender,int datalen,void *data);
 
 /** Updates the local copies of tuples and performs any neccessary notifications */
 void peisk_appendLocalTuple(PeisTuple *proto,int difflen,const void *diff);
@@ -414,13 +685,45 @@ PeisCallback *peisk_findCallbackHandle(PeisCallbackHandle);
 /** Looks up  a subscriber handle to a subscriber structure */
 PeisSubscriber *peisk_findSubscriberHandle(PeisSubscriberHandle);
 
-/** Removes a tuple from the expire list */
+/** Allocates a new tuple for the local tuplespace, or a prototype
+    for a subscriber or callback, as a copy of the given tuple and
+    interns its subkeys. Returns NULL if out of memory. */
+PeisTuple *peisk_newStoredTuple(PeisTuple *original);
+
+/** Frees a tuple allocated with peisk_newStoredTuple */
+void peisk_freeStoredTuple(PeisTuple *tuple);
+
+/** Forgets the serialized push message of a stored tuple. Must be
+    called whenever the stored tuple is modified. The message of a
+    large tuple is kept as base for pushing the next version as a
+    difference. */
+void peisk_invalidatePushPayload(PeisTuple *tuple);
+
+/** Allocates at least size bytes of data for stored tuples from the
+    slab allocator. The usable size of the block is returned through
+    usable if non NULL. Returns NULL if out of memory. */
+void *peisk_slabAlloc(int size,int *usable);
+/** Grows a block from the slab allocator to hold at least size
+    bytes, keeping the block if it is already large enough. Works
+    like realloc, data may be NULL. */
+void *peisk_slabRealloc(void *data,int size,int *usable);
+/** Returns a block to the slab allocator, data may be NULL */
+void peisk_slabFree(void *data);
+/** Prints usage statistics for the slab allocator into the given buffer */
+void peisk_slabStatistics(char *str,int len);
+
+/** Copies the original tuple into an already allocated tuple,
+    duplicating the data. Returns zero on success. */
+int peisk_cloneTupleInto(PeisTuple *tuple,PeisTuple *original);
+
+/** Removes a stored tuple from the expiry heap, if it is in it */
 void peisk_expireListRemove(PeisTuple *tuple);
 
-/** Adds a tuple from the expire list at the proper place in the list */
+/** Adds a stored tuple to the expiry heap using its current
+    ts_expire value. Tuples that never expire are ignored. */
 void peisk_expireListAdd(PeisTuple *tuple);
 
-/** Periodic function for deleting outdated nodes from the expiry list */
+/** Periodic function for deleting outdated tuples from the expiry heap */
 void peisk_periodic_expireTuples(void *data);
 
 
@@ -20,6 +20,9 @@
     02110-1301  USA
 */
 
+/* Needed for recvmmsg/sendmmsg */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <getopt.h>
 #include <fcntl.h>
@@ -47,28 +50,83 @@
 #include "p2p.h"
 #include "linklayer.h"
 #include "peiskernel_tcpip.h"
+#include "udp.h"
+
+#ifndef __linux__
+/* Platforms without recvmmsg/sendmmsg use one system call per datagram */
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+static int recvmmsg(int sock,struct mmsghdr *msgs,unsigned int n,int flags,void *timeout) {
+  int i, status;
+  for(i=0;i<n;i++) {
+    status = recvmsg(sock,&msgs[i].msg_hdr,flags);
+    if(status == -1) return i > 0 ? i : -1;
+    msgs[i].msg_len = status;
+  }
+  return i;
+}
+static int sendmmsg(int sock,struct mmsghdr *msgs,unsigned int n,int flags) {
+  int i, status;
+  for(i=0;i<n;i++) {
+    status = sendmsg(sock,&msgs[i].msg_hdr,flags);
+    if(status == -1) return i > 0 ? i : -1;
+    msgs[i].msg_len = status;
+  }
+  return i;
+}
+#endif
 
+/** Creates a nonblocking UDP socket with large buffers, or returns -1 on failure */
+static int peisk_udpSocket() {
+  int sock, size;
 
-int peisk_udpConnect(char *name,int port,int flags) {
+  sock=socket(AF_INET,SOCK_DGRAM,0);
+  if(sock == -1) {
+    perror("peisk::udpSocket::socket");
+    return -1;
+  }
+  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
+    fprintf(stderr,"peisk: error setting UDP socket nonblocking\n");
+    close(sock);
+    return -1;
+  }
+  /* Failing to get larger buffers only makes losses more likely */
+  size=PEISK_UDP_SOCKET_BUFFER;
+  setsockopt(sock,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+  setsockopt(sock,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+  return sock;
+}
+
+/** Finds the connected UDP connection to the given peer address, or NULL */
+static PeisConnection *peisk_lookupUDPConnection(struct sockaddr_in *addr) {
+  struct sockaddr_in *peer;
+  int i;
+
+  for(i=0;i<=peiskernel.highestConnection;i++)
+    if(peiskernel.connections[i].id != -1 && peiskernel.connections[i].type == eUDPConnection) {
+      peer = (struct sockaddr_in *) &peiskernel.connections[i].connection.udp.addr;
+      if(peer->sin_addr.s_addr == addr->sin_addr.s_addr && peer->sin_port == addr->sin_port)
+	return &peiskernel.connections[i];
+    }
+  return NULL;
+}
+
+PeisConnection *peisk_udpConnect(char *name,int port,int flags) {
   PeisConnection *connection;
   struct hostent *hostent;
   struct sockaddr_in addr;
-  socklen_t len;
-  int sock,index;
-  char buf[256],str[256];
-  int ret;
+  PeisConnectMessage message;
+  int sock;
 
-  printf("Creating UDP connection to %s at port %d\n",name,port);
+  if(peiskernel.udp_serverPort == 0) return NULL;
 
-  /* Find a free connection to use */
-  for(index=0;index<PEISK_MAX_CONNECTIONS;index++)
-    if(peiskernel.connections[index].id == -1) break;
-  if(index == PEISK_MAX_CONNECTIONS) {
-    fprintf(stdout,"peisk: too many connections - refusing manual connection\n");
-    return -1;
-  }
-  connection=&peiskernel.connections[index];
-  if(index > peiskernel.highestConnection) peiskernel.highestConnection=index;
+  /* Refuse connections to ourselves */
+  if(port == peiskernel.udp_serverPort &&
+     (strcmp(name,"localhost") == 0 ||
+      strcmp(name,"127.0.0.1") == 0 ||
+      strcmp(name,peiskernel.hostInfo.hostname) == 0)) return NULL;
 
   /* Lookup the given hostname */
   h_errno=0;
@@ -76,193 +134,314 @@ int peisk_udpConnect(char *name,int port,int flags) {
   if(!hostent) {
     fprintf(stdout,"peisk: gethostbyname(%s)  failed. h_errno=%d hostent=%x\n",
 	    name,h_errno,(unsigned int)(unsigned long) hostent);
-    return -1;
+    return NULL;
   }
 
   /* Create the sockaddr structures */
+  memset(&addr,0,sizeof(addr));
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = INADDR_ANY;
-  bzero(&(addr.sin_zero),8);
   bcopy((char *)hostent->h_addr,(char *)&addr.sin_addr,hostent->h_length);
-  len=sizeof(struct sockaddr_in); /*hostent->h_length;*/
 
-  /* Create a socket to use and bind it to a fresh port */
-  sock=socket(AF_INET,SOCK_DGRAM,0);
+  sock=peisk_udpSocket();
+  if(sock == -1) return NULL;
 
-  /* Set socket non blocking */
-  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
-    fprintf(stderr,"peisk: error setting socket nonblocking, not connecting\n");
+  /* Create connection structure to use. This will allocate and
+     place the connection in PENDING mode. */
+  connection = peisk_newConnection();
+  if(!connection) {
     close(sock);
-    return -1;
+    return NULL;
   }
 
   /* Store socket, destination etc. in connection */
   connection->type=eUDPConnection;
   connection->connection.udp.socket = sock;
   memcpy(&connection->connection.udp.addr,&addr,sizeof(struct sockaddr_in));
-  connection->connection.udp.len = len;
-
+  connection->connection.udp.len = sizeof(struct sockaddr_in);
   connection->connection.udp.status=eUDPPending;
-  peisk_initConnection(connection);
-
-  if(flags & PEISK_CONNECT_FLAG_FORCE_BCAST)
-    peiskernel.connections[index].forceBroadcasts=1;
-  else
-    peiskernel.connections[index].forceBroadcasts=0;
-
-  /* Send connection strings */
-  long version = htonl(peisk_protocollVersion);
-  memcpy((void*)buf,(void*)&version,sizeof(version));
-  /* Setup connection string message.
-     Make sure connection string is null terminated, put connection
-     flags as last byte. */
-  strcpy(str,peisk_networkString);
-  str[62]=0;
-  str[63]=flags & PEISK_CONNECT_FLAG_FORCE_BCAST;
-  memcpy((void*)buf+sizeof(version),(void*)str,64);
-
-  /*sendto(sock,(void*)buf,sizeof(int)+strlen(peisk_networkString)+1,MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len);*/
-  ret=sendto(sock,(void*)buf,sizeof(int)+64,MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len);
-  if(ret == -1) perror("peisk::udpConnect::sendto");
-
-  return connection->id;
+  connection->connection.udp.flags=flags;
+  connection->connection.udp.timeout=peisk_timeNow + PEISK_UDP_CONNECT_TIMEOUT;
+  connection->connection.udp.nextAttempt=peisk_timeNow + PEISK_UDP_CONNECT_RETRY;
+
+  /* The answer is handled by peisk_acceptUDPConnections */
+  peisk_reactorWatch(sock,1);
+  peisk_initConnectMessage(&message,flags);
+  if(sendto(sock,&message,sizeof(message),MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len) == -1 &&
+     peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    perror("peisk::udpConnect::sendto");
+
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: connecting with udp/ip to %s:%d as connection #%d, flags=%d\n",
+	    name,port,connection->id,flags);
+  return connection;
 }
 
-void peisk_acceptUDPConnections() {
-  struct sockaddr addr;
+/** Finishes a pending outgoing UDP connection once the peer answered,
+    resends the connect message or gives up the connection. */
+static void peisk_udpProcessPending(PeisConnection *connection) {
+  PeisConnectMessage message;
+  PeisConnectionMgrInfo *connMgrInfo;
+  struct sockaddr_in addr;
   socklen_t len;
-  char buf[1024];
-  int size;
-  int sock;
-  int index;
-  int flags;
-  struct sockaddr_in *in_addr;
-  PeisConnection *connection;
-
-  if(peiskernel.udp_serverPort == 0) return;
+  int size, sock;
 
+  sock = connection->connection.udp.socket;
   len=sizeof(addr);
-  size=recvfrom(peiskernel.udp_serverSocket,buf,sizeof(buf),0,&addr,&len);
-  if(size <= 0) return;
-  printf("Incomming udp connection...\n");
-  if(size < sizeof(int)) { printf("wrong size %d\n",size); return; }
-  long version=ntohl(*((long*)buf));
-  if(peisk_protocollVersion != version) {
-    printf("wrong version, got %d. expected %d\n",(int)version,(int)peisk_protocollVersion);
-    if(version > peisk_protocollVersion && version < 1000)
-      printf("ERROR - A newer version of the  PEIS kernel is available!\n");
+  size=recvfrom(sock,&message,sizeof(message),MSG_DONTWAIT,(struct sockaddr*) &addr,&len);
+  /* Only accept an answer from the host we are connecting to, on our
+     network. The id is unknown when connecting to a given url. */
+  if(size == sizeof(message) && ntohl(message.version) == peisk_protocollVersion &&
+     ((struct sockaddr_in*) &connection->connection.udp.addr)->sin_addr.s_addr == addr.sin_addr.s_addr &&
+     ntohl(message.id) != peiskernel.id &&
+     (connection->neighbour.id == -1 || ntohl(message.id) == connection->neighbour.id) &&
+     strncmp(message.networkString,peisk_networkString,sizeof(message.networkString)) == 0) {
+    /* The peer answers from the socket it uses for this connection,
+       only accept packages from it from now on */
+    if(connect(sock,(struct sockaddr*) &addr,len) == -1) {
+      perror("peisk::udpProcessPending::connect");
+      return;
+    }
+    memcpy(&connection->connection.udp.addr,&addr,len);
+    connection->connection.udp.len = len;
+    connection->connection.udp.status=eUDPConnected;
+    connection->sequencedIds = (ntohl(message.flags) & PEISK_CONNECT_FLAG_SEQUENCED) ? 1 : 0;
+    connection->routingDeltas = (ntohl(message.flags) & PEISK_CONNECT_FLAG_ROUTING_DELTA) ? 1 : 0;
+    connection->multicasts = (ntohl(message.flags) & PEISK_CONNECT_FLAG_MULTICAST) ? 1 : 0;
+    peisk_outgoingConnectFinished(connection,connection->connection.udp.flags);
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      fprintf(stdout,"peisk: new outbound udp/ip connection #%d established\n",connection->id);
     return;
   }
-  buf[size-1]=0;
-  if(strcmp(buf+sizeof(int),peisk_networkString) !=  0) { printf("bad network string '%s'\n",buf+sizeof(int)); }
-
-  /* Extract flags from last byte of message */
-  flags=buf[sizeof(int)+63];
-
-  /* Ok, this looks like a valid connection attempt */
 
-  /* find a connection structure to use */
-  for(index=0;index<PEISK_MAX_CONNECTIONS;index++)
-    if(peiskernel.connections[index].id == -1) break;
-  if(index == PEISK_MAX_CONNECTIONS) {
+  if(connection->connection.udp.timeout < peisk_timeNow) {
     if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
-      fprintf(stdout,"peisk: too many connections - refusing peer\n");
-    /* \todo is this a bug? */
-    /*close(sock);*/
+      fprintf(stdout,"peisk: udp/ip connection #%d got no answer, giving up\n",connection->id);
+    /* The host might be behind a firewall, use other links to it for a while */
+    connMgrInfo = peisk_lookupConnectionMgrInfo(connection->neighbour.id);
+    if(connMgrInfo) connMgrInfo->avoidUdpUntil = peisk_timeNow + PEISK_UDP_AVOID_RETRY;
+    peisk_abortConnect(connection);
+    close(sock);
     return;
   }
-  connection = &peiskernel.connections[index];
-  if(index > peiskernel.highestConnection) peiskernel.highestConnection=index;
 
-  /* store addr, len in this connection structure */
-  peisk_initConnection(connection);
-  connection->type=eUDPConnection;
-  connection->connection.udp.addr = addr;
-  connection->connection.udp.len = len;
-  connection->connection.udp.status=eUDPConnected;
+  if(connection->connection.udp.nextAttempt < peisk_timeNow) {
+    /* The connect message or the answer might have been lost */
+    connection->connection.udp.nextAttempt = peisk_timeNow + PEISK_UDP_CONNECT_RETRY;
+    peisk_initConnectMessage(&message,connection->connection.udp.flags);
+    sendto(sock,&message,sizeof(message),MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len);
+  }
+}
 
-  if(flags & PEISK_CONNECT_FLAG_FORCE_BCAST)
-    peiskernel.connections[index].forceBroadcasts=1;
-  else
-    peiskernel.connections[index].forceBroadcasts=0;
+void peisk_acceptUDPConnections() {
+  static PeisConnectMessage messages[PEISK_UDP_ACCEPT_BATCH];
+  static struct sockaddr_in addrs[PEISK_UDP_ACCEPT_BATCH];
+  static struct iovec iov[PEISK_UDP_ACCEPT_BATCH];
+  static struct mmsghdr msgs[PEISK_UDP_ACCEPT_BATCH];
+  PeisConnectMessage answer;
+  PeisConnection *connection;
+  int i, n, sock;
 
-  /* debug */
-  in_addr=(struct sockaddr_in *)&connection->connection.udp.addr;
-  printf("incoming port: %d\n",ntohs(in_addr->sin_port));
+  if(peiskernel.udp_serverPort == 0) return;
 
-  /* create a new socket */
-  sock=socket(AF_INET,SOCK_DGRAM,0);
-  /* Set it non blocking */
-  if(fcntl(sock,F_SETFL,O_NONBLOCK) == -1) {
-    fprintf(stderr,"peisk: error setting socket nonblocking, not connecting\n");
-    close(sock);
-    connection->id = -1;
-    return;
+  for(i=0;i<=peiskernel.highestConnection;i++)
+    if(peiskernel.connections[i].id != -1 && peiskernel.connections[i].type == eUDPConnection &&
+       peiskernel.connections[i].connection.udp.status == eUDPPending)
+      peisk_udpProcessPending(&peiskernel.connections[i]);
+
+  /* Read all waiting connect messages at once */
+  memset(msgs,0,sizeof(msgs));
+  for(i=0;i<PEISK_UDP_ACCEPT_BATCH;i++) {
+    iov[i].iov_base = &messages[i];
+    iov[i].iov_len = sizeof(PeisConnectMessage);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
   }
-  /* store this socket in the connection */
-  connection->connection.udp.socket = sock;
+  n=recvmmsg(peiskernel.udp_serverSocket,msgs,PEISK_UDP_ACCEPT_BATCH,MSG_DONTWAIT,NULL);
+
+  for(i=0;i<n;i++) {
+    if(msgs[i].msg_len != sizeof(PeisConnectMessage)) continue;
 
-  /* Send a response acknowledging that connection is ok */
-  sendto(sock,(void*)"ack",4,MSG_NOSIGNAL,&addr,len);
+    /* Repeated connect messages mean our answer was lost, answer again */
+    connection = peisk_lookupUDPConnection(&addrs[i]);
+    if(connection) {
+      peisk_initConnectMessage(&answer,0);
+      send(connection->connection.udp.socket,&answer,sizeof(answer),MSG_NOSIGNAL);
+      continue;
+    }
 
-  /* that's it, done */
-  printf("new incomming UDP connection %d finished\n",connection->id);
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      printf("peisk: incomming UDP connection ...\n");
+
+    /* Create connection structure to use */
+    connection = peisk_newConnection();
+    if(!connection) return;
+    /* Check that it's ok to accept this connection */
+    if(peisk_verifyConnectMessage(connection,&messages[i]) != 0) {
+      peisk_freeConnection(connection);
+      continue;
+    }
+
+    /* Use a socket of its own for the connection, only receiving from the peer */
+    sock=peisk_udpSocket();
+    if(sock == -1 || connect(sock,(struct sockaddr*) &addrs[i],sizeof(struct sockaddr_in)) == -1) {
+      if(sock != -1) close(sock);
+      peisk_freeConnection(connection);
+      continue;
+    }
+    connection->type=eUDPConnection;
+    connection->connection.udp.socket = sock;
+    memcpy(&connection->connection.udp.addr,&addrs[i],sizeof(struct sockaddr_in));
+    connection->connection.udp.len = sizeof(struct sockaddr_in);
+    connection->connection.udp.status=eUDPConnected;
+
+    /* Answer from the new socket, the peer uses its address from now on */
+    peisk_initConnectMessage(&answer,0);
+    send(sock,&answer,sizeof(answer),MSG_NOSIGNAL);
+
+    /* Let P2P layer handle this connection */
+    peisk_incommingConnectFinished(connection,&messages[i]);
+
+    if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+      printf("peisk: accepted new udp connection to %d with index: %d, flags=%d\n",
+	     messages[i].id,connection->id,messages[i].flags);
+  }
 }
 
-int peisk_udpSendAtomic(PeisConnection *connection,PeisPackage *package,int len) {
-  int status, timeout, value;
-  void *data = (void*) package;
-  struct sockaddr_in *in_addr;
-  PeisPackageHeader *header;
+/** Closes a UDP connection after a failed send or receive, unless
+    the error only means that we have to try again later. Returns
+    non-zero if the connection was closed. */
+static int peisk_udpError(PeisConnection *connection,const char *operation) {
+  if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS) return 0;
+  /* Typically ECONNREFUSED, the peer is no longer there */
+  if(peisk_printLevel & PEISK_PRINT_CONNECTIONS)
+    fprintf(stdout,"peisk: udp connection %d failed to %s (errno=%d '%s')\n",connection->id,operation,errno,strerror(errno));
+  peisk_closeConnection(connection->id);
+  return 1;
+}
+
+int peisk_udpSendAtomic(PeisConnection *connection,PeisPackageHeader *header,void *data,int datalen) {
+  struct iovec iov[2];
+  struct msghdr msg;
+  int status;
 
-  if(connection->outgoing >= connection->maxOutgoing * PEISK_CONNECTION_CONTROL_PERIOD) { connection->isThrottled=1; return -1; }
-  connection->outgoing += PEISK_ASSUMED_UDP_OVERHEAD + len;
-  
-  /* Give package the next link count used for congestion control. */
-  header=&package->header;
   header->linkCnt = htonl(connection->outgoingIdCnt++);
 
+  iov[0].iov_base = (void*) header;
+  iov[0].iov_len = sizeof(PeisPackageHeader);
+  iov[1].iov_base = data;
+  iov[1].iov_len = datalen;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = datalen > 0 ? 2 : 1;
+
   errno=0;
-  /*status=sendto(connection->connection.udp.socket,(void*) data,len,MSG_DONTWAIT|MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len);*/
-  status=sendto(connection->connection.udp.socket,(void*) data,len,MSG_NOSIGNAL,&connection->connection.udp.addr,connection->connection.udp.len);
+  status=sendmsg(connection->connection.udp.socket,&msg,MSG_DONTWAIT|MSG_NOSIGNAL);
   if(status == -1) {
-    perror("failed udp send");
-    printf("len: %d (%d)\n",(int)connection->connection.udp.len,(int)sizeof(struct sockaddr_in));
-    printf("socket: %d\n",connection->connection.udp.socket);
-    in_addr=(struct sockaddr_in*) &connection->connection.udp.addr;
-    printf("port: %d\n",ntohs(in_addr->sin_port));
-    /*exit(0);*/
+    connection->outgoingIdCnt--;
+    peisk_udpError(connection,"send");
+    return -1;
   }
+  return 0;
+}
 
-  if(status == -1) return -1;
-  if(status < len) {
-    printf("Error, sending %d bytes on udp socket but only %d got sent\n",len,status);
-    return -1;
+int peisk_udpSendQueued(PeisConnection *connection,PeisQueuedPackage **packages,int n) {
+  static struct mmsghdr msgs[PEISK_MAX_SEND_BATCH];
+  static struct iovec iov[2*PEISK_MAX_SEND_BATCH];
+  static int packageOfMessage[PEISK_MAX_SEND_BATCH];
+  PeisPackageHeader *header;
+  int i, m, status, datalen, sent;
+
+  /* One datagram per package, gathered directly from where the
+     packages are stored */
+  memset(msgs,0,n*sizeof(struct mmsghdr));
+  for(i=0,m=0;i<n;i++) {
+    header = &packages[i]->package.header;
+    header->linkCnt = htonl(connection->outgoingIdCnt++);
+    if(peiskernel.simulatePackageLoss > 0.0 && (rand()%1000) < (peiskernel.simulatePackageLoss*1000.0))
+      /* Introduces a fake packet loss on outgoing packages, used for
+	 debugging robustness */
+      continue;
+    datalen = ntohs(header->datalen);
+    iov[2*m].iov_base = (void*) header;
+    iov[2*m].iov_len = sizeof(PeisPackageHeader);
+    iov[2*m+1].iov_base = peisk_queuedPackage_data(packages[i]);
+    iov[2*m+1].iov_len = datalen;
+    msgs[m].msg_hdr.msg_iov = &iov[2*m];
+    msgs[m].msg_hdr.msg_iovlen = datalen > 0 ? 2 : 1;
+    packageOfMessage[m++] = i;
+  }
+
+  status=0;
+  if(m > 0) {
+    errno=0;
+    status=sendmmsg(connection->connection.udp.socket,msgs,m,MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(status == -1) {
+      if(peisk_udpError(connection,"send")) return -1;
+      /* Nothing was sent, try again when the socket is writable */
+      status=0;
+    }
   }
-  connection->outgoing++;
+
+  /* Packages after the first datagram that was not sent are sent
+     again later, so don't count their link counters */
+  sent = status < m ? packageOfMessage[status] : n;
+  connection->outgoingIdCnt -= n - sent;
+  return sent;
 }
 
-int peisk_udpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage *package) {
-  errno=0;
-  len=sizeof(addr);
-  size=recvfrom(connection->connection.udp.socket,(void*)package,sizeof(PeisPackage),0,&addr,&len);
-  if(size <= 0) return 0;  /* no message received */
-  if(memcmp(&addr,&connection->connection.udp.addr,sizeof(struct sockaddr_in)) != 0) {
-    printf("peisk::warning %s@%d: Got UDP message from unexpected source\n",__FILE__,__LINE__);
-    return 0;
+int peisk_udpReceiveIncomming(PeisConnection *connection,PeisPackage **package) {
+  static struct mmsghdr msgs[PEISK_STREAM_BUFFER_SIZE / sizeof(PeisPackage)];
+  static struct iovec iov[PEISK_STREAM_BUFFER_SIZE / sizeof(PeisPackage)];
+  int maxPackages = PEISK_STREAM_BUFFER_SIZE / sizeof(PeisPackage);
+  PeisPackage *packages;
+  PeisPackageHeader *header;
+  int i, n, len;
+
+  /* The buffer holds whole packages, inStart and inEnd count packages
+     instead of bytes for UDP connections */
+  if(!connection->inBuffer) {
+    connection->inBuffer = (char*) malloc(PEISK_STREAM_BUFFER_SIZE);
+    connection->inStart = connection->inEnd = 0;
   }
-  if(size!=sizeof(PeisPackageHeader)+ntohs(package->header.datalen)) {
-    printf("peisk::warning %s@%d: Bad size of incoming UDP package. Got %d bytes, expected %d+%d=%d bytes",
-	   __FILE__,__LINE__,
-	   (int)size,(int)sizeof(PeisPackageHeader),ntohs(package->header.datalen),
-	   (int)sizeof(PeisPackageHeader)+ntohs(package->header.datalen));
-    return 0;
+  packages = (PeisPackage*) connection->inBuffer;
+
+  while(connection->inStart == connection->inEnd) {
+    /* Read as many datagrams as fits in the buffer at once */
+    memset(msgs,0,sizeof(msgs));
+    for(i=0;i<maxPackages;i++) {
+      iov[i].iov_base = &packages[i];
+      iov[i].iov_len = sizeof(PeisPackage);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    errno=0;
+    n=recvmmsg(connection->connection.udp.socket,msgs,maxPackages,MSG_DONTWAIT,NULL);
+    if(n == -1) {
+      peisk_udpError(connection,"receive");
+      return 0;
+    }
+    if(n == 0) return 0;
+
+    /* Keep only well formed packages. Repeated answers to our
+       connect message also end up here. */
+    connection->inStart = connection->inEnd = 0;
+    for(i=0;i<n;i++) {
+      header = &packages[i].header;
+      len = msgs[i].msg_len;
+      if(len < sizeof(PeisPackageHeader) || header->sync != PEISK_SYNC ||
+	 len != sizeof(PeisPackageHeader) + ntohs(header->datalen)) {
+	if(len != sizeof(PeisConnectMessage) && peisk_printLevel & PEISK_PRINT_PACKAGE_ERR)
+	  printf("peisk: warning - bad UDP package of %d bytes on connection %d\n",len,connection->id);
+	continue;
+      }
+      if(i != connection->inEnd) memcpy(&packages[connection->inEnd],&packages[i],len);
+      connection->inEnd++;
+    }
   }
-  /* Update congestion control information */
-  if(ntohl(package->header.linkCnt)+1 > connection->incomingIdHi)
-    connection->incomingIdHi = ntohl(package->header.linkCnt)+1;
-  connection->incomingIdSuccess++;
 
+  *package = &packages[connection->inStart++];
   return 1;
 }
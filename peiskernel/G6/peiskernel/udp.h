@@ -26,25 +26,68 @@
 /** \ingroup LinkLayer */
 /** \defgroup UdpIP  UDP/IPv4
 
-    This is a linklayer interface using UDP over IP. Currently not in use. 
+    This is a linklayer interface using UDP over IP. UDP connections
+    are not affected by head of line blocking, a lost package only
+    delays itself instead of all packages sent after it. Lost
+    packages are resent by the acknowledgements of the P2P layer
+    (see \ref Acknowledgements) and the sending rate is set by its
+    congestion control (see \ref CongestionControl). The connection
+    manager prefers UDP when connecting to hosts on the same local
+    network, unless disabled with --peis-no-udp.
 
+    A connection is established by sending a PeisConnectMessage to
+    the UDP server port of the peer, which answers with its own
+    PeisConnectMessage from a new socket used only for this
+    connection. The connect message is repeated every
+    PEISK_UDP_CONNECT_RETRY seconds until the answer arrives. Both
+    sockets are then connected to each other so that the kernel
+    filters out datagrams from anyone else. Packages are sent one per
+    datagram, and as many of them as possible are sent and received
+    with each system call (sendmmsg/recvmmsg).
  */
 /** @{ */
 
-/** Checks for new incomming udp connections */
+/** Time between repeated connect messages on a pending UDP connection */
+#define PEISK_UDP_CONNECT_RETRY    0.2
+
+/** Pending UDP connections that get no answer for this long are given up */
+#define PEISK_UDP_CONNECT_TIMEOUT  2.0
+
+/** After an UDP connection to a host got no answer, other link types
+    are used for that host for this many seconds before UDP is tried again */
+#define PEISK_UDP_AVOID_RETRY      60.0
+
+/** Maximum number of connect messages read from the UDP server port each step */
+#define PEISK_UDP_ACCEPT_BATCH     8
+
+/** Size of the socket buffers requested for UDP connections. Larger
+    buffers let bursts of packages through without losses. */
+#define PEISK_UDP_SOCKET_BUFFER    262144
+
+/** Attempts to create a UDP/IP connection towards target. Returns a
+    PENDING connection structure, or NULL on failure. The connection
+    is finished by peisk_acceptUDPConnections once the peer
+    answers. */
+struct PeisConnection *peisk_udpConnect(char *name,int port,int flags);
+
+/** Checks for new incomming udp connections, and for answers to our
+    pending outgoing udp connections. */
 void peisk_acceptUDPConnections();                  
-/** Listens for udp multicasts of available hosts on the local tcp/ip networks */
-void peisk_acceptUDPMulticasts();                   
 
-/** Performs the sending of data on a bluetooth L2CAP connection. Package
-    points to a PeisPackage structure including data for a total 
-    length of len bytes. Returns zero on success. */
-int peisk_udpSendAtomic(PeisConnection *connection,PeisPackage *package,int len);
+/** Sends a single package on a UDP connection. Returns zero on success. */
+int peisk_udpSendAtomic(struct PeisConnection *connection,struct PeisPackageHeader *header,void *data,int datalen);
+
+/** Performs the sending of queued packages on a UDP/IP connection,
+    see peisk_connection_sendQueued. The packages are sent as one
+    datagram each, all with one system call when possible. */
+int peisk_udpSendQueued(struct PeisConnection *connection,struct PeisQueuedPackage **packages,int n);
 
-/** Attempts to read a package from the connection. 
-    Returns non-zero if there was a package.  */
-int peisk_udpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage *package);
+/** Attempts to read a package from the connection. Datagrams are
+    received into the buffer of the connection, as many as fits with
+    each system call, and *package is changed to point into the
+    buffer. Returns non-zero if there was a package.  */
+int peisk_udpReceiveIncomming(struct PeisConnection *connection,struct PeisPackage **package);
 
-/* @} TCP/IPv4 */
+/* @} UDP/IPv4 */
 
 #endif
@@ -0,0 +1,213 @@
+/** \file kerneltest.c
+   Runs a few kernels on the loopback interface and checks that they
+   find routes, recover lost packages and push tuple differences
+*/
+/*
+   Copyright (C) 2005  Mathias Broxvall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/** \page kerneltest KernelTest
+    Starts a chain of kernels on the loopback interface, each
+    connected to the one before it, and checks that:
+
+    - every kernel gets a route to every other kernel, through the
+      routing differences exchanged by neighbours,
+    - long messages from the first to the last kernel arrive intact
+      although the first kernel drops some of its packages, which
+      needs the parts to be asked for again with NACKs,
+    - a large tuple of the first kernel that changes a little at a
+      time is rebuilt from differences by the last kernel, also when
+      its copy does not match the base of a difference and it has to
+      ask for the full tuple.
+
+    Invoke as kerneltest [--port <port>] [--nodes <n>], the exit
+    status is zero if all kernels passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#define PEISK_PRIVATE
+#include "peiskernel.h"
+
+#define TEST_PORT        100
+#define TEST_MESSAGES    30
+#define TEST_MESSAGE_LEN 50000
+#define TEST_TUPLE_LEN   20000
+#define TEST_STEPS       80
+#define MAX_NODES        8
+
+int firstId=8100, nNodes=3;
+
+int nGood=0, nBad=0, nNacks=0, nFull=0, nDelta=0;
+
+/** Fills in the data of message or tuple version i */
+void fillData(char *data,int len,int i) {
+  int j;
+  for(j=0;j<len;j++) data[j]='a'+j%26;
+  /* Change a few bytes more for each version */
+  for(j=1;j<=i;j++) data[(j*37)%len]='A'+j%26;
+  memcpy(data,&i,sizeof(int));
+}
+
+int receiveMessageHook(int port,int destination,int sender,int datalen,void *data) {
+  static char expected[TEST_MESSAGE_LEN];
+  int i;
+
+  if(destination != peisk_peisid()) return 0;
+  memcpy(&i,data,sizeof(int));
+  fillData(expected,TEST_MESSAGE_LEN,i);
+  if(datalen == TEST_MESSAGE_LEN && memcmp(data,expected,datalen) == 0) nGood++;
+  else nBad++;
+  return 0;
+}
+
+int countNackHook(int port,int destination,int sender,int datalen,void *data) {
+  if(destination == peisk_peisid()) nNacks++;
+  return 0;
+}
+
+int countPushHook(int port,int destination,int sender,int datalen,void *data) {
+  if(destination != peisk_peisid()) return 0;
+  if(port == PEISK_PORT_PUSH_TUPLE_DELTA) nDelta++;
+  else nFull++;
+  return 0;
+}
+
+/** True once we have routes to all other kernels */
+int allRoutable() {
+  int i;
+  for(i=0;i<nNodes;i++)
+    if(firstId+i != peisk_peisid() && !peisk_isRoutable(firstId+i)) return 0;
+  return 1;
+}
+
+/** Runs kernel number node of the chain, returns zero if it passed */
+int runNode(int node,int port) {
+  static char buffer[TEST_MESSAGE_LEN];
+  char id[16], ownPort[16], connect[64];
+  char *args[16];
+  int argc, i, routed, checks, last, v;
+  PeisTuple *tuple;
+
+  argc=0;
+  args[argc++]="kerneltest";
+  args[argc++]="--peis-silent";
+  args[argc++]="--peis-no-shm";
+  args[argc++]="--peis-id";
+  sprintf(id,"%d",firstId+node);
+  args[argc++]=id;
+  args[argc++]="--peis-port";
+  sprintf(ownPort,"%d",port+node);
+  args[argc++]=ownPort;
+  if(node > 0) {
+    args[argc++]="--peis-connect";
+    sprintf(connect,"tcp://127.0.0.1:%d",port+node-1);
+    args[argc++]=connect;
+  } else {
+    args[argc++]="--peis-package-loss";
+    args[argc++]="0.05";
+  }
+  args[argc]=NULL;
+  peisk_initialize(&argc,args);
+
+  peisk_registerHook(TEST_PORT,receiveMessageHook);
+  peisk_registerHook(PEISK_PORT_NACK,countNackHook);
+  peisk_registerHookWithName(PEISK_PORT_PUSH_TUPLE,countPushHook,"countPushHook");
+  peisk_registerHookWithName(PEISK_PORT_PUSH_TUPLE_DELTA,countPushHook,"countPushHook");
+  if(node == nNodes-1) peisk_subscribe(firstId,"kerneltest.big");
+
+  routed=-1;
+  checks=0;
+  last=-1;
+  for(i=0;i<2*TEST_STEPS;i++) {
+    if(routed == -1 && allRoutable()) routed=i;
+
+    if(node == 0 && i >= 20 && i < 20+TEST_STEPS) {
+      fillData(buffer,TEST_TUPLE_LEN,i-20);
+      peisk_setTuple("kerneltest.big",TEST_TUPLE_LEN,buffer,"application/octet-stream",PEISK_ENCODING_BINARY);
+      if(i-20 < TEST_MESSAGES) {
+	fillData(buffer,TEST_MESSAGE_LEN,i-20);
+	peisk_sendMessage(TEST_PORT,firstId+nNodes-1,TEST_MESSAGE_LEN,buffer,0);
+      }
+    }
+
+    if(node == nNodes-1) {
+      tuple=peisk_getTuple(firstId,"kerneltest.big",PEISK_KEEP_OLD|PEISK_NON_BLOCKING);
+      if(tuple && tuple->datalen >= sizeof(int)) {
+	memcpy(&v,tuple->data,sizeof(int));
+	if(v != last) {
+	  fillData(buffer,TEST_TUPLE_LEN,v);
+	  if(tuple->datalen != TEST_TUPLE_LEN || memcmp(buffer,tuple->data,TEST_TUPLE_LEN) != 0) nBad++;
+	  checks++;
+	  last=v;
+	  /* Now and then pretend we have another version than the
+	     owner believes, so that the next difference does not match */
+	  if(checks % 10 == 0) tuple->seqno--;
+	}
+      }
+    }
+    peisk_wait(100000);
+  }
+
+  printf("kernel %d: routed after %.1fs, got %d/%d messages (%d bad), %d nacks, "
+	 "%d tuple versions (%d full, %d differences)\n",
+	 firstId+node,routed*0.1,nGood,node == nNodes-1 ? TEST_MESSAGES : 0,nBad,nNacks,checks,nFull,nDelta);
+  peisk_shutdown();
+
+  if(routed == -1 || nBad) return 1;
+  if(node == 0) return nNacks == 0;
+  if(node < nNodes-1) return 0;
+  return nGood != TEST_MESSAGES || last != TEST_STEPS-1 || nDelta == 0 || nFull < 2;
+}
+
+int main(int argc,char **args) {
+  int i, port, status, failed;
+  pid_t pids[MAX_NODES];
+
+  port=10000+getpid()%20000;
+  for(i=1;i<argc;i++) {
+    if(strcmp(args[i],"--port") == 0 && i+1 < argc) port=atoi(args[++i]);
+    else if(strcmp(args[i],"--nodes") == 0 && i+1 < argc) nNodes=atoi(args[++i]);
+    else { fprintf(stderr,"usage: %s [--port <port>] [--nodes <n>]\n",args[0]); exit(2); }
+  }
+  if(nNodes < 2 || nNodes > MAX_NODES) { fprintf(stderr,"kerneltest: 2 to %d nodes are needed\n",MAX_NODES); exit(2); }
+
+  for(i=0;i<nNodes;i++) {
+    fflush(stdout);
+    pids[i]=fork();
+    if(pids[i] == -1) { perror("kerneltest::fork"); exit(2); }
+    if(pids[i] == 0) exit(runNode(i,port));
+    /* Give each kernel time to open its server port */
+    usleep(500000);
+  }
+
+  failed=0;
+  for(i=0;i<nNodes;i++) {
+    waitpid(pids[i],&status,0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("kernel %d FAILED\n",firstId+i);
+      failed=1;
+    }
+  }
+  printf(failed ? "kerneltest FAILED\n" : "kerneltest passed\n");
+  return failed;
+}